@@ -0,0 +1,89 @@
+/*!
+ * @file AssetBundle.cpp
+ *
+ * @brief Looks up web assets in the flash directory
+ *
+ */
+#include "AssetBundle.h"
+#include "asset_bundle.hh"
+
+const char mime_html[] PROGMEM = "text/html";              ///<MIME_HTML
+const char mime_css[] PROGMEM = "text/css";                ///<MIME_CSS
+const char mime_js[] PROGMEM = "application/javascript";   ///<MIME_JS
+const char mime_svg[] PROGMEM = "image/svg+xml";           ///<MIME_SVG
+const char mime_ico[] PROGMEM = "image/x-icon";            ///<MIME_ICO
+const char mime_png[] PROGMEM = "image/png";               ///<MIME_PNG
+const char mime_text[] PROGMEM = "text/plain";             ///<MIME_TEXT
+/*! @var mime_types
+ *  Content types, indexed by asset_mime.*/
+const char * const mime_types[] PROGMEM = {
+  mime_html, mime_css, mime_js, mime_svg, mime_ico, mime_png, mime_text
+};
+
+
+/*!
+ * @param mime
+ *        one of asset_mime
+ *
+ * @return the Content-Type for mime, in PROGMEM
+ */
+PGM_P asset_mime_type(unsigned char mime){
+  if(mime > MIME_TEXT)
+    mime = MIME_TEXT;
+  return (PGM_P)pgm_read_word(&mime_types[mime]);
+}
+
+
+/*!
+ * @return how many assets are in the bundle
+ */
+unsigned char get_asset_count(){
+  return ASSET_COUNT;
+}
+
+
+/*!
+ * Compares a request path with a path in PROGMEM, like strcmp().  The
+ * query string, if any, is not part of the request path.
+ */
+static int compare_path_P(const buffer_span & path, PGM_P asset_path){
+  unsigned int length = 0;
+  while(length < path.length && path.pointer[length] != '?')
+    length++;
+  int result = strncmp_P(path.pointer, asset_path, length);
+  if(result != 0)
+    return result;
+  // equal so far - the asset path may still be longer
+  return pgm_read_byte(asset_path + length) == '\0' ? 0 : -1;
+}
+
+
+/*!
+ * Binary search of the asset directory.
+ *
+ * @param path
+ *        the path of a request, e.g. "/config?x=1"
+ * @param entry
+ *        filled in with a copy of the directory entry, if there is one
+ *
+ * @return TRUE if an asset is served at path
+ */
+bool find_asset(const buffer_span & path, asset_entry * entry){
+  if(path.length == 0)
+    return false;
+  int low = 0;
+  int high = ASSET_COUNT - 1;
+  while(low <= high){
+    int middle = (low + high) / 2;
+    int result = compare_path_P(path, (PGM_P)pgm_read_word(&asset_directory[middle].path));
+    if(result == 0){
+      memcpy_P(entry, &asset_directory[middle], sizeof(asset_entry));
+      return true;
+    }
+    if(result < 0)
+      high = middle - 1;
+    else
+      low = middle + 1;
+  }
+  return false;
+}
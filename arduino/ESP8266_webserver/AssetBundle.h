@@ -0,0 +1,69 @@
+/*!
+ * @file AssetBundle.h
+ *
+ * @brief Directory of the web assets packed into flash
+ *
+ * Every file in html/ is packed into one PROGMEM image by the asset
+ * compiler in tools/, which writes asset_bundle.hh.  AssetBundle.cpp is
+ * the only place that includes it.  If you update a file in html/, you 
+ * need to run these commands to refresh it:<pre>
+ *    g++ -std=c++11 -O2 -o tools/asset_compiler tools/asset_compiler.cpp
+ *    tools/asset_compiler html/favicon.svg html/config_website.html ...</pre>
+ * (every file in html/).
+ */
+#ifndef ASSET_BUNDLE_H
+#define ASSET_BUNDLE_H
+
+#include <Arduino.h>
+#include "RequestView.h"
+
+/*! @def ASSET_GZIP
+ *  asset_entry flag: the data is gzip-compressed, and must be sent with
+ *  "Content-Encoding: gzip".*/
+#define ASSET_GZIP 0x01
+/*! @def ASSET_CACHEABLE
+ *  asset_entry flag: the asset only changes when the sketch is reflashed,
+ *  so browsers may cache it.  Assets with fetched fields never are.*/
+#define ASSET_CACHEABLE 0x02
+
+/*!
+ * @enum asset_mime
+ *
+ * @brief Content types of assets, see asset_mime_type()
+ */
+enum asset_mime{
+  MIME_HTML,   ///<text/html
+  MIME_CSS,    ///<text/css
+  MIME_JS,     ///<application/javascript
+  MIME_SVG,    ///<image/svg+xml
+  MIME_ICO,    ///<image/x-icon
+  MIME_PNG,    ///<image/png
+  MIME_TEXT    ///<text/plain, for anything else
+};
+
+/*!
+ * @struct asset_entry
+ *
+ * @brief One asset in the directory.  The directory lives in PROGMEM and
+ *        is sorted by path; find_asset() copies an entry out to RAM.
+ *
+ * An asset may have fetched fields: the firmware writes live values for
+ * them (e.g. ssid__:"home",) into the page, split bytes into the data.
+ */
+struct asset_entry{
+  PGM_P path;                  ///<request path, e.g. "/config"
+  PGM_P etag;                  ///<quoted entity tag (content hash)
+  const char * const * fields; ///<PROGMEM table of fetched field names, NULL if none
+  PGM_P data;                  ///<first byte of the asset in the bundle
+  unsigned int length;         ///<bytes of asset data, not counting fetched fields
+  unsigned int split;          ///<bytes of data before the fetched fields (length if none)
+  unsigned char field_count;   ///<number of entries in fields
+  unsigned char mime;          ///<one of asset_mime
+  unsigned char flags;         ///<ASSET_GZIP, ASSET_CACHEABLE
+};
+
+bool find_asset(const buffer_span & path, asset_entry * entry);
+PGM_P asset_mime_type(unsigned char mime);
+unsigned char get_asset_count();
+
+#endif
@@ -0,0 +1,257 @@
+/*!
+ * @file AtEngine.cpp
+ * 
+ * @brief Queue of AT commands to the ESP8266, and a table-driven matcher
+ *        for their responses.
+ * 
+ */
+#include "AtEngine.h"
+
+/*!
+ * @var at_final_results
+ * 
+ * @brief Tokens that end the command in flight at the start of a line, 
+ *        and how it ended.
+ */
+const at_token at_final_results[] PROGMEM = {
+  {TOKEN_OK,        AT_OK},
+  {TOKEN_ERROR,     AT_ERROR},
+  {TOKEN_FAIL,      AT_FAIL},
+  {TOKEN_BUSY,      AT_BUSY},
+  {TOKEN_NO_CHANGE, AT_OK},   //older firmware says this instead of OK
+  {TOKEN_SEND_OK,   AT_OK},   //the data after a '>' prompt went out
+  {TOKEN_SEND_FAIL, AT_FAIL},
+};
+#define AT_FINAL_RESULTS_LEN (sizeof(at_final_results)/sizeof(at_final_results[0])) ///< @def number of final result codes
+
+/*!
+ * @var at_unsolicited
+ * 
+ * @brief Tokens of messages the ESP8266 sends on its own.  Connection 
+ *        messages come after "<channel>,"
+ */
+const at_token at_unsolicited[] PROGMEM = {
+  {TOKEN_CONNECT,         AT_URC_CONNECT},
+  {TOKEN_CLOSED,          AT_URC_CLOSED},
+  {TOKEN_WIFI_CONNECTED,  AT_URC_WIFI_CONNECTED},
+  {TOKEN_WIFI_GOT_IP,     AT_URC_WIFI_GOT_IP},
+  {TOKEN_WIFI_DISCONNECT, AT_URC_WIFI_DISCONNECT},
+  {TOKEN_READY,           AT_URC_READY},
+};
+#define AT_UNSOLICITED_LEN (sizeof(at_unsolicited)/sizeof(at_unsolicited[0])) ///< @def number of unsolicited messages
+
+
+/*!
+ * @brief Constructor
+ * 
+ * @param port  already-initialized transport to the ESP8266
+ */
+AtEngine::AtEngine(EspTransport * port){
+  this->port = port;
+  this->queue_head = 0;
+  this->queue_len = 0;
+  this->in_flight = false;
+  this->matched = false;
+  this->awaiting_prompt = false;
+  this->started_ms = 0;
+  this->urc_handler = NULL;
+  this->urc_context = NULL;
+}
+
+
+/*!
+ * @brief Looks up the tokens found at one place in a line in a PROGMEM 
+ *        token table
+ * 
+ * @param table      PROGMEM array of at_token
+ * @param table_len  number of entries in the table
+ * @param line       the line, with the tokens found in it
+ * @param offset     where in the line the token must start
+ * 
+ * @return the id of the first entry whose token starts at offset, or AT_NO_MATCH
+ */
+unsigned char AtEngine::match_token(const at_token table[], unsigned char table_len,
+                                    const request_view * line, unsigned int offset){
+  for(unsigned char i = 0; i < table_len; i++){
+    unsigned int found;
+    if(find_token(line->tokens, pgm_read_byte(&table[i].token), &found) && found == offset)
+      return pgm_read_byte(&table[i].id);
+  }
+  return AT_NO_MATCH;
+}
+
+
+/*!
+ * @brief Set the function that is told about unsolicited messages
+ * 
+ * @param handler  see at_urc_callback, or NULL to ignore them
+ * @param context  passed back to the handler
+ */
+void AtEngine::set_urc_handler(at_urc_callback handler, void * context){
+  this->urc_handler = handler;
+  this->urc_context = context;
+}
+
+
+/*!
+ * @brief Queue a command.  It is sent from poll() once every command 
+ *        ahead of it has finished.
+ * 
+ * @param command  the command; it is copied, but the strings it points to are not
+ * 
+ * @return FALSE if the queue is full
+ */
+bool AtEngine::submit(const at_command & command){
+  if(queue_len >= AT_MAX_PENDING_COMMANDS)
+    return false;
+  queue[(queue_head + queue_len) % AT_MAX_PENDING_COMMANDS] = command;
+  queue_len++;
+  if(!in_flight)
+    start_next();
+  return true;
+}
+
+
+/*!
+ * @return TRUE if no command is queued or in flight
+ */
+bool AtEngine::is_idle(){
+  return queue_len == 0;
+}
+
+
+/*!
+ * @return TRUE if the command in flight is waiting for its '>' prompt
+ */
+bool AtEngine::is_awaiting_prompt(){
+  return in_flight && awaiting_prompt;
+}
+
+
+/*!
+ * @brief Call when the '>' prompt of the command in flight has been read.
+ *        Hands over to its prompt callback to write the data; the final
+ *        result comes in once the ESP8266 has sent it.
+ */
+void AtEngine::handle_prompt(){
+  if(!is_awaiting_prompt())
+    return;
+  awaiting_prompt = false;
+  at_command * command = &queue[queue_head];
+  if(command->on_prompt != NULL)
+    command->on_prompt(command->context);
+}
+
+
+/*!
+ * @brief Write the oldest queued command to the ESP8266
+ */
+void AtEngine::start_next(){
+  if(in_flight || queue_len == 0)
+    return;
+  at_command * command = &queue[queue_head];
+  if(command->flags & AT_COMMAND_WRITER){
+    command->on_prompt(command->context);
+  } else if(command->flags & AT_COMMAND_IN_PROGMEM){
+    char c;
+    for(PGM_P p = command->command; (c = pgm_read_byte(p)) != '\0'; p++){
+      port->write(c);
+    }
+  } else {
+    port->write(command->command, strlen(command->command));
+  }
+  in_flight = true;
+  matched = false;
+  awaiting_prompt = (command->flags & AT_EXPECT_PROMPT) != 0;
+  started_ms = millis();
+}
+
+
+/*!
+ * @brief Finish the command in flight and start the next one
+ * 
+ * @param result  one of at_result
+ */
+void AtEngine::complete(unsigned char result){
+  at_command finished = queue[queue_head];
+  queue_head = (queue_head + 1) % AT_MAX_PENDING_COMMANDS;
+  queue_len--;
+  in_flight = false;
+  // The callback may submit more commands, so the queue must be consistent first
+  if(finished.on_done != NULL)
+    finished.on_done(finished.context, result);
+  start_next();
+}
+
+
+/*!
+ * @brief Time out the command in flight if it has taken too long, and 
+ *        send the next queued command if nothing is in flight.
+ */
+void AtEngine::poll(){
+  if(in_flight && (millis() - started_ms) > queue[queue_head].timeout_ms){
+    complete(AT_TIMEOUT);
+  }
+  start_next();
+}
+
+
+/*!
+ * @brief Offer a line read from the ESP8266 to the engine
+ * 
+ * @param line  a parsed line from ESP8266::read_request()
+ * 
+ * @return TRUE if the line was an unsolicited message or part of a 
+ *         command's response, and should not be looked at again.
+ *         FALSE for connection data and stray lines.
+ */
+bool AtEngine::handle_line(request_view * line){
+  if(line->is_ipd || line->is_payload)
+    return false;
+
+  const char * text = line->line.pointer;
+  unsigned int text_len = line->line.length;
+
+  // Unsolicited messages may carry a "<channel>," prefix
+  char channel = 0;
+  if(text_len >= 2 && text[0] >= '0' && text[0] <= '9' && text[1] == ','){
+    channel = text[0] - '0';
+    unsigned char urc = match_token(at_unsolicited, AT_UNSOLICITED_LEN, line, 2);
+    if(urc == AT_URC_CONNECT || urc == AT_URC_CLOSED){
+      if(urc_handler != NULL)
+        urc_handler(urc_context, urc, channel);
+      return true;
+    }
+  } else {
+    unsigned char urc = match_token(at_unsolicited, AT_UNSOLICITED_LEN, line, 0);
+    if(urc != AT_NO_MATCH && urc != AT_URC_CONNECT && urc != AT_URC_CLOSED){
+      if(urc_handler != NULL)
+        urc_handler(urc_context, urc, 0);
+      return true;
+    }
+  }
+
+  if(!in_flight)
+    return false;
+  at_command * command = &queue[queue_head];
+
+  unsigned char result = match_token(at_final_results, AT_FINAL_RESULTS_LEN, line, 0);
+  if(result != AT_NO_MATCH){
+    if(result == AT_OK && awaiting_prompt)
+      return true;  // the command was accepted, the prompt comes next
+    if(result == AT_OK && command->expect != NULL && !matched)
+      result = AT_MISMATCH;
+    complete(result);
+    return true;
+  }
+
+  if(command->expect != NULL && !matched){
+    if(command->flags & AT_EXPECT_IN_PROGMEM)
+      matched = span_contains_P(line->line, command->expect);
+    else
+      matched = strstr(line->line.pointer, command->expect) != NULL;
+  }
+  if(command->on_line != NULL)
+    command->on_line(command->context, line);
+  return true;
+}
@@ -0,0 +1,179 @@
+/*!
+ * @file AtEngine.h
+ * 
+ * @brief Queue of AT commands to the ESP8266, and a table-driven matcher
+ *        for their responses.
+ * 
+ */
+#ifndef AT_ENGINE_H
+#define AT_ENGINE_H
+
+#include <Arduino.h>
+#include "EspTransport.h"
+#include "RequestView.h"
+
+/*! @def AT_MAX_PENDING_COMMANDS
+ *  Number of commands that can be waiting for (or in) execution at once.*/
+#define AT_MAX_PENDING_COMMANDS 4
+
+/*! @def AT_COMMAND_IN_PROGMEM
+ *  at_command flag: the command string is in PROGMEM*/
+#define AT_COMMAND_IN_PROGMEM 0x01
+/*! @def AT_EXPECT_IN_PROGMEM
+ *  at_command flag: the expected response string is in PROGMEM*/
+#define AT_EXPECT_IN_PROGMEM  0x02
+/*! @def AT_EXPECT_PROMPT
+ *  at_command flag: the ESP8266 answers with a '>' prompt for data (e.g.
+ *  AT+CIPSEND).  The "OK" before the prompt doesn't end the command, the
+ *  prompt callback writes the data, and "SEND OK"/"SEND FAIL" end it.*/
+#define AT_EXPECT_PROMPT      0x04
+/*! @def AT_COMMAND_WRITER
+ *  at_command flag: there is no command string, the on_prompt callback 
+ *  writes the command when it is sent - e.g. to escape its parameters on
+ *  the way out, without a buffer for the escaped command.  Not for 
+ *  AT_EXPECT_PROMPT commands.*/
+#define AT_COMMAND_WRITER     0x08
+
+/*! @def AT_NO_MATCH
+ *  Returned by the token matcher when no token matches.*/
+#define AT_NO_MATCH 0xFF
+
+/*! 
+ * @enum at_result
+ * 
+ * @brief How an AT command ended
+ */
+enum at_result{
+  AT_PENDING = 0,  ///<not finished yet
+  AT_OK,           ///<"OK" or "SEND OK" (and the expected response, if any, was seen)
+  AT_ERROR,        ///<"ERROR"
+  AT_FAIL,         ///<"FAIL", or "SEND FAIL"
+  AT_BUSY,         ///<"busy p..."/"busy s..." - the ESP ignored the command
+  AT_TIMEOUT,      ///<no final result code within the timeout
+  AT_MISMATCH      ///<"OK", but the expected response never showed up
+};
+
+/*! 
+ * @enum at_urc
+ * 
+ * @brief Unsolicited messages from the ESP8266
+ */
+enum at_urc{
+  AT_URC_CONNECT = 0,      ///<"<channel>,CONNECT"
+  AT_URC_CLOSED,           ///<"<channel>,CLOSED"
+  AT_URC_WIFI_CONNECTED,   ///<"WIFI CONNECTED"
+  AT_URC_WIFI_GOT_IP,      ///<"WIFI GOT IP"
+  AT_URC_WIFI_DISCONNECT,  ///<"WIFI DISCONNECT"
+  AT_URC_READY             ///<"ready" - the ESP8266 has (re)booted
+};
+
+/*! @typedef at_line_callback
+ *  Called with each line of a command's response, other than the final result code.*/
+typedef void (*at_line_callback)(void * context, request_view * line);
+/*! @typedef at_done_callback
+ *  Called once when a command ends, with one of at_result.*/
+typedef void (*at_done_callback)(void * context, unsigned char result);
+/*! @typedef at_urc_callback
+ *  Called with each unsolicited message, with one of at_urc and the channel
+ *  it was about (zero if none).*/
+typedef void (*at_urc_callback)(void * context, unsigned char urc, char channel);
+/*! @typedef at_prompt_callback
+ *  Called at the '>' prompt of an AT_EXPECT_PROMPT command.  Must write 
+ *  exactly the number of bytes the command announced.  For an 
+ *  AT_COMMAND_WRITER command, called instead to write the command itself.*/
+typedef void (*at_prompt_callback)(void * context);
+
+/*! 
+ * @struct at_command
+ * 
+ * @brief One command for the AtEngine, and what to do with its response
+ * 
+ * The command and expect strings are not copied, they must stay put 
+ * until the command is done.  So must whatever the writer of an 
+ * AT_COMMAND_WRITER command reads.
+ */
+struct at_command{
+  const char * command;      ///<command text, including the "\r\n", NULL for AT_COMMAND_WRITER
+  const char * expect;       ///<substring the response must contain, or NULL
+  at_line_callback on_line;  ///<optional, see at_line_callback
+  at_done_callback on_done;  ///<optional, see at_done_callback
+  void * context;            ///<passed back to the callbacks
+  unsigned int timeout_ms;   ///<how long to wait for the final result code
+  unsigned char flags;       ///<AT_COMMAND_IN_PROGMEM, AT_EXPECT_IN_PROGMEM, AT_EXPECT_PROMPT, AT_COMMAND_WRITER
+  at_prompt_callback on_prompt;  ///<AT_EXPECT_PROMPT and AT_COMMAND_WRITER commands only, see at_prompt_callback
+};
+
+/*! 
+ * @struct at_token
+ * 
+ * @brief Entry in a PROGMEM table of tokens to recognize at the start of
+ *        a line.
+ */
+struct at_token{
+  unsigned char token;  ///<one of token_id
+  unsigned char id;     ///<returned when the line starts with the token
+};
+
+/*!
+ * @class AtEngine
+ * 
+ * @brief Sends queued AT commands one at a time and routes the responses
+ * 
+ * Every line read from the ESP8266 goes through handle_line(), with the
+ * tokens the reader found in it (see TokenMatcher), so result codes and
+ * unsolicited messages are recognized without searching the line again.
+ * Lines that belong to connection payloads are left alone, unsolicited
+ * messages go to the URC handler, and everything else belongs to the 
+ * command in flight: final result codes (OK/ERROR/FAIL/busy) finish it, 
+ * and other lines are checked against its expected response and handed
+ * to its line callback.
+ * 
+ * The ESP8266 only executes one command at a time, so the next queued 
+ * command is sent the moment the previous one finishes - no fixed delays
+ * or purges between commands.
+ * 
+ * The '>' prompt for data doesn't end in a newline, so whoever reads the
+ * port watches for it while is_awaiting_prompt() and calls handle_prompt().
+ * 
+ * Usage:<pre>
+ *    AtEngine at(&transport);
+ *    at_command query = {PSTR("AT+CIPMUX?\r\n"), PSTR("+CIPMUX:1"), NULL,
+ *                        my_done_callback, my_context, 2000,
+ *                        AT_COMMAND_IN_PROGMEM | AT_EXPECT_IN_PROGMEM, NULL};
+ *    at.submit(query);
+ *    while(true){
+ *      at.poll();
+ *      if(read_a_line(&line) && !at.handle_line(&line))
+ *        handle_http(&line);
+ *    }</pre>
+ */
+class AtEngine{
+private:
+  EspTransport * port;                         ///<where commands are written
+  at_command queue[AT_MAX_PENDING_COMMANDS];   ///<ring of commands, head is in flight
+  unsigned char queue_head;                    ///<index of the oldest command
+  unsigned char queue_len;                     ///<number of queued commands
+  bool in_flight;                              ///<true if the head command has been sent
+  bool matched;                                ///<true once the head's expected response was seen
+  bool awaiting_prompt;                        ///<true until the head's '>' prompt is seen, see AT_EXPECT_PROMPT
+  unsigned long started_ms;                    ///<when the head command was sent
+  at_urc_callback urc_handler;                 ///<see set_urc_handler()
+  void * urc_context;                          ///<passed back to urc_handler
+
+  void start_next();
+  void complete(unsigned char result);
+
+public:
+  AtEngine(EspTransport * port);
+  bool submit(const at_command & command);
+  bool handle_line(request_view * line);
+  void poll();
+  bool is_idle();
+  bool is_awaiting_prompt();
+  void handle_prompt();
+  void set_urc_handler(at_urc_callback handler, void * context);
+  static unsigned char match_token(const at_token table[], unsigned char table_len,
+                                   const request_view * line, unsigned int offset);
+};
+
+#endif
@@ -9,12 +9,14 @@
 /*!
  * Simple ring buffer to handle serial output that we want to scan for string matches.
  * 
+ * @param storage
+ *        Space for the buffer, owned by the caller (see StaticCircularBuffer).
  * @param buf_size
- *        How much space to allocate for the buffer.
+ *        Size of storage, in bytes.
  */
 // Constructor just clears the buffer
-CircularBuffer::CircularBuffer(int buf_size){
-  this->buf = new char[buf_size];
+CircularBuffer::CircularBuffer(char * storage, unsigned int buf_size){
+  this->buf = storage;
   this->buf_reset();
   this->buf_size = buf_size;
 }
@@ -38,7 +40,7 @@ void CircularBuffer::buf_reset(){
  * @return True if the buffer was not full, false otherwise
  */
 bool CircularBuffer::buf_put(char data){
-  bool rv;
+  bool rv = true;
   buf[head] = data;
   head = (head + 1) % buf_size;
 
@@ -89,6 +91,59 @@ bool CircularBuffer::is_full(){
   return ((head + 1) % buf_size) == tail;
 }
 
+/*!
+ * returns the number of characters currently held in the buffer
+ * 
+ * @return number of characters between the tail and the head
+ */
+unsigned int CircularBuffer::get_length(){
+  return (head + buf_size - tail) % buf_size;
+}
+
+/*!
+ * Reverses the raw storage between start (inclusive) and end (exclusive).
+ * Used to rotate wrapped data into place without a second buffer.
+ */
+void CircularBuffer::reverse(unsigned int start, unsigned int end){
+  while(start + 1 < end){
+    end--;
+    char swap = buf[start];
+    buf[start] = buf[end];
+    buf[end] = swap;
+    start++;
+  }
+}
+
+/*!
+ * Gives direct access to the buffered data as one contiguous, 
+ * null-terminated string, without copying it anywhere else.
+ * 
+ * If the data wraps around the end of the storage (only happens
+ * after an overflow, or if the buffer is never reset), it is rotated
+ * in place so that it starts at the beginning of the storage.
+ * 
+ * The returned pointer stays valid until the next buf_put/buf_get/buf_reset.
+ * 
+ * @param length
+ *        set to the number of characters available at the returned pointer
+ *        
+ * @return pointer to the oldest character in the buffer
+ */
+char * CircularBuffer::get_contiguous(unsigned int * length){
+  unsigned int len = get_length();
+  if(tail > head){
+    // rotate left by tail: data ends up in [0,len)
+    reverse(0, tail);
+    reverse(tail, buf_size);
+    reverse(0, buf_size);
+    tail = 0;
+    head = len;
+  }
+  buf[head] = '\0';  //always a free slot at head, since we never fill completely
+  *length = len;
+  return &buf[tail];
+}
+
 /*!
  * reads the contents of my buffer to a string pointer provided.
  * 
@@ -23,17 +23,38 @@ private:
   unsigned int head;      ///<current location of the newest data
   unsigned int tail;      ///<current location of the oldest data
   unsigned int buf_size;  ///<current distance between the head and tail
-  
+  void reverse(unsigned int start, unsigned int end);
+
 public:
-  CircularBuffer(int buf_size);
+  CircularBuffer(char * storage, unsigned int buf_size);
   void buf_reset();
   bool buf_put(char data);
   bool buf_get(char * data);
   bool is_empty();
   bool is_full();
   unsigned int get_buf_size(){return buf_size;}
+  unsigned int get_length();
+  char * get_contiguous(unsigned int * length);
   void read_buffer_to_string(char string[], unsigned int max_size);
   
 };
 
+/*!
+ * @class StaticCircularBuffer
+ * 
+ * @brief CircularBuffer that carries its own storage, so its size is 
+ *        fixed (and checked) at compile time and it never touches the heap.
+ * 
+ * @tparam SIZE  bytes of storage; the buffer holds one less than this
+ */
+template <unsigned int SIZE>
+class StaticCircularBuffer : public CircularBuffer{
+private:
+  static_assert(SIZE >= 2, "a CircularBuffer needs room for at least one character");
+  char storage[SIZE];  ///<the data
+
+public:
+  StaticCircularBuffer() : CircularBuffer(storage, SIZE){}
+};
+
 #endif
@@ -0,0 +1,292 @@
+/*!
+ * @file ConfigStore.cpp
+ * 
+ * @brief Log-structured key/value configuration store in EEPROM
+ * 
+ */
+#include "ConfigStore.h"
+#include <util/crc16.h>
+
+/*!
+ * @brief true if sequence number a was written after sequence number b
+ * 
+ * Sequence numbers wrap, so compare them by their signed difference.
+ */
+static bool sequence_is_newer(uint16_t a, uint16_t b){
+  return (int16_t)(a - b) > 0;
+}
+
+/*!
+ * @brief Constructor - does not touch the EEPROM, call begin() for that.
+ * 
+ * @param writer
+ *        queues the writes, and reads back what is queued
+ * @param base_address
+ *        EEPROM address where the store starts
+ * @param slot_count
+ *        number of record slots to use.  Must be larger than the number
+ *        of keys, and the region occupies 
+ *        CONFIG_STORE_HEADER_SIZE + slot_count*CONFIG_SLOT_SIZE bytes.
+ */
+ConfigStore::ConfigStore(EepromWriter * writer, int base_address, unsigned char slot_count){
+  this->writer = writer;
+  this->base_address = base_address;
+  this->slot_count = slot_count;
+  this->next_slot = 0;
+  this->next_sequence = 0;
+  this->scanned = false;
+}
+
+
+/*!
+ * Checks the store header, formatting the store if it's missing or was 
+ * written with a different schema version.
+ * 
+ * @return TRUE if an existing store was found, FALSE if it was formatted
+ */
+bool ConfigStore::begin(){
+  if(writer->read(base_address) == CONFIG_STORE_MAGIC &&
+     writer->read(base_address + 1) == CONFIG_SCHEMA_VERSION){
+    return true;
+  }
+  Serial.println(F("| ConfigStore: no store with this schema version - formatting"));
+  format();
+  return false;
+}
+
+
+/*!
+ * Writes a fresh header and marks every slot empty.
+ */
+void ConfigStore::format(){
+  const unsigned char empty = CONFIG_KEY_EMPTY;
+  const unsigned char header[CONFIG_STORE_HEADER_SIZE] = {CONFIG_STORE_MAGIC, CONFIG_SCHEMA_VERSION};
+  for(unsigned char slot = 0; slot < slot_count; slot++){
+    writer->write(slot_address(slot), &empty, 1);
+  }
+  writer->write(base_address + 1, &header[1], 1);
+  writer->write(base_address, &header[0], 1);
+  next_slot = 0;
+  next_sequence = 0;
+  scanned = true;
+}
+
+
+/*!
+ * @return the first EEPROM address after the store
+ */
+int ConfigStore::end_address(){
+  return slot_address(slot_count);
+}
+
+
+/*!
+ * @return EEPROM address of the first byte (the key) of a slot
+ */
+int ConfigStore::slot_address(unsigned char slot){
+  return base_address + CONFIG_STORE_HEADER_SIZE + slot * CONFIG_SLOT_SIZE;
+}
+
+
+/*!
+ * @return the sequence number stored in a slot
+ */
+uint16_t ConfigStore::slot_sequence(unsigned char slot){
+  int address = slot_address(slot);
+  return writer->read(address + 2) | ((uint16_t)writer->read(address + 3) << 8);
+}
+
+
+/*!
+ * Checks that a slot holds a complete record: a known key, a sane 
+ * length, and a matching CRC.
+ * 
+ * @return TRUE if the slot's record can be trusted
+ */
+bool ConfigStore::slot_is_valid(unsigned char slot){
+  int address = slot_address(slot);
+  unsigned char key = writer->read(address);
+  unsigned char length = writer->read(address + 1);
+  if(key == CONFIG_KEY_EMPTY || key >= CONFIG_KEY_COUNT || length > CONFIG_SLOT_PAYLOAD_SIZE)
+    return false;
+
+  uint8_t crc = 0;
+  for(int i = 0; i < CONFIG_SLOT_HEADER_SIZE + length; i++){
+    crc = _crc8_ccitt_update(crc, writer->read(address + i));
+  }
+  return crc == writer->read(address + CONFIG_SLOT_SIZE - 1);
+}
+
+
+/*!
+ * Finds the newest valid record for a key.
+ * 
+ * @return the slot holding it, or CONFIG_NO_SLOT if there is none
+ */
+unsigned char ConfigStore::find_latest(unsigned char key){
+  unsigned char latest = CONFIG_NO_SLOT;
+  uint16_t latest_sequence = 0;
+  for(unsigned char slot = 0; slot < slot_count; slot++){
+    if(writer->read(slot_address(slot)) != key)
+      continue;
+    uint16_t sequence = slot_sequence(slot);
+    if(latest != CONFIG_NO_SLOT && !sequence_is_newer(sequence, latest_sequence))
+      continue;
+    if(slot_is_valid(slot)){
+      latest = slot;
+      latest_sequence = sequence;
+    }
+  }
+  return latest;
+}
+
+
+/*!
+ * Finds the newest record of any key, to know where the log ends.  Only
+ * needed before the first save, so reads stay lazy.
+ */
+void ConfigStore::scan(){
+  unsigned char newest = CONFIG_NO_SLOT;
+  uint16_t newest_sequence = 0;
+  for(unsigned char slot = 0; slot < slot_count; slot++){
+    uint16_t sequence = slot_sequence(slot);
+    if(newest != CONFIG_NO_SLOT && !sequence_is_newer(sequence, newest_sequence))
+      continue;
+    if(slot_is_valid(slot)){
+      newest = slot;
+      newest_sequence = sequence;
+    }
+  }
+  if(newest == CONFIG_NO_SLOT){
+    next_slot = 0;
+    next_sequence = 0;
+  } else {
+    next_slot = (newest + 1) % slot_count;
+    next_sequence = newest_sequence + 1;
+  }
+  scanned = true;
+}
+
+
+/*!
+ * Reads the newest copy of a value.
+ * 
+ * @param key
+ *        which value to read (see config_key)
+ * @param value
+ *        where to copy the value.  Left untouched if the key is missing, 
+ *        so callers can pre-load their defaults.
+ * @param size
+ *        size of the value buffer.  Must match the size that was saved.
+ *        
+ * @return TRUE if the value was found and copied
+ */
+bool ConfigStore::load(unsigned char key, void * value, unsigned char size){
+  unsigned char slot = find_latest(key);
+  if(slot == CONFIG_NO_SLOT)
+    return false;
+  int address = slot_address(slot);
+  if(writer->read(address + 1) != size){
+    Serial.print(F("| ConfigStore: size mismatch for key "));Serial.println(key,DEC);
+    return false;
+  }
+  for(unsigned char i = 0; i < size; i++){
+    ((unsigned char *)value)[i] = writer->read(address + CONFIG_SLOT_HEADER_SIZE + i);
+  }
+  return true;
+}
+
+
+/*!
+ * Writes a new copy of a value, unless the newest copy already matches.
+ * 
+ * @param key
+ *        which value to write (see config_key)
+ * @param value
+ *        pointer to the value
+ * @param size
+ *        number of bytes to store, at most CONFIG_SLOT_PAYLOAD_SIZE
+ *        
+ * @return TRUE if the store now holds the value.  It may still be on its
+ *         way to the EEPROM, see flush().
+ */
+bool ConfigStore::save(unsigned char key, const void * value, unsigned char size){
+  const unsigned char * bytes = (const unsigned char *)value;
+  if(size > CONFIG_SLOT_PAYLOAD_SIZE || key == CONFIG_KEY_EMPTY || key >= CONFIG_KEY_COUNT)
+    return false;
+  if(!scanned)
+    scan();
+
+  // Nothing to do if the newest copy is identical
+  unsigned char latest = find_latest(key);
+  if(latest != CONFIG_NO_SLOT && writer->read(slot_address(latest) + 1) == size){
+    unsigned char i;
+    for(i = 0; i < size; i++){
+      if(writer->read(slot_address(latest) + CONFIG_SLOT_HEADER_SIZE + i) != bytes[i])
+        break;
+    }
+    if(i == size)
+      return true;
+  }
+
+  // Never overwrite the newest copy of any key - that's what we'd fall back to
+  unsigned char live[CONFIG_KEY_COUNT];
+  for(unsigned char k = 1; k < CONFIG_KEY_COUNT; k++){
+    live[k] = find_latest(k);
+  }
+  unsigned char target = CONFIG_NO_SLOT;
+  for(unsigned char i = 0; i < slot_count && target == CONFIG_NO_SLOT; i++){
+    unsigned char slot = (next_slot + i) % slot_count;
+    target = slot;
+    for(unsigned char k = 1; k < CONFIG_KEY_COUNT; k++){
+      if(live[k] == slot){
+        target = CONFIG_NO_SLOT;
+        break;
+      }
+    }
+  }
+  if(target == CONFIG_NO_SLOT){
+    Serial.println(F("| ConfigStore: no free slot! Increase the slot count."));
+    return false;
+  }
+
+  // Invalidate, write the body, then commit by writing the key last.  The
+  // writer keeps the order, so a power loss leaves the record invisible.
+  int address = slot_address(target);
+  const unsigned char empty = CONFIG_KEY_EMPTY;
+  uint8_t crc = _crc8_ccitt_update(0, key);
+  unsigned char header[CONFIG_SLOT_HEADER_SIZE - 1] = {size,
+                                                       (unsigned char)(next_sequence & 0xFF),
+                                                       (unsigned char)(next_sequence >> 8)};
+  for(unsigned char i = 0; i < sizeof(header); i++){
+    crc = _crc8_ccitt_update(crc, header[i]);
+  }
+  for(unsigned char i = 0; i < size; i++){
+    crc = _crc8_ccitt_update(crc, bytes[i]);
+  }
+  writer->write(address, &empty, 1);
+  writer->write(address + 1, header, sizeof(header));
+  writer->write(address + CONFIG_SLOT_HEADER_SIZE, bytes, size);
+  writer->write(address + CONFIG_SLOT_SIZE - 1, &crc, 1);
+  writer->write(address, &key, 1);
+
+  next_slot = (target + 1) % slot_count;
+  next_sequence++;
+  return true;
+}
+
+
+/*!
+ * @return TRUE while saved records are still being written to the EEPROM
+ */
+bool ConfigStore::is_busy(){
+  return writer->is_busy();
+}
+
+
+/*!
+ * Waits until every saved record is in the EEPROM.
+ */
+void ConfigStore::flush(){
+  writer->flush();
+}
@@ -0,0 +1,126 @@
+/*!
+ * @file ConfigStore.h
+ * 
+ * @brief Log-structured key/value configuration store in EEPROM
+ * 
+ */
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <Arduino.h>
+#include "EepromWriter.h"
+
+/*! @def CONFIG_STORE_MAGIC
+ *  First byte of the store.  If it's not this, the EEPROM has never been 
+ *  formatted as a config store.*/
+#define CONFIG_STORE_MAGIC 0xC5
+/*! @def CONFIG_SCHEMA_VERSION
+ *  Bump this whenever the meaning or layout of a record changes.  A store
+ *  written with a different schema version is reformatted on boot, and 
+ *  everybody falls back to their defaults.*/
+#define CONFIG_SCHEMA_VERSION 1
+/*! @def CONFIG_STORE_HEADER_SIZE
+ *  magic byte + schema version byte*/
+#define CONFIG_STORE_HEADER_SIZE 2
+/*! @def CONFIG_SLOT_PAYLOAD_SIZE
+ *  Largest value a record can hold.  Sized for an SSID or password plus
+ *  its null terminator.*/
+#define CONFIG_SLOT_PAYLOAD_SIZE 33
+/*! @def CONFIG_SLOT_HEADER_SIZE
+ *  key + length + 16-bit sequence number*/
+#define CONFIG_SLOT_HEADER_SIZE 4
+/*! @def CONFIG_SLOT_SIZE
+ *  header + payload + crc*/
+#define CONFIG_SLOT_SIZE (CONFIG_SLOT_HEADER_SIZE + CONFIG_SLOT_PAYLOAD_SIZE + 1)
+/*! @def CONFIG_RECORD_QUEUE_SIZE
+ *  EepromWriter queue taken by save(): five writes (invalidate, header,
+ *  payload, crc, key) of a full record.*/
+#define CONFIG_RECORD_QUEUE_SIZE (5 * EEPROM_JOB_HEADER_SIZE + CONFIG_SLOT_SIZE + 1)
+static_assert(EEPROM_QUEUE_SIZE >= 2 * CONFIG_RECORD_QUEUE_SIZE,
+              "EEPROM_QUEUE_SIZE should fit two records, e.g. an SSID and its password");
+/*! @def CONFIG_NO_SLOT
+ *  Returned by slot searches that came up empty.*/
+#define CONFIG_NO_SLOT 0xFF
+
+/*! 
+ * @enum config_key
+ * 
+ * @brief Keys of the records kept in the config store.
+ * 
+ * Never renumber these - add new ones at the end, and bump 
+ * CONFIG_SCHEMA_VERSION if the layout of an existing value changes.
+ */
+enum config_key{
+  CONFIG_KEY_STATION_SSID = 1,   ///<char[MAX_SSID_LENGTH+1]
+  CONFIG_KEY_STATION_PASSWORD,   ///<char[MAX_PASSWORD_LENGTH+1]
+  CONFIG_KEY_AP_SSID,            ///<char[MAX_SSID_LENGTH+1]
+  CONFIG_KEY_AP_PASSWORD,        ///<char[MAX_PASSWORD_LENGTH+1]
+  CONFIG_KEY_AP_IP,              ///<char[IP_ADDRESS_LENGTH+1]
+  CONFIG_KEY_SERVER_PORT,        ///<unsigned int
+  CONFIG_KEY_SERVER_MAXCONNS,    ///<unsigned char
+  CONFIG_KEY_MOTION_CALIBRATION, ///<struct motion_calibration
+  CONFIG_KEY_SERIAL_BAUD,        ///<unsigned long
+  CONFIG_KEY_COUNT,              ///<one past the last key
+  CONFIG_KEY_EMPTY = 0xFF        ///<erased EEPROM - slot holds no record
+};
+
+/*!
+ * @class ConfigStore
+ * 
+ * @brief Small key/value store for settings that survive a power cycle
+ * 
+ * The EEPROM region is a magic/version header followed by a ring of 
+ * fixed-size slots.  Each slot holds one record:
+ * <pre>
+ *   [key][length][sequence lo][sequence hi][payload ...][crc8]
+ * </pre>
+ * Saving a value never rewrites the record it replaces; it writes a new 
+ * record with a higher sequence number into the next slot that does not 
+ * hold the newest copy of some key, so writes are spread over the whole 
+ * region (wear leveling).  The key byte is written last, so a record
+ * interrupted by a power loss is either invisible or fails its CRC, and 
+ * the previous copy of the value is used instead.
+ * 
+ * Nothing is cached in RAM: load() only reads the slots needed to find 
+ * the newest valid copy of the one key asked for.
+ * 
+ * The EEPROM is written through an EepromWriter, so save() returns as 
+ * soon as the record is queued, and the key byte is still written last.
+ * Reads go through the writer too, and see queued records as saved.  
+ * flush() waits until everything is in the EEPROM.
+ * 
+ * Usage:<pre>
+ *    EepromWriter writer;
+ *    ConfigStore config(&writer, 0, 20);
+ *    config.begin();
+ *    unsigned int port = DEFAULT_PORT;
+ *    config.load(CONFIG_KEY_SERVER_PORT, &port, sizeof(port)); //keeps default if missing
+ *    config.save(CONFIG_KEY_SERVER_PORT, &port, sizeof(port));</pre>
+ */
+class ConfigStore{
+private:
+  EepromWriter * writer;       ///<all EEPROM access goes through it, initialized outside of this class
+  int base_address;            ///<EEPROM address of the magic byte
+  unsigned char slot_count;    ///<number of record slots after the header
+  unsigned char next_slot;     ///<where the wear-leveling search starts for the next save
+  uint16_t next_sequence;      ///<sequence number of the next record saved
+  bool scanned;                ///<true once next_slot/next_sequence are known
+
+  int slot_address(unsigned char slot);
+  uint16_t slot_sequence(unsigned char slot);
+  bool slot_is_valid(unsigned char slot);
+  unsigned char find_latest(unsigned char key);
+  void scan();
+  void format();
+
+public:
+  ConfigStore(EepromWriter * writer, int base_address, unsigned char slot_count);
+  bool begin();
+  bool load(unsigned char key, void * value, unsigned char size);
+  bool save(unsigned char key, const void * value, unsigned char size);
+  bool is_busy();
+  void flush();
+  int end_address();
+};
+
+#endif
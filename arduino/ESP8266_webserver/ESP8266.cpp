@@ -3,7 +3,7 @@
  * 
  * @brief ESP8266 webserver class
  *  
- * This class is an ESP8266 for the purposes of my IOT work.  On creation,
+ * This class is an ESP8266 for the purposes of my IOT work.  On begin(),
  * it will set the device to:
  *  * Only act as a client of an access point, not an access point itself
  *  * Connect to the house access point
@@ -24,113 +24,202 @@ void print_fail(){
   Serial.println(F("[FAIL]"));
 }
 
-//Do not search beyond the end of your haystack
-char *strnstr_P(char *haystack, PGM_P needle, size_t haystack_length)
-{
-  size_t needle_length = strlen_P(needle);
-  size_t i;
-  for (i = 0; i < haystack_length; i++)
-  {
-    if (i + needle_length > haystack_length){
-      return NULL;
-    }
-    if (strncmp_P(&haystack[i], needle, needle_length) == 0){
-      return &haystack[i];
-    }
-  }
-  return NULL;
-}
-
 /*!
- * @brief Constructor: SoftwareSerial port must already be initialized 
+ * @brief Constructor: only sets up the object, see begin()
+ * 
+ * @param port     This is a reference to the serial transport.  By begin(),
+ *                 it must be initialized: the baud rate it was started at
+ *                 is tried first, then the link is renegotiated to the 
+ *                 fastest rate it supports.
  * 
- * @param port     This is a reference to an already-initialized AltSoftSerial port.
+ * @param verbose  If this is set to true, we will say more about what we are doing.
+ *                 Data to and from the device is logged by the transport.
  * 
- * @param verbose  If this is set to true, we will spew data received over the serial port.
+ * @param config   Config store to read settings from.  Only the
+ *                 keys this class needs are read; anything missing keeps its
+ *                 default value.
  * 
- * @param eeprom_address  This is the start location to read configuration info from the eeprom.
- *                        The EEPROM memory block we use looks
- *                        [char initialized][network_info network_info]
- *                         ^eeprom_address   ^eeprom_address + 1
- *                        if "initialized" is set  not exactly equal to INITIALIZED_LETTER, 
- *                           then we load the default settings and write them to
- *                           the EEPROM.
+ * @param buffers  Storage to work in, see ESP8266Server.
  * 
  * @return         This is a constructor.
  */
-ESP8266::ESP8266(AltSoftSerial *port, bool verbose, int eeprom_address){
-  int eeprom_position = 0;
+ESP8266::ESP8266(EspTransport *port, bool verbose, ConfigStore * config, const esp8266_buffers & buffers)
+  : at(port), transmit(port, &at, buffers.streams, buffers.stream_count){
   this->port = port;  //serial port
-  serial_input_buffer = new CircularBuffer(SERIAL_INPUT_BUFFER_MAX_SIZE);
+  this->serial_input_buffer = buffers.input;
+  this->prefetch_output_buffer = buffers.prefetch;
+  this->prefetch_output_buffer_size = buffers.prefetch_size;
+  this->prefetch_output_buffer_len = 0;
+  this->line_handed_out = false;
+  this->command_result = AT_PENDING;
+  this->ipd_remaining = 0;
+  this->ipd_channel = 0;
+  this->line_in_payload = false;
+  this->open_channels = 0;
+  this->prefetch_channel = TX_NO_STREAM;
+  this->scan_channel = TX_NO_STREAM;
+  this->wait_hook = NULL;
+  this->station_connected = false;
+  this->status_matched = false;
+  this->quoted = NULL;
+  this->setting_matched = false;
+  this->job.id = SETTINGS_NO_JOB;
+  this->job.state = SETTINGS_JOB_NONE;
+  at.set_urc_handler(on_unsolicited, this);
   this->verbose = verbose;
-  PRINTSTRLN_IF_VERBOSE("| Dumping all reads and writes to the serial port!");
-
-  this->eeprom_address=eeprom_address;
-
-  if(EEPROM.read(eeprom_address) != INITIALIZED_LETTER){
-    Serial.println(F("| ESP8266: Network settings not initialized - loading defaults"));
-    // Set my own values to the defaults
-    strcpy_P(station.ssid,PSTR("leedy"));         //default SSID
-    strcpy_P(station.password,PSTR("teamgoat"));  //default password
-    strcpy_P(station.macaddr, PSTR("dc:4f:22:11:e9:64"));
-    strcpy_P(station.ip, PSTR("192.168.1.25"));
-
-    strcpy_P(ap.ssid,PSTR("cannon_ap"));         //default SSID
-    strcpy_P(ap.password,PSTR("cannon_pass_!@#$"));  //default password
-    strcpy_P(ap.macaddr, PSTR("11:22:33:44:55:66"));
-    strcpy_P(ap.ip, PSTR("192.168.4.1"));
-    // Save these settings to EEPROM
-    update_eeprom();
-
-  } else{
-    //Read my settings from EEPROM, starting after the INITIALIZED_LETTER
-    eeprom_position++;
-    PRINTSTRLN_IF_VERBOSE("| Reading Settings from EEPROM.");
-    EEPROM.get( (this->eeprom_address+eeprom_position),this->station);
-    eeprom_position += sizeof(this->station);
-    EEPROM.get( (this->eeprom_address+eeprom_position),this->ap);
-  }
+  this->config = config;
+}
+
+
+/*!
+ * @brief Reads the settings and sets the device up.  The transport and the
+ *        config store must be started first.
+ * 
+ * @return True if setup was successful
+ */
+bool ESP8266::begin(){
+  // Start with the defaults, and override them with whatever has been 
+  // saved.  Only the station SSID is kept: setup_device() reads the other
+  // network settings when it needs them.
+  if(verbose)
+    Serial.println(F("| Reading Settings from EEPROM."));
+  load_setting(CONFIG_KEY_STATION_SSID, station_ssid, sizeof(station_ssid), PSTR("leedy"));
   this->server.port = DEFAULT_PORT;
   this->server.maxconns = DEFAULT_MAXCONNS;
+  config->load(CONFIG_KEY_SERVER_PORT, &server.port, sizeof(server.port));
+  config->load(CONFIG_KEY_SERVER_MAXCONNS, &server.maxconns, sizeof(server.maxconns));
 
-  this->setup_device();
+  return this->setup_device();
 }
 
 
-void ESP8266::update_eeprom(){
-  int eeprom_location=0;
-  PRINTSTRLN_IF_VERBOSE("| ESP8266: Updating EEPROM");
-  EEPROM.put(this->eeprom_address, INITIALIZED_LETTER);
-  eeprom_location++;
-  EEPROM.put((this->eeprom_address+eeprom_location), station);
-  eeprom_location += sizeof(station);
-  EEPROM.put((this->eeprom_address+eeprom_location), ap);
+/*!
+ * Reads a string setting from the config store, or its default if none 
+ * has been saved.
+ * 
+ * @param key
+ *        config_key of the setting
+ * @param value
+ *        where to put it
+ * @param size
+ *        size of value, the size the setting is saved with
+ * @param default_value
+ *        PROGMEM default
+ */
+void ESP8266::load_setting(unsigned char key, char * value, unsigned char size, PGM_P default_value){
+  strncpy_P(value, default_value, size);
+  value[size-1] = '\0';
+  config->load(key, value, size);
+}
+
+
+/*!
+ * Saves the SSID and password of a network to the config store.  The 
+ * store skips the write if nothing changed.
+ * 
+ * @param ssid
+ *        the SSID, at most MAX_SSID_LENGTH characters
+ * @param password
+ *        the password, at most MAX_PASSWORD_LENGTH characters
+ * @param ssid_key
+ *        config_key under which to save the SSID
+ * @param password_key
+ *        config_key under which to save the password
+ */
+void ESP8266::save_network_settings(const char * ssid, const char * password,
+                                    unsigned char ssid_key, unsigned char password_key){
+  // padded with zeros, so an unchanged setting saves the same record
+  char value[(MAX_SSID_LENGTH > MAX_PASSWORD_LENGTH ? MAX_SSID_LENGTH : MAX_PASSWORD_LENGTH) + 1];
+  if(verbose)
+    Serial.println(F("| ESP8266: Updating EEPROM"));
+  strncpy(value, ssid, MAX_SSID_LENGTH+1);
+  config->save(ssid_key, value, MAX_SSID_LENGTH+1);
+  strncpy(value, password, MAX_PASSWORD_LENGTH+1);
+  config->save(password_key, value, MAX_PASSWORD_LENGTH+1);
 }
 
 /*!
  *  Read all data avalable on the serial port.  If I encounter
- *    a '\n'  write the data from the beginning of the input buffer
+ *    a '\n'  fill in the view with slices of the input buffer
  *    up to and including the '\n' character and return TRUE.
  *    
- *  If I do not encounter a '\n' return FALSE and do not copy 
- *    anything.
- *  @param line_buffer
- *         pointer to the buffer which we will fill with the line data.
+ *  If I do not encounter a '\n' return FALSE and leave the view alone.
+ *  
+ *  Bytes of an +IPD payload are counted, and the end of the payload also
+ *    ends a line, so e.g. a POST body without a trailing '\n' is still 
+ *    handed out as soon as it has arrived.  A payload line that fills the
+ *    input ring is handed out in pieces, each flagged is_payload.
+ *  
+ *  The tokens of tokens.h are picked out as the bytes arrive, one 
+ *    automaton step per byte, and come with the view.
+ *  
+ *  Every line is offered to the AT engine first: responses to commands
+ *    and unsolicited messages are handled there, and only the lines it
+ *    doesn't want (connection data, stray lines) are handed out.
+ *  
+ *  This is also what keeps responses going out: the transmit scheduler
+ *    gets its turn here, and the '>' prompt it waits for before writing
+ *    data is picked out of the input (it doesn't end in a '\n').
+ *  
+ *  Nothing is copied: the view points into my input ring, and is only
+ *    valid until the next call to read_request().  Callers may modify 
+ *    the line in place (e.g. with strtok) while they hold it.
+ *    
+ *  @param view
+ *         pointer to the view which we will fill with the line data.
  *         
  *  @return TRUE if a line was read successfully
  */
-bool ESP8266::read_line(char line_buffer[], unsigned int line_buffer_size){
+bool ESP8266::read_request(request_view * view){
   char latest_byte = '\0';
+
+  // The previous line has been consumed - give its space back
+  if(line_handed_out){
+    serial_input_buffer->buf_reset();
+    line_handed_out = false;
+  }
+
+  at.poll();
+  if(job.state == SETTINGS_JOB_QUEUED && at.is_idle())
+    submit_settings_job();
+  transmit.poll();
+
   while (this->port->available()) {
     latest_byte = read_port();
 
-    // Add the byte I read to the input buffer
-    serial_input_buffer->buf_put(latest_byte);
+    // The prompt for data comes at the start of a line of its own
+    if(latest_byte == '>' && ipd_remaining == 0 && at.is_awaiting_prompt() &&
+       serial_input_buffer->is_empty()){
+      at.handle_prompt();
+      continue;
+    }
+
+    // Add the byte I read to the input buffer, and look for tokens as it goes by
+    if(!serial_input_buffer->buf_put(latest_byte))
+      tokens.drop_first();
+    tokens.feed(latest_byte);
+
+    bool end_of_line = (latest_byte == '\n');
+    if(ipd_remaining > 0){
+      line_in_payload = true;
+      if(--ipd_remaining == 0 || serial_input_buffer->is_full())
+        end_of_line = true;
+    } else if(latest_byte == ':' && !line_in_payload){
+      start_ipd();
+    }
 
-    // If I just read the end of line char, write out the line,
-    //   clearing out that buffer space.
-    if(latest_byte == '\n') {
-      serial_input_buffer->read_buffer_to_string(line_buffer, line_buffer_size);
+    // If I just read the end of line char, hand out the line
+    if(end_of_line) {
+      view->line.pointer = serial_input_buffer->get_contiguous(&view->line.length);
+      view->tokens = tokens.get_hits();
+      tokens.reset();
+      parse_request_view(view);
+      line_in_payload = false;
+      if(at.handle_line(view)){
+        serial_input_buffer->buf_reset();
+        continue;
+      }
+      line_handed_out = true;
       return true;
     }
   }
@@ -140,28 +229,93 @@ bool ESP8266::read_line(char line_buffer[], unsigned int line_buffer_size){
 
 
 /*!
- *  Read one line from the ESP until timeout.
- *  
- *  @param line_buffer
- *         pointer to the buffer which we will fill with the line data.
- *  @param timeout_ms
- *         number of milliseconds to wait until the line has been read.
- *         
- *  @returns TRUE if a line was read successfully
+ * @brief Called on a ':' outside of any payload.  If the line so far is 
+ *        an "+IPD,<channel>,<length>:" header, start counting the payload.
  */
-bool ESP8266::read_line(char line_buffer[], unsigned int line_buffer_size, unsigned int timeout_ms){
-  unsigned int start_time = millis();
+void ESP8266::start_ipd(){
+  // The matcher has seen the line so far, so the header needs no search
+  unsigned int ipd_offset;
+  if(!find_token(tokens.get_hits(), TOKEN_IPD, &ipd_offset) || ipd_offset != 0)
+    return;
+  buffer_span header;
+  header.pointer = serial_input_buffer->get_contiguous(&header.length);
+
+  char * cursor = header.pointer + 5;
+  char * end = header.pointer + header.length;
+  char channel = 0;
+  while(cursor < end && *cursor >= '0' && *cursor <= '9'){
+    channel = channel*10 + (*cursor - '0');
+    cursor++;
+  }
+  unsigned int ipd_length = 0;
+  if(cursor < end && *cursor == ',')
+    cursor++;
+  while(cursor < end && *cursor >= '0' && *cursor <= '9'){
+    ipd_length = ipd_length*10 + (*cursor - '0');
+    cursor++;
+  }
+  ipd_channel = channel;
+  ipd_remaining = ipd_length;
+  trace_ipd(channel);
+  line_in_payload = true;
+}
 
-  while( (millis() - start_time) <= timeout_ms ){
-    if(read_line(line_buffer, line_buffer_size)){
-      return true;
-    }
-    else{
-      delay(1);  //chill for 1 ms
-    }
+
+/*!
+ * @brief Fills in the channel, method, path and body spans of a view
+ * 
+ * Parses the line in place.  Expects the line span to already be set.
+ * 
+ * @param view
+ *        the view whose line should be parsed
+ */
+void ESP8266::parse_request_view(request_view * view){
+  char * line = view->line.pointer;
+  unsigned int len = view->line.length;
+
+  view->method.pointer = NULL;
+  view->method.length = 0;
+  view->path.pointer = NULL;
+  view->path.length = 0;
+  view->body = view->line;
+  view->is_ipd = false;
+  view->is_payload = false;
+  view->channel = 0;
+
+  if(line_in_payload){
+    view->is_payload = true;
+    view->channel = ipd_channel;
   }
-  Serial.println(F("| read_line timeout"));
-  return false;
+
+  //Look for the channel indicator: "+IPD,<channel>,<length>:"
+  if(!span_starts_with_token(*view, view->line, TOKEN_IPD))
+    return;
+  view->is_ipd = true;
+  this->current_channel = view->channel;
+
+  // the payload starts after the ':'
+  char * end = line + len;
+  char * cursor = (char *)memchr(line, ':', len);
+  if(cursor == NULL)
+    return;
+  cursor++;
+  view->body.pointer = cursor;
+  view->body.length = end - cursor;
+
+  // "<METHOD> <path> HTTP/1.1"
+  char * method = cursor;
+  while(cursor < end && *cursor >= 'A' && *cursor <= 'Z')
+    cursor++;
+  if(cursor == method || cursor >= end || *cursor != ' ')
+    return;
+  view->method.pointer = method;
+  view->method.length = cursor - method;
+  cursor++;
+  char * path = cursor;
+  while(cursor < end && *cursor != ' ' && *cursor != '\r' && *cursor != '\n')
+    cursor++;
+  view->path.pointer = path;
+  view->path.length = cursor - path;
 }
 
 
@@ -170,6 +324,7 @@ bool ESP8266::read_line(char line_buffer[], unsigned int line_buffer_size, unsig
  */
 void ESP8266::clear_buffer(){
   serial_input_buffer->buf_reset();
+  tokens.reset();
 }
 
 
@@ -181,60 +336,452 @@ void ESP8266::clear_buffer(){
  *         number of milliseconds to run the purge
  */
 void ESP8266::purge_serial_input(unsigned int timeout){
-  unsigned int start_time = millis();
-  while (this->port->available() || ((millis()-start_time) >= timeout)) {
+  unsigned long start_time = millis();
+  while ((millis()-start_time) < timeout) {
     //read the port and do nothing 
     if(this->port->available())
       read_port();
   }
   clear_buffer();
+  line_handed_out = false;
 }
 
+
 /*!
- *  Send a command and expect a string in response.
+ *  Set a function to call over and over while run_command() waits for the
+ *  ESP8266, e.g. to keep a watchdog from going off during a command that 
+ *  is allowed to take a while.  Every wait is bounded by its command's 
+ *  timeout.
  *  
- *  Used for setting up the ESP8266
+ *  @param hook
+ *         function to call, or NULL for none
+ */
+void ESP8266::set_wait_hook(void (*hook)()){
+  this->wait_hook = hook;
+}
+
+/*!
+ *  Send a command through the AT engine and wait for it to finish.  
+ *  Lines that are not part of the response (e.g. requests arriving 
+ *  meanwhile) are dropped, and no task runs while it waits - so it is 
+ *  only for setting up the ESP8266, in begin().  Once the server is up,
+ *  submit commands to the AT engine with a done callback instead (see 
+ *  send_networks_list()).
  *  
  *  @param command
- *         pointer to the string containing an ESP8266 AT command
- *  @param command_len
- *         length of the command string
- *  @param desired_response
- *         String to expect in response to the command
- *  @param response_len
- *         length of the response string
+ *         the ESP8266 AT command, including the "\r\n"; NULL with 
+ *         AT_COMMAND_WRITER, which writes the quoted command instead
+ *  @param expect
+ *         string the response must contain, or NULL if "OK" is enough
  *  @param timeout_ms
  *         amount of time to wait for the command to respond.
+ *  @param flags
+ *         AT_COMMAND_IN_PROGMEM, AT_EXPECT_IN_PROGMEM, AT_COMMAND_WRITER
+ *  @param on_line
+ *         optional callback for each line of the response; its context 
+ *         is this ESP8266.
  *         
- *  @return TRUE if we received the expected response
+ *  @return one of at_result
  */
-bool ESP8266::expect_response_to_command(const char * command, unsigned int command_len,
-                                const char * desired_response,
-                                unsigned int timeout_ms){
-  char response_line[MAX_RESPONSE_LINE_LEN] = "";
+unsigned char ESP8266::run_command(const char * command, const char * expect,
+                                   unsigned int timeout_ms, unsigned char flags,
+                                   at_line_callback on_line){
+  at_command request = {command, expect, on_line, on_command_done, this, timeout_ms, flags,
+                        (flags & AT_COMMAND_WRITER) ? on_write_quoted : NULL};
+  request_view stray;
+
+  command_result = AT_PENDING;
+  if(!at.submit(request))
+    return AT_BUSY;
+  while(command_result == AT_PENDING){
+    read_request(&stray);
+    if(wait_hook != NULL)
+      wait_hook();
+  }
+  if(command_result == AT_TIMEOUT){
+    Serial.println(F("| run_command: Timeout"));
+  }
+  return command_result;
+}
 
-  // Write the command
-  this->write_port((char *)command, command_len);
-  
-  // Spin for timeout_ms
-  unsigned int start_time = millis();
-  while((millis() - start_time) < timeout_ms){
-    if(this->read_line(response_line,MAX_RESPONSE_LINE_LEN)){
-      // a line is found
-      if(strstr(response_line,desired_response) != NULL) {
-        //line has response string, return success
-        return true;
-      } else {
-        // line does not have response string
-        // continue reading more lines
-      }
-    }//if(read_line)
-  }//while(millis...)
-  Serial.println(F("| expect_response: Timeout"));
+
+/*!
+ * @return TRUE for the characters the ESP8266 AT parser escapes in a 
+ *         quoted string
+ */
+static bool is_at_special(char c){
+  return c == '"' || c == ',' || c == '\\';
+}
+
+
+/*!
+ * Matches PROGMEM text at the start of [p, end)
+ * 
+ * @return the end of the text in the line, or NULL if it isn't there
+ */
+static const char * match_text_P(const char * p, const char * end, PGM_P text){
+  char c;
+  while((c = pgm_read_byte(text++)) != '\0'){
+    if(p == end || *p != c)
+      return NULL;
+    p++;
+  }
+  return p;
+}
+
+
+/*!
+ * Matches a string at the start of [p, end) as the ESP8266 quotes it: in
+ * double quotes, with its special characters escaped.
+ * 
+ * @return the end of the quoted string in the line, or NULL if it isn't there
+ */
+static const char * match_at_string(const char * p, const char * end, const char * value){
+  if(p == end || *p++ != '"')
+    return NULL;
+  for(; *value != '\0'; value++){
+    if(is_at_special(*value) && (p == end || *p++ != '\\'))
+      return NULL;
+    if(p == end || *p++ != *value)
+      return NULL;
+  }
+  if(p == end || *p++ != '"')
+    return NULL;
+  return p;
+}
+
+
+/*!
+ * @return TRUE if the line contains the quoted command, with its strings
+ *         escaped
+ */
+static bool span_contains_quoted(const buffer_span & line, const quoted_command & expected){
+  const char * end = line.pointer + line.length;
+  for(const char * start = line.pointer; start < end; start++){
+    const char * p = match_text_P(start, end, expected.prefix);
+    if(p != NULL && expected.first != NULL)
+      p = match_at_string(p, end, expected.first);
+    if(p != NULL && expected.second != NULL){
+      p = match_text_P(p, end, PSTR(","));
+      if(p != NULL)
+        p = match_at_string(p, end, expected.second);
+    }
+    if(p != NULL && expected.suffix != NULL)
+      p = match_text_P(p, end, expected.suffix);
+    if(p != NULL)
+      return true;
+  }
+  return false;
+}
+
+
+/*!
+ *  Query a setting, and if it isn't what it should be, set it.  Gives up
+ *  after SETUP_STAGE_ATTEMPTS tries.
+ *  
+ *  @param query
+ *         PROGMEM query command, e.g. "AT+CIPMUX?\r\n"
+ *  @param expected
+ *         what the query response contains if the setting is right; its
+ *         strings are compared in their escaped form
+ *  @param set_command
+ *         command that fixes the setting, escaped as it is written
+ *  @param set_timeout_ms
+ *         how long the set command may take
+ *  
+ *  @return TRUE if the setting is right now
+ */
+bool ESP8266::ensure_setting(PGM_P query, const quoted_command & expected,
+                             const quoted_command & set_command, unsigned int set_timeout_ms){
+  for(unsigned char attempt = 0; attempt < SETUP_STAGE_ATTEMPTS; attempt++){
+    quoted = &expected;
+    setting_matched = false;
+    if(run_command(query, NULL, 2000, AT_COMMAND_IN_PROGMEM, on_setting_line) == AT_OK &&
+       setting_matched){
+      print_ok();
+      return true;
+    }
+    Serial.print(F("\n| ESP8266 -    Not set up yet. Setting up now..."));
+    quoted = &set_command;
+    if(run_command(NULL, NULL, set_timeout_ms, AT_COMMAND_WRITER) == AT_OK){
+      print_ok();
+      return true;
+    }
+    print_fail();
+  }
   return false;
 }
 
 
+/*!
+ * AT engine callback: looks for the response ensure_setting() expects.
+ */
+void ESP8266::on_setting_line(void * context, request_view * line){
+  ESP8266 * esp = (ESP8266 *)context;
+  if(span_contains_quoted(line->line, *esp->quoted))
+    esp->setting_matched = true;
+}
+
+
+/*!
+ * AT engine callback: writes the quoted command of an AT_COMMAND_WRITER 
+ * command.
+ */
+void ESP8266::on_write_quoted(void * context){
+  ESP8266 * esp = (ESP8266 *)context;
+  esp->write_quoted(*esp->quoted);
+}
+
+
+/*!
+ * Writes a quoted command to the ESP8266, escaping its strings on the way.
+ * 
+ * @param command
+ *        the command
+ */
+void ESP8266::write_quoted(const quoted_command & command){
+  char c;
+  for(PGM_P p = command.prefix; (c = pgm_read_byte(p)) != '\0'; p++)
+    port->write(c);
+  if(command.first != NULL)
+    write_at_string(command.first);
+  if(command.second != NULL){
+    port->write(',');
+    write_at_string(command.second);
+  }
+  if(command.suffix != NULL){
+    for(PGM_P p = command.suffix; (c = pgm_read_byte(p)) != '\0'; p++)
+      port->write(c);
+  }
+}
+
+
+/*!
+ * Writes a string to the ESP8266 as a quoted parameter, escaping the 
+ * characters the ESP8266 AT parser treats specially ('"', ',' and '\').
+ * 
+ * @param value
+ *        the parameter value
+ */
+void ESP8266::write_at_string(const char * value){
+  port->write('"');
+  for(; *value != '\0'; value++){
+    if(is_at_special(*value))
+      port->write('\\');
+    port->write(*value);
+  }
+  port->write('"');
+}
+
+
+/*!
+ * AT engine callback: records how a blocking run_command() ended.
+ */
+void ESP8266::on_command_done(void * context, unsigned char result){
+  ((ESP8266 *)context)->command_result = result;
+}
+
+
+/*!
+ * AT engine callback: keeps track of which channels are connected.
+ */
+void ESP8266::on_unsolicited(void * context, unsigned char urc, char channel){
+  ESP8266 * esp = (ESP8266 *)context;
+  if(urc == AT_URC_CONNECT){
+    esp->open_channels |= (1 << channel);
+  } else if(urc == AT_URC_CLOSED){
+    esp->open_channels &= ~(1 << channel);
+    // our own AT+CIPCLOSE traces its close when it finishes
+    if(esp->transmit.drop(channel))
+      trace_channel_closed(channel, TRACE_CLOSED);
+  } else if(urc == AT_URC_READY){
+    Serial.println(F("| WARNING: the ESP8266 restarted"));
+    for(unsigned char i = 0; i < TRACE_CHANNELS; i++){
+      if(esp->open_channels & (1 << i))
+        trace_channel_closed(i, TRACE_CLOSED);
+    }
+    esp->open_channels = 0;
+    esp->transmit.drop_all();
+  }
+}
+
+
+/*!
+ * @var serial_baud_rates
+ * 
+ * @brief Baud rates the ESP8266 might be running at, fastest first.
+ */
+const unsigned long serial_baud_rates[] PROGMEM = {115200, 57600, 38400, 19200, 9600, 4800};
+#define SERIAL_BAUD_RATES_LEN (sizeof(serial_baud_rates)/sizeof(serial_baud_rates[0])) ///< @def number of baud rates to scan
+
+
+/*!
+ *  Restart the port at a baud rate and check whether the ESP answers.
+ *  
+ *  @param baud
+ *         the baud rate to try
+ *  
+ *  @return TRUE if the ESP8266 replied "OK" to "AT" at this rate
+ */
+bool ESP8266::probe_baud(unsigned long baud){
+  port->begin(baud);
+  delay(10);
+  clear_buffer();
+  line_handed_out = false;
+  for(unsigned char attempt = 0; attempt < 2; attempt++){
+    if(run_command(PSTR("AT\r\n"),NULL,BAUD_PROBE_TIMEOUT_MS,AT_COMMAND_IN_PROGMEM) == AT_OK)
+      return true;
+  }
+  return false;
+}
+
+
+/*!
+ *  Find the baud rate the ESP8266 is currently running at, starting with 
+ *  the rate the port was started at.
+ *  
+ *  @return the baud rate found, or zero if the ESP8266 didn't answer at all
+ */
+unsigned long ESP8266::find_baud(){
+  unsigned long initial_baud = port->get_baud();
+  if(initial_baud != 0 && probe_baud(initial_baud))
+    return initial_baud;
+  for(unsigned char i = 0; i < SERIAL_BAUD_RATES_LEN; i++){
+    unsigned long baud = pgm_read_dword(&serial_baud_rates[i]);
+    if(baud == initial_baud)
+      continue;
+    Serial.print(F("| ESP8266 - Trying serial baud ")); Serial.println(baud,DEC);
+    if(probe_baud(baud))
+      return baud;
+  }
+  if(initial_baud != 0)
+    port->begin(initial_baud);
+  return 0;
+}
+
+
+/*!
+ *  Make sure the link works at the current rate, not just once.
+ *  
+ *  @return TRUE if LINK_CHECK_ROUNDS commands in a row came back clean
+ */
+bool ESP8266::check_link_quality(){
+  for(unsigned char round = 0; round < LINK_CHECK_ROUNDS; round++){
+    if(run_command(PSTR("AT\r\n"),NULL,BAUD_PROBE_TIMEOUT_MS,AT_COMMAND_IN_PROGMEM) != AT_OK)
+      return false;
+  }
+  return true;
+}
+
+
+/*!
+ *  Send an AT+UART_CUR / AT+UART_DEF command for a baud rate.
+ *  
+ *  @param command
+ *         PROGMEM start of the command, up to the '='
+ *  @param baud
+ *         the baud rate to put in the command
+ *  @param wait_for_ok
+ *         if false, don't wait for a response (e.g. because it will come
+ *         back at a rate we can't hear)
+ *  
+ *  @return TRUE if the command was acknowledged (or not waited for)
+ */
+bool ESP8266::send_uart_command(PGM_P command, unsigned long baud, bool wait_for_ok){
+  char request_buffer[COMMAND_BUFFER_SIZE];
+  unsigned int request_len = TextWriter(request_buffer, COMMAND_BUFFER_SIZE)
+                               .print(flash(command), baud, F(",8,1,0,0\r\n"));
+  if(!wait_for_ok){
+    write_port(request_buffer, request_len);
+    return true;
+  }
+  return run_command(request_buffer,NULL,1000,0) == AT_OK;
+}
+
+
+/*!
+ *  Move the link to a new baud rate, and move it back if the link is 
+ *  not clean at the new rate.
+ *  
+ *  @param new_baud
+ *         the rate to switch to
+ *  @param fallback_baud
+ *         the rate the link is running at now
+ *  
+ *  @return TRUE if the link now runs at new_baud, FALSE if it's back at 
+ *          fallback_baud (or lost - call find_baud() to recover)
+ */
+bool ESP8266::switch_baud(unsigned long new_baud, unsigned long fallback_baud){
+  Serial.print(F("| ESP8266 - Switching serial baud to ")); Serial.print(new_baud,DEC); Serial.print(F("..."));
+  if(!send_uart_command(PSTR("AT+UART_CUR="), new_baud, true)){
+    print_fail();
+    return false;
+  }
+  // The ESP switches as soon as it has said OK
+  port->begin(new_baud);
+  delay(10);
+  clear_buffer();
+  line_handed_out = false;
+  if(check_link_quality()){
+    print_ok();
+    return true;
+  }
+
+  // Link is not clean - ask the ESP to go back, as best we can
+  print_fail();
+  send_uart_command(PSTR("AT+UART_CUR="), fallback_baud, false);
+  delay(10);
+  probe_baud(fallback_baud);
+  return false;
+}
+
+
+/*!
+ *  Find the rate the ESP8266 is running at, then move the link to the 
+ *  fastest rate the transport supports that passes the link check.  The 
+ *  result is saved in the ESP (AT+UART_DEF) and in the config store so the
+ *  next boot starts there, unless the config store has it already.
+ *  
+ *  @return the baud rate the link is now running at, zero if the ESP8266
+ *          could not be found at any rate.
+ */
+unsigned long ESP8266::negotiate_baud(){
+  Serial.print(F("| ESP8266 - Looking for the device's serial baud rate..."));
+  unsigned long current_baud = find_baud();
+  if(current_baud == 0){
+    print_fail();
+    return 0;
+  }
+  Serial.println(current_baud,DEC);
+
+  for(unsigned char i = 0; i < SERIAL_BAUD_RATES_LEN; i++){
+    unsigned long baud = pgm_read_dword(&serial_baud_rates[i]);
+    if(baud > port->get_max_baud() || baud <= current_baud)
+      continue;
+    if(switch_baud(baud, current_baud)){
+      current_baud = baud;
+      break;
+    }
+    // make sure we can still hear it before trying the next rate down
+    if(!probe_baud(current_baud)){
+      current_baud = find_baud();
+      if(current_baud == 0)
+        return 0;
+    }
+  }
+
+  // Make the negotiated rate the default on both ends - but only if it
+  // changed: AT+UART_DEF rewrites a sector of the ESP8266's flash
+  unsigned long saved_baud = 0;
+  config->load(CONFIG_KEY_SERIAL_BAUD, &saved_baud, sizeof(saved_baud));
+  if(saved_baud != current_baud){
+    send_uart_command(PSTR("AT+UART_DEF="), current_baud, true);
+    config->save(CONFIG_KEY_SERIAL_BAUD, &current_baud, sizeof(current_baud));
+  }
+  return current_baud;
+}
+
+
 /*!
  *  
  *  Setup the ESP8266 as a webserver
@@ -243,254 +790,145 @@ bool ESP8266::expect_response_to_command(const char * command, unsigned int comm
  *  
  */
 bool ESP8266::setup_device(){
-    char request_buffer[COMMAND_BUFFER_SIZE]; 
-    char response_buffer[COMMAND_BUFFER_SIZE];
-    int setup_stage_delay=1000;
+    char request_buffer[sizeof("AT+CIPSERVER=1,65535\r\n")];
+    bool all_set = true;
    
+    // Run the link as fast as it will go
+    negotiate_baud();
+
     // Get a response from anyone
     Serial.print(F("| ESP8266 - Waiting for a response from the Wifi Device..."));
-    while(!expect_response_to_command("AT\r\n",4,"OK",2000)){
+    unsigned char attempt = 0;
+    while(run_command(PSTR("AT\r\n"),NULL,2000,AT_COMMAND_IN_PROGMEM) != AT_OK){
+        if(++attempt >= SETUP_STAGE_ATTEMPTS){
+            print_fail();
+            return false;
+        }
         delay(1000);
     }
     print_ok();
     
     Serial.print(F("| ESP8266 - Checking the device CWMODE..."));
     // Set myself up as a client of an access point.
-    strncpy_P(request_buffer,PSTR("AT+CWMODE?\r\n"), COMMAND_BUFFER_SIZE);
-    strncpy_P(response_buffer,PSTR("+CWMODE:3"),COMMAND_BUFFER_SIZE);
-    while(true){
-      purge_serial_input(setup_stage_delay);
-      if(expect_response_to_command(request_buffer,
-                                    strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                    response_buffer,2000)){
-          print_ok();
-          break;
-      } else {
-        Serial.print (F("\n| ESP8266 -    Setting the mode to 'client mode'"));
-        strncpy_P(request_buffer,PSTR("AT+CWMODE_DEF=3\r\n"), COMMAND_BUFFER_SIZE);
-        strncpy_P(response_buffer,PSTR("OK"), COMMAND_BUFFER_SIZE);
-        if(expect_response_to_command(request_buffer,
-                                      strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                      response_buffer,2000)){
-            print_ok();
-            break;
-        }
-        else {
-            print_fail();
-        }
-      }
-    }
+    quoted_command mode_reply = {PSTR("+CWMODE:3"), NULL, NULL, NULL};
+    quoted_command mode_set = {PSTR("AT+CWMODE_DEF=3\r\n"), NULL, NULL, NULL};
+    all_set &= ensure_setting(PSTR("AT+CWMODE?\r\n"), mode_reply, mode_set, 2000);
 
     // configure the cannon AP
-    Serial.print(F("| ESP8266 - configuring my own access point..."));
-    strncpy_P(request_buffer,PSTR("AT+CWSAP_DEF?\r\n"), COMMAND_BUFFER_SIZE);
-    snprintf_P(response_buffer,COMMAND_BUFFER_SIZE,PSTR("+CWSAP_DEF:\"%s\",\"%s\",1,3"),ap.ssid,ap.password);
-    while(true){
-      purge_serial_input(setup_stage_delay);
-      if(expect_response_to_command(request_buffer,
-                                    strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                    response_buffer,2000)){
-          print_ok();
-          break;
-      } else {
-        Serial.print (F("\n| ESP8266 -     Access point not set up.  Setting up now..."));
-        snprintf_P(request_buffer,COMMAND_BUFFER_SIZE,PSTR("AT+CWSAP_DEF=\"%s\",\"%s\",1,3,4,0\r\n"),ap.ssid,ap.password);
-        strncpy_P(response_buffer,PSTR("OK"),COMMAND_BUFFER_SIZE);
-        if(expect_response_to_command(request_buffer,
-                                      strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                      response_buffer,
-                                      10000)){
-            print_ok();
-            break;
-        }
-        else {
-            print_fail();
-        }
-      }
+    {
+      char ssid[MAX_SSID_LENGTH+1];
+      char password[MAX_PASSWORD_LENGTH+1];
+      load_setting(CONFIG_KEY_AP_SSID, ssid, sizeof(ssid), PSTR("cannon_ap"));
+      load_setting(CONFIG_KEY_AP_PASSWORD, password, sizeof(password), PSTR("cannon_pass_!@#$"));
+      Serial.print(F("| ESP8266 - configuring my own access point..."));
+      quoted_command ap_reply = {PSTR("+CWSAP_DEF:"), ssid, password, PSTR(",1,3")};
+      quoted_command ap_set = {PSTR("AT+CWSAP_DEF="), ssid, password, PSTR(",1,3,4,0\r\n")};
+      all_set &= ensure_setting(PSTR("AT+CWSAP_DEF?\r\n"), ap_reply, ap_set, 10000);
     }
 
-
-    
     // configure the cannon AP
-    Serial.print(F("| ESP8266 - configuring my ip address on cannon_ap network to 192.168.4.1..."));
-    strncpy_P(request_buffer,PSTR("AT+CIPAP_DEF?\r\n"), COMMAND_BUFFER_SIZE);
-    snprintf_P(response_buffer,COMMAND_BUFFER_SIZE,PSTR("+CIPAP_DEF:ip:\"%s\""),ap.ip);
-    while(true){
-      purge_serial_input(setup_stage_delay);
-      if(expect_response_to_command(request_buffer,
-                                    strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                    response_buffer,2000)){
-          print_ok();
-          break;
-      } else {
-        Serial.print (F("\n| ESP8266 -  ip address on cannon_ap not set up.  Setting up now..."));
-        snprintf_P(request_buffer,COMMAND_BUFFER_SIZE,PSTR("AT+CIPAP_DEF=\"%s\",\"%s\",\"255.255.255.0\"\r\n"),ap.ip,ap.ip);
-        strncpy_P(response_buffer,PSTR("OK"),COMMAND_BUFFER_SIZE);
-        if(expect_response_to_command(request_buffer,
-                                      strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                      response_buffer,
-                                      10000)){
-            print_ok();
-            break;
-        }
-        else {
-            print_fail();
-        }
-      }
+    {
+      char ip[IP_ADDRESS_LENGTH+1];
+      load_setting(CONFIG_KEY_AP_IP, ip, sizeof(ip), PSTR("192.168.4.1"));
+      Serial.print(F("| ESP8266 - configuring my ip address on cannon_ap network to "));Serial.print(ip);Serial.print(F("..."));
+      quoted_command ip_reply = {PSTR("+CIPAP_DEF:ip:"), ip, NULL, NULL};
+      quoted_command ip_set = {PSTR("AT+CIPAP_DEF="), ip, ip, PSTR(",\"255.255.255.0\"\r\n")};
+      all_set &= ensure_setting(PSTR("AT+CIPAP_DEF?\r\n"), ip_reply, ip_set, 10000);
     }
-
     
     // Now join the house access point
-    Serial.print(F("| ESP8266 - Checking that we are on the correct network..."));
-    strncpy_P(request_buffer,PSTR("AT+CWJAP?\r\n"), COMMAND_BUFFER_SIZE);
-    snprintf_P(response_buffer,COMMAND_BUFFER_SIZE,PSTR("+CWJAP:\"%s\""),station.ssid);
-    while(true){
-      purge_serial_input(setup_stage_delay);
-      if(expect_response_to_command(request_buffer,
-                                    strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                    response_buffer,2000)){
-          print_ok();
-          break;
-      } else {
-        Serial.print (F("\n| ESP8266 -     Not on the correct network. Fixing the WiFi settings..."));
-        snprintf_P(request_buffer, COMMAND_BUFFER_SIZE,PSTR("AT+CWJAP_DEF=\"%s\",\"%s\"\r\n"),station.ssid,station.password);
-        strncpy_P(response_buffer,PSTR("OK"),COMMAND_BUFFER_SIZE);
-        if(expect_response_to_command(request_buffer,
-                                      strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                      response_buffer,
-                                      10000)){
-            print_ok();
-            break;
-        }
-        else {
-            print_fail();
-        }
-      }
+    {
+      char password[MAX_PASSWORD_LENGTH+1];
+      load_setting(CONFIG_KEY_STATION_PASSWORD, password, sizeof(password), PSTR("teamgoat"));
+      Serial.print(F("| ESP8266 - Checking that we are on the correct network..."));
+      quoted_command join_reply = {PSTR("+CWJAP:"), station_ssid, NULL, NULL};
+      quoted_command join_set = {PSTR("AT+CWJAP_DEF="), station_ssid, password, PSTR("\r\n")};
+      all_set &= ensure_setting(PSTR("AT+CWJAP?\r\n"), join_reply, join_set, 10000);
     }
-/*
-    // Now setup the CIP Server
-    Serial.print(F("ESP8266 - Setting server maxconns..."));
-    snprintf_P(request_buffer, COMMAND_BUFFER_SIZE,PSTR("AT+CIPSERVERMAXCONN=%d\r\n"),server.maxconns);
-    strncpy_P(response_buffer,PSTR("OK"),COMMAND_BUFFER_SIZE);
-    while(true){
-      purge_serial_input(setup_stage_delay);
-      if(expect_response_to_command(request_buffer,
-                                    strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                    response_buffer,
-                                    10000)){
-        print_ok();
-        break;
-      } else {
-        print_fail();
-      }
-    }
-  */  
+
     // Set ourselves up to mux connections into our little server
     Serial.print(F("| ESP8266 - Checking the CIPMUX Settings..."));
-    strncpy_P(request_buffer,PSTR("AT+CIPMUX?\r\n"), COMMAND_BUFFER_SIZE);
-    strncpy_P(response_buffer,PSTR("+CIPMUX:1"),COMMAND_BUFFER_SIZE);
-    while(true){
-      purge_serial_input(setup_stage_delay);
-      if(expect_response_to_command(request_buffer,
-                                    strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                    response_buffer,2000)){
-          print_ok();
-          break;
-      } else {
-          Serial.print(F("\n| ESP8266 -    Server not enabled yet. Setting CIPMUX=1..."));
-          strncpy_P(request_buffer,PSTR("AT+CIPMUX=1\r\n"), COMMAND_BUFFER_SIZE);
-          strncpy_P(response_buffer,PSTR("OK"),COMMAND_BUFFER_SIZE);
-          if(expect_response_to_command(request_buffer,
-                                        strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                        response_buffer,
-                                        10000)){
-              print_ok();
-              break;
-          }
-          else {
-              print_fail();
-          }
-      }
-    }
+    quoted_command mux_reply = {PSTR("+CIPMUX:1"), NULL, NULL, NULL};
+    quoted_command mux_set = {PSTR("AT+CIPMUX=1\r\n"), NULL, NULL, NULL};
+    all_set &= ensure_setting(PSTR("AT+CIPMUX?\r\n"), mux_reply, mux_set, 10000);
     
     // Now setup the CIP Server
     Serial.print(F("| ESP8266 - Configuring my server on port 8080..."));
-    snprintf_P(request_buffer, COMMAND_BUFFER_SIZE,PSTR("AT+CIPSERVER=1,%d\r\n"),server.port);
-    strncpy_P(response_buffer,PSTR("OK"),COMMAND_BUFFER_SIZE);
-    while(true){
-      purge_serial_input(setup_stage_delay);
-      if(expect_response_to_command(request_buffer,
-                                    strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                    response_buffer,
-                                    10000)){
-          print_ok();
-          break;
-      } else {
-          print_fail();
-          return false;
-      }
+    TextWriter(request_buffer,sizeof(request_buffer)).print(F("AT+CIPSERVER=1,"),server.port,F("\r\n"));
+    if(run_command(request_buffer,NULL,10000,0) != AT_OK){
+        print_fail();
+        return false;
     }
+    print_ok();
     
-  return true;
+  return all_set;
 }
 
 
 /*!
+ *  Get an empty output queue for a response to a channel.  Once the 
+ *    response is queued, hand it to the transmit scheduler with 
+ *    transmit.send(channel); it goes out in the background, and the 
+ *    connection is closed after it.
  *  
- *  Send the contents of my output queue to a specific channel
+ *  If the lane is full, or the prefetch output buffer is still being 
+ *    sent, the request is answered with a 503 instead.
  *  
  *  @param channel
- *         The channel to which this send will be transmitted.
+ *         The channel to which the response will be sent.
+ *  @param lane
+ *         one of tx_lane
+ *  @param uses_prefetch
+ *         TRUE if the response will point into the prefetch output buffer.
+ *  
+ *  @return the queue, or NULL if there is no room for the response
  */
-void ESP8266::send_output_queue(unsigned char channel){
-    // Command the esp to listen for n bytes of data
-    char write_command_string[COMMAND_BUFFER_SIZE];
-    char response_buffer[COMMAND_BUFFER_SIZE];
-    
-    // Put the ESP int send mode
-    snprintf_P(write_command_string, COMMAND_BUFFER_SIZE, 
-                                     PSTR("AT+CIPSEND=%d,%d\r\n"),
-                                     channel,
-                                     output_queue.get_total_size());
-    write_port(write_command_string,strnlen(write_command_string,COMMAND_BUFFER_SIZE));
-
-    // Wait a bit to let it get ready
-    delay(20);
-
-    // Write all of the elements in my output queue
-    string_element data_to_write;
-    //while we can retrieve things from the output queue
-    while(output_queue.get_element(&data_to_write)){
-      PRINTSTR_IF_VERBOSE("| Outputting queue element of size: ");
-      PRINTLN_IF_VERBOSE(data_to_write.string_length);
-      if(data_to_write.is_progmem){
-        for(unsigned int i=0;i<data_to_write.string_length;i++){
-          char byte_to_write = pgm_read_byte(data_to_write.pointer + i);
-          write_port(&byte_to_write, 1);
-        }
-      }else{
-        write_port(data_to_write.pointer,data_to_write.string_length);
-      }
-    }
-    
-    // Send the command to terminate the data stream, 
-    //  even though it should have been terminated based on length.
-    write_port((char *)"++++++\r\n",8);
+OutputQueue * ESP8266::open_response(unsigned char channel, unsigned char lane, bool uses_prefetch){
+  OutputQueue * queue = NULL;
+  if(!uses_prefetch || !transmit.is_sending(prefetch_channel))
+    queue = transmit.open(channel, lane);
+  if(queue == NULL){
+    this->send_http_503(channel);
+    return NULL;
+  }
+  if(uses_prefetch)
+    prefetch_channel = channel;
+  return queue;
+}
 
-    // Wait 500 ms before sending any other command, per the Espressif ICD, this should be 1s
-    delay(500); 
-    
-    // Now close the connection, printing a warning if I don't see an "OK" in response
-    snprintf_P(write_command_string, COMMAND_BUFFER_SIZE, PSTR("AT+CIPCLOSE=%d\r\n"),channel);
-    strncpy_P(response_buffer,PSTR("OK"),COMMAND_BUFFER_SIZE);
-    if(expect_response_to_command(write_command_string,
-                                  strnlen(write_command_string,COMMAND_BUFFER_SIZE),
-                                  response_buffer,1000)){
-        //Closed successfully - no action needed
-    } else {
-        //Print a warning - if this happens often, potentially put this into a loop to make sure we close channels
-        Serial.print(F("| WARNING Failed to close connection to the ESP8266 on channel ")); Serial.println(channel,DEC);
-    }
+
+/*!
+ *  Tell the client to try again in a moment (HTTP 503).  Goes out in the
+ *    control lane, which always has room unless every stream is taken.
+ *  
+ *  @param channel
+ *         The channel on which we send this response
+ */
+void ESP8266::send_http_503(unsigned char channel){
+  Serial.print(F("| Busy: 503 on channel ")); Serial.println(channel,DEC);
+  OutputQueue * queue = transmit.open(channel, TX_LANE_CONTROL);
+  if(queue == NULL){
+    Serial.println(F("| WARNING: no room for the 503 either, dropping the request"));
+    return;
+  }
+  queue->add_progmem(http_503_response, HTTP_503_RESPONSE_LEN);
+  this->transmit.send(channel);
+}
+
+
+/*!
+ *  Queue up the HTTP 200 start line and headers for a response body of 
+ *  a known size.
+ *  
+ *  @param queue
+ *         the response, from open_response()
+ *  @param content_length
+ *         Number of bytes in the body that will follow the headers
+ */
+void ESP8266::queue_http_200_header(OutputQueue * queue, unsigned int content_length){
+  queue->add_progmem(http_200_start_line, HTTP_200_START_LINE_LEN);
+  queue->add_unsigned(content_length);
+  queue->add_progmem(http_header_end, HTTP_HEADER_END_LEN);
 }
 
 
@@ -503,226 +941,253 @@ void ESP8266::send_output_queue(unsigned char channel){
  *         A pointer to the page data to be transmitted
  *  @param page_data_len
  *         Number of characters in the page data to be transmitted
+ *  @param lane
+ *         one of tx_lane; TX_LANE_CONTROL for short replies to commands
  */
-void ESP8266::send_http_200_static(unsigned char channel, char page_data[], unsigned int page_data_len){
-
-  this->output_queue.add_element((char *)http_200_start_line, HTTP_200_START_LINE_LEN, true);
+void ESP8266::send_http_200_static(unsigned char channel, char page_data[], unsigned int page_data_len,
+                                   unsigned char lane){
+  OutputQueue * queue = this->open_response(channel, lane, false);
+  if(queue == NULL)
+    return;
 
-  //todo: add Content_Length header so I don't have to close the connection forcibly
+  this->queue_http_200_header(queue, page_data_len);
 
   // Now enqueue the website page data, which is stored in progmem
-  this->output_queue.add_element(page_data, page_data_len,true);
+  queue->add_progmem(page_data, page_data_len);
   
   // Send!
-  this->send_output_queue(channel);
+  this->transmit.send(channel);
+}
+
+
+/*!
+ *  Send an asset from the flash bundle as an HTTP 200 response.  Assets 
+ *    with fetched fields (the config page) get the current settings 
+ *    written in, and are never cached.  The others may be cached by the
+ *    browser, carry their content hash as the ETag, and can be sent in
+ *    part (HTTP 206) to resume a transfer that was cut off.
+ *  
+ *  @param channel
+ *         The channel on which we send this response
+ *  @param asset
+ *         directory entry of the asset, see find_asset()
+ *  @param range
+ *         the part of the asset to send, from the Range header, or NULL 
+ *         for all of it.  Ignored for assets with fetched fields.
+ */
+void ESP8266::send_asset(unsigned char channel, const asset_entry & asset, const byte_range * range){
+  bool partial = (range != NULL) && range->requested && (asset.flags & ASSET_CACHEABLE);
+  unsigned int first = 0;
+  unsigned int count = asset.length;
+
+  OutputQueue * queue = this->open_response(channel, TX_LANE_BULK, partial || asset.field_count > 0);
+  if(queue == NULL)
+    return;
+  prefetch_output_buffer_len = 0;
+  if(partial){
+    if(!resolve_byte_range(*range, asset.length, &first, &count)){
+      queue->add_progmem(http_416_start_line, HTTP_416_START_LINE_LEN);
+      queue->add_unsigned(asset.length);
+      queue->add_progmem(http_content_length, HTTP_CONTENT_LENGTH_LEN);
+      queue->add_unsigned(0);
+      queue->add_progmem(http_header_end, HTTP_HEADER_END_LEN);
+      this->transmit.send(channel);
+      return;
+    }
+    // the prefetch buffer isn't needed for the body, so it holds the Content-Range header
+    prefetch_output_buffer_len = TextWriter(prefetch_output_buffer, prefetch_output_buffer_size)
+                                   .print(F("\r\nContent-Range: bytes "), first, '-', first + count - 1,
+                                          '/', asset.length);
+  } else if(asset.field_count > 0){
+    this->prefetch_fields(asset.fields, asset.field_count);
+    count += prefetch_output_buffer_len;
+  }
+
+  PGM_P mime = asset_mime_type(asset.mime);
+  if(partial)
+    queue->add_progmem(http_206_content_type, HTTP_206_CONTENT_TYPE_LEN);
+  else
+    queue->add_progmem(http_200_content_type, HTTP_200_CONTENT_TYPE_LEN);
+  queue->add_progmem(mime, strlen_P(mime));
+  if(asset.flags & ASSET_GZIP)
+    queue->add_progmem(http_gzip_encoding, HTTP_GZIP_ENCODING_LEN);
+  if(partial)
+    queue->add_ram(prefetch_output_buffer, prefetch_output_buffer_len);
+  if(asset.flags & ASSET_CACHEABLE){
+    queue->add_progmem(http_cache_control, HTTP_CACHE_CONTROL_LEN);
+    queue->add_progmem(asset.etag, strlen_P(asset.etag));
+  }
+  queue->add_progmem(http_content_length, HTTP_CONTENT_LENGTH_LEN);
+  queue->add_unsigned(count);
+  queue->add_progmem(http_header_end, HTTP_HEADER_END_LEN);
+
+  if(partial){
+    queue->add_progmem(asset.data + first, count);
+  } else {
+    // The asset data, with the fetched fields written in at the split
+    queue->add_progmem(asset.data, asset.split);
+    if(prefetch_output_buffer_len > 0)
+      queue->add_ram(prefetch_output_buffer, prefetch_output_buffer_len);
+    if(asset.length > asset.split)
+      queue->add_progmem(asset.data + asset.split, asset.length - asset.split);
+  }
+
+  // Send!
+  this->transmit.send(channel);
+}
+
+
+/*!
+ *  Tell the browser that its cached copy of an asset is still good 
+ *    (HTTP 304), i.e. the If-None-Match header matched the asset's ETag.
+ *  
+ *  @param channel
+ *         The channel on which we send this response
+ *  @param asset
+ *         directory entry of the asset, see find_asset()
+ */
+void ESP8266::send_not_modified(unsigned char channel, const asset_entry & asset){
+  OutputQueue * queue = this->open_response(channel, TX_LANE_BULK, false);
+  if(queue == NULL)
+    return;
+  queue->add_progmem(http_304_start_line, HTTP_304_START_LINE_LEN);
+  queue->add_progmem(http_cache_control, HTTP_CACHE_CONTROL_LEN);
+  queue->add_progmem(asset.etag, strlen_P(asset.etag));
+  queue->add_progmem(http_header_end, HTTP_HEADER_END_LEN);
+  this->transmit.send(channel);
+}
+
+
+/*!
+ *  Send an HTTP 200 response whose body is produced on the fly.
+ *  
+ *  @param channel
+ *         The channel on which we send this response
+ *  @param generator
+ *         produces the body, see segment_generator
+ *  @param context
+ *         passed back to the generator
+ *  @param length
+ *         exact number of bytes the generator will produce
+ */
+void ESP8266::send_http_200_generated(unsigned char channel, segment_generator generator,
+                                      void * context, unsigned int length){
+  OutputQueue * queue = this->open_response(channel, TX_LANE_BULK, false);
+  if(queue == NULL)
+    return;
+  this->queue_http_200_header(queue, length);
+  queue->add_generator(generator, context, length);
+  this->transmit.send(channel);
 }
 
 
 /*!
- *  Sends an http 200 response, populating a javascript map variable 
- *    with data fetched about the device's configuration.  This was 
- *    created for the config page, which should display the current settings
- *    when you load the page.
+ *  Fills the prefetch output buffer with the current value of each 
+ *    field, as entries of a javascript map (e.g. ssid__:"home",).  This
+ *    was created for the config page, which should display the current
+ *    settings when you load the page.
  *    
- *    @param channel
- *           the channel to which we will send this request
- *    @param page_data_0
- *           pointer to the first page data element to write (before the dynamic data)
- *    @param page_data_0_len
- *           length of the element above
- *    @param page_data_2
- *           pointer to the first page data element to write (after the dynamic data)
- *    @param page_data_2_len
- *           length of the element above
  *    @param prefetch_data_fields
- *           this is a list of 7-character ID's
+ *           PROGMEM list of 7-character ID's
  *    @param num_prefetch_data_fields
  *           the number of 7-character fields to retrieve
  */
-void ESP8266::send_http_200_with_prefetch(unsigned char channel,
-                                          char page_data_0[], unsigned int page_data_0_len,
-                                          char page_data_2[], unsigned int page_data_2_len,
-                                          const char* const prefetch_data_fields[], unsigned int num_prefetch_data_fields){
-
-
-  this->output_queue.add_element((char *)http_200_start_line, HTTP_200_START_LINE_LEN, true);
-
-  // Now enqueue the first section of website page data (in progmem)
-  this->output_queue.add_element(page_data_0, page_data_0_len,true);
+void ESP8266::prefetch_fields(const char* const prefetch_data_fields[], unsigned int num_prefetch_data_fields){
 
   // Add each field to a prefetch buffer, that I'll put in the output queue
-  strncpy_P(prefetch_output_buffer,PSTR("//begin prefetched data\n"),PREFETCH_OUTPUT_BUFFER_SIZE);
-
+  TextWriter fields(prefetch_output_buffer, prefetch_output_buffer_size);
+  bool wrote_addresses = false;  //ipaddr and macadr are written together
+  
   // For each prefetch data field, find the matching data and add it
   //   to the buffer string.
-  prefetch_output_buffer_len = 0; //clear the output buffer
-  bool have_queried_mac = false;  //only queried to get mac and IP
-  int buffer_size_remaining;
-  
-  for(unsigned int i=0; i<=num_prefetch_data_fields; i++){
-
-    // check
-    buffer_size_remaining = PREFETCH_OUTPUT_BUFFER_SIZE - prefetch_output_buffer_len;
-    if(buffer_size_remaining < 20){
-      Serial.println(F("| WARNING: prefetch output buffer is running out of space!"));
-      Serial.println(PREFETCH_OUTPUT_BUFFER_SIZE);
-      Serial.println(prefetch_output_buffer_len);
-    }
+  for(unsigned int i=0; i<num_prefetch_data_fields; i++){
 
     char prefetch_field_name[10];
 
     strncpy_P(prefetch_field_name, (char*)pgm_read_word(&(prefetch_data_fields[i])), 7);
     prefetch_field_name[7] = '\0';
 
-    if(strnstr_P(prefetch_field_name, PSTR("ssid__"),10)){
-//      //this->query_network_ssid();
-      snprintf_P( (prefetch_output_buffer+prefetch_output_buffer_len),
-                  buffer_size_remaining,
-                  PSTR("%s:\"%s\","),
-                  prefetch_field_name,
-                  station.ssid);
-      prefetch_output_buffer_len = strnlen(prefetch_output_buffer,PREFETCH_OUTPUT_BUFFER_SIZE);
-    } else if(strnstr_P(prefetch_field_name, PSTR("conctd"),10)){
+    if(strnstr_P(prefetch_field_name, PSTR("ssid__"),sizeof(prefetch_field_name))){
+      fields.print(prefetch_field_name, F(":\""), station_ssid, F("\","));
+    } else if(strnstr_P(prefetch_field_name, PSTR("conctd"),sizeof(prefetch_field_name))){
       if(this->is_network_connected()){
-        strncpy_P( (prefetch_output_buffer+prefetch_output_buffer_len),
-                    PSTR("conctd:true,"),
-                    buffer_size_remaining);
+        fields.print(F("conctd:true,"));
       } else {
-        strncpy_P( (prefetch_output_buffer+prefetch_output_buffer_len),
-                   PSTR("conctd:false,"), 
-                   buffer_size_remaining);
+        fields.print(F("conctd:false,"));
       }
-      prefetch_output_buffer_len = strnlen(prefetch_output_buffer,PREFETCH_OUTPUT_BUFFER_SIZE);
-    }else if( (strnstr_P(prefetch_field_name, PSTR("ipaddr"),10) ||
-              strnstr_P(prefetch_field_name,  PSTR("macadr"),10))){
-      if(!have_queried_mac){
-        //this->query_ip_and_mac();//todo: re-enable
-        have_queried_mac = true; //only do one query to refresh IP and mac
-        snprintf_P( (prefetch_output_buffer+prefetch_output_buffer_len), 
-                    buffer_size_remaining,
-                    PSTR("ipaddr:\"%s\","),station.ip);
-        prefetch_output_buffer_len = strnlen(prefetch_output_buffer,PREFETCH_OUTPUT_BUFFER_SIZE);
-        snprintf_P( (prefetch_output_buffer+prefetch_output_buffer_len),
-                    buffer_size_remaining,
-                    PSTR("macadr:\"%s\","),station.macaddr);
-        prefetch_output_buffer_len = strnlen(prefetch_output_buffer,PREFETCH_OUTPUT_BUFFER_SIZE);
+    }else if( (strnstr_P(prefetch_field_name, PSTR("ipaddr"),sizeof(prefetch_field_name)) ||
+              strnstr_P(prefetch_field_name,  PSTR("macadr"),sizeof(prefetch_field_name)))){
+      // not read back from the device, so these are the usual ones
+      if(!wrote_addresses){
+        wrote_addresses = true;
+        fields.print(F("ipaddr:\"192.168.1.25\","));
+        fields.print(F("macadr:\"dc:4f:22:11:e9:64\","));
       }
-    }else if(strnstr_P(prefetch_field_name, PSTR("port__"),MAX_RESPONSE_LINE_LEN)){
+    }else if(strnstr_P(prefetch_field_name, PSTR("port__"),sizeof(prefetch_field_name))){
       Serial.println(F("| writing port"));
-      snprintf_P( (prefetch_output_buffer+prefetch_output_buffer_len), 
-                 buffer_size_remaining,
-                 PSTR("port__:%d"),server.port);
-      prefetch_output_buffer_len = strnlen(prefetch_output_buffer,PREFETCH_OUTPUT_BUFFER_SIZE);
+      fields.print(F("port__:"), server.port);
     }else{
       Serial.print(F("| Prefetch field not found: "));Serial.write(prefetch_field_name,7);Serial.println("");
     } 
   }//for(prefetch_data_fields)
-  
-  //add the prefetch output buffer to the output queue
-  this->output_queue.add_element(prefetch_output_buffer, prefetch_output_buffer_len, false);
 
-  // Add the last chunk of website page data
-  this->output_queue.add_element(page_data_2, page_data_2_len,true);
-  
-  // Send!
-  this->send_output_queue(channel);
+  if(fields.is_truncated()){
+    Serial.print(F("| WARNING: prefetch output buffer ran out of space at "));
+    Serial.println(fields.get_length());
+  }
+  prefetch_output_buffer_len = fields.get_length();
 }
 
 
 /*!
- *  
- *  Make a call to the ESP8266 to get my own SSID and update my internal
- *    class variables with the values I read.
- * 
+ * @return TRUE if the station was connected to its network the last time
+ *         refresh_status() heard back from the ESP8266.
  */
-void ESP8266::query_network_ssid(){
-  char input_buffer[MAX_RESPONSE_LINE_LEN] = "";
-  unsigned int timeout_ms = 10000;
-  char * read_pointer = NULL;
-
-  // Write the command
-  this->port->print(F("AT+CWJAP_CUR?\r\n"));
-
-  // Read lines from the ESP8266 until we time out or succeed
-  unsigned int start_time = millis();
-  while((millis() - start_time) < timeout_ms){
-    if(this->read_line(input_buffer,MAX_RESPONSE_LINE_LEN)){
-      // a line is found
-      if(strnstr_P(input_buffer,PSTR("+CWJAP"),MAX_RESPONSE_LINE_LEN) != NULL) {
-          //Response is on this line, parse out the strings
-          read_pointer = strtok(input_buffer,"\""); //up to the start of the SSID
-          read_pointer = strtok(NULL,"\""); //the SSID field
-          strncpy(station.ssid, read_pointer, MAX_SSID_LENGTH); //copy into my SSID string
-          return; //done.  return before I time out.
-      } else {
-        // line does not have response string
-        // continue reading more lines
-      }
-    }//if(read_line)
-  }//while(millis...)
-  
-  Serial.println(F("Response timed out"));
+bool ESP8266::is_network_connected(){
+  return station_connected;
 }
 
 
 /*!
- * Make a call to the ESP8266 serial port and check that it responds happily
+ * Ask the ESP8266 whether the station is connected to its network, 
+ * without waiting for the answer.  is_network_connected() catches up when
+ * the response comes in.
  * 
- * @return TRUE if the network is connected
+ * @return FALSE if the AT engine had no room for the query
  */
-bool ESP8266::is_network_connected(){
-  char request_buffer[COMMAND_BUFFER_SIZE];
-  char response_buffer[COMMAND_BUFFER_SIZE];
-  strcpy_P(request_buffer, PSTR("AT+CWJAP?\r\n"));
-  sprintf_P(response_buffer,PSTR("+CWJAP:\"%s\""),station.ssid);
-  return expect_response_to_command(request_buffer,
-                                  strnlen(request_buffer,COMMAND_BUFFER_SIZE),
-                                  response_buffer,2000);
-}
-
-
-/*!
- *  Make a call to the ESP8266 serial port to get the current station
- *    IP address and MAC address.  Save these in the class variables
- *    as my current station ip and MAC.
- *  
- */
-void ESP8266::query_ip_and_mac(){
-  char input_buffer[MAX_RESPONSE_LINE_LEN] = "";
-  unsigned int timeout_ms = 2000;
-  char * read_pointer = NULL;
-
-  // Write the command
-  this->port->print(F("AT+CIFSR\r\n"));
-
-  unsigned int start_time = millis();
-  while((millis() - start_time) < timeout_ms){
-    if(this->read_line(input_buffer, MAX_RESPONSE_LINE_LEN)){
-      // a line is found
-      if(strnstr_P(input_buffer,PSTR("+CWJAP"),MAX_RESPONSE_LINE_LEN) != NULL) {
-        if(strnstr_P(input_buffer,PSTR("STAIP"),MAX_RESPONSE_LINE_LEN) != NULL){
-          //IP Address is on this line, parse out the strings
-          read_pointer = strtok(input_buffer,"\""); //up to the start of the IP Address
-          read_pointer = strtok(NULL,"\""); //the SSID field
-          strncpy(station.ip, read_pointer, IP_ADDRESS_LENGTH); //copy into my ip string
-        } else if(strnstr_P(input_buffer,PSTR("STAMAC"),MAX_RESPONSE_LINE_LEN) != NULL){
-                    //Response is on this line, parse out the strings
-          read_pointer = strtok(input_buffer,"\""); //up to the start of the SSID
-          read_pointer = strtok(NULL,"\""); //the SSID field
-          strncpy(station.macaddr, read_pointer, MAC_ADDRESS_LENGTH); //copy into my macaddr string
-          return; //done.  return before I time out. (this value should come last
-        } 
-      } else {
-        // line does not have response string
-        // continue reading more lines
-      }
-    }
+bool ESP8266::refresh_status(){
+  at_command query = {PSTR("AT+CWJAP?\r\n"), NULL, on_status_line, on_status_done,
+                      this, 2000, AT_COMMAND_IN_PROGMEM, NULL};
+  status_matched = false;
+  return at.submit(query);
+}
+
+
+/*!
+ * AT engine callback: checks the '+CWJAP:"ssid",...' line against the 
+ * station SSID, as the ESP8266 escapes it.
+ */
+void ESP8266::on_status_line(void * context, request_view * line){
+  ESP8266 * esp = (ESP8266 *)context;
+  if(span_starts_with_token(*line, line->line, TOKEN_CWJAP)){
+    quoted_command joined = {PSTR("+CWJAP:"), esp->station_ssid, NULL, NULL};
+    esp->status_matched = span_contains_quoted(line->line, joined);
   }
-  Serial.println(F("| IP and mac Response timed out"));
 }
 
+
 /*!
- * Simply writes to the ESP serial port, with logging if needed.
+ * AT engine callback: publishes the result of refresh_status().
+ */
+void ESP8266::on_status_done(void * context, unsigned char result){
+  ESP8266 * esp = (ESP8266 *)context;
+  esp->station_connected = (result == AT_OK) && esp->status_matched;
+}
+
+
+/*!
+ * Simply writes to the ESP serial port.  The transport logs it, if its
+ * logging policy says so.
  * 
  * @param write_string
  *        a char array to write out to the ESP serial port
@@ -733,241 +1198,247 @@ void ESP8266::query_ip_and_mac(){
 void ESP8266::write_port(char * write_string, unsigned int len){
   //write to port here
   this->port->write(write_string, len);
-  WRITE_IF_VERBOSE(write_string,len);
 }
 
 /*!
- * Simply reads from the ESP serial port, with logging if needed.
+ * Simply reads from the ESP serial port.  The transport logs it, if its
+ * logging policy says so.
  * 
  * @return a char from the serial port;
  */
 char ESP8266::read_port(){
   char rv = this->port->read();
-  WRITE_IF_VERBOSE(&rv,1);
   return rv;
 }
 
 
 /*!
- * Sends the command to set the SSID to the ESP8266 and returns true if it succeeds.
+ * Queues a change of network settings, to be applied in the background.
+ * 
+ * The command is sent once the AT engine has nothing else to do, so a 
+ * response acknowledging the job can go out first, and is retried up to
+ * NETWORK_COMMAND_ATTEMPTS times.  The settings are saved to EEPROM only 
+ * if the ESP8266 accepts them.  Poll the job with settings_job_generator().
+ * 
+ * The SSID and password are not copied - the command is escaped as it is
+ * written to the port, straight from them - so they must stay put until
+ * the job is done (see is_settings_job_busy()).
  * 
- * @param new_ssid
- *        c-string array containing the new SSID
+ * @param for_ap
+ *        TRUE to set up my own access point, FALSE to join a network
+ * @param ssid
+ *        the network name
+ * @param password
+ *        its password
  *     
- * @return TRUE if we successfully set the SSID we connect to.
+ * @return the ID of the new job, or SETTINGS_NO_JOB if the settings are 
+ *         too long or another job is still in progress
  */
-bool ESP8266::set_station_ssid_and_passwd(char new_ssid_and_passwd[]){
+unsigned char ESP8266::queue_settings_job(bool for_ap, const char * ssid, const char * password){
+  if(is_settings_job_busy()){
+    Serial.println(F("| Settings job already in progress."));
+    return SETTINGS_NO_JOB;
+  }
 
-  char command_to_send[(MAX_SSID_LENGTH+MAX_PASSWORD_LENGTH+18)];
-  char desired_response[] = "OK";
-  unsigned int max_attempts = 3;
+  Serial.print(F("| Queueing new ssid: ["));Serial.print(ssid);Serial.println("]");
 
-  Serial.print(F("| Setting new ssid: ["));Serial.write(new_ssid_and_passwd,strlen(new_ssid_and_passwd));Serial.println("]");
+  if(strlen(ssid) > MAX_SSID_LENGTH || strlen(password) > MAX_PASSWORD_LENGTH){
+    Serial.println(F("| SSID or password too long."));
+    return SETTINGS_NO_JOB;
+  }
 
-  snprintf_P(command_to_send,
-             (MAX_SSID_LENGTH+MAX_PASSWORD_LENGTH+18), 
-             PSTR("AT+CWJAP_DEF=%s\r\n"), 
-             new_ssid_and_passwd);
-  
-  for(unsigned int i=0; i<max_attempts; i++){
-    if(expect_response_to_command(command_to_send, 
-                                     strlen(command_to_send),
-                                     desired_response,10000)){
-      //update my class variables
-      char* read_pointer = strtok(new_ssid_and_passwd,",\"");
-      strncpy(this->station.ssid,read_pointer,MAX_PASSWORD_LENGTH+1);
-      read_pointer = strtok(NULL,",\"");
-      strncpy(this->station.password,read_pointer,MAX_SSID_LENGTH+1);
-
-      //Store the new settings in eeprom
-      update_eeprom();
-      
-      //return success
-      return true;
-    }else{
-      Serial.print(F("| Attempt "));Serial.print(i,DEC);Serial.println(F(" to set SSID failed."));
-    }
+  if(for_ap){
+    job.command.prefix = PSTR("AT+CWSAP_DEF=");
+    job.command.suffix = PSTR(",1,3\r\n");
+  } else {
+    job.command.prefix = PSTR("AT+CWJAP_DEF=");
+    job.command.suffix = PSTR("\r\n");
   }
+  job.command.first = ssid;
+  job.command.second = password;
+  job.for_ap = for_ap;
+  job.attempts = 0;
+  job.state = SETTINGS_JOB_QUEUED;
+  if(++job.id == SETTINGS_NO_JOB)
+    job.id++;
+  return job.id;
+}
+
 
-  return false; //we timed out and did not succeed.
+/*!
+ * @return TRUE while a settings job is queued or running, and still 
+ *         needs the strings it was given
+ */
+bool ESP8266::is_settings_job_busy(){
+  return job.state == SETTINGS_JOB_QUEUED || job.state == SETTINGS_JOB_RUNNING;
 }
 
-bool ESP8266::set_ap_ssid_and_passwd(char new_ssid_and_passwd[]){
 
-  char command_to_send[(MAX_SSID_LENGTH+MAX_PASSWORD_LENGTH+18)];
-  char desired_response[] = "OK";
-  unsigned int max_attempts = 3;
+/*!
+ * Hands the settings job's command to the AT engine, which writes it 
+ * through on_write_quoted().
+ */
+void ESP8266::submit_settings_job(){
+  at_command set = {NULL, NULL, NULL, on_settings_done, this,
+                    NETWORK_COMMAND_TIMEOUT_MS, AT_COMMAND_WRITER, on_write_quoted};
+  quoted = &job.command;
+  if(at.submit(set)){
+    job.attempts++;
+    job.state = SETTINGS_JOB_RUNNING;
+  }
+}
 
-  // configure the cannon AP
-  Serial.print(F("| ESP8266 - Setting new access point ssid and password..."));
-  
-  snprintf_P(command_to_send,
-             (MAX_SSID_LENGTH+MAX_PASSWORD_LENGTH+18),
-             PSTR("AT+CWSAP_DEF=%s,1,3\r\n"),
-             new_ssid_and_passwd);
-
-
-  for(unsigned int i=0; i<max_attempts; i++){
-    if(expect_response_to_command(command_to_send, 
-                                  strlen(command_to_send),
-                                  desired_response,10000)){
-      //update my class variables
-      char* read_pointer = strtok(new_ssid_and_passwd,",\"");
-      strncpy(this->ap.ssid,read_pointer,MAX_PASSWORD_LENGTH+1);
-      read_pointer = strtok(NULL,",\"");
-      strncpy(this->ap.password,read_pointer,MAX_SSID_LENGTH+1);
-
-      //Store the new settings in eeprom
-      update_eeprom();
-      
-      //return success
-      return true;
-    }else{
-      Serial.print(F("| Attempt "));Serial.print(i,DEC);Serial.println(F(" to set AP SSID failed."));
+
+/*!
+ * AT engine callback: saves the settings if the command succeeded, or 
+ * queues the job for another attempt.
+ */
+void ESP8266::on_settings_done(void * context, unsigned char result){
+  ESP8266 * esp = (ESP8266 *)context;
+  settings_job * job = &esp->job;
+  if(result == AT_OK){
+    if(job->for_ap){
+      esp->save_network_settings(job->command.first, job->command.second,
+                                 CONFIG_KEY_AP_SSID, CONFIG_KEY_AP_PASSWORD);
+      Serial.println(F("| Set Access Point SSID succeeded!"));
+    } else {
+      strcpy(esp->station_ssid, job->command.first);
+      esp->save_network_settings(job->command.first, job->command.second,
+                                 CONFIG_KEY_STATION_SSID, CONFIG_KEY_STATION_PASSWORD);
+      esp->station_connected = true;
+      Serial.println(F("| Set Station SSID succeeded!"));
     }
+    job->state = SETTINGS_JOB_SUCCEEDED;
+  } else if(job->attempts < NETWORK_COMMAND_ATTEMPTS){
+    Serial.print(F("| Attempt "));Serial.print(job->attempts,DEC);Serial.println(F(" to set SSID failed."));
+    job->state = SETTINGS_JOB_QUEUED;
+  } else {
+    Serial.println(F("| Giving up on the new SSID."));
+    job->state = SETTINGS_JOB_FAILED;
   }
-
-  return false; //we timed out and did not succeed.
-  
 }
 
 
+const char settings_job_none[] PROGMEM = "none";          ///<status of SETTINGS_JOB_NONE
+const char settings_job_queued[] PROGMEM = "queued";      ///<status of SETTINGS_JOB_QUEUED
+const char settings_job_running[] PROGMEM = "running";    ///<status of SETTINGS_JOB_RUNNING
+const char settings_job_succeeded[] PROGMEM = "done";     ///<status of SETTINGS_JOB_SUCCEEDED
+const char settings_job_failed[] PROGMEM = "failed";      ///<status of SETTINGS_JOB_FAILED
+/*! @var settings_job_states
+ *  Status names, indexed by settings_job_state.*/
+const char * const settings_job_states[] PROGMEM = {
+  settings_job_none, settings_job_queued, settings_job_running,
+  settings_job_succeeded, settings_job_failed
+};
 
 
 /*!
- * Reads the list of networks that the ESP can see and writes it back 
- * in an HTTP response to the connection at the channel param.
- * 
- * @param channel
- *        The channel to which I should send the response.
+ * @brief OutputQueue segment_generator for the status of the latest 
+ *        settings job.
  * 
+ * Produces one line of SETTINGS_JOB_STATUS_LEN bytes, e.g. 
+ * "job 7 running attempt 1/3".  Queue it with the ESP8266 as the context.
  */
-void ESP8266::send_networks_list(unsigned char channel){
-  char command_to_write[COMMAND_BUFFER_SIZE];
-  char response_line[MAX_RESPONSE_LINE_LEN];
-  
-  //Setup the access point list settings
-  strncpy_P(command_to_write,PSTR("AT+CWLAPOPT=0,2\r\n"),COMMAND_BUFFER_SIZE);
-  write_port(command_to_write,strnlen(command_to_write,COMMAND_BUFFER_SIZE));
-  
-  //Request the access point list
-  strncpy_P(command_to_write,PSTR("AT+CWLAP\r\n"), COMMAND_BUFFER_SIZE);
-  write_port(command_to_write,strnlen(command_to_write,COMMAND_BUFFER_SIZE));
-
-  //now, parse through till i see the my response
-  bool response_started = false;
-  unsigned int buffer_index = 0;
-  int buffer_size_remaining = PREFETCH_OUTPUT_BUFFER_SIZE;
-  while(true){
-    
-    //Check my space remaining
-    buffer_size_remaining = PREFETCH_OUTPUT_BUFFER_SIZE - prefetch_output_buffer_len;
-    if(buffer_size_remaining < 20){
-      Serial.println(F("| WARNING: prefetch output buffer is running out of space!"));
-    }
-
-    //Read a line and queue it up to send
-    read_line(response_line, 2000);
-    if(strnstr_P(response_line,PSTR("+CWLAP"),MAX_RESPONSE_LINE_LEN) != NULL){
-      response_started = true;
-      snprintf_P(prefetch_output_buffer+buffer_index,
-                 buffer_size_remaining,
-                 PSTR("%s\n"),
-                 response_line);
-      prefetch_output_buffer_len = strnlen(prefetch_output_buffer,PREFETCH_OUTPUT_BUFFER_SIZE);
-    } else if(response_started && strnstr_P(response_line,PSTR("OK"),MAX_RESPONSE_LINE_LEN)){
-      send_http_200_static(channel,prefetch_output_buffer,prefetch_output_buffer_len);
-    }
-  }//while()
+unsigned int ESP8266::settings_job_generator(void * context, unsigned int offset,
+                                             char * output, unsigned int output_size){
+  ESP8266 * esp = (ESP8266 *)context;
+  char line[SETTINGS_JOB_STATUS_LEN + 1];
+  if(offset >= SETTINGS_JOB_STATUS_LEN)
+    return 0;
+  TextWriter status(line, sizeof(line));
+  status.print(F("job "), esp->job.id, ' ', flash((PGM_P)pgm_read_word(&settings_job_states[esp->job.state])),
+               F(" attempt "), esp->job.attempts, '/', NETWORK_COMMAND_ATTEMPTS);
+  // pad to the fixed width, so the Content-Length is known up front
+  status.end_line(SETTINGS_JOB_STATUS_LEN);
+  unsigned int wanted = SETTINGS_JOB_STATUS_LEN - offset;
+  if(wanted > output_size)
+    wanted = output_size;
+  memcpy(output, line + offset, wanted);
+  return wanted;
 }
 
 
 /*!
- * @brief Gets the channel number from an ESP "IPD" line
+ * Starts a scan for the networks that the ESP can see, and answers the 
+ * connection at the channel param with the list once it is done.
  * 
- * Reads the input line with length len and returns the channel found, 
- * or zero if none is found.
+ * Returns at once: the scan takes seconds, and the tasks (and the 
+ * requests that come in meanwhile) must not wait for it.  The response
+ * is opened now, so the stream and the prefetch buffer the list is 
+ * collected in are held for it, and sent from on_networks_done().
+ * 
+ * @param channel
+ *        The channel to which I should send the response.
  * 
- * @param line
- *        a pointer to the array containing a line from the ESP
- *        
- * @param len
- *        the number of characters in the line, including the '\n'
- *        
- * @return the channel found, or zero if one is not found
  */
-char ESP8266::get_channel_from_string(char line[], int len){
-  char string_to_parse[len]; 
-  strncpy(string_to_parse,line,len);
-  char rv = 0;
-
-  //Try to find the channel indicator
-  char * token = strnstr_P(string_to_parse, PSTR("IPD,"),len);
-
-  if(token != NULL){
-    strtok(token,","); //this is "IPD"
-    char * chan_string = strtok(NULL,","); //this is the channel ID
-    rv = atoi(chan_string);
+void ESP8266::send_networks_list(unsigned char channel){
+  if(scan_channel != TX_NO_STREAM){
+    // one scan at a time: the list is collected in the prefetch buffer
+    this->send_http_503(channel);
+    return;
   }
-  this->current_channel=rv;
-  return rv;
-  
+  OutputQueue * queue = this->open_response(channel, TX_LANE_BULK, true);
+  if(queue == NULL)
+    return;
+
+  //Setup the access point list settings, then request the list
+  at_command options = {PSTR("AT+CWLAPOPT=0,2\r\n"), NULL, NULL, NULL, this,
+                        1000, AT_COMMAND_IN_PROGMEM, NULL};
+  at_command list = {PSTR("AT+CWLAP\r\n"), NULL, on_network_line, on_networks_done, this,
+                     10000, AT_COMMAND_IN_PROGMEM, NULL};
+  prefetch_output_buffer_len = 0;
+  scan_channel = channel;
+  at.submit(options);
+  if(!at.submit(list))
+    on_networks_done(this, AT_BUSY);
 }
 
 
-
-
-
-
 /*!
- * @fn void process_settings(unsigned char channel, char input_line[])
- * 
- * @brief processes the settings command for the ESP
- * 
- * @param channel
- *        This is the channel on which the request for settings was transmitted.
- *        Send the response back on the same channel.
- *        
- * @param input_line[]
- *        This is the last line read from the ESP8266, which contains the path to
- *        the setting that we want to change.
- */
-void ESP8266::process_settings(unsigned char channel, char input_line[],int input_line_size) {
-  char* read_pointer = NULL;
-
-  // Read the remaining lines, until I find my parameter, or I time out:
-  if((strnstr_P(input_line,PSTR("ssid__"),input_line_size) != NULL) ||
-     (strnstr_P(input_line,PSTR("ap_ssd"),input_line_size) != NULL)){
-    Serial.println(F("| received an SSID setting request"));
-    do{
-      if(strnstr_P(input_line,PSTR("ssid__="),input_line_size) != NULL){
-        //found the setting string
-        read_pointer = strtok(input_line,"="); //up to the start of the SSID
-        read_pointer = strtok(NULL,"="); //the SSID field
-        read_pointer = strtok(read_pointer,"\n"); //trimming the trailing newline
-        if(set_station_ssid_and_passwd(read_pointer)){
-          //No point in sending a response - SSID change will break the connection.
-          Serial.println(F("| Set Station SSID succeeded!"));
-          break;
-        }
-      } else if(strnstr_P(input_line,PSTR("ap_ssd="),input_line_size) != NULL){
-        //found the setting string
-        read_pointer = strtok(input_line,"="); //up to the start of the SSID
-        read_pointer = strtok(NULL,"="); //the SSID field
-        read_pointer = strtok(read_pointer,"\n"); //trimming the trailing newline
-        if(set_ap_ssid_and_passwd(read_pointer)){
-          //No point in sending a response - SSID change will break the connection.
-          Serial.println(F("| Set Access Point SSID succeeded!"));
-          break;
-        } else {
-          send_http_200_static(channel,(char *)failure_msg,(sizeof(failure_msg)-1));
-        }
-      }//if(ssid)
-    }while(read_line(input_line,input_line_size, 10000));//while(read_line)
+ * AT engine callback: answers the scan's connection with the list 
+ * collected in the prefetch buffer, or with failure_msg.  Nothing is sent
+ * if the connection has gone away meanwhile.
+ */
+void ESP8266::on_networks_done(void * context, unsigned char result){
+  ESP8266 * esp = (ESP8266 *)context;
+  unsigned char channel = esp->scan_channel;
+  esp->scan_channel = TX_NO_STREAM;
+  OutputQueue * queue = esp->transmit.get_filling(channel);
+  if(queue == NULL)
+    return;
+  if(result == AT_OK){
+    esp->queue_http_200_header(queue, esp->prefetch_output_buffer_len);
+    queue->add_ram(esp->prefetch_output_buffer, esp->prefetch_output_buffer_len);
   } else {
-    Serial.println(F("| received an unknown setting path."));
+    Serial.println(F("| Network scan failed"));
+    esp->queue_http_200_header(queue, sizeof(failure_msg)-1);
+    queue->add_progmem(failure_msg, sizeof(failure_msg)-1);
   }
+  esp->transmit.send(channel);
 }
 
 
-
+/*!
+ * AT engine callback: appends each '+CWLAP:(...)' line to the prefetch 
+ * buffer, as long as it fits - and as long as the buffer is still held 
+ * for the scan's response.
+ */
+void ESP8266::on_network_line(void * context, request_view * line){
+  ESP8266 * esp = (ESP8266 *)context;
+  if(!span_starts_with_token(*line, line->line, TOKEN_CWLAP))
+    return;
+  if(esp->prefetch_channel != esp->scan_channel || esp->transmit.get_filling(esp->scan_channel) == NULL)
+    return;
+  unsigned int buffer_size_remaining = esp->prefetch_output_buffer_size - esp->prefetch_output_buffer_len;
+  // drop the "\r\n", and end the entry with a "\n"
+  unsigned int entry_len = line->line.length;
+  while(entry_len > 0 && (line->line.pointer[entry_len-1] == '\r' || line->line.pointer[entry_len-1] == '\n'))
+    entry_len--;
+  if(entry_len + 1 > buffer_size_remaining){
+    Serial.println(F("| WARNING: prefetch output buffer is running out of space!"));
+    return;
+  }
+  memcpy(esp->prefetch_output_buffer + esp->prefetch_output_buffer_len, line->line.pointer, entry_len);
+  esp->prefetch_output_buffer_len += entry_len;
+  esp->prefetch_output_buffer[esp->prefetch_output_buffer_len++] = '\n';
+}
@@ -4,7 +4,7 @@
  * @brief Interface class and helper classes to interface with the ESP8266
  * 
  *  
- * This class is an ESP8266 for the purposes of my IOT work.  On creation,
+ * This class is an ESP8266 for the purposes of my IOT work.  On begin(),
  * it will set the device to:
  *  * Only act as a client of an access point, not an access point itself
  *  * Connect to the house access point
@@ -19,48 +19,61 @@
 #ifndef ESP8266_H
 #define ESP8266_H
 
-//#include <SoftwareSerial.h>
-#include <AltSoftSerial.h>
 #include <Arduino.h>
 #include "HardwareSerial.h"
 #include "webserver_constants.h"
+#include "EspTransport.h"
+#include "RequestView.h"
+#include "TokenMatcher.h"
+#include "AtEngine.h"
 #include "CircularBuffer.h"
 #include "OutputQueue.h"
-#include <EEPROM.h>
-
-// Devug definition
-#define PRINT_SERIAL_STREAM true ///<If set, all data to and from the ESP8266 is dumped to the debug serial port.
-
-#if PRINT_SERIAL_STREAM
-#define PRINTSTR_IF_VERBOSE(x){Serial.print(F(x));}
-#define PRINT_IF_VERBOSE(x){Serial.print(x);}
-#define PRINTSTRLN_IF_VERBOSE(x){Serial.print(F(x));}
-#define PRINTLN_IF_VERBOSE(x){Serial.println(x);}
-#define WRITE_IF_VERBOSE(x,y){Serial.write(x,y);}
-#else
-#define PRINTSTR_IF_VERBOSE(x){}
-#define PRINT_IF_VERBOSE(x){}
-#define PRINTSTRLN_IF_VERBOSE(x){}
-#define PRINTLN_IF_VERBOSE(x){}
-#define WRITE_IF_VERBOSE(x,y){}
-#endif
+#include "TransmitScheduler.h"
+#include "TextWriter.h"
+#include "ConfigStore.h"
+#include "AssetBundle.h"
+#include "Trace.h"
+
 
 /*! @def SERIAL_INPUT_BUFFER_MAX_SIZE
- *  This is the size of the buffer I will use to read data from the ESP8266.
+ *  This is the default size of the buffer I will use to read data from the
+ *  ESP8266 (the INPUT_SIZE of ESP8266Server).
  *  Since I read one line at a time, this value needs to be larger than the 
  *  length of the longest line that I'll read from the device. 
  *  Lines always end in '\n'.
  *
+ *  This is the only copy of incoming data: request_views handed out by 
+ *  read_request() point straight into it.
+ *
  *  I want to minimize the size of this buffer, as it occupies a fixed 
- *  amount of space in my class, whether or not it is used.*/
-#define SERIAL_INPUT_BUFFER_MAX_SIZE 400
+ *  amount of space in my class, whether or not it is used.  It must be
+ *  at least MAX_RESPONSE_LINE_LEN.  A longer line of connection data is
+ *  handed out in pieces (see read_request()), which a streamed POST body 
+ *  takes in its stride, and the headers that are looked at are short; 
+ *  but the "+IPD" line with the request line must fit.  The 
+ *  transport's own receive buffer (80 bytes for AltSoftSerial) is in front
+ *  of this one, so together they hold over 30 ms of input at 57600 baud.*/
+#define SERIAL_INPUT_BUFFER_MAX_SIZE 128
 /*! @def PREFETCH_OUTPUT_BUFFER_SIZE
- * the fixed size we allocate to prefetching data for pages.  
+ * the default size we allocate to prefetching data for pages (the 
+ *  PREFETCH_SIZE of ESP8266Server).
  *  This is a buffer of data I use to queue up dynamic strings to be written 
  *    to the ESP8266 serial port.  It was originally used when I needed to prefetch
  *    dynamic data for my website, but now it's used for any thing the current 
- *    method needs to queue up before sending an HTTP response.*/
+ *    method needs to queue up before sending an HTTP response.  It must be
+ *    at least MIN_PREFETCH_OUTPUT_BUFFER_SIZE.*/
 #define PREFETCH_OUTPUT_BUFFER_SIZE  100  //! @def
+/*! @def MIN_PREFETCH_OUTPUT_BUFFER_SIZE
+ *  the prefetch buffer must fit the longest Content-Range header of a 
+ *  partial response.*/
+#define MIN_PREFETCH_OUTPUT_BUFFER_SIZE sizeof("\r\nContent-Range: bytes 65535-65535/65535")
+/*! @def MAX_RESPONSE_STREAMS
+ *  Default number of connections that can be answered at once (the 
+ *  MAX_CONNECTIONS of ESP8266Server).  Each one holds an OutputQueue, so
+ *  this costs RAM.  With two, one page goes out at a time, and the other
+ *  stream is kept for control replies; a second page request meanwhile 
+ *  gets a 503.*/
+#define MAX_RESPONSE_STREAMS 2
 /*! @def MAX_RESPONSE_LINE_LEN
  * the longest single line we expect in a response, including "\r\n\0".  
  *  This is the longest length of line I expect to receive back from the 
@@ -74,13 +87,9 @@
  *  number of characters, not counting string null terminator.*/
 #define MAX_PASSWORD_LENGTH 32
 /*! @def COMMAND_BUFFER_SIZE
- *  size of buffer used for constructing commands to the ESP8266. Should be 
- *   The largest string length command you might send.*/
-#define COMMAND_BUFFER_SIZE 75
-/*! @def MAC_ADDRESS_LENGTH
- *  ASCII-encoded MAC address. Number of characters, not counting string null terminator.
- *  e.g. "DE:AD:BE:EF:AB:BA" */
-#define MAC_ADDRESS_LENGTH 17
+ *  size of buffer used for constructing the AT+UART commands.  Commands 
+ *  carrying an SSID or password need none, see quoted_command.*/
+#define COMMAND_BUFFER_SIZE sizeof("AT+UART_DEF=4294967295,8,1,0,0\r\n")
 /*! @def IP_ADDRESS_LENGTH
  *  max length of an ASCII-encoded IP address. Number of characters, not counting string 
  *  null terminator.  e.g. 192.168.320.089"*/
@@ -91,22 +100,43 @@
 /*! @def DEFAULT_MAXCONNS
  *  Webserver will allow only up to this many incoming connections at once*/
 #define DEFAULT_MAXCONNS 1
-
-#define INITIALIZED_LETTER 'z'
-
-//! @todo put config page values in eeprom (instead of just loading defaults at start).
+/*! @def LINK_CHECK_ROUNDS
+ *  After switching baud rates, this many AT commands in a row must come 
+ *  back clean, or we fall back to a slower rate.*/
+#define LINK_CHECK_ROUNDS 5
+/*! @def BAUD_PROBE_TIMEOUT_MS
+ *  How long to wait for an "OK" when probing a baud rate.*/
+#define BAUD_PROBE_TIMEOUT_MS 300
+/*! @def SETUP_STAGE_ATTEMPTS
+ *  Each stage of setup_device() gives up after this many tries, so a 
+ *  missing or misconfigured ESP8266 can't hang the sketch.*/
+#define SETUP_STAGE_ATTEMPTS 5
+/*! @def NETWORK_COMMAND_ATTEMPTS
+ *  A settings job sends its AT+CWJAP_DEF/AT+CWSAP_DEF this many times 
+ *  before it gives up.*/
+#define NETWORK_COMMAND_ATTEMPTS 3
+/*! @def NETWORK_COMMAND_TIMEOUT_MS
+ *  How long the ESP8266 may take to join or set up a network.*/
+#define NETWORK_COMMAND_TIMEOUT_MS 10000
+/*! @def SETTINGS_NO_JOB
+ *  Job ID that never belongs to a settings job.*/
+#define SETTINGS_NO_JOB 0
+/*! @def SETTINGS_JOB_STATUS_LEN
+ *  Length of the status line of a settings job, including the '\n'.  The
+ *  line is padded to this width so the Content-Length is known up front.*/
+#define SETTINGS_JOB_STATUS_LEN 32
 
 /*! 
- * @struct network_info
- * 
- * @brief All of the info needed to specify the ESP8266 network connectivity parameters.
+ * @enum settings_job_state
  * 
+ * @brief Progress of a settings job, see ESP8266::queue_settings_job()
  */
-struct network_info{
-  char ssid[MAX_SSID_LENGTH+1];        ///< SSID string
-  char password[MAX_PASSWORD_LENGTH+1];///< Password string
-  char ip[IP_ADDRESS_LENGTH+1];        ///< IP Address string
-  char macaddr[MAC_ADDRESS_LENGTH+1];  ///< MAC Address string
+enum settings_job_state{
+  SETTINGS_JOB_NONE,      ///<no job yet
+  SETTINGS_JOB_QUEUED,    ///<waiting for the AT engine to be idle
+  SETTINGS_JOB_RUNNING,   ///<the command is in the AT engine
+  SETTINGS_JOB_SUCCEEDED, ///<applied and saved to EEPROM
+  SETTINGS_JOB_FAILED     ///<every attempt failed, nothing was saved
 };
 
 /*! 
@@ -120,72 +150,226 @@ struct server_info{
   unsigned char maxconns;  ///< The maximum number of connections the server will support
 };
 
-char *strnstr_P(char *haystack, PGM_P needle, size_t haystack_length);
+
+/*! 
+ * @struct quoted_command
+ * 
+ * @brief An AT command, or a line of a response, of the form 
+ *        prefix"first","second"suffix
+ * 
+ * The ESP8266 quotes strings such as SSIDs and passwords, with '"', ','
+ * and '\' escaped.  Commands are escaped as they are written to the port,
+ * and responses matched against the escaped strings in place, so no 
+ * buffer has to fit the escaped form.
+ */
+struct quoted_command{
+  PGM_P prefix;         ///<text before the strings
+  const char * first;   ///<first quoted string, or NULL for none
+  const char * second;  ///<second quoted string, or NULL for none
+  PGM_P suffix;         ///<text after the strings, e.g. "\r\n", or NULL for none
+};
+
+
+/*! 
+ * @struct settings_job
+ * 
+ * @brief A network settings change being applied in the background.
+ * 
+ * The command points at the caller's SSID and password, which are escaped
+ * as the command is written, and saved once it succeeds.
+ */
+struct settings_job{
+  unsigned char id;        ///<handed back to the client to poll with
+  unsigned char state;     ///<one of settings_job_state
+  unsigned char attempts;  ///<how many times the command has been sent
+  bool for_ap;             ///<TRUE for the access point, FALSE for the station
+  quoted_command command;  ///<AT+CWJAP_DEF or AT+CWSAP_DEF, with the SSID and password
+};
+
+/*!
+ * @struct esp8266_buffers
+ * 
+ * @brief Storage the ESP8266 class works in, owned by ESP8266Server
+ */
+struct esp8266_buffers{
+  CircularBuffer * input;       ///<lines read from the ESP8266
+  char * prefetch;              ///<dynamic data queued up for a response
+  unsigned int prefetch_size;   ///<size of prefetch
+  tx_stream * streams;          ///<one per connection that can be answered at once
+  unsigned char stream_count;   ///<number of streams
+};
 
 /*!
  * @class ESP8266
  *
  * @brief Interface class with the ESP8266 device.
  *
- * This class is an ESP8266 for the purposes of my IOT work.  On creation,
+ * This class is an ESP8266 for the purposes of my IOT work.  On begin(),
  * it will set the device to:
  *  * Only act as a client of an access point, not an access point itself
  *  * Connect to the house access point
  *  * Serve a multi-connection TCP server on port 8080
  *<pre>
  * USAGE:
- *   ESP8266 * myesp;
- *   myesp = new ESP8266(&serial_port, verbose_flag);
+ *   ESP8266Server<> myesp(&serial_port, verbose_flag, &config);
+ *   request_view request;
+ *   myesp.begin();
  *   while(1){
- *     if(myesp->check_for_request(F("GET"))){
+ *     if(myesp.read_request(&request) && request.method.length){
  *       Serial.println(F("got a request!!!"));
- *       myesp->send_http_200_static(0,(char*)static_website_text,
- *                                   sizeof(static_website_text));
+ *       myesp.send_http_200_static(0,(char*)static_website_text,
+ *                                  sizeof(static_website_text));
  *</pre>
+ * 
+ * The buffers are not part of this class, see ESP8266Server.
  */
 class ESP8266{
 private:
-    AltSoftSerial *port;                    ///<Initialized outside of this class
+    EspTransport *port;                     ///<Initialized outside of this class
     CircularBuffer * serial_input_buffer;   ///<Pointer to the buffer we use for input
     bool verbose;                           ///<overall verbosity
-    OutputQueue output_queue;   //Does not hold data, just pointers to data
-    char prefetch_output_buffer[PREFETCH_OUTPUT_BUFFER_SIZE];
+    char * prefetch_output_buffer;          ///<see PREFETCH_OUTPUT_BUFFER_SIZE
+    unsigned int prefetch_output_buffer_size;
     unsigned int prefetch_output_buffer_len;
-    network_info station;
-    network_info ap;
+    unsigned char prefetch_channel;  ///<Channel whose response points into the prefetch buffer
+    char station_ssid[MAX_SSID_LENGTH+1];  ///<network to join; the other network settings are read when needed
     server_info server;
-    void query_network_ssid();
-    void query_ip_and_mac();
-    bool is_network_connected();
     char current_channel;
-    int eeprom_address;
+    ConfigStore * config;       ///<Persistent settings, initialized outside of this class
+    bool line_handed_out;       ///<True if the last line in the input ring belongs to a request_view
+    AtEngine at;                ///<Sends commands and sorts out their responses
+    TransmitScheduler transmit; ///<Sends responses, see open_response()
+    unsigned char command_result;  ///<Result of the last blocking run_command()
+    unsigned int ipd_remaining; ///<Bytes of the last +IPD payload not read yet
+    char ipd_channel;           ///<Channel the last +IPD payload belongs to
+    bool line_in_payload;       ///<True if the line being read is (part of) an +IPD payload
+    TokenMatcher tokens;        ///<Finds the tokens of the line being read, byte by byte
+    unsigned char open_channels;///<Bit n set while channel n is connected
+    void (*wait_hook)();        ///<Called while blocked in run_command(), see set_wait_hook()
+    bool station_connected;     ///<Result of the last refresh_status()
+    bool status_matched;        ///<refresh_status() saw our SSID in the response
+    const quoted_command * quoted; ///<Written by an AT_COMMAND_WRITER command, or looked for by ensure_setting()
+    bool setting_matched;       ///<ensure_setting() found its expected response
+    settings_job job;           ///<The latest settings change, see queue_settings_job()
+    unsigned char scan_channel; ///<Channel waiting for send_networks_list(), TX_NO_STREAM if none
 
 public:
-    ESP8266(AltSoftSerial *port, bool verbose, int eeprom_address);
-    void send_http_200_static(unsigned char channel,char page_data[],unsigned int page_data_len);
-    void send_http_200_with_prefetch(unsigned char channel,char page_data_0[], unsigned int page_data_0_len,
-                                                           char page_data_2[], unsigned int page_data_2_len,
-                                                           const char* const prefetch_data_fields[], 
-                                                           unsigned int num_prefetch_data_fields);
+    ESP8266(EspTransport *port, bool verbose, ConfigStore * config, const esp8266_buffers & buffers);
+    bool begin();
+    unsigned long negotiate_baud();
+    void send_http_200_static(unsigned char channel,char page_data[],unsigned int page_data_len,
+                              unsigned char lane = TX_LANE_BULK);
+    void send_http_503(unsigned char channel);
+    void send_asset(unsigned char channel, const asset_entry & asset, const byte_range * range = NULL);
+    void send_not_modified(unsigned char channel, const asset_entry & asset);
+    void send_http_200_generated(unsigned char channel, segment_generator generator,
+                                 void * context, unsigned int length);
     void send_networks_list(unsigned char channel);
-    bool read_line(char line_buffer[], unsigned int line_buffer_size);
-    bool read_line(char line_buffer[], unsigned int line_buffer_size, unsigned int timeout_ms);
+    bool read_request(request_view * view);
+    bool refresh_status();
+    bool is_network_connected();
     void clear_buffer();
+    void set_wait_hook(void (*hook)());
     void purge_serial_input(unsigned int timeout);
-    bool set_station_ssid_and_passwd(char new_ssid_and_passwd[]);
-    bool set_ap_ssid_and_passwd(char new_ssid_and_passwd[]);
-    char get_channel_from_string(char line[], int len);
-    void process_settings(unsigned char channel, char input_line[], int input_line_size);
+    unsigned char queue_settings_job(bool for_ap, const char * ssid, const char * password);
+    bool is_settings_job_busy();
+    static unsigned int settings_job_generator(void * context, unsigned int offset,
+                                               char * output, unsigned int output_size);
     
 private:
-    bool expect_response_to_command(const char * command, unsigned int command_len,
-                                    const char * desired_response,
-                                    unsigned int timeout_ms);
+    unsigned char run_command(const char * command, const char * expect,
+                              unsigned int timeout_ms, unsigned char flags,
+                              at_line_callback on_line = NULL);
+    bool ensure_setting(PGM_P query, const quoted_command & expected,
+                        const quoted_command & set_command, unsigned int set_timeout_ms);
+    void write_quoted(const quoted_command & command);
+    void write_at_string(const char * value);
     bool setup_device();
-    void send_output_queue(unsigned char channel);
+    bool probe_baud(unsigned long baud);
+    unsigned long find_baud();
+    bool check_link_quality();
+    bool switch_baud(unsigned long new_baud, unsigned long fallback_baud);
+    bool send_uart_command(PGM_P command, unsigned long baud, bool wait_for_ok);
+    OutputQueue * open_response(unsigned char channel, unsigned char lane, bool uses_prefetch);
+    void queue_http_200_header(OutputQueue * queue, unsigned int content_length);
+    void prefetch_fields(const char* const prefetch_data_fields[], unsigned int num_prefetch_data_fields);
     char read_port();
     void write_port(char * write_string, unsigned int len);
-    void update_eeprom();
+    void load_setting(unsigned char key, char * value, unsigned char size, PGM_P default_value);
+    void save_network_settings(const char * ssid, const char * password,
+                               unsigned char ssid_key, unsigned char password_key);
+    void parse_request_view(request_view * view);
+    void start_ipd();
+    void submit_settings_job();
+    static void on_command_done(void * context, unsigned char result);
+    static void on_write_quoted(void * context);
+    static void on_setting_line(void * context, request_view * line);
+    static void on_unsolicited(void * context, unsigned char urc, char channel);
+    static void on_network_line(void * context, request_view * line);
+    static void on_networks_done(void * context, unsigned char result);
+    static void on_status_line(void * context, request_view * line);
+    static void on_status_done(void * context, unsigned char result);
+    static void on_settings_done(void * context, unsigned char result);
+};
+
+/*!
+ * @class ESP8266Storage
+ * 
+ * @brief The buffers of an ESP8266Server.  A base class of its own, so 
+ *        they are built before the ESP8266 that points into them.
+ */
+template <unsigned int INPUT_SIZE, unsigned int PREFETCH_SIZE, unsigned char MAX_CONNECTIONS>
+class ESP8266Storage{
+protected:
+  StaticCircularBuffer<INPUT_SIZE> input_storage;  ///<see SERIAL_INPUT_BUFFER_MAX_SIZE
+  char prefetch_storage[PREFETCH_SIZE];            ///<see PREFETCH_OUTPUT_BUFFER_SIZE
+  tx_stream stream_storage[MAX_CONNECTIONS];       ///<see MAX_RESPONSE_STREAMS
+
+  esp8266_buffers get_buffers(){
+    esp8266_buffers buffers = {&input_storage, prefetch_storage, PREFETCH_SIZE,
+                               stream_storage, MAX_CONNECTIONS};
+    return buffers;
+  }
+};
+
+/*!
+ * @class ESP8266Server
+ * 
+ * @brief ESP8266 with its buffers sized at compile time
+ * 
+ * Everything the server needs is allocated with it, so a global 
+ * ESP8266Server is all static RAM, and the sizes are checked when it is
+ * built rather than when it runs out.  The protocol code itself isn't a 
+ * template, so it is compiled once, whatever the sizes.
+ * 
+ * @tparam INPUT_SIZE       bytes of input ring, see SERIAL_INPUT_BUFFER_MAX_SIZE
+ * @tparam PREFETCH_SIZE    bytes of prefetch buffer, see PREFETCH_OUTPUT_BUFFER_SIZE
+ * @tparam MAX_CONNECTIONS  connections that can be answered at once, see MAX_RESPONSE_STREAMS
+ */
+template <unsigned int INPUT_SIZE = SERIAL_INPUT_BUFFER_MAX_SIZE,
+          unsigned int PREFETCH_SIZE = PREFETCH_OUTPUT_BUFFER_SIZE,
+          unsigned char MAX_CONNECTIONS = MAX_RESPONSE_STREAMS>
+class ESP8266Server : private ESP8266Storage<INPUT_SIZE, PREFETCH_SIZE, MAX_CONNECTIONS>,
+                      public ESP8266{
+  static_assert(INPUT_SIZE >= MAX_RESPONSE_LINE_LEN,
+                "the input ring must fit the longest response line");
+  static_assert(PREFETCH_SIZE >= MIN_PREFETCH_OUTPUT_BUFFER_SIZE,
+                "the prefetch buffer must fit a Content-Range header");
+  static_assert(MAX_CONNECTIONS >= 2,
+                "one connection is kept for control replies, so bulk needs another");
+  static_assert(MAX_CONNECTIONS <= TX_MAX_STREAMS,
+                "the ESP8266 has no more link ids than this");
+
+public:
+  /*!
+   * @brief Constructor.  Doesn't talk to the device, see ESP8266::begin().
+   * 
+   * @param port     transport to the ESP8266, started before begin()
+   * @param verbose  see ESP8266::ESP8266()
+   * @param config   config store, started before begin()
+   */
+  ESP8266Server(EspTransport * port, bool verbose, ConfigStore * config)
+    : ESP8266(port, verbose, config, this->get_buffers()){}
 };
 
 
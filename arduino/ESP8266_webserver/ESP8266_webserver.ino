@@ -12,8 +12,10 @@
  * device from my phone, tablet, the internet, or whatever.    
  *
  * @section dependencies Dependencies
- *  This library depends on AltSoftSerial, ServoTimer2, and Stepper Arduino drivers being present on your system. Please make sure you have
- * installed the latest version before using this library.
+ *  This library depends on the AltSoftSerial Arduino driver being present on your system. Please make sure you have
+ * installed the latest version before using this library.  The servos and the base stepper are
+ * timed by PulseEngine, which owns Timer2, so ServoTimer2 is no longer needed (and can't be linked in).
+ * The IR remote is decoded by IrReceiver from pin change interrupts on A0, so IRremote isn't needed either.
  * 
  * @section author Author
  * 
@@ -25,10 +27,8 @@
  */
 
 //! @todo set esp maxconns to 1
-//! @todo when level shifter hardware is available, increase baud to 115200bps
 //! @todo Use HTTP "Content Length:" header instead of terminating connections
 //! @todo Add a camera to the shooter/website (snap after each turn)
-//! @todo Create an ESP initializer program, to discover serial baud and set up settings 
 //! @todo Code lint 
 //! @todo Implement TLS
 //! @todo Make a custom icon for the project.
@@ -39,47 +39,254 @@
 
 
 #include <AltSoftSerial.h>
-#include <MemoryUsage.h>
 #include "ESP8266.h"
 #include "Rubber_Band_Shooter.h"
+#include "Scheduler.h"
+#include "Watchdog.h"
+#include "FormParser.h"
+#include "MemoryGuard.h"
+#include "PulseEngine.h"
+#include "Trace.h"
+#include "IrReceiver.h"
+
+#if defined(ALTSS_USE_TIMER2)
+#error "AltSoftSerial is set to use Timer2, which belongs to PulseEngine"
+#endif
 
 
-#define DEBUG_MEMORY false ///<flag to enable serial port prints indicating amount of free heap.
+#define DEBUG_MEMORY false ///<flag to enable serial port prints indicating amount of free RAM.
 
 
 #if DEBUG_MEMORY
-#define PRINT_FREE_MEMORY() {Serial.print(F("'| Free: "));Serial.println(mu_freeRam());}
+#define PRINT_FREE_MEMORY() {Serial.print(F("'| Free: "));Serial.println(get_free_ram());}
 #else
 #define PRINT_FREE_MEMORY() {}
 #endif
 
 
 /*! @def SERIAL_BAUD_RATE
- * Serial baud rate to talk to the ESP8266 and to the debug serial port.
- * Altsoftserial in my configration (non-ideal level shifting) is flaky at
- * 57600bps.*/
+ * Serial baud rate of the debug serial port, and the first rate tried on
+ * the ESP8266 link if none has been negotiated yet.  The ESP8266 class 
+ * moves the link up to the fastest rate the transport passes a link check
+ * at, and remembers it in the config store.*/
 #define SERIAL_BAUD_RATE 19200
 
+/*! @def CONFIG_STORE_ADDRESS
+ *  EEPROM address at which the config store starts.*/
+#define CONFIG_STORE_ADDRESS 0
+/*! @def CONFIG_STORE_SLOTS
+ *  Number of record slots in the config store.  More slots = less wear, 
+ *  at CONFIG_SLOT_SIZE bytes of EEPROM each.*/
+#define CONFIG_STORE_SLOTS 20
+/*! @def SETTINGS_TIMEOUT_MS
+ *  How long a settings request may take to deliver its headers and body.*/
+#define SETTINGS_TIMEOUT_MS 10000
+/*! @def GET_HEADERS_TIMEOUT_MS
+ *  How long to wait for the headers of a GET request before answering 
+ *  without them.*/
+#define GET_HEADERS_TIMEOUT_MS 2000
+/*! @def STATUS_REFRESH_MS
+ *  How often to ask the ESP8266 whether it is still on its network.*/
+#define STATUS_REFRESH_MS 30000
+/*! @def MOTION_QUEUE_LEN
+ *  Most moves that can wait for the motion task.  Requests for more get 
+ *  a 503.*/
+#define MOTION_QUEUE_LEN 4
+/*! @def MOTION_MAX_INCREMENTS
+ *  Repeats of the same move are merged into one move of up to this many
+ *  increments.*/
+#define MOTION_MAX_INCREMENTS 6
+/*! @def IR_HOLD_TIMEOUT_MS
+ *  A held remote button sends a repeat code every 108 ms; it counts as let
+ *  go when none has come for this long.*/
+#define IR_HOLD_TIMEOUT_MS 200
+/*! @def IR_REPEAT_DELAY_MS
+ *  How long a remote button must be held before its move repeats.*/
+#define IR_REPEAT_DELAY_MS 400
+/*! @def IR_REPEAT_ACCEL_MS
+ *  Each repeat of a held button comes this much sooner than the last, 
+ *  until the moves follow each other without a pause.*/
+#define IR_REPEAT_ACCEL_MS 50
+/*! @def DRIVE_TICK_MS
+ *  How often the drive task ramps and applies the velocity mode rates.*/
+#define DRIVE_TICK_MS 50
+/*! @def DRIVE_DEADMAN_MS
+ *  The targeting page repeats its /drive request every 200 ms while a 
+ *  button is held.  If none has come for this long, the page (or the 
+ *  network) is taken to be gone, and the turret is ramped to a stop.*/
+#define DRIVE_DEADMAN_MS 600
+/*! @def TASK_BUDGET_MS
+ *  A task that runs on every pass is considered stuck if it hasn't run for this long.*/
+#define TASK_BUDGET_MS 4000
+
+/*! @var eeprom_writer
+ *  Writes the settings to the EEPROM from its interrupt, so saving them 
+ *  doesn't hold up the serial link.
+ */
+EepromWriter eeprom_writer;
+
+/*! @var config
+ *  Settings that survive a power cycle.  Values are read lazily, by whoever
+ *  needs them.
+ */
+ConfigStore config(&eeprom_writer, CONFIG_STORE_ADDRESS, CONFIG_STORE_SLOTS);
+
+/*! @typedef EspLog
+ *  Logging policy of the ESP8266 link: EchoToSerial dumps all data to and
+ *  from the ESP8266 to the debug serial port, NoEcho leaves it out of the 
+ *  build.*/
+typedef EchoToSerial EspLog;
+
+#if defined(HAVE_HWSERIAL1)
+/*! @var espTransport
+ *  Boards with a spare hardware UART talk to the ESP8266 on Serial1,
+ *  which is good for HARDWARE_UART_MAX_BAUD.
+ */
+SerialTransport<HardwareSerial, EspLog> espTransport(&Serial1, HARDWARE_UART_MAX_BAUD);
+#else
 /*! @var softPort
  *  9 = TX;
  *  8 = RX;
  *  This is the serial port used to communicate with the ESP8266
  */
 AltSoftSerial softPort;
+/*! @var espTransport
+ *  The ESP8266 class talks to softPort through this.
+ */
+SerialTransport<AltSoftSerial, EspLog> espTransport(&softPort, ALTSOFTSERIAL_MAX_BAUD);
+#endif
+
+/*! @var esp
+ *  This is the class used to interface the ESP.  Its buffers are sized
+ *  here, and live in static RAM with it.
+ */
+ESP8266Server<SERIAL_INPUT_BUFFER_MAX_SIZE, PREFETCH_OUTPUT_BUFFER_SIZE, MAX_RESPONSE_STREAMS>
+  esp(&espTransport, EspLog::enabled, &config);
+/*! @var request
+ * View of the most recent line read from the ESP.  Points into the ESP8266
+ * class input buffer, so it costs no extra RAM for the line data.
+ */
+request_view request;
+bool request_pending = false; ///<TRUE while request holds a line the http task hasn't finished with
+char channel = 0; ///<The channel on which the last request to me was sent.
+buffer_span index_path = {(char *)"/", 1}; ///<Path of the page served for unknown paths
+
+/*! 
+ * @enum get_target
+ * 
+ * @brief What a GET request asks for, decided from its request line
+ */
+enum get_target{
+  GET_NONE,          ///<nothing to serve
+  GET_ASSET,         ///<get_asset, from the flash bundle
+  GET_NETWORKS,      ///<list of networks the ESP8266 can see
+  GET_SETTINGS_JOB,  ///<status of the latest settings job
+  GET_METRICS,       ///<watchdog report and scheduler stats
+  GET_TRACE          ///<the request timeline, see Trace.h
+};
+unsigned char get_request_target = GET_NONE; ///<one of get_target, for the GET being handled
+asset_entry get_asset;         ///<asset the GET asks for, if get_request_target is GET_ASSET
+byte_range get_range;          ///<from the Range header of the GET
+bool get_not_modified;         ///<the If-None-Match header of the GET matched get_asset's ETag
+unsigned int trace_dump_end;   ///<get_trace_count() when the last /debug/trace was asked for
+
+/*! 
+ * @enum motion_command
+ * 
+ * @brief Moves the http task hands to the motion task
+ */
+enum motion_command{
+  MOTION_NONE = 0,  ///<nothing to do
+  MOTION_TILT_UP,   ///<Rubber_Band_Shooter::turn_up()
+  MOTION_TILT_DOWN, ///<Rubber_Band_Shooter::turn_down()
+  MOTION_PAN_RIGHT, ///<Rubber_Band_Shooter::turn_right()
+  MOTION_PAN_LEFT,  ///<Rubber_Band_Shooter::turn_left()
+  MOTION_FIRE       ///<fire, then re-arm
+};
 
-ESP8266 * esp; ///<This is the class used to interface the ESP.
-/*! var input_line
- * This is used to hold the most recent line read from the ESP.
+/*! 
+ * @struct motion_request
+ * 
+ * @brief A move waiting for the motion task
+ */
+struct motion_request{
+  unsigned char command;     ///<one of motion_command
+  unsigned char increments;  ///<how many times to make the move, see MOTION_MAX_INCREMENTS
+  unsigned char trace_id;    ///<request that asked for the move, see Trace.h
+};
+motion_request motion_queue[MOTION_QUEUE_LEN]; ///<ring of moves, oldest first
+unsigned char motion_queue_head = 0;           ///<index of the oldest move
+unsigned char motion_queue_len = 0;            ///<number of moves waiting
+motion_request current_motion;                 ///<the move the motion task is making
+
+/*! 
+ * @struct ir_binding
+ * 
+ * @brief A remote control button, and the move it makes
  */
-//! @todo This is a bigtime memory waster - implement everything I'm doing here in the ESP8266 class to existing buffers
-#define MAXIMUM_INPUT_LINE_LENGTH 200
-char input_line[MAXIMUM_INPUT_LINE_LENGTH+1];
+struct ir_binding{
+  unsigned long code;     ///<NEC code of the button, see IrReceiver
+  unsigned char command;  ///<one of motion_command
+};
+/*! @var ir_bindings
+ *  Buttons of the remote (the small "Car mp3" one) that do something.*/
+const ir_binding ir_bindings[] PROGMEM = {
+  {0xFF22DD, MOTION_FIRE},       // PAUSE
+  {0xFF02FD, MOTION_PAN_LEFT},   // FAST BACK
+  {0xFFC23D, MOTION_PAN_RIGHT},  // FAST FORWARD
+  {0xFFA857, MOTION_TILT_DOWN},  // VOL-
+  {0xFF906F, MOTION_TILT_UP}     // VOL+
+};
+IrReceiver ir;                         ///<decodes the remote in the background
+unsigned char ir_held = MOTION_NONE;   ///<move of the remote button being held, if it repeats
+unsigned long ir_last_frame_ms;        ///<when the held button was last heard from
+unsigned long ir_last_move_ms;         ///<when the held button last queued its move
+unsigned char ir_repeats;              ///<moves queued since the button was pressed
+
+bool drive_alive = false;          ///<TRUE while /drive heartbeats keep coming
+unsigned long drive_heartbeat_ms;  ///<when the last /drive request came
+unsigned long drive_update_ms;     ///<when the drive task last ran
 
-Rubber_Band_Shooter * shooter;///<This is the class used to interface rubber band shooter
+Scheduler scheduler; ///<Runs everything after setup()
+
+const char field_name_ssid[] PROGMEM = "ssid__";        ///<station SSID form field
+const char field_name_password[] PROGMEM = "paswrd";    ///<station password form field
+const char field_name_ap_ssid[] PROGMEM = "ap_ssd";     ///<access point SSID form field
+const char field_name_ap_password[] PROGMEM = "ap_pwd"; ///<access point password form field
+char settings_ssid[MAX_SSID_LENGTH+1];         ///<SSID from the last settings form
+char settings_password[MAX_PASSWORD_LENGTH+1]; ///<password from the last settings form
+/*! @var settings_fields
+ *  The station and access point forms share the value buffers; the path
+ *  says which network the values are for.
+ */
+const form_field settings_fields[] PROGMEM = {
+  {field_name_ssid, settings_ssid, sizeof(settings_ssid)},
+  {field_name_password, settings_password, sizeof(settings_password)},
+  {field_name_ap_ssid, settings_ssid, sizeof(settings_ssid)},
+  {field_name_ap_password, settings_password, sizeof(settings_password)},
+};
+#define SETTINGS_FIELD_COUNT (sizeof(settings_fields)/sizeof(settings_fields[0])) ///< @def number of settings form fields
+FormParser settings_form;              ///<Parses the body of a settings request
+unsigned int settings_content_length;  ///<Content-Length of the settings request
+bool settings_in_body;                 ///<TRUE once the settings request headers are over
+bool settings_for_ap;                  ///<TRUE if the settings are for the access point
+Watchdog watchdog(&scheduler); ///<Resets the board if a task gets stuck
 
 #define SHOOTER_HAMMER_PIN      3 ///<The pin to use to control the hammer servo.
 #define SHOOTER_ELEVATION_PIN   11 ///<The pin to use to control the hammer servo.
 
+/*! @var pulse_engine
+ *  Times the servo pulses and the base stepper's steps, from Timer2.
+ */
+PulseEngine pulse_engine;
+
+/*! @var shooter
+ *  This is the class used to interface rubber band shooter.  Its pins are
+ *  template parameters, so the base stepper's coils are written straight
+ *  to the port registers.
+ */
+PinnedShooter<SHOOTER_HAMMER_PIN, SHOOTER_ELEVATION_PIN, BASE_STEPPER_PINS> shooter(&pulse_engine);
+
 /*!
  * @fn setup
  * 
@@ -96,18 +303,41 @@ void setup() {
   }
   Serial.println(F(""));
   Serial.println(F("| Serial Port Initialized..."));
-  Serial.println(F("| Initializing software serial..."));
-  softPort.begin(SERIAL_BAUD_RATE);
-  Serial.print(F("|   Done. Free Memory: "));Serial.println(mu_freeRam());
+  config.begin();
+  watchdog.begin(config.end_address());
+  unsigned long esp_baud_rate = SERIAL_BAUD_RATE;
+  config.load(CONFIG_KEY_SERIAL_BAUD, &esp_baud_rate, sizeof(esp_baud_rate));
+  Serial.print(F("| Initializing ESP8266 serial at "));Serial.println(esp_baud_rate);
+  espTransport.begin(esp_baud_rate);
+  Serial.print(F("|   Done. Free Memory: "));Serial.println(get_free_ram());
 
   // Setup the connection to the ESP8266
   Serial.println(F("| Initializing ESP8266..."));
-  esp = new ESP8266(&softPort, PRINT_SERIAL_STREAM, 0);
-  Serial.print(F("|   Done. Free Memory: "));Serial.println(mu_freeRam());
+  esp.begin();
+  Serial.print(F("|   Done. Free Memory: "));Serial.println(get_free_ram());
 
-  shooter = new Rubber_Band_Shooter(SHOOTER_HAMMER_PIN, SHOOTER_ELEVATION_PIN);
+  pulse_engine.begin();
+  shooter.begin();
+  ir.begin();
+  motion_calibration calibration;
+  if(config.load(CONFIG_KEY_MOTION_CALIBRATION, &calibration, sizeof(calibration))){
+    shooter.set_calibration(calibration);
+  }
   
-  if(PRINT_SERIAL_STREAM)
+  watchdog.watch_task(scheduler.add_task(PSTR("net_rx"), network_task, 0), TASK_BUDGET_MS);
+  watchdog.watch_task(scheduler.add_task(PSTR("http"), http_task, 0), TASK_BUDGET_MS);
+  watchdog.watch_task(scheduler.add_task(PSTR("motion"), motion_task, 0), TASK_BUDGET_MS);
+  watchdog.watch_task(scheduler.add_task(PSTR("status"), status_task, STATUS_REFRESH_MS),
+                      STATUS_REFRESH_MS + TASK_BUDGET_MS);
+  watchdog.watch_task(scheduler.add_task(PSTR("serial"), passthrough_task, 0), TASK_BUDGET_MS);
+  watchdog.watch_task(scheduler.add_task(PSTR("ir"), ir_task, 0), TASK_BUDGET_MS);
+  watchdog.watch_task(scheduler.add_task(PSTR("drive"), drive_task, DRIVE_TICK_MS),
+                      DRIVE_TICK_MS + TASK_BUDGET_MS);
+  esp.set_wait_hook(keep_watchdog_alive);
+  watchdog.enable();
+  Serial.print(F("| Stack margin after setup: "));Serial.println(get_stack_margin());
+
+  if(EspLog::enabled)
     Serial.println(F("\n\nENTERING INTERACTIVE SERIAL PASSTHROUGH-------------------"));
   else
     Serial.println(F("\n\nREADY TO RECEIVE COMMANDS, BUT NOT ECHOING WIFI DATA------"));
@@ -116,75 +346,517 @@ void setup() {
 
 
 /*!
- * @fn loop
+ * @fn network_task
  * 
- * @brief main loop for the Arduino
+ * @brief Reads lines from the ESP8266 into request, whenever the http 
+ *        task is done with the last one.
+ */
+void network_task(task * self){
+  if(!request_pending && esp.read_request(&request)){
+    request_pending = true;
+  }
+}
+
+
+/*!
+ * @fn motion_for_path
+ * 
+ * @param view  request line of a POST request
  * 
+ * @return the motion_command its path asks for, MOTION_NONE if it isn't a move
  */
-char channel = 0; ///<The channel on which the last request to me was sent.
-void loop() {
+unsigned char motion_for_path(const request_view &view){
+  if(span_has_token(view, view.path, TOKEN_TILT_UP))
+    return MOTION_TILT_UP;
+  if(span_has_token(view, view.path, TOKEN_TILT_DOWN))
+    return MOTION_TILT_DOWN;
+  if(span_has_token(view, view.path, TOKEN_PAN_RIGHT))
+    return MOTION_PAN_RIGHT;
+  if(span_has_token(view, view.path, TOKEN_PAN_LEFT))
+    return MOTION_PAN_LEFT;
+  if(span_has_token(view, view.path, TOKEN_FIRE))
+    return MOTION_FIRE;
+  return MOTION_NONE;
+}
+
+
+/*!
+ * @fn queue_motion
+ * 
+ * @brief Hands a move to the motion task.  If the last move waiting is 
+ *        the same, they are merged into one bigger move instead.  Fire
+ *        commands are never merged: each one is a shot.
+ * 
+ * @param command   one of motion_command
+ * @param trace_id  request asking for the move (see Trace.h), 
+ *                  TRACE_NO_REQUEST for the remote control
+ * 
+ * @return FALSE if the queue is full
+ */
+bool queue_motion(unsigned char command, unsigned char trace_id){
+  if(motion_queue_len > 0){
+    motion_request * newest = &motion_queue[(motion_queue_head + motion_queue_len - 1) % MOTION_QUEUE_LEN];
+    if(newest->command == command && command != MOTION_FIRE &&
+       newest->increments < MOTION_MAX_INCREMENTS){
+      newest->increments++;
+      return true;
+    }
+  }
+  if(motion_queue_len >= MOTION_QUEUE_LEN)
+    return false;
+  motion_request * request = &motion_queue[(motion_queue_head + motion_queue_len) % MOTION_QUEUE_LEN];
+  request->command = command;
+  request->increments = 1;
+  request->trace_id = trace_id;
+  motion_queue_len++;
+  return true;
+}
+
+
+/*!
+ * @fn drive
+ * 
+ * @brief Sets the velocity mode rates from a "/drive?pan=P&tilt=T" path, 
+ *        in degrees per second.  Every request is also a heartbeat, see
+ *        DRIVE_DEADMAN_MS; a missing rate is zero.
+ * 
+ * @param path  path of the POST request
+ */
+void drive(const buffer_span &path){
+  int pan = 0;
+  int tilt = 0;
+  span_query_int_P(path, PSTR("pan="), &pan);
+  span_query_int_P(path, PSTR("tilt="), &tilt);
+  shooter.set_velocity(pan, tilt);
+  drive_alive = pan != 0 || tilt != 0;
+  drive_heartbeat_ms = millis();
+}
+
+
+/*!
+ * @fn route_get
+ * 
+ * @brief Works out what a GET request asks for, while its request line 
+ *        is still in the input buffer
+ */
+void route_get(){
+  Serial.print(F("|  GET received on channel ")); Serial.println(channel,DEC);
+  get_range.requested = false;
+  get_not_modified = false;
+  if(find_asset(request.path, &get_asset)){
+    get_request_target = GET_ASSET;
+  } else if (span_starts_with_token(request, request.path, TOKEN_INFO_NETWORKS)){
+    get_request_target = GET_NETWORKS;
+  } else if (span_starts_with_token(request, request.path, TOKEN_INFO_SETTINGS)){
+    get_request_target = GET_SETTINGS_JOB;
+  } else if (span_starts_with_token(request, request.path, TOKEN_METRICS)){
+    get_request_target = GET_METRICS;
+  } else if (span_starts_with_token(request, request.path, TOKEN_DEBUG_TRACE)){
+    get_request_target = GET_TRACE;
+  } else if(find_asset(index_path, &get_asset)){
+    // anything else gets the targeting page
+    Serial.println(F("|     targeting page requested"));
+    get_request_target = GET_ASSET;
+  } else {
+    get_request_target = GET_NONE;
+  }
+  trace_channel(channel, TRACE_ROUTED);
+}
+
+
+/*!
+ * @fn read_get_header
+ * 
+ * @brief Picks the conditions (Range, If-None-Match) out of a header 
+ *        line of the GET request
+ */
+void read_get_header(){
+  buffer_span value;
+  if(get_request_target != GET_ASSET)
+    return;
+  if(span_header_value_P(request.body, PSTR("Range:"), &value)){
+    span_parse_byte_range(value, &get_range);
+  } else if(span_header_value_P(request.body, PSTR("If-None-Match:"), &value)){
+    get_not_modified = (get_asset.flags & ASSET_CACHEABLE) &&
+                       (span_contains_P(value, get_asset.etag) || span_starts_with_P(value, PSTR("*")));
+  }
+}
+
+
+/*!
+ * @fn handle_get
+ * 
+ * @brief Serves what the GET request asks for
+ */
+void handle_get(){
+  if(get_request_target == GET_ASSET){
+    if(get_not_modified)
+      esp.send_not_modified(channel, get_asset);
+    else
+      esp.send_asset(channel, get_asset, &get_range);
+  } else if(get_request_target == GET_NETWORKS){
+    esp.send_networks_list(channel);
+  } else if(get_request_target == GET_SETTINGS_JOB){
+    esp.send_http_200_generated(channel, ESP8266::settings_job_generator, &esp,
+                                 SETTINGS_JOB_STATUS_LEN);
+  } else if(get_request_target == GET_METRICS){
+    esp.send_http_200_generated(channel, metrics_generator, NULL,
+                                 watchdog.get_report_length() + scheduler.get_stats_length());
+  } else if(get_request_target == GET_TRACE){
+    trace_dump_end = get_trace_count();
+    esp.send_http_200_generated(channel, trace_generator, &trace_dump_end, get_trace_length());
+  }
+  PRINT_FREE_MEMORY();
+}
+
+
+/*!
+ * @fn apply_settings
+ * 
+ * @brief Queues a complete settings form to be applied in the background,
+ *        and answers the request right away with the job's status line.  
+ *        The client polls /info/settings for the outcome.
+ */
+void apply_settings(){
+  unsigned char job = SETTINGS_NO_JOB;
+  if(!settings_form.is_valid() || settings_ssid[0] == '\0' || settings_password[0] == '\0'){
+    Serial.println(F("| Malformed settings request"));
+  } else {
+    job = esp.queue_settings_job(settings_for_ap, settings_ssid, settings_password);
+  }
+  if(job != SETTINGS_NO_JOB)
+    esp.send_http_200_generated(channel, ESP8266::settings_job_generator, &esp,
+                                 SETTINGS_JOB_STATUS_LEN);
+  else
+    esp.send_http_200_static(channel,(char *)failure_msg,(sizeof(failure_msg)-1));
+}
+
+
+/*!
+ * @fn http_task
+ * 
+ * @brief Answers requests.  Moves are queued for the motion task and 
+ *        answered at once in the control lane, ahead of any page being 
+ *        sent.  GET requests wait (without blocking) for their headers, 
+ *        and settings requests wait for their headers and then 
+ *        Content-Length bytes of form body.  Whatever there is no room for
+ *        gets a 503.
+ */
+unsigned char requested_motion = MOTION_NONE; ///<move asked for by the request being handled
+void http_task(task * self){
+  TASK_BEGIN(self);
+  while(true){
+    TASK_WAIT_UNTIL(self, request_pending);
+    request_pending = false;
 
-  // Read a line (delimited by '\n') from the ESP8266
-  if(esp->read_line(input_line,MAXIMUM_INPUT_LINE_LENGTH)){
-    //Serial.print("Input Line length:  ");Serial.println(input_line->length());
-
-    //First, parse out the connection channel, zero of none is found
-    channel = esp->get_channel_from_string(input_line,50);
-
-    if(strnstr_P(input_line,PSTR("GET"),MAXIMUM_INPUT_LINE_LENGTH) != NULL){
-      Serial.print(F("|  GET received on channel ")); Serial.println(channel,DEC);
-      if(strnstr_P(input_line,PSTR("/config"),MAXIMUM_INPUT_LINE_LENGTH)){
-        //config page has been requested
-        Serial.println(F("|     config page requested"));
-        esp->send_http_200_with_prefetch(channel,(char *)config_website_text_0,config_website_text_0_len-1,
-                                        (char *)config_website_text_2,config_website_text_2_len,
-                                        config_website_prefetch, config_website_PREFETCH_LEN-1);
-      } else if (strnstr_P(input_line,PSTR("/info/networks"),MAXIMUM_INPUT_LINE_LENGTH)){
-        esp->send_networks_list(channel);
+    //First, get the connection channel, zero of none is found
+    channel = request.channel;
+
+    if(span_starts_with_token(request, request.method, TOKEN_GET)){
+      // The request line is only valid until the next line is read
+      route_get();
+      task_set_deadline(self, GET_HEADERS_TIMEOUT_MS);
+      while(true){
+        TASK_WAIT_UNTIL(self, request_pending || task_deadline_passed(self));
+        if(!request_pending || request.method.length){
+          // timed out, or a new request - leave it pending for the top of the loop
+          break;
+        }
+        request_pending = false;
+        if(!request.is_payload || request.channel != channel)
+          continue;
+        if(span_is_blank_line(request.body))
+          break;
+        read_get_header();
+      }
+      handle_get();
+    } else if(span_starts_with_token(request, request.method, TOKEN_POST)){
+      Serial.print(F("|  POST received on channel ")); Serial.println(channel,DEC);
+      requested_motion = motion_for_path(request);
+      trace_channel(channel, TRACE_ROUTED);
+      if(requested_motion != MOTION_NONE){
+        if(queue_motion(requested_motion, get_trace_request(channel)))
+          esp.send_http_200_static(channel,(char *)blank_website_text,(sizeof(blank_website_text)-1),
+                                    TX_LANE_CONTROL);
+        else
+          esp.send_http_503(channel);
+      } else if(span_has_token(request, request.path, TOKEN_DRIVE)){
+        drive(request.path);
+        esp.send_http_200_static(channel,(char *)blank_website_text,(sizeof(blank_website_text)-1),
+                                  TX_LANE_CONTROL);
+      } else if(esp.is_settings_job_busy() &&
+                (span_has_token(request, request.path, TOKEN_SETTINGS_SSID) ||
+                 span_has_token(request, request.path, TOKEN_SETTINGS_AP))){
+        // the running job still points at settings_ssid and settings_password
+        Serial.println(F("| Settings job still running"));
+        esp.send_http_503(channel);
+      } else if(span_has_token(request, request.path, TOKEN_SETTINGS_SSID) ||
+                span_has_token(request, request.path, TOKEN_SETTINGS_AP)){
+        Serial.println(F("Settings Request Received!"));
+        settings_for_ap = span_has_token(request, request.path, TOKEN_SETTINGS_AP);
+        settings_content_length = 0;
+        settings_in_body = false;
+        task_set_deadline(self, SETTINGS_TIMEOUT_MS);
+        while(!settings_in_body || !settings_form.is_complete()){
+          TASK_WAIT_UNTIL(self, request_pending || task_deadline_passed(self));
+          if(!request_pending){
+            Serial.println(F("| Settings request timed out"));
+            break;
+          }
+          if(request.method.length && request.channel == channel){
+            // a new request on the same connection - leave it pending for the top of the loop
+            break;
+          }
+          request_pending = false;
+          if(request.method.length){
+            // another connection has to wait until this body is in
+            trace_channel(request.channel, TRACE_ROUTED);
+            esp.send_http_503(request.channel);
+            continue;
+          }
+          if(!request.is_payload || request.channel != channel)
+            continue;
+          if(settings_in_body){
+            settings_form.feed(request.body.pointer, request.body.length);
+          } else if(span_is_blank_line(request.body)){
+            settings_in_body = true;
+            settings_form.begin(settings_fields, SETTINGS_FIELD_COUNT, settings_content_length);
+          } else {
+            span_header_uint_P(request.body, PSTR("Content-Length:"), &settings_content_length);
+          }
+        }
+        if(settings_in_body && settings_form.is_complete()){
+          apply_settings();
+        } else {
+          esp.send_http_200_static(channel,(char *)failure_msg,(sizeof(failure_msg)-1));
+        }
+      } else if(span_has_token(request, request.path, TOKEN_SETTINGS)){
+        Serial.println(F("| received an unknown setting path."));
       } else {
-        Serial.println(F("|     targeting page requested"));
-        esp->send_http_200_static(channel,(char *)static_website_text_0,(sizeof(static_website_text_0)-1));      
+        Serial.println(F("OTHER"));
       }
       PRINT_FREE_MEMORY();
-    }else {
-      if(strnstr_P(input_line,PSTR("POST"),MAXIMUM_INPUT_LINE_LENGTH) != NULL){
-        Serial.print(F("|  POST received on channel ")); Serial.println(channel,DEC);
-        if(strnstr_P(input_line,PSTR("tilt_up"),MAXIMUM_INPUT_LINE_LENGTH) != NULL){
-          Serial.println(F("tilt_up"));
-          shooter->turn_up();
-          esp->send_http_200_static(channel,(char *)blank_website_text,(sizeof(blank_website_text)-1));
-        } else if(strnstr_P(input_line,PSTR("tilt_down"),MAXIMUM_INPUT_LINE_LENGTH) != NULL){
-          Serial.println(F("tilt_down"));
-          shooter->turn_down();
-          esp->send_http_200_static(channel,(char *)blank_website_text,(sizeof(blank_website_text)-1));
-        } else if(strnstr_P(input_line,PSTR("pan_right"),MAXIMUM_INPUT_LINE_LENGTH) != NULL){
-          Serial.println(F("pan_right"));
-          shooter->turn_right();
-          esp->send_http_200_static(channel,(char *)blank_website_text,(sizeof(blank_website_text)-1));
-        } else if(strnstr_P(input_line,PSTR("pan_left"),MAXIMUM_INPUT_LINE_LENGTH) != NULL){
-          Serial.println(F("pan_left"));
-          shooter->turn_left();
-          esp->send_http_200_static(channel,(char *)blank_website_text,(sizeof(blank_website_text)-1));
-        } else if(strnstr_P(input_line,PSTR("fire"),MAXIMUM_INPUT_LINE_LENGTH) != NULL){
-          Serial.println(F("FIRRRRRRE!!!!"));
-          shooter->fire();
-          esp->send_http_200_static(channel,(char *)blank_website_text,(sizeof(blank_website_text)-1));
-        } else if(strnstr_P(input_line,PSTR("settings"),MAXIMUM_INPUT_LINE_LENGTH)){
-          Serial.println(F("Settings Request Received!"));
-          esp->process_settings(channel,input_line,MAXIMUM_INPUT_LINE_LENGTH);
-        }else {
-          Serial.println(F("OTHER"));
-        }
-        PRINT_FREE_MEMORY();
+    }
+  }
+  TASK_END(self);
+}
+
+
+/*!
+ * @fn motion_task
+ * 
+ * @brief Carries out moves queued by the http task, oldest first.  Each
+ *        move is finished before the next starts; the pulse engine does the
+ *        moving, so waiting for it (or for the hammer) doesn't block the
+ *        other tasks.
+ */
+void motion_task(task * self){
+  TASK_BEGIN(self);
+  while(true){
+    TASK_WAIT_UNTIL(self, motion_queue_len > 0);
+    // take the move off the queue, so nothing more is merged into it
+    current_motion = motion_queue[motion_queue_head];
+    motion_queue_head = (motion_queue_head + 1) % MOTION_QUEUE_LEN;
+    motion_queue_len--;
+    trace_request(current_motion.trace_id, TRACE_MOTION_START);
+    if(current_motion.command == MOTION_TILT_UP){
+      Serial.print(F("tilt_up x")); Serial.println(current_motion.increments);
+      shooter.turn_up(current_motion.increments);
+    } else if(current_motion.command == MOTION_TILT_DOWN){
+      Serial.print(F("tilt_down x")); Serial.println(current_motion.increments);
+      shooter.turn_down(current_motion.increments);
+    } else if(current_motion.command == MOTION_PAN_RIGHT){
+      Serial.print(F("pan_right x")); Serial.println(current_motion.increments);
+      shooter.turn_right(current_motion.increments);
+    } else if(current_motion.command == MOTION_PAN_LEFT){
+      Serial.print(F("pan_left x")); Serial.println(current_motion.increments);
+      shooter.turn_left(current_motion.increments);
+    } else if(current_motion.command == MOTION_FIRE){
+      Serial.println(F("FIRRRRRRE!!!!"));
+      shooter.release_hammer();
+      TASK_SLEEP(self, HAMMER_TRAVEL_MS);
+      shooter.arm_hammer();
+    }
+    TASK_WAIT_UNTIL(self, !shooter.is_moving());
+    trace_request(current_motion.trace_id, TRACE_MOTION_END);
+  }
+  TASK_END(self);
+}
+
+
+/*!
+ * @fn drive_task
+ * 
+ * @brief Ramps the velocity mode rates and moves the turret on at them, 
+ *        every DRIVE_TICK_MS.  When the heartbeats stop, the turret is 
+ *        ramped to a stop.  Should this task itself be held up, the base
+ *        stops VELOCITY_LEASE_MS after its last run.
+ */
+void drive_task(task * self){
+  unsigned long now = millis();
+  if(drive_alive && now - drive_heartbeat_ms > DRIVE_DEADMAN_MS){
+    Serial.println(F("| drive: no heartbeat, stopping"));
+    shooter.set_velocity(0, 0);
+    drive_alive = false;
+  }
+  if(shooter.is_driving() || drive_alive)
+    shooter.update_velocity(now - drive_update_ms);
+  drive_update_ms = now;
+}
+
+
+/*!
+ * @fn motion_for_ir_code
+ * 
+ * @return the move bound to a remote control button, or MOTION_NONE
+ */
+unsigned char motion_for_ir_code(unsigned long code){
+  for(unsigned char i = 0; i < sizeof(ir_bindings) / sizeof(ir_bindings[0]); i++){
+    if(pgm_read_dword(&ir_bindings[i].code) == code)
+      return pgm_read_byte(&ir_bindings[i].command);
+  }
+  return MOTION_NONE;
+}
+
+
+/*!
+ * @fn ir_task
+ * 
+ * @brief Queues the moves of the remote control, next to the ones of the
+ *        http task.  A held button repeats its move, sooner each time, 
+ *        but only once the queue is empty - so the turret keeps moving 
+ *        while the button is held, and stops soon after it is let go.
+ */
+void ir_task(task * self){
+  ir_frame frame;
+  unsigned long now = millis();
+  if(ir.read(&frame)){
+    if(frame.type == IR_FRAME_REPEAT){
+      ir_last_frame_ms = now;
+    } else {
+      unsigned char command = motion_for_ir_code(frame.code);
+      if(command == MOTION_NONE){
+        Serial.print(F("| IR: other button ")); Serial.println(frame.code, HEX);
+      } else if(!queue_motion(command, TRACE_NO_REQUEST)){
+        Serial.println(F("| IR: motion queue full"));
       }
+      // firing doesn't repeat: each shot is a press
+      ir_held = (command == MOTION_FIRE) ? MOTION_NONE : command;
+      ir_last_frame_ms = now;
+      ir_last_move_ms = now;
+      ir_repeats = 0;
     }
   }
+  if(ir_held == MOTION_NONE)
+    return;
+  if(now - ir_last_frame_ms > IR_HOLD_TIMEOUT_MS){
+    ir_held = MOTION_NONE;
+    return;
+  }
+  unsigned int interval = 0;
+  if((unsigned int)ir_repeats * IR_REPEAT_ACCEL_MS < IR_REPEAT_DELAY_MS)
+    interval = IR_REPEAT_DELAY_MS - ir_repeats * IR_REPEAT_ACCEL_MS;
+  if(motion_queue_len == 0 && now - ir_last_move_ms >= interval && queue_motion(ir_held, TRACE_NO_REQUEST)){
+    ir_last_move_ms = now;
+    if(ir_repeats < 0xFF)
+      ir_repeats++;
+  }
+}
+
+
+/*!
+ * @fn status_task
+ * 
+ * @brief Keeps the cached network status fresh, every STATUS_REFRESH_MS
+ */
+void status_task(task * self){
+  esp.refresh_status();
+}
+
 
-  // Pass through manual commands to the ESP8266
+/*!
+ * @fn passthrough_task
+ * 
+ * @brief Passes manual commands from the debug port through to the ESP8266
+ */
+void passthrough_task(task * self){
   unsigned char data;
   while(Serial.available()) {
     data = Serial.read();
-    softPort.write(data);
+    espTransport.write((char)data);
   }
 }
 
+
+/*!
+ * @fn keep_watchdog_alive
+ * 
+ * @brief ESP8266 wait hook: blocking AT commands have their own timeouts,
+ *        so the watchdog is kept quiet while one runs.
+ */
+void keep_watchdog_alive(){
+  watchdog.keep_alive();
+}
+
+
+/*!
+ * @fn metrics_generator
+ * 
+ * @brief segment_generator for /metrics: the watchdog report, then the 
+ *        scheduler stats.
+ */
+unsigned int metrics_generator(void * context, unsigned int offset, char * output, unsigned int output_size){
+  unsigned int produced = 0;
+  unsigned int watchdog_length = watchdog.get_report_length();
+  if(offset < watchdog_length){
+    produced = Watchdog::report_generator(&watchdog, offset, output, output_size);
+  }
+  if(produced < output_size){
+    produced += Scheduler::stats_generator(&scheduler, offset + produced - watchdog_length,
+                                           output + produced, output_size - produced);
+  }
+  return produced;
+}
+
+
+/*!
+ * @fn loop
+ * 
+ * @brief main loop for the Arduino
+ * 
+ */
+void loop() {
+  scheduler.run_once();
+  watchdog.feed();
+}
+
+
+/*! @def MODULE_STATIC_RAM
+ *  File statics of the other modules: the trace ring and its counters, 
+ *  and the pointers the interrupt handlers find their objects by.*/
+#define MODULE_STATIC_RAM (TRACE_EVENTS * sizeof(trace_event) + TRACE_CHANNELS + 5 + 4 * sizeof(void *))
+#if defined(HAVE_HWSERIAL1)
+/*! @def TRANSPORT_STATIC_RAM
+ *  The ESP8266 link, with the buffers of the UART it runs on.*/
+#define TRANSPORT_STATIC_RAM (sizeof(espTransport) + sizeof(Serial1))
+#else
+#define TRANSPORT_STATIC_RAM (sizeof(espTransport) + sizeof(softPort) + ALTSOFTSERIAL_STATIC_RAM)
+#endif
+/*! @def SKETCH_STATIC_RAM
+ *  Every global of the sketch, so one that grows (or a new one) shows up
+ *  in the check below.*/
+#define SKETCH_STATIC_RAM \
+  (sizeof(eeprom_writer) + sizeof(config) + sizeof(esp) + sizeof(request) + \
+   sizeof(request_pending) + sizeof(channel) + sizeof(index_path) + \
+   sizeof(get_request_target) + sizeof(get_asset) + sizeof(get_range) + \
+   sizeof(get_not_modified) + sizeof(trace_dump_end) + \
+   sizeof(motion_queue) + sizeof(motion_queue_head) + sizeof(motion_queue_len) + \
+   sizeof(current_motion) + sizeof(ir) + sizeof(ir_held) + sizeof(ir_last_frame_ms) + \
+   sizeof(ir_last_move_ms) + sizeof(ir_repeats) + sizeof(drive_alive) + \
+   sizeof(drive_heartbeat_ms) + sizeof(drive_update_ms) + sizeof(scheduler) + \
+   sizeof(settings_ssid) + sizeof(settings_password) + sizeof(settings_form) + \
+   sizeof(settings_content_length) + sizeof(settings_in_body) + sizeof(settings_for_ap) + \
+   sizeof(watchdog) + sizeof(pulse_engine) + sizeof(shooter) + sizeof(requested_motion))
+static_assert(SKETCH_STATIC_RAM + TRANSPORT_STATIC_RAM + MODULE_STATIC_RAM + sizeof(Serial) +
+              CORE_STATIC_RAM <= RAM_SIZE - STACK_RESERVE,
+              "static RAM leaves less than STACK_RESERVE bytes for the stack");
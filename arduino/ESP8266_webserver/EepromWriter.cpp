@@ -0,0 +1,208 @@
+/*!
+ * @file EepromWriter.cpp
+ *
+ * @brief EEPROM writes queued in RAM and made from the EEPROM ready
+ *        interrupt
+ *
+ */
+#include "EepromWriter.h"
+
+/*! @var active_writer
+ *  The instance the EEPROM ready interrupt works for, see
+ *  EepromWriter::write().*/
+static EepromWriter * active_writer = NULL;
+
+/*!
+ * @brief EEPROM ready: the last byte is written, start the next.
+ */
+ISR(EE_READY_vect){
+  active_writer->on_interrupt();
+}
+
+
+/*!
+ * @brief Constructor - the queue starts empty
+ */
+EepromWriter::EepromWriter(){
+  this->head = 0;
+  this->used = 0;
+  this->next_address = 0;
+  this->left = 0;
+  this->writing = false;
+  this->queued = 0;
+  this->retired = 0;
+}
+
+
+/*!
+ * @return the oldest queued byte, which is taken off the queue.  Only
+ *         from the interrupt.
+ */
+unsigned char EepromWriter::pop(){
+  unsigned char value = queue[head];
+  head = (head + 1) % EEPROM_QUEUE_SIZE;
+  used--;
+  return value;
+}
+
+
+/*!
+ * @return the queued byte offset bytes after the oldest one
+ */
+unsigned char EepromWriter::peek(unsigned char offset){
+  return queue[(head + offset) % EEPROM_QUEUE_SIZE];
+}
+
+
+/*!
+ * @brief Queue a write.  Returns at once, unless the queue is too full
+ *        to take it - then it waits for room.
+ *
+ * @param address  EEPROM address of the first byte
+ * @param data     what to write; copied, so it may change right away
+ * @param length   bytes to write
+ *
+ * @return FALSE if the write would never fit the queue
+ */
+bool EepromWriter::write(int address, const void * data, unsigned char length){
+  unsigned char needed = EEPROM_JOB_HEADER_SIZE + length;
+  if(length == 0)
+    return true;
+  if(length > EEPROM_QUEUE_SIZE - EEPROM_JOB_HEADER_SIZE)
+    return false;
+  active_writer = this;
+  while(EEPROM_QUEUE_SIZE - used < needed)
+    ;  // the interrupt is making room
+
+  // The interrupt only reads the bytes up to used, so the new ones can be
+  // filled in while it runs, and published at once
+  unsigned char sreg = SREG;
+  cli();
+  unsigned char tail = (head + used) % EEPROM_QUEUE_SIZE;
+  SREG = sreg;
+  const unsigned char * bytes = (const unsigned char *)data;
+  queue[tail] = address & 0xFF;
+  queue[(tail + 1) % EEPROM_QUEUE_SIZE] = address >> 8;
+  queue[(tail + 2) % EEPROM_QUEUE_SIZE] = length;
+  for(unsigned char i = 0; i < length; i++)
+    queue[(tail + EEPROM_JOB_HEADER_SIZE + i) % EEPROM_QUEUE_SIZE] = bytes[i];
+
+  sreg = SREG;
+  cli();
+  used += needed;
+  queued += length;
+  EECR |= _BV(EERIE);
+  SREG = sreg;
+  return true;
+}
+
+
+/*!
+ * @brief Read a byte as it will be once the queue is written out
+ *
+ * @param address  EEPROM address
+ *
+ * @return the newest queued value for address, or the EEPROM's if none
+ */
+unsigned char EepromWriter::read(int address){
+  bool running = eeprom_pause_writer();
+  unsigned char value = EEPROM.read(address);
+  // the rest of the write in progress, then every queued write after it
+  unsigned char offset = 0;
+  int job_address = next_address;
+  unsigned char job_left = left;
+  while(true){
+    if(address >= job_address && address - job_address < job_left)
+      value = peek(offset + (address - job_address));
+    offset += job_left;
+    if(offset >= used)
+      break;
+    job_address = peek(offset) | (peek(offset + 1) << 8);
+    job_left = peek(offset + 2);
+    offset += EEPROM_JOB_HEADER_SIZE;
+  }
+  eeprom_resume_writer(running);
+  return value;
+}
+
+
+/*!
+ * @return a ticket for everything queued so far, for is_done()
+ */
+unsigned int EepromWriter::get_ticket(){
+  return queued;
+}
+
+
+/*!
+ * @param ticket  from get_ticket()
+ *
+ * @return TRUE once everything queued before the ticket was taken is in
+ *         the EEPROM
+ */
+bool EepromWriter::is_done(unsigned int ticket){
+  unsigned char sreg = SREG;
+  cli();
+  bool done = (int)(retired - ticket) >= 0;
+  SREG = sreg;
+  return done;
+}
+
+
+/*!
+ * @return TRUE while queued bytes are still to be written
+ */
+bool EepromWriter::is_busy(){
+  return !is_done(queued);
+}
+
+
+/*!
+ * @brief Wait until everything queued is in the EEPROM, e.g. before a
+ *        reset.  Needs interrupts enabled.
+ */
+void EepromWriter::flush(){
+  while(is_busy())
+    ;
+}
+
+
+/*!
+ * @brief Called from the EEPROM ready interrupt: the EEPROM is idle, so
+ *        count the byte just written, and start writing the next one that
+ *        changes anything.
+ */
+void EepromWriter::on_interrupt(){
+  if(writing){
+    writing = false;
+    retired++;
+  }
+  for(unsigned char skips = 0; skips < EEPROM_SKIPS_PER_INTERRUPT; skips++){
+    if(left == 0){
+      if(used == 0){
+        // all written: stop the interrupt until the next write()
+        EECR &= ~_BV(EERIE);
+        return;
+      }
+      next_address = pop();
+      next_address |= pop() << 8;
+      left = pop();
+      continue;
+    }
+    unsigned char value = pop();
+    left--;
+    EEAR = next_address++;
+    EECR |= _BV(EERE);
+    if(EEDR != value){
+      EEDR = value;
+      // EEPE must follow EEMPE within four cycles; interrupts are off in here
+      EECR = _BV(EEMPE) | _BV(EERIE);
+      EECR |= _BV(EEPE);
+      writing = true;
+      return;
+    }
+    retired++;
+  }
+  // more to check: the interrupt comes straight back, after any other
+  // pending ones
+}
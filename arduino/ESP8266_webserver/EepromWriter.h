@@ -0,0 +1,104 @@
+/*!
+ * @file EepromWriter.h
+ *
+ * @brief EEPROM writes queued in RAM and made from the EEPROM ready
+ *        interrupt
+ *
+ */
+#ifndef EEPROM_WRITER_H
+#define EEPROM_WRITER_H
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+/*! @def EEPROM_QUEUE_SIZE
+ *  RAM for queued writes: EEPROM_JOB_HEADER_SIZE bytes per write plus its
+ *  data.  Fits two full config records (e.g. an SSID and its password) of
+ *  54 bytes each, and not a byte more.*/
+#define EEPROM_QUEUE_SIZE 108
+static_assert(EEPROM_QUEUE_SIZE <= 255, "queue indexes are bytes");
+/*! @def EEPROM_JOB_HEADER_SIZE
+ *  Address (two bytes) and length of each queued write.*/
+#define EEPROM_JOB_HEADER_SIZE 3
+/*! @def EEPROM_SKIPS_PER_INTERRUPT
+ *  Unchanged bytes the interrupt passes over before it gives the other
+ *  interrupts a turn.*/
+#define EEPROM_SKIPS_PER_INTERRUPT 8
+
+/*!
+ * @brief Keep the writer's interrupt from running, e.g. around EEPROM
+ *        library calls: the library sets the address register before it
+ *        disables interrupts, so the writer could change it in between.
+ *        A write in progress finishes on its own; the library waits for it.
+ *
+ * @return whether the writer was running, for eeprom_resume_writer()
+ */
+inline bool eeprom_pause_writer(){
+  bool running = EECR & _BV(EERIE);
+  EECR &= ~_BV(EERIE);
+  return running;
+}
+
+/*!
+ * @param running  from eeprom_pause_writer()
+ */
+inline void eeprom_resume_writer(bool running){
+  if(running)
+    EECR |= _BV(EERIE);
+}
+
+/*!
+ * @class EepromWriter
+ *
+ * @brief Writes to the EEPROM without waiting for them
+ *
+ * Each byte written to the EEPROM takes about 3.3 ms, and EEPROM.update()
+ * waits for every one of them, so saving a record used to hold up the
+ * main loop for a hundred milliseconds or more while the serial link
+ * overflowed.  write() only copies the data into a RAM queue.  The EEPROM
+ * ready interrupt then writes it out, one byte per interrupt, in the
+ * order it was queued - so a marker queued after its record (like the
+ * key byte of a ConfigStore record) is committed last, and a power loss
+ * leaves the record invisible rather than half written.  Bytes that
+ * already hold their value are skipped, as EEPROM.update() would.
+ *
+ * read() sees queued bytes as if they were written already, so the owner
+ * of the data can go on as though every write had been made.  Others
+ * using the EEPROM library meanwhile must wrap their calls in
+ * eeprom_pause_writer() and eeprom_resume_writer().
+ *
+ * Usage:<pre>
+ *    EepromWriter writer;
+ *    writer.write(address, &value, sizeof(value));  // returns at once
+ *    unsigned int ticket = writer.get_ticket();
+ *    ...
+ *    if(writer.is_done(ticket))                     // everything up to the ticket is written
+ *      ...
+ *    writer.flush();                                // or wait for it</pre>
+ */
+class EepromWriter{
+private:
+  unsigned char queue[EEPROM_QUEUE_SIZE];  ///<ring of queued writes: address lo, address hi, length, data
+  unsigned char head;                      ///<oldest queued byte
+  volatile unsigned char used;             ///<bytes in the queue
+  int next_address;                        ///<where the next byte of the write in progress goes
+  unsigned char left;                      ///<bytes of the write in progress still in the queue
+  bool writing;                            ///<TRUE while the EEPROM is writing a byte
+  unsigned int queued;                     ///<data bytes queued since boot, wraps; see get_ticket()
+  volatile unsigned int retired;           ///<data bytes written (or skipped) since boot, wraps
+
+  unsigned char pop();
+  unsigned char peek(unsigned char offset);
+
+public:
+  EepromWriter();
+  bool write(int address, const void * data, unsigned char length);
+  unsigned char read(int address);
+  unsigned int get_ticket();
+  bool is_done(unsigned int ticket);
+  bool is_busy();
+  void flush();
+  void on_interrupt();
+};
+
+#endif
@@ -0,0 +1,131 @@
+/*!
+ * @file EspTransport.h
+ * 
+ * @brief Serial link between the Arduino and the ESP8266
+ * 
+ * The ESP8266 class only talks to the device through an EspTransport, so
+ * the same code runs over AltSoftSerial on an Uno, or over a spare
+ * hardware UART (e.g. Serial1 on a Leonardo or Mega) at much higher 
+ * baud rates.
+ */
+#ifndef ESP_TRANSPORT_H
+#define ESP_TRANSPORT_H
+
+#include <Arduino.h>
+
+/*! @def ALTSOFTSERIAL_MAX_BAUD
+ *  Highest baud rate worth trying over AltSoftSerial.  With my (non-ideal)
+ *  level shifting it's flaky here - the link check will fall back if so.*/
+#define ALTSOFTSERIAL_MAX_BAUD 57600
+/*! @def HARDWARE_UART_MAX_BAUD
+ *  Highest baud rate worth trying over a hardware UART.*/
+#define HARDWARE_UART_MAX_BAUD 115200
+
+/*!
+ * @class EspTransport
+ * 
+ * @brief Interface to the serial port the ESP8266 is wired to.
+ * 
+ * Implemented by SerialTransport for any Arduino serial class with 
+ * begin()/end()/available()/read()/write().
+ */
+class EspTransport{
+public:
+  virtual void begin(unsigned long baud) = 0;
+  virtual void end() = 0;
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual size_t write(const char * data, size_t len) = 0;
+  virtual size_t write(char data) = 0;
+  virtual unsigned long get_max_baud() = 0;   ///<Fastest rate this link may be negotiated to
+  virtual unsigned long get_baud() = 0;       ///<Rate the port is running at now
+};
+
+/*!
+ * @struct NoEcho
+ * 
+ * @brief SerialTransport logging policy: nothing is logged, and no code 
+ *        is generated for it.
+ */
+struct NoEcho{
+  static const bool enabled = false;  ///<FALSE: data to and from the ESP8266 is not shown
+  static void on_read(char data){}
+  static void on_write(const char * data, size_t len){}
+};
+
+/*!
+ * @struct EchoToSerial
+ * 
+ * @brief SerialTransport logging policy: all data to and from the ESP8266
+ *        is dumped to the debug serial port.
+ */
+struct EchoToSerial{
+  static const bool enabled = true;   ///<TRUE: data to and from the ESP8266 is shown
+  static void on_read(char data){
+    Serial.write(data);
+  }
+  static void on_write(const char * data, size_t len){
+    Serial.write(data, len);
+  }
+};
+
+/*!
+ * @class SerialTransport
+ * 
+ * @brief Adapts an Arduino serial port class to EspTransport
+ * 
+ * The Log policy (NoEcho or EchoToSerial) sees every byte read and 
+ * written, so dumping the link to the debug port costs nothing when it is
+ * turned off.
+ * 
+ * Usage:<pre>
+ *   AltSoftSerial softPort;
+ *   SerialTransport<AltSoftSerial, EchoToSerial> transport(&softPort, ALTSOFTSERIAL_MAX_BAUD);
+ *   transport.begin(19200);</pre>
+ */
+template <class SerialPort, class Log = NoEcho>
+class SerialTransport : public EspTransport{
+private:
+  SerialPort * port;           ///<the underlying serial port
+  unsigned long max_baud;      ///<see get_max_baud()
+  unsigned long baud;          ///<see get_baud()
+
+public:
+  SerialTransport(SerialPort * port, unsigned long max_baud){
+    this->port = port;
+    this->max_baud = max_baud;
+    this->baud = 0;
+  }
+  void begin(unsigned long baud){
+    this->baud = baud;
+    port->begin(baud);
+  }
+  void end(){
+    port->end();
+  }
+  int available(){
+    return port->available();
+  }
+  int read(){
+    int data = port->read();
+    if(data >= 0)
+      Log::on_read((char)data);
+    return data;
+  }
+  size_t write(const char * data, size_t len){
+    Log::on_write(data, len);
+    return port->write(data, len);
+  }
+  size_t write(char data){
+    Log::on_write(&data, 1);
+    return port->write((uint8_t)data);
+  }
+  unsigned long get_max_baud(){
+    return max_baud;
+  }
+  unsigned long get_baud(){
+    return baud;
+  }
+};
+
+#endif
@@ -0,0 +1,189 @@
+/*!
+ * @file FastPin.h
+ *
+ * @brief GPIO through the port registers, with the pin known at compile time
+ *
+ * digitalWrite() looks the pin up in three PROGMEM tables, checks for a
+ * timer, and saves and restores the interrupt flag, every call: a few
+ * dozen cycles to flip one bit.  With the pin as a template parameter,
+ * FastPin<PIN> resolves the port and bit mask at compile time, so a write
+ * is a single sbi/cbi instruction.
+ *
+ * The pin mapping is the ATmega328P's (Uno, Nano, Pro Mini).  On other
+ * boards FastPin falls back to digitalWrite(), and RuntimePin works
+ * anywhere, with the port and mask looked up once instead of every call.
+ */
+#ifndef FAST_PIN_H
+#define FAST_PIN_H
+
+#include <Arduino.h>
+
+/*! @def FAST_PIN_DIRECT
+ *  Set if FastPin knows this chip's pin mapping and writes the port
+ *  registers directly.*/
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__)
+#define FAST_PIN_DIRECT 1
+#else
+#define FAST_PIN_DIRECT 0
+#endif
+
+/*!
+ * @enum fast_port
+ *
+ * @brief The GPIO ports of the ATmega328P
+ */
+enum fast_port{
+  FAST_PORT_NONE = 0,  ///<mapping unknown, see FAST_PIN_DIRECT
+  FAST_PORT_B,         ///<digital pins 8 to 13
+  FAST_PORT_C,         ///<analog pins A0 to A5 (digital 14 to 19)
+  FAST_PORT_D          ///<digital pins 0 to 7
+};
+
+#if FAST_PIN_DIRECT
+/*!
+ * @param port  one of fast_port, other than FAST_PORT_NONE
+ *
+ * @return the output register of port.  With a constant port, this folds
+ *         to the register's address.
+ */
+inline volatile uint8_t & fast_port_output(unsigned char port){
+  return port == FAST_PORT_B ? PORTB : (port == FAST_PORT_C ? PORTC : PORTD);
+}
+
+/*!
+ * @param port  one of fast_port, other than FAST_PORT_NONE
+ *
+ * @return the input register of port
+ */
+inline volatile uint8_t & fast_port_input(unsigned char port){
+  return port == FAST_PORT_B ? PINB : (port == FAST_PORT_C ? PINC : PIND);
+}
+#endif
+
+/*!
+ * @return TRUE if pin is one of the pins after it
+ */
+constexpr bool pin_in(unsigned char pin){
+  return false;
+}
+template <class... Pins>
+constexpr bool pin_in(unsigned char pin, unsigned char first, Pins... rest){
+  return pin == first || pin_in(pin, rest...);
+}
+
+/*!
+ * @return TRUE if no pin is given twice, for static_asserts on pin lists
+ */
+constexpr bool pins_distinct(){
+  return true;
+}
+template <class... Pins>
+constexpr bool pins_distinct(unsigned char first, Pins... rest){
+  return !pin_in(first, rest...) && pins_distinct(rest...);
+}
+
+/*!
+ * @class FastPin
+ *
+ * @brief One digital pin, resolved to a port and bit mask at compile time
+ *
+ * Usage:<pre>
+ *    typedef FastPin<13> led;
+ *    led::set_output();
+ *    led::write(true);</pre>
+ *
+ * @tparam PIN  Arduino digital pin number
+ */
+template <unsigned char PIN>
+class FastPin{
+  static_assert(PIN < NUM_DIGITAL_PINS, "no such pin on this board");
+
+public:
+  /*!
+   * @return one of fast_port
+   */
+  static constexpr unsigned char get_port(){
+    return !FAST_PIN_DIRECT ? FAST_PORT_NONE :
+           (PIN < 8 ? FAST_PORT_D : (PIN < 14 ? FAST_PORT_B : FAST_PORT_C));
+  }
+  /*!
+   * @return the pin's bit in its port
+   */
+  static constexpr unsigned char get_mask(){
+    return (unsigned char)(1 << (PIN < 8 ? PIN : (PIN < 14 ? PIN - 8 : PIN - 14)));
+  }
+  /*!
+   * @return the pin's bit if it is on port, zero otherwise
+   */
+  static constexpr unsigned char get_mask_on(unsigned char port){
+    return get_port() == port && port != FAST_PORT_NONE ? get_mask() : 0;
+  }
+  static void set_output(){
+    pinMode(PIN, OUTPUT);
+  }
+  static void set_input(){
+    pinMode(PIN, INPUT);
+  }
+  static void write(bool high){
+#if FAST_PIN_DIRECT
+    // one bit of an I/O register: sbi/cbi, which interrupts can't split
+    if(high)
+      fast_port_output(get_port()) |= get_mask();
+    else
+      fast_port_output(get_port()) &= (unsigned char)~get_mask();
+#else
+    digitalWrite(PIN, high ? HIGH : LOW);
+#endif
+  }
+  static bool read(){
+#if FAST_PIN_DIRECT
+    return (fast_port_input(get_port()) & get_mask()) != 0;
+#else
+    return digitalRead(PIN) == HIGH;
+#endif
+  }
+};
+
+/*!
+ * @class RuntimePin
+ *
+ * @brief One digital pin chosen at run time, for when the pin isn't known
+ *        at compile time or FastPin doesn't know the board.  The port and
+ *        mask are looked up once, in the constructor.
+ */
+class RuntimePin{
+private:
+  volatile uint8_t * output;  ///<the pin's output register
+  volatile uint8_t * input;   ///<the pin's input register
+  unsigned char mask;         ///<the pin's bit
+  unsigned char pin;          ///<Arduino pin number, for pinMode()
+
+public:
+  RuntimePin(unsigned char pin){
+    this->pin = pin;
+    this->output = portOutputRegister(digitalPinToPort(pin));
+    this->input = portInputRegister(digitalPinToPort(pin));
+    this->mask = digitalPinToBitMask(pin);
+  }
+  void set_output(){
+    pinMode(pin, OUTPUT);
+  }
+  void set_input(){
+    pinMode(pin, INPUT);
+  }
+  void write(bool high){
+    // read-modify-write through a pointer: keep interrupts out of it
+    unsigned char sreg = SREG;
+    cli();
+    if(high)
+      *output |= mask;
+    else
+      *output &= (unsigned char)~mask;
+    SREG = sreg;
+  }
+  bool read(){
+    return (*input & mask) != 0;
+  }
+};
+
+#endif
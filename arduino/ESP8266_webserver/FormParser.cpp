@@ -0,0 +1,239 @@
+/*!
+ * @file FormParser.cpp
+ * 
+ * @brief Incremental parser for HTTP form bodies
+ * 
+ */
+#include "FormParser.h"
+
+/*!
+ * @brief value of a hex digit, or 0xFF if it isn't one
+ */
+static unsigned char hex_value(char c){
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return 0xFF;
+}
+
+
+/*!
+ * @brief Constructor - call begin() before feeding anything
+ */
+FormParser::FormParser(){
+  this->fields = NULL;
+  this->field_count = 0;
+  this->remaining = 0;
+  this->valid = false;
+}
+
+
+/*!
+ * @brief Start parsing a new body.  Every field's value is cleared.
+ * 
+ * @param fields          PROGMEM table of where to put the values; the buffers must stay put until the body is parsed
+ * @param field_count     number of entries in fields
+ * @param content_length  number of bytes in the body
+ */
+void FormParser::begin(const form_field * fields, unsigned char field_count, unsigned int content_length){
+  this->fields = fields;
+  this->field_count = field_count;
+  this->remaining = content_length;
+  this->state = FORM_NAME;
+  this->name_length = 0;
+  this->field = FORM_NO_FIELD;
+  this->value_length = 0;
+  this->valid = true;
+  for(unsigned char i = 0; i < field_count; i++){
+    if(pgm_read_byte(&fields[i].size) > 0)
+      field_value(i)[0] = '\0';
+  }
+  if(remaining == 0)
+    finish();
+}
+
+
+/*!
+ * @return the value buffer of a field in the table
+ */
+char * FormParser::field_value(unsigned char index){
+  return (char *)pgm_read_word(&fields[index].value);
+}
+
+
+/*!
+ * @brief Look up the name just read, and start filling in its field
+ */
+void FormParser::find_field(){
+  field = FORM_NO_FIELD;
+  value_length = 0;
+  if(name_length > FORM_MAX_NAME_LEN)
+    return;
+  name[name_length] = '\0';
+  for(unsigned char i = 0; i < field_count; i++){
+    if(strcmp_P(name, (PGM_P)pgm_read_word(&fields[i].name)) == 0){
+      field = i;
+      field_value(i)[0] = '\0';
+      return;
+    }
+  }
+}
+
+
+/*!
+ * @brief Add a decoded character to the field being filled in
+ */
+void FormParser::append(char c){
+  if(field == FORM_NO_FIELD)
+    return;
+  if(c == '\0' || value_length + 1 >= pgm_read_byte(&fields[field].size)){
+    valid = false;
+    return;
+  }
+  char * value = field_value(field);
+  value[value_length++] = c;
+  value[value_length] = '\0';
+}
+
+
+/*!
+ * @brief The body is over - it must not end in the middle of something
+ */
+void FormParser::finish(){
+  if(state == FORM_PERCENT_HIGH || state == FORM_PERCENT_LOW ||
+     state == FORM_QUOTED || state == FORM_QUOTED_ESCAPE || state == FORM_LIST_NEXT)
+    valid = false;
+}
+
+
+/*!
+ * @brief Feed the next byte of the body.  Bytes past Content-Length are ignored.
+ */
+void FormParser::feed(char c){
+  if(remaining == 0)
+    return;
+  remaining--;
+
+  switch(state){
+    case FORM_NAME:
+      if(c == '='){
+        find_field();
+        state = FORM_VALUE_START;
+      } else if(c == '&'){
+        name_length = 0;
+      } else if(c != '\r' && c != '\n'){
+        if(name_length < FORM_MAX_NAME_LEN)
+          name[name_length++] = c;
+        else
+          name_length = FORM_MAX_NAME_LEN + 1; //too long to match anything
+      }
+      break;
+
+    case FORM_VALUE_START:
+      if(c == '"'){
+        state = FORM_QUOTED;
+        break;
+      }
+      state = FORM_VALUE;
+      // fall through - the first character of a plain value
+    case FORM_VALUE:
+      if(c == '&'){
+        name_length = 0;
+        state = FORM_NAME;
+      } else if(c == '%'){
+        return_state = FORM_VALUE;
+        state = FORM_PERCENT_HIGH;
+      } else if(c == '+'){
+        append(' ');
+      } else if(c != '\r' && c != '\n'){
+        append(c);
+      }
+      break;
+
+    case FORM_PERCENT_HIGH:
+      percent_high = hex_value(c);
+      if(percent_high == 0xFF)
+        valid = false;
+      state = FORM_PERCENT_LOW;
+      break;
+
+    case FORM_PERCENT_LOW:
+      if(hex_value(c) == 0xFF || percent_high == 0xFF)
+        valid = false;
+      else
+        append((percent_high << 4) | hex_value(c));
+      state = return_state;
+      break;
+
+    case FORM_QUOTED:
+      if(c == '"')
+        state = FORM_AFTER_QUOTE;
+      else if(c == '\\')
+        state = FORM_QUOTED_ESCAPE;
+      else
+        append(c);
+      break;
+
+    case FORM_QUOTED_ESCAPE:
+      append(c);
+      state = FORM_QUOTED;
+      break;
+
+    case FORM_AFTER_QUOTE:
+      if(c == ','){
+        // the next quoted string goes to the next field in the table
+        if(field != FORM_NO_FIELD && field + 1 < field_count){
+          field++;
+          field_value(field)[0] = '\0';
+        } else {
+          field = FORM_NO_FIELD;
+        }
+        value_length = 0;
+        state = FORM_LIST_NEXT;
+      } else if(c == '&'){
+        name_length = 0;
+        state = FORM_NAME;
+      } else if(c != '\r' && c != '\n'){
+        valid = false;
+      }
+      break;
+
+    case FORM_LIST_NEXT:
+      if(c == '"')
+        state = FORM_QUOTED;
+      else if(c != ' ')
+        valid = false;
+      break;
+  }
+
+  if(remaining == 0)
+    finish();
+}
+
+
+/*!
+ * @brief Feed the next piece of the body
+ * 
+ * @param data    the bytes, need not be null-terminated
+ * @param length  number of bytes
+ */
+void FormParser::feed(const char * data, unsigned int length){
+  for(unsigned int i = 0; i < length && remaining > 0; i++)
+    feed(data[i]);
+}
+
+
+/*!
+ * @return TRUE once Content-Length bytes have been fed
+ */
+bool FormParser::is_complete(){
+  return remaining == 0;
+}
+
+
+/*!
+ * @return TRUE if the body so far was well-formed and every value fit
+ */
+bool FormParser::is_valid(){
+  return valid;
+}
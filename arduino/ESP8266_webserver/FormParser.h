@@ -0,0 +1,108 @@
+/*!
+ * @file FormParser.h
+ * 
+ * @brief Incremental parser for HTTP form bodies
+ * 
+ */
+#ifndef FORM_PARSER_H
+#define FORM_PARSER_H
+
+#include <Arduino.h>
+
+/*! @def FORM_MAX_NAME_LEN
+ *  Longest field name the parser keeps track of.  Longer names can't 
+ *  match any field, so their values are skipped.*/
+#define FORM_MAX_NAME_LEN 8
+
+/*! @def FORM_NO_FIELD
+ *  Field index used while skipping the value of an unknown field.*/
+#define FORM_NO_FIELD 0xFF
+
+/*! 
+ * @struct form_field
+ * 
+ * @brief Where the parser puts the value of one field.  The table of 
+ *        fields is kept in PROGMEM; only the value buffers are in RAM.
+ */
+struct form_field{
+  PGM_P name;          ///<PROGMEM field name, at most FORM_MAX_NAME_LEN characters
+  char * value;        ///<buffer for the decoded, null-terminated value
+  unsigned char size;  ///<size of the buffer, including the null terminator
+};
+
+/*! 
+ * @enum form_state
+ * 
+ * @brief Where the parser is within the body
+ */
+enum form_state{
+  FORM_NAME = 0,      ///<reading a field name
+  FORM_VALUE_START,   ///<just read '=' - the value may be quoted
+  FORM_VALUE,         ///<reading a urlencoded value
+  FORM_PERCENT_HIGH,  ///<read '%', expecting the first hex digit
+  FORM_PERCENT_LOW,   ///<expecting the second hex digit
+  FORM_QUOTED,        ///<inside a quoted value
+  FORM_QUOTED_ESCAPE, ///<read '\' inside a quoted value
+  FORM_AFTER_QUOTE,   ///<read the closing '"'
+  FORM_LIST_NEXT      ///<read ',' after a quoted value, expecting the next '"'
+};
+
+/*!
+ * @class FormParser
+ * 
+ * @brief Fills in fields from an HTTP form body, a byte at a time
+ * 
+ * Understands application/x-www-form-urlencoded bodies:
+ * <pre>
+ *   ssid__=my%20network&paswrd=p%26ss
+ * </pre>
+ * and the older quoted-list form the config page used to send, where 
+ * each quoted string goes to the named field and then the fields after 
+ * it in the table:
+ * <pre>
+ *   ssid__="my network","p&ss"
+ * </pre>
+ * Nothing is buffered but the current field name, so the body can be fed
+ * in whatever pieces it arrives in.  The body is over once Content-Length
+ * bytes have been fed.  Values that don't fit their buffer make the form 
+ * invalid rather than being silently cut short.
+ * 
+ * Usage:<pre>
+ *    char ssid[33], password[33];
+ *    const form_field fields[] PROGMEM = {{field_name_ssid, ssid, sizeof(ssid)},
+ *                                         {field_name_password, password, sizeof(password)}};
+ *    FormParser form;
+ *    form.begin(fields, 2, content_length);
+ *    while(!form.is_complete())
+ *      form.feed(next_piece, next_piece_length);
+ *    if(form.is_valid()) ...</pre>
+ */
+class FormParser{
+private:
+  const form_field * fields;      ///<caller's PROGMEM field table
+  unsigned char field_count;      ///<number of entries in the table
+  unsigned int remaining;         ///<body bytes not fed yet
+  unsigned char state;            ///<one of form_state
+  unsigned char return_state;     ///<state to go back to after a %XX escape
+  char name[FORM_MAX_NAME_LEN+1]; ///<field name read so far
+  unsigned char name_length;      ///<characters in name
+  unsigned char field;            ///<index of the field being filled, or FORM_NO_FIELD
+  unsigned char value_length;     ///<characters written to the field so far
+  unsigned char percent_high;     ///<first hex digit of a %XX escape
+  bool valid;                     ///<false once anything went wrong
+
+  char * field_value(unsigned char index);
+  void find_field();
+  void append(char c);
+  void finish();
+
+public:
+  FormParser();
+  void begin(const form_field * fields, unsigned char field_count, unsigned int content_length);
+  void feed(char c);
+  void feed(const char * data, unsigned int length);
+  bool is_complete();
+  bool is_valid();
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*!
+ * @file IrReceiver.cpp
+ *
+ * @brief NEC infrared remote decoder, driven by pin change interrupts
+ *
+ */
+#include "IrReceiver.h"
+
+/*!
+ * @enum ir_state
+ *
+ * @brief Where the decoder is in a frame
+ */
+enum ir_state{
+  IR_IDLE,    ///<waiting for a leader mark
+  IR_LEADER,  ///<leader mark seen, its space tells a frame from a repeat
+  IR_DATA     ///<receiving bits
+};
+
+/*! @var active_receiver
+ *  The instance the pin change interrupt feeds, see IrReceiver::begin().*/
+static IrReceiver * active_receiver = NULL;
+
+/*!
+ * @brief Pin change on IR_RECEIVER_PIN's port: a mark or space ended.
+ */
+ISR(IR_RECEIVER_VECT){
+  active_receiver->on_pin_change();
+}
+
+
+/*!
+ * @brief Constructor - the pin is left alone until begin()
+ */
+IrReceiver::IrReceiver(){
+  this->last_edge_us = 0;
+  this->code = 0;
+  this->bits = 0;
+  this->state = IR_IDLE;
+  this->level_high = true;
+  this->ready = IR_FRAME_NONE;
+  this->ready_code = 0;
+}
+
+
+/*!
+ * @brief Start listening: enable the pin change interrupt of
+ *        IR_RECEIVER_PIN.
+ */
+void IrReceiver::begin(){
+  pinMode(IR_RECEIVER_PIN, INPUT_PULLUP);
+  unsigned char sreg = SREG;
+  cli();
+  active_receiver = this;
+  last_edge_us = micros();
+  *digitalPinToPCMSK(IR_RECEIVER_PIN) |= _BV(digitalPinToPCMSKbit(IR_RECEIVER_PIN));
+  PCIFR = _BV(digitalPinToPCICRbit(IR_RECEIVER_PIN));
+  *digitalPinToPCICR(IR_RECEIVER_PIN) |= _BV(digitalPinToPCICRbit(IR_RECEIVER_PIN));
+  SREG = sreg;
+}
+
+
+/*!
+ * @brief Take the newest frame
+ *
+ * @param frame  filled in if there is one
+ *
+ * @return FALSE if nothing arrived since the last call
+ */
+bool IrReceiver::read(ir_frame * frame){
+  unsigned char sreg = SREG;
+  cli();
+  frame->type = ready;
+  frame->code = ready_code;
+  ready = IR_FRAME_NONE;
+  SREG = sreg;
+  return frame->type != IR_FRAME_NONE;
+}
+
+
+/*!
+ * @brief The carrier stopped.  A leader mark starts a frame from
+ *        anywhere; the mark after the last bit ends it.
+ *
+ * @param length_us  how long the mark was
+ */
+void IrReceiver::mark_ended(unsigned long length_us){
+  if(length_us >= IR_LEADER_MARK_MIN_US && length_us <= IR_LEADER_MARK_MAX_US){
+    state = IR_LEADER;
+  } else if(state != IR_DATA || length_us > IR_BIT_MARK_MAX_US){
+    state = IR_IDLE;
+  } else if(bits == IR_NEC_BITS){
+    ready_code = code;
+    ready = IR_FRAME_CODE;
+    state = IR_IDLE;
+  }
+}
+
+
+/*!
+ * @brief The carrier started again.  After the leader, the space says
+ *        whether a frame or a repeat code follows; within a frame, it is
+ *        the value of a bit.
+ *
+ * @param length_us  how long the space was
+ */
+void IrReceiver::space_ended(unsigned long length_us){
+  if(state == IR_LEADER){
+    if(length_us >= IR_DATA_SPACE_MIN_US && length_us <= IR_LEADER_SPACE_MAX_US){
+      code = 0;
+      bits = 0;
+      state = IR_DATA;
+    } else {
+      if(length_us >= IR_REPEAT_SPACE_MIN_US && length_us < IR_DATA_SPACE_MIN_US)
+        ready = IR_FRAME_REPEAT;
+      state = IR_IDLE;
+    }
+  } else if(state == IR_DATA){
+    if(length_us > IR_BIT_SPACE_MAX_US || bits >= IR_NEC_BITS){
+      state = IR_IDLE;
+      return;
+    }
+    code = (code << 1) | (length_us >= IR_ONE_SPACE_MIN_US ? 1 : 0);
+    bits++;
+  }
+}
+
+
+/*!
+ * @brief Called from the pin change interrupt.  Other pins of the port
+ *        raise it too, and are told apart by the level not changing.
+ */
+void IrReceiver::on_pin_change(){
+  bool high = FastPin<IR_RECEIVER_PIN>::read();
+  if(high == level_high)
+    return;
+  level_high = high;
+  unsigned long now = micros();
+  unsigned long length_us = now - last_edge_us;
+  last_edge_us = now;
+  if(high)
+    mark_ended(length_us);
+  else
+    space_ended(length_us);
+}
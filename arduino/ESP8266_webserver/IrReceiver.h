@@ -0,0 +1,114 @@
+/*!
+ * @file IrReceiver.h
+ *
+ * @brief NEC infrared remote decoder, driven by pin change interrupts
+ *
+ */
+#ifndef IR_RECEIVER_H
+#define IR_RECEIVER_H
+
+#include <Arduino.h>
+#include "FastPin.h"
+
+/*! @def IR_RECEIVER_PIN
+ *  Output of the IR receiver module (idle high, low while it sees the
+ *  carrier).  Any pin works, since no timer is involved.*/
+#define IR_RECEIVER_PIN A0
+/*! @def IR_RECEIVER_VECT
+ *  Pin change interrupt of IR_RECEIVER_PIN's port: PCINT0_vect for pins
+ *  8 to 13, PCINT1_vect for A0 to A5, PCINT2_vect for 0 to 7.*/
+#define IR_RECEIVER_VECT PCINT1_vect
+static_assert(digitalPinToPCICRbit(IR_RECEIVER_PIN) == 1,
+              "IR_RECEIVER_VECT must be the pin change interrupt of IR_RECEIVER_PIN");
+
+/*! @def IR_NEC_BITS
+ *  Bits in a NEC frame: address, inverted address, command, inverted
+ *  command.*/
+#define IR_NEC_BITS 32
+/*! @def IR_LEADER_MARK_MIN_US
+ *  Shortest 9 ms leader mark taken as one.*/
+#define IR_LEADER_MARK_MIN_US 7000
+/*! @def IR_LEADER_MARK_MAX_US
+ *  Longest 9 ms leader mark taken as one.*/
+#define IR_LEADER_MARK_MAX_US 11000
+/*! @def IR_DATA_SPACE_MIN_US
+ *  The leader is followed by 4.5 ms of space before a frame...*/
+#define IR_DATA_SPACE_MIN_US 3500
+/*! @def IR_REPEAT_SPACE_MIN_US
+ *  ...or by 2.25 ms before a repeat code, sent every 108 ms while a button
+ *  is held.*/
+#define IR_REPEAT_SPACE_MIN_US 1800
+/*! @def IR_LEADER_SPACE_MAX_US
+ *  Longest space after the leader.*/
+#define IR_LEADER_SPACE_MAX_US 5500
+/*! @def IR_BIT_MARK_MAX_US
+ *  Every bit starts with a 562 us mark.*/
+#define IR_BIT_MARK_MAX_US 900
+/*! @def IR_ONE_SPACE_MIN_US
+ *  A 0 is followed by 562 us of space, a 1 by 1687 us.*/
+#define IR_ONE_SPACE_MIN_US 1100
+/*! @def IR_BIT_SPACE_MAX_US
+ *  Longest space within a frame.*/
+#define IR_BIT_SPACE_MAX_US 2200
+
+/*!
+ * @enum ir_frame_type
+ *
+ * @brief What the remote sent
+ */
+enum ir_frame_type{
+  IR_FRAME_NONE,    ///<nothing new
+  IR_FRAME_CODE,    ///<a button was pressed, see ir_frame::code
+  IR_FRAME_REPEAT   ///<the last button is still held
+};
+
+/*!
+ * @struct ir_frame
+ *
+ * @brief A decoded frame
+ */
+struct ir_frame{
+  unsigned char type;  ///<one of ir_frame_type
+  unsigned long code;  ///<the 32 bits, first received in the high bit (as IRremote reports them)
+};
+
+/*!
+ * @class IrReceiver
+ *
+ * @brief Decodes the NEC remote protocol in the background
+ *
+ * Every timer is taken (millis(), AltSoftSerial, PulseEngine), so unlike
+ * IRremote this needs none: each edge on IR_RECEIVER_PIN raises a pin
+ * change interrupt, which times the mark or space that just ended with
+ * micros() and moves the decoder along.  A few microseconds per edge, and
+ * nothing runs between frames.  The newest frame waits for read(); frames
+ * come at least 40 ms apart, so polling from a task is plenty.
+ *
+ * Usage:<pre>
+ *    IrReceiver ir;
+ *    ir.begin();
+ *    ir_frame frame;
+ *    if(ir.read(&frame) && frame.type == IR_FRAME_CODE)
+ *      Serial.println(frame.code, HEX);</pre>
+ */
+class IrReceiver{
+private:
+  unsigned long last_edge_us;       ///<micros() at the last edge
+  unsigned long code;               ///<bits of the frame being received
+  unsigned char bits;               ///<bits received so far
+  unsigned char state;              ///<one of ir_state, in IrReceiver.cpp
+  bool level_high;                  ///<level of the pin after the last edge
+  volatile unsigned char ready;     ///<one of ir_frame_type, for read()
+  volatile unsigned long ready_code;///<code of the frame for read()
+
+  void mark_ended(unsigned long length_us);
+  void space_ended(unsigned long length_us);
+
+public:
+  IrReceiver();
+  void begin();
+  bool read(ir_frame * frame);
+  void on_pin_change();
+};
+
+#endif
@@ -0,0 +1,81 @@
+/*!
+ * @file MemoryGuard.cpp
+ * 
+ * @brief Keeps the heap out of the build, and measures how close the 
+ *        stack has come to the static data.
+ * 
+ * Every object in the firmware is a global (or lives in one), so the RAM
+ * above .bss belongs to the stack alone.  On a 2 KB AVR, a heap in there 
+ * would grow into the stack with no warning, so there is none: the 
+ * allocator is replaced by functions that refer to a symbol which is 
+ * never defined.  They are dropped by --gc-sections as long as nothing
+ * calls them - and if anything does (new, String, strdup...), the link 
+ * fails with an undefined reference to heap_allocation_is_not_allowed.
+ */
+#include "MemoryGuard.h"
+
+extern char _end;  ///<end of .data and .bss, from the linker script
+
+/*!
+ * Never defined: referencing it is what fails the link.
+ */
+extern "C" void heap_allocation_is_not_allowed();
+
+extern "C" void * malloc(size_t size){
+  heap_allocation_is_not_allowed();
+  return NULL;
+}
+
+extern "C" void * calloc(size_t count, size_t size){
+  heap_allocation_is_not_allowed();
+  return NULL;
+}
+
+extern "C" void * realloc(void * pointer, size_t size){
+  heap_allocation_is_not_allowed();
+  return NULL;
+}
+
+extern "C" void free(void * pointer){
+  heap_allocation_is_not_allowed();
+}
+
+
+/*!
+ * @brief Fills the RAM between the static data and the stack with 
+ *        STACK_PAINT_BYTE.
+ * 
+ * Runs from .init3: the stack pointer is set up, nothing has been pushed
+ * yet, and no constructor has run.  Being naked, it falls through to the
+ * next init section instead of returning.
+ */
+void paint_stack() __attribute__((naked, used, section(".init3")));
+void paint_stack(){
+  unsigned char * p = (unsigned char *)&_end;
+  while(p < (unsigned char *)SP)
+    *p++ = STACK_PAINT_BYTE;
+}
+
+
+/*!
+ * @brief The worst-case stack margin since boot
+ * 
+ * @return bytes above the static data that the stack has never reached
+ */
+unsigned int get_stack_margin(){
+  const unsigned char * p = (const unsigned char *)&_end;
+  unsigned int margin = 0;
+  while(p < (const unsigned char *)SP && *p == STACK_PAINT_BYTE){
+    p++;
+    margin++;
+  }
+  return margin;
+}
+
+
+/*!
+ * @return bytes between the static data and the stack right now
+ */
+unsigned int get_free_ram(){
+  return SP - (uintptr_t)&_end;
+}
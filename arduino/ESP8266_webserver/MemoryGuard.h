@@ -0,0 +1,40 @@
+/*!
+ * @file MemoryGuard.h
+ * 
+ * @brief Keeps the heap out of the build, and measures how close the 
+ *        stack has come to the static data.
+ * 
+ */
+#ifndef MEMORY_GUARD_H
+#define MEMORY_GUARD_H
+
+#include <Arduino.h>
+
+/*! @def STACK_PAINT_BYTE
+ *  At boot, the RAM between the static data and the stack is filled with
+ *  this.  Whatever still holds it has never been used by the stack.*/
+#define STACK_PAINT_BYTE 0xC5
+/*! @def RAM_SIZE
+ *  Bytes of internal RAM, from the device header: 2048 on an ATmega328P.*/
+#define RAM_SIZE (RAMEND - RAMSTART + 1)
+/*! @def STACK_RESERVE
+ *  RAM the static data has to leave to the stack.  Counted by hand, the
+ *  deepest path is a /metrics line being generated into a transmit chunk:
+ *  about 160 bytes of frames and line buffers, with up to 25 more for an
+ *  interrupt on top.  Compare it with stack_margin in /metrics on the 
+ *  board.*/
+#define STACK_RESERVE 192
+/*! @def CORE_STATIC_RAM
+ *  Static RAM of the Arduino core that the sketch can't take the sizeof
+ *  of: the millis() counters (9 bytes) and the vtables, which avr-gcc 
+ *  keeps in RAM (about 90).*/
+#define CORE_STATIC_RAM 100
+/*! @def ALTSOFTSERIAL_STATIC_RAM
+ *  AltSoftSerial's ring buffers and state, which are file statics of the
+ *  library.*/
+#define ALTSOFTSERIAL_STATIC_RAM 162
+
+unsigned int get_stack_margin();
+unsigned int get_free_ram();
+
+#endif
@@ -1,15 +1,14 @@
 /*!
- * @file OutputQueue.h
+ * @file OutputQueue.cpp
  * 
  * @brief Helper Class to hold ESP8266 class serial output data
  * 
  *    
  */
  #include "OutputQueue.h"
- #include <Arduino.h>
 
 /*! 
- * Holds pointers to strings, their sizes, and a tally of the sizes
+ * Holds descriptors of strings, their sizes, and a tally of the sizes
  * of all of the strings that need to be outputted.
  * 
  * (see header file for usage)
@@ -20,7 +19,28 @@ OutputQueue::OutputQueue(){
 
 
 /*!
- * Add an element to this queue.
+ * Claims the next free slot in the ring and accounts for its size.
+ * 
+ * @param string_len
+ *        number of bytes the new element will output
+ *        
+ * @return pointer to the claimed element, or NULL if the queue is full
+ */
+string_element * OutputQueue::next_free_element(unsigned int string_len){
+  if(queue_len >= MAX_OUTPUT_QUEUE_LENGTH){
+    Serial.println(F("| OutputQueue: Max output queue length exceeded! Check your code!"));
+    return NULL;
+  }
+  string_element * element = &queue[(queue_head + queue_len) % MAX_OUTPUT_QUEUE_LENGTH];
+  element->string_length = string_len;
+  total_size += string_len;  //tally up size of referenced strings
+  queue_len++;
+  return element;
+}
+
+
+/*!
+ * Add a RAM or PROGMEM string to this queue.
  * 
  * @param string
  *        pointer to the string to be written
@@ -30,19 +50,121 @@ OutputQueue::OutputQueue(){
  *        
  * @param is_progmem
  *        set to true if this is a progmem string
+ *        
+ * @return TRUE if the element was queued, FALSE if the queue is full
  */
-void OutputQueue::add_element(char * string, unsigned int string_len, bool is_progmem){
-  if(queue_len >= MAX_OUTPUT_QUEUE_LENGTH){
-    Serial.println(F("| OutputQueue::add_element: Max output queue length exceeded! Check your code!"));
-  }else if(read_position != 0){
-    Serial.println(F("| OutputQueue::add_element: Cannot add elements to an output queue that's partially read!"));
-  }else{
-    queue[queue_len].pointer = string;
-    queue[queue_len].string_length = string_len;
-    queue[queue_len].is_progmem = is_progmem;
-    total_size += string_len;  //tally up size of referenced strings
-    queue_len++;
+bool OutputQueue::add_element(char * string, unsigned int string_len, bool is_progmem){
+  if(is_progmem)
+    return add_progmem(string, string_len);
+  return add_ram(string, string_len);
+}
+
+
+/*!
+ * Add a string stored in RAM.  The string must stay put until it is read.
+ * 
+ * @param string
+ *        pointer to the string to be written
+ * @param string_len
+ *        length of string to be written
+ *        
+ * @return TRUE if the element was queued, FALSE if the queue is full
+ */
+bool OutputQueue::add_ram(const char * string, unsigned int string_len){
+  string_element * element = next_free_element(string_len);
+  if(element == NULL)
+    return false;
+  element->type = SEGMENT_RAM;
+  element->pointer = string;
+  return true;
+}
+
+
+/*!
+ * Add a string stored in PROGMEM.
+ * 
+ * @param string
+ *        PROGMEM pointer to the string to be written
+ * @param string_len
+ *        length of string to be written
+ *        
+ * @return TRUE if the element was queued, FALSE if the queue is full
+ */
+bool OutputQueue::add_progmem(PGM_P string, unsigned int string_len){
+  string_element * element = next_free_element(string_len);
+  if(element == NULL)
+    return false;
+  element->type = SEGMENT_PROGMEM;
+  element->pointer = string;
+  return true;
+}
+
+
+/*!
+ * Add a small value by copying it into the queue itself, so the caller's 
+ * copy does not need to outlive this call.
+ * 
+ * @param string
+ *        pointer to the characters to be copied
+ * @param string_len
+ *        number of characters, at most INLINE_SEGMENT_SIZE
+ *        
+ * @return TRUE if the element was queued, FALSE if the queue is full or 
+ *         the value is too long
+ */
+bool OutputQueue::add_inline(const char * string, unsigned int string_len){
+  if(string_len > INLINE_SEGMENT_SIZE){
+    Serial.println(F("| OutputQueue::add_inline: value too long for an inline element!"));
+    return false;
   }
+  string_element * element = next_free_element(string_len);
+  if(element == NULL)
+    return false;
+  element->type = SEGMENT_INLINE;
+  memcpy(element->inline_data, string, string_len);
+  return true;
+}
+
+
+/*!
+ * Add the decimal representation of a number as an inline element.
+ * 
+ * @param value
+ *        the number to output
+ *        
+ * @return TRUE if the element was queued, FALSE if the queue is full
+ */
+bool OutputQueue::add_unsigned(unsigned int value){
+  char digits[INLINE_SEGMENT_SIZE];
+  unsigned char position = INLINE_SEGMENT_SIZE;
+  do{
+    digits[--position] = '0' + (value % 10);
+    value /= 10;
+  }while(value != 0 && position > 0);
+  return add_inline(&digits[position], INLINE_SEGMENT_SIZE - position);
+}
+
+
+/*!
+ * Add an element whose bytes are produced by a callback as they are read.
+ * 
+ * @param function
+ *        the callback producing the bytes (see segment_generator)
+ * @param context
+ *        passed back to the callback untouched
+ * @param string_len
+ *        exact number of bytes the callback will produce
+ *        
+ * @return TRUE if the element was queued, FALSE if the queue is full
+ */
+bool OutputQueue::add_generator(segment_generator function, void * context, unsigned int string_len){
+  string_element * element = next_free_element(string_len);
+  if(element == NULL)
+    return false;
+  element->type = SEGMENT_GENERATOR;
+  element->generator.function = function;
+  element->generator.context = context;
+  return true;
 }
 
 
@@ -51,6 +173,7 @@ void OutputQueue::add_element(char * string, unsigned int string_len, bool is_pr
  */
 void OutputQueue::clear_elements(){
   //no need to actually erase the data, just reset list position
+  queue_head = 0;
   queue_len = 0;
   read_position = 0;
   total_size = 0;
@@ -58,33 +181,107 @@ void OutputQueue::clear_elements(){
 
 
 /*!
- * returns false if none are available.
- * resets the queue and returns false when there is nothing left to read
+ * Copies the next bytes of the queue into output, crossing element 
+ * boundaries as needed.  Elements are released as soon as they are 
+ * fully read, so their slots can be reused by new elements.
  * 
  * @param output
- *        A pointer to the data field to which we'll copy the next field. 
+ *        buffer to which the bytes are copied
+ * @param output_size
+ *        maximum number of bytes to copy
  *        
- * @return TRUE of an element is available
+ * @return the number of bytes copied, zero once the queue is empty
  */
-bool OutputQueue::get_element(string_element * output){
-  if(read_position >= queue_len){
-    //nothing to read
-    this->clear_elements();
-    return false;
-  } else {
-    *output = queue[read_position];
-    read_position++;
+unsigned int OutputQueue::read(char * output, unsigned int output_size){
+  unsigned int copied = 0;
+  while(copied < output_size && queue_len > 0){
+    string_element * element = &queue[queue_head];
+    unsigned int wanted = element->string_length - read_position;
+    if(wanted > output_size - copied)
+      wanted = output_size - copied;
+
+    unsigned int produced = wanted;
+    switch(element->type){
+      case SEGMENT_PROGMEM:
+        memcpy_P(output + copied, element->pointer + read_position, wanted);
+        break;
+      case SEGMENT_INLINE:
+        memcpy(output + copied, element->inline_data + read_position, wanted);
+        break;
+      case SEGMENT_GENERATOR:
+        produced = element->generator.function(element->generator.context, read_position,
+                                                output + copied, wanted);
+        if(produced > wanted)
+          produced = wanted;
+        break;
+      default:
+        memcpy(output + copied, element->pointer + read_position, wanted);
+        break;
+    }
+    copied += produced;
+    read_position += produced;
+    total_size -= produced;
+
+    if(read_position >= element->string_length || produced == 0){
+      if(read_position < element->string_length){
+        // a generator came up short - account for the bytes it never made
+        Serial.println(F("| OutputQueue::read: generator ended early!"));
+        total_size -= element->string_length - read_position;
+      }
+      queue_head = (queue_head + 1) % MAX_OUTPUT_QUEUE_LENGTH;
+      queue_len--;
+      read_position = 0;
+    }
   }
-  return true;
+  if(queue_len == 0)
+    this->clear_elements();
+  return copied;
+}
+
+
+/*!
+ * Remembers the read position, see rewind().
+ * 
+ * @param position
+ *        filled in with the current read position
+ */
+void OutputQueue::mark(queue_mark * position){
+  position->queue_head = queue_head;
+  position->queue_len = queue_len;
+  position->read_position = read_position;
+  position->total_size = total_size;
+}
+
+
+/*!
+ * Goes back to a read position saved by mark(), so the bytes read since 
+ * then are read again.  Generators are simply asked for the same offsets
+ * again.  Elements must not have been added since the mark.
+ * 
+ * @param position
+ *        a read position from mark()
+ */
+void OutputQueue::rewind(const queue_mark & position){
+  queue_head = position.queue_head;
+  queue_len = position.queue_len;
+  read_position = position.read_position;
+  total_size = position.total_size;
 }
 
 
 /*!
- * Returns the sum of the lengths of the enqueued strings
+ * @return TRUE if there is nothing left to read
+ */
+bool OutputQueue::is_empty(){
+  return queue_len == 0;
+}
+
+
+/*!
+ * Returns the number of bytes left to be read, across all elements
  * 
- * @return the sum of the lengths of the strings in the output buffer.
+ * @return the sum of the unread lengths of the elements in the queue.
  */
 unsigned int OutputQueue::get_total_size(){
   return this->total_size;
 }
-
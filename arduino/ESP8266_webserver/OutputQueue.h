@@ -8,11 +8,46 @@
 #ifndef OUTPUT_QUEUE_H
 #define OUTPUT_QUEUE_H
 
+#include <Arduino.h>
 
 /*! @def MAX_OUTPUT_QUEUE_LENGTH
- *  My output queue is an array of pointers to elements of data I will output
- *  via the ESP8266 serial port.  Minimize this to save on class memory footprint.*/
-#define MAX_OUTPUT_QUEUE_LENGTH  20
+ *  My output queue is a ring of descriptors of data I will output via the 
+ *  ESP8266 serial port.  This is how many descriptors can be waiting to be
+ *  drained at once - drained slots are reused, so the total number of 
+ *  elements in a response is not limited.  Minimize this to save on class 
+ *  memory footprint: every transmit stream has a queue of its own.  The
+ *  longest response (a 206) takes 10.*/
+#define MAX_OUTPUT_QUEUE_LENGTH  10
+
+/*! @def INLINE_SEGMENT_SIZE
+ *  Small values (e.g. a Content-Length number) are copied into the queue
+ *  element itself, so they don't need a buffer of their own.  This is the 
+ *  most characters an inline element can hold.*/
+#define INLINE_SEGMENT_SIZE 6
+
+/*! 
+ * @typedef segment_generator
+ * 
+ * @brief Callback that produces element data on demand
+ * 
+ * Writes up to output_size bytes of the element, starting at offset, into 
+ * output.  Must return the number of bytes written, which may only be zero
+ * once offset has reached the length declared when the element was added.
+ */
+typedef unsigned int (*segment_generator)(void * context, unsigned int offset,
+                                          char * output, unsigned int output_size);
+
+/*! 
+ * @enum segment_type
+ * 
+ * @brief Where the data for an element in the output queue comes from
+ */
+enum segment_type{
+  SEGMENT_RAM,        ///<pointer to a string in RAM
+  SEGMENT_PROGMEM,    ///<pointer to a string in PROGMEM
+  SEGMENT_INLINE,     ///<small value stored in the element itself
+  SEGMENT_GENERATOR   ///<callback producing bytes on demand
+};
 
 /*! 
  * @struct string_element
@@ -21,52 +56,90 @@
  * 
  */
 struct string_element{
-  char * pointer;             ///<pointer to a string element
   unsigned int string_length; ///<length of the string element
-  bool is_progmem;            ///<true if the string element is stored in progmem
+  unsigned char type;         ///<one of segment_type
+  union{
+    const char * pointer;                   ///<SEGMENT_RAM and SEGMENT_PROGMEM data
+    char inline_data[INLINE_SEGMENT_SIZE];  ///<SEGMENT_INLINE data
+    struct{
+      segment_generator function;           ///<SEGMENT_GENERATOR callback
+      void * context;                       ///<passed back to the callback
+    } generator;
+  };
+};
+
+/*! 
+ * @struct queue_mark
+ * 
+ * @brief A read position in an OutputQueue, see OutputQueue::mark()
+ */
+struct queue_mark{
+  unsigned char queue_head;    ///<index of the element being read
+  unsigned char queue_len;     ///<number of elements left, including it
+  unsigned int read_position;  ///<bytes already read from it
+  unsigned int total_size;     ///<bytes left to read
 };
 
 /*!
  * @class OutputQueue
  * 
- * @brief Holds pointers to strings to be sent to the ESP serial port
+ * @brief Holds descriptors of data to be sent to the ESP serial port
  * 
- * Holds pointers to strings, their sizes, and a tally of the sizes
- * of all of the strings that need to be outputted.
+ * Holds pointers to strings (in RAM or PROGMEM), small inline values and
+ * generator callbacks, along with a tally of the number of bytes that 
+ * still need to be outputted.  That tally is exact, so it can be used
+ * for a Content-Length header before anything is sent.
  * 
  * This is a huge space saver compared to keeping an output buffer 
- * in dynamic memory, where it may topple your heap.  It's only 
- * dynamic memory usage is the compact array of pointers to strings 
- * and string lengths.
+ * in dynamic memory, where it may topple your heap.  Large or dynamic 
+ * responses can be streamed through a small buffer without ever being 
+ * fully materialized.
+ * 
+ * Elements may be added while the queue is being drained.
  * 
+ * A read position can be marked and rewound to, so a send that failed can
+ * be repeated.  Released elements are not erased, only their slots are 
+ * given back, so this works as long as nothing is added in between.
  *        
  * Usage:<pre>
  *    char string1[10] = "1234567890";
- *    char string2[3]  = "321";
  *    OutputQueue myqueue;
- *    myqueue.add_element(string1,sizeof(string1);
- *    myqueue.add_element(string2,sizeof(string2);
- *    //...etc, etc, up to max number of elements.
- *    string_element output;
- *    while(myqueue.get_element(&output)){
- *      my_method_to_use_the_output_strings(output);
+ *    myqueue.add_ram(string1,sizeof(string1));
+ *    myqueue.add_progmem(my_progmem_string,sizeof(my_progmem_string)-1);
+ *    myqueue.add_unsigned(myqueue.get_total_size());
+ *    //...etc, etc.
+ *    char chunk[16];
+ *    unsigned int n;
+ *    while((n = myqueue.read(chunk, sizeof(chunk))) > 0){
+ *      my_method_to_use_the_output_bytes(chunk, n);
  *    }</pre>
  *-----------------------------------------------------------------
  */
 class OutputQueue{
   private:
-  string_element queue[MAX_OUTPUT_QUEUE_LENGTH];  ///<A list of pointers to elements to output
-  unsigned int queue_len;                         ///<Number of elements in the queue
-  unsigned int read_position;                     ///<Index of most recently read element
-  unsigned int total_size;                        ///<Total number of characters in the buffer
+  string_element queue[MAX_OUTPUT_QUEUE_LENGTH];  ///<Ring of elements to output
+  unsigned char queue_head;                       ///<Index of the element being read
+  unsigned char queue_len;                        ///<Number of elements in the queue
+  unsigned int read_position;                     ///<Bytes already read from the head element
+  unsigned int total_size;                        ///<Number of characters left to output
+  string_element * next_free_element(unsigned int string_len);
 
   public:
   OutputQueue();
-  void add_element(char * string, unsigned int string_len, bool is_progmem);
-  //reset queue position and length. Automatic when you get the last element.
+  bool add_element(char * string, unsigned int string_len, bool is_progmem);
+  bool add_ram(const char * string, unsigned int string_len);
+  bool add_progmem(PGM_P string, unsigned int string_len);
+  bool add_inline(const char * string, unsigned int string_len);
+  bool add_unsigned(unsigned int value);
+  bool add_generator(segment_generator function, void * context, unsigned int string_len);
+  //reset queue position and length. Automatic when you read the last byte.
   void clear_elements();
-  //gets the element
-  bool get_element(string_element * output);//returns false if none are available.
+  //copies out up to output_size bytes, returns zero when the queue is empty.
+  unsigned int read(char * output, unsigned int output_size);
+  //remember the read position, to read the same bytes again after a failed send.
+  void mark(queue_mark * position);
+  void rewind(const queue_mark & position);
+  bool is_empty();
   unsigned int get_total_size();
 };
 
@@ -0,0 +1,321 @@
+/*!
+ * @file PulseEngine.cpp
+ *
+ * @brief Servo pulses and stepper steps, all timed by Timer2
+ *
+ */
+#include "PulseEngine.h"
+
+#if F_CPU == 16000000L
+#define PULSE_PRESCALER (_BV(CS22) | _BV(CS20))  ///< @def clk/128: 8 us ticks
+#elif F_CPU == 8000000L
+#define PULSE_PRESCALER _BV(CS22)                ///< @def clk/64: 8 us ticks
+#else
+#error "PulseEngine needs a 16 or 8 MHz clock"
+#endif
+
+/*! @var active_engine
+ *  The instance that owns Timer2, see PulseEngine::begin().*/
+static PulseEngine * active_engine = NULL;
+
+/*!
+ * @brief Timer2 compare match: the next edge is due.
+ */
+ISR(TIMER2_COMPA_vect){
+  active_engine->on_interrupt();
+}
+
+
+/*!
+ * @brief Constructor - Timer2 is left alone until begin()
+ */
+PulseEngine::PulseEngine(){
+  this->servo_count = 0;
+  this->stepper = NULL;
+  this->steps_left = 0;
+  this->stepper_continuous = false;
+  this->stepper_forward = true;
+  this->step_ticks = PULSE_SLOT_TICKS;
+  this->step_elapsed_ticks = 0;
+  this->slot = PULSE_SLOTS - 1;
+  this->pulse_high = false;
+  this->wait_ticks = 0;
+}
+
+
+/*!
+ * @brief Take Timer2 over and start the frames.  Only one engine may own
+ *        the timer.
+ *
+ * @return FALSE if another engine already has it
+ */
+bool PulseEngine::begin(){
+  if(active_engine != NULL)
+    return false;
+  unsigned char sreg = SREG;
+  cli();
+  active_engine = this;
+  TIMSK2 = 0;
+  TCCR2A = _BV(WGM21);  // CTC: count up to OCR2A, then start over
+  TCCR2B = PULSE_PRESCALER;
+  TCNT2 = 0;
+  OCR2A = PULSE_MAX_CHUNK - 1;
+  TIFR2 = _BV(OCF2A);
+  TIMSK2 = _BV(OCIE2A);
+  SREG = sreg;
+  return true;
+}
+
+
+/*!
+ * @brief Give a servo a channel.  It gets no pulses until its first 
+ *        position is set.
+ *
+ * @param pin                     the servo's signal pin, made an output
+ * @param max_degrees_per_second  slew limit, zero for none
+ *
+ * @return the channel, or PULSE_NO_SERVO if all are taken
+ */
+unsigned char PulseEngine::attach_servo(unsigned char pin, unsigned int max_degrees_per_second){
+  if(servo_count >= PULSE_MAX_SERVOS)
+    return PULSE_NO_SERVO;
+  pulse_servo servo;
+  servo.output = portOutputRegister(digitalPinToPort(pin));
+  servo.mask = digitalPinToBitMask(pin);
+  servo.ticks = 0;
+  servo.target_ticks = 0;
+  servo.slew_ticks = 0;
+  if(max_degrees_per_second > 0){
+    const unsigned long frame_us = (unsigned long)PULSE_SLOTS * PULSE_SLOT_US;
+    unsigned long per_frame = (unsigned long)max_degrees_per_second * SERVO_TICKS_PER_DEGREE_X128
+                              * frame_us / 128 / 1000000UL;
+    servo.slew_ticks = per_frame == 0 ? 1 : (per_frame > 0xFF ? 0xFF : per_frame);
+  }
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, LOW);
+  unsigned char sreg = SREG;
+  cli();
+  servos[servo_count] = servo;
+  SREG = sreg;
+  return servo_count++;
+}
+
+
+/*!
+ * @brief Move a servo.  The first position is taken at once, later ones 
+ *        are slewed to if the servo has a slew limit.
+ *
+ * @param channel  from attach_servo()
+ * @param degrees  0 to SERVO_MAX_DEGREES
+ */
+void PulseEngine::set_servo_degrees(unsigned char channel, unsigned char degrees){
+  if(channel >= servo_count)
+    return;
+  if(degrees > SERVO_MAX_DEGREES)
+    degrees = SERVO_MAX_DEGREES;
+  unsigned int ticks = SERVO_MIN_TICKS + ((degrees * (unsigned int)SERVO_TICKS_PER_DEGREE_X128) >> 7);
+  unsigned char sreg = SREG;
+  cli();
+  pulse_servo * servo = &servos[channel];
+  servo->target_ticks = ticks;
+  if(servo->ticks == 0 || servo->slew_ticks == 0)
+    servo->ticks = ticks;
+  SREG = sreg;
+}
+
+
+/*!
+ * @param channel  from attach_servo()
+ *
+ * @return TRUE while the servo is still slewing to its last position
+ */
+bool PulseEngine::is_servo_moving(unsigned char channel){
+  if(channel >= servo_count)
+    return false;
+  unsigned char sreg = SREG;
+  cli();
+  bool moving = servos[channel].ticks != servos[channel].target_ticks;
+  SREG = sreg;
+  return moving;
+}
+
+
+/*!
+ * @brief Set the stepper that move_stepper() moves
+ *
+ * @param stepper  started already (see StepperDriver::begin())
+ */
+void PulseEngine::attach_stepper(StepperDriver * stepper){
+  stop_stepper();
+  this->stepper = stepper;
+}
+
+
+/*!
+ * @brief Keep a stepper interval between one slot and PULSE_MAX_STEP_TICKS
+ *
+ * @param step_ticks  requested interval, in ticks
+ *
+ * @return the interval the engine can keep
+ */
+static unsigned int constrain_step_ticks(unsigned int step_ticks){
+  if(step_ticks < PULSE_SLOT_TICKS)
+    return PULSE_SLOT_TICKS;
+  if(step_ticks > PULSE_MAX_STEP_TICKS)
+    return PULSE_MAX_STEP_TICKS;
+  return step_ticks;
+}
+
+
+/*!
+ * @brief Start moving the stepper.  Returns at once; the steps are made
+ *        from the interrupt.  Replaces any move still in progress.
+ *
+ * @param steps       how far to move; negative steps go backward
+ * @param step_ticks  average time between steps, in ticks (see 
+ *                    PULSE_TICKS_FOR_US), at least one slot
+ */
+void PulseEngine::move_stepper(int steps, unsigned int step_ticks){
+  if(stepper == NULL)
+    return;
+  step_ticks = constrain_step_ticks(step_ticks);
+  unsigned char sreg = SREG;
+  cli();
+  this->stepper_continuous = false;
+  this->stepper_forward = steps > 0;
+  this->steps_left = steps > 0 ? steps : -steps;
+  this->step_ticks = step_ticks;
+  this->step_elapsed_ticks = step_ticks - PULSE_SLOT_TICKS;  // first step in the next slot
+  SREG = sreg;
+}
+
+
+/*!
+ * @brief Keep the stepper stepping, for at most lease_steps more steps.
+ *        The caller renews the lease while it wants the stepper to go on,
+ *        so should it stop being called (a task held up, or gone), the 
+ *        stepper stops on its own.  Called again while it runs the same
+ *        way, only the rate and the lease change: the step in progress 
+ *        isn't restarted, so the rate can be adjusted often without the 
+ *        steps bunching up.
+ *
+ * @param forward      direction
+ * @param step_ticks   average time between steps, in ticks (see 
+ *                     PULSE_TICKS_FOR_US), at least one slot
+ * @param lease_steps  steps to make unless called again first
+ */
+void PulseEngine::run_stepper(bool forward, unsigned int step_ticks, unsigned int lease_steps){
+  if(stepper == NULL)
+    return;
+  step_ticks = constrain_step_ticks(step_ticks);
+  unsigned char sreg = SREG;
+  cli();
+  if(!stepper_continuous || steps_left == 0 || stepper_forward != forward)
+    this->step_elapsed_ticks = step_ticks - PULSE_SLOT_TICKS;
+  else if(this->step_elapsed_ticks >= step_ticks)
+    this->step_elapsed_ticks = step_ticks - PULSE_SLOT_TICKS;  // overdue at a faster rate: step in the next slot
+  this->stepper_continuous = true;
+  this->stepper_forward = forward;
+  this->steps_left = lease_steps;
+  this->step_ticks = step_ticks;
+  SREG = sreg;
+}
+
+
+/*!
+ * @brief Drop whatever steps are left of the current move
+ */
+void PulseEngine::stop_stepper(){
+  unsigned char sreg = SREG;
+  cli();
+  steps_left = 0;
+  stepper_continuous = false;
+  SREG = sreg;
+}
+
+
+/*!
+ * @return TRUE while a stepper move is in progress
+ */
+bool PulseEngine::is_stepper_moving(){
+  unsigned char sreg = SREG;
+  cli();
+  bool moving = steps_left != 0;
+  SREG = sreg;
+  return moving;
+}
+
+
+/*!
+ * @brief Move each slewing servo one frame's worth toward its target
+ */
+void PulseEngine::slew_servos(){
+  for(unsigned char i = 0; i < servo_count; i++){
+    pulse_servo * servo = &servos[i];
+    if(servo->ticks == servo->target_ticks)
+      continue;
+    if(servo->ticks < servo->target_ticks)
+      servo->ticks = (servo->target_ticks - servo->ticks > servo->slew_ticks) ?
+                     servo->ticks + servo->slew_ticks : servo->target_ticks;
+    else
+      servo->ticks = (servo->ticks - servo->target_ticks > servo->slew_ticks) ?
+                     servo->ticks - servo->slew_ticks : servo->target_ticks;
+  }
+}
+
+
+/*!
+ * @brief Set the timer up for the next part of the wait.  Waits longer
+ *        than PULSE_MAX_CHUNK are split in two, so no part is too short
+ *        to be loaded before the timer gets there.
+ */
+void PulseEngine::load_chunk(){
+  unsigned int chunk = wait_ticks;
+  if(chunk > 2 * PULSE_MAX_CHUNK)
+    chunk = PULSE_MAX_CHUNK;
+  else if(chunk > PULSE_MAX_CHUNK)
+    chunk = chunk / 2;
+  wait_ticks -= chunk;
+  OCR2A = chunk - 1;
+}
+
+
+/*!
+ * @brief Called from the Timer2 compare match interrupt: keep waiting,
+ *        end the pulse in flight, or start the next slot.
+ */
+void PulseEngine::on_interrupt(){
+  if(wait_ticks == 0){
+    if(pulse_high){
+      // end of the pulse: wait out the rest of the slot
+      pulse_servo * servo = &servos[slot];
+      *servo->output &= (unsigned char)~servo->mask;
+      pulse_high = false;
+      wait_ticks = PULSE_SLOT_TICKS - servo->ticks;
+    } else {
+      // start of the next slot
+      slot++;
+      if(slot == PULSE_SLOTS){
+        slot = 0;
+        slew_servos();
+      }
+      // the pulse edge first, so the step below can't shorten the pulse
+      wait_ticks = PULSE_SLOT_TICKS;
+      if(slot < servo_count && servos[slot].ticks != 0){
+        pulse_servo * servo = &servos[slot];
+        *servo->output |= servo->mask;
+        pulse_high = true;
+        wait_ticks = servo->ticks;
+      }
+      if(steps_left != 0){
+        step_elapsed_ticks += PULSE_SLOT_TICKS;
+        if(step_elapsed_ticks >= step_ticks){
+          stepper->single_step(stepper_forward);
+          steps_left--;
+          step_elapsed_ticks -= step_ticks;
+        }
+      }
+    }
+  }
+  load_chunk();
+}
@@ -0,0 +1,153 @@
+/*!
+ * @file PulseEngine.h
+ *
+ * @brief Servo pulses and stepper steps, all timed by Timer2
+ *
+ */
+#ifndef PULSE_ENGINE_H
+#define PULSE_ENGINE_H
+
+#include <Arduino.h>
+#include "StepperDriver.h"
+
+/*! @def PULSE_TICK_US
+ *  Timer2 tick.  One degree of servo travel is just over one tick.*/
+#define PULSE_TICK_US 8
+/*! @def PULSE_SLOT_US
+ *  Each servo gets a slot this long for its pulse, and the stepper can
+ *  step at the start of any slot.*/
+#define PULSE_SLOT_US 2500
+/*! @def PULSE_SLOTS
+ *  Slots per frame.  A servo gets one pulse per frame: 8 slots of 2.5 ms
+ *  make the usual 20 ms servo frame.*/
+#define PULSE_SLOTS 8
+/*! @def PULSE_SLOT_TICKS
+ *  Timer2 ticks per slot.*/
+#define PULSE_SLOT_TICKS (PULSE_SLOT_US / PULSE_TICK_US)
+/*! @def PULSE_MAX_CHUNK
+ *  Timer2 only counts to 255, so longer waits take more than one compare
+ *  match.*/
+#define PULSE_MAX_CHUNK 250
+/*! @def PULSE_MAX_SERVOS
+ *  Servos the engine can drive, one per slot.*/
+#define PULSE_MAX_SERVOS 4
+/*! @def PULSE_NO_SERVO
+ *  attach_servo() found no free channel.*/
+#define PULSE_NO_SERVO 0xFF
+
+/*! @def SERVO_MIN_PULSE_US
+ *  Pulse for 0 degrees (the same as ServoTimer2's, so calibrations carry over).*/
+#define SERVO_MIN_PULSE_US 750
+/*! @def SERVO_MAX_PULSE_US
+ *  Pulse for 180 degrees.*/
+#define SERVO_MAX_PULSE_US 2250
+/*! @def SERVO_MAX_DEGREES
+ *  Travel of a servo.*/
+#define SERVO_MAX_DEGREES 180
+/*! @def SERVO_MIN_TICKS
+ *  SERVO_MIN_PULSE_US in Timer2 ticks.*/
+#define SERVO_MIN_TICKS (SERVO_MIN_PULSE_US / PULSE_TICK_US)
+/*! @def SERVO_TICKS_PER_DEGREE_X128
+ *  Timer2 ticks per degree, times 128, so degrees turn into ticks with a
+ *  16-bit multiply and a shift.*/
+#define SERVO_TICKS_PER_DEGREE_X128 \
+  (((SERVO_MAX_PULSE_US - SERVO_MIN_PULSE_US) * 128L / PULSE_TICK_US + SERVO_MAX_DEGREES / 2) / SERVO_MAX_DEGREES)
+
+static_assert(SERVO_MAX_PULSE_US / PULSE_TICK_US < PULSE_SLOT_TICKS,
+              "the longest pulse must end inside its slot");
+static_assert(SERVO_MAX_DEGREES * SERVO_TICKS_PER_DEGREE_X128 <= 0xFFFF,
+              "degrees to ticks must fit 16 bits");
+static_assert(PULSE_MAX_SERVOS <= PULSE_SLOTS, "one slot per servo");
+
+/*! @def PULSE_TICKS_FOR_US
+ *  Timer2 ticks nearest to us microseconds, e.g. for a stepper interval.*/
+#define PULSE_TICKS_FOR_US(us) (((us) + PULSE_TICK_US / 2) / PULSE_TICK_US)
+/*! @def PULSE_MAX_STEP_TICKS
+ *  Longest stepper interval, so a slot added to the time since the last
+ *  step still fits 16 bits.*/
+#define PULSE_MAX_STEP_TICKS (0xFFFF - PULSE_SLOT_TICKS)
+
+/*!
+ * @struct pulse_servo
+ *
+ * @brief One servo channel.  The ISR only reads the port, the mask and
+ *        the pulse length, all worked out beforehand.
+ */
+struct pulse_servo{
+  volatile uint8_t * output;  ///<output register of the servo's pin
+  unsigned char mask;         ///<the pin's bit
+  unsigned int ticks;         ///<pulse being sent, zero until the first position is set
+  unsigned int target_ticks;  ///<pulse to slew to
+  unsigned char slew_ticks;   ///<most the pulse may change per frame, zero for no limit
+};
+
+/*!
+ * @class PulseEngine
+ *
+ * @brief Owns Timer2, and uses it for every servo pulse and stepper step
+ *
+ * The frame is cut into PULSE_SLOTS slots.  A servo's pulse starts its
+ * slot, so servo pulses never overlap; the stepper can step at the start
+ * of any slot.  The stepper interval needn't be a whole number of slots:
+ * the time since the last step is kept in ticks, and the step is made in
+ * the first slot that reaches the interval, with the overshoot carried
+ * over to the next, so the steps come in the nearest slots and average
+ * out to the interval.  Each interrupt sets or clears one pin from a precomputed
+ * port and mask and loads the next compare value - and there are only a
+ * few per slot - so the software serial link, whose own interrupts must
+ * not be held up, sees little jitter.  Positions are converted to pulse
+ * lengths when they are set, never in the interrupt.
+ *
+ * A servo may be slew-rate limited: the pulse then moves toward its
+ * target by at most its slew limit per frame.
+ *
+ * Timer ownership: the engine takes Timer2 over in begin(), and defines
+ * its compare match interrupt, so anything else that uses that
+ * interrupt (ServoTimer2, tone(), IRremote on its default timer) fails
+ * to link.  analogWrite() on pins 3 and 11 stops working.  Timer0 stays
+ * with millis(), and Timer1 with AltSoftSerial.
+ *
+ * Usage:<pre>
+ *    PulseEngine engine;
+ *    engine.begin();
+ *    unsigned char hammer = engine.attach_servo(3, 0);
+ *    engine.set_servo_degrees(hammer, 90);
+ *    engine.attach_stepper(&stepper);
+ *    engine.move_stepper(100, PULSE_TICKS_FOR_US(3750));
+ *    while(engine.is_stepper_moving())
+ *      ;
+ *    engine.run_stepper(true, PULSE_TICKS_FOR_US(10000), 50);   // up to 50 steps, unless called again first
+ *    engine.stop_stepper();</pre>
+ */
+class PulseEngine{
+private:
+  pulse_servo servos[PULSE_MAX_SERVOS];  ///<one per slot, from the first
+  unsigned char servo_count;             ///<attached servos
+  StepperDriver * stepper;               ///<see attach_stepper()
+  volatile unsigned int steps_left;      ///<steps the stepper has still to make
+  bool stepper_continuous;               ///<TRUE while run_stepper() is in charge
+  bool stepper_forward;                  ///<direction of the stepper move
+  unsigned int step_ticks;               ///<stepper interval, in ticks
+  unsigned int step_elapsed_ticks;       ///<ticks since the last step was due
+  unsigned char slot;                    ///<slot being timed, 0 to PULSE_SLOTS-1
+  bool pulse_high;                       ///<TRUE while the slot's pulse is on
+  unsigned int wait_ticks;               ///<ticks still to wait before the next edge
+
+  void slew_servos();
+  void load_chunk();
+
+public:
+  PulseEngine();
+  bool begin();
+  unsigned char attach_servo(unsigned char pin, unsigned int max_degrees_per_second);
+  void set_servo_degrees(unsigned char channel, unsigned char degrees);
+  bool is_servo_moving(unsigned char channel);
+  void attach_stepper(StepperDriver * stepper);
+  void move_stepper(int steps, unsigned int step_ticks);
+  void run_stepper(bool forward, unsigned int step_ticks, unsigned int lease_steps);
+  void stop_stepper();
+  bool is_stepper_moving();
+  void on_interrupt();
+};
+
+#endif
@@ -0,0 +1,315 @@
+/*!
+ * @file RequestView.cpp
+ * 
+ * @brief Helpers to search the spans of a request_view
+ * 
+ */
+#include "RequestView.h"
+
+//Do not search beyond the end of your haystack
+char *strnstr_P(char *haystack, PGM_P needle, size_t haystack_length)
+{
+  size_t needle_length = strlen_P(needle);
+  size_t i;
+  for (i = 0; i < haystack_length; i++)
+  {
+    if (i + needle_length > haystack_length){
+      return NULL;
+    }
+    if (strncmp_P(&haystack[i], needle, needle_length) == 0){
+      return &haystack[i];
+    }
+  }
+  return NULL;
+}
+
+/*!
+ * @brief Checks whether a PROGMEM string appears anywhere in a span
+ * 
+ * @param span    the span to search
+ * @param needle  PROGMEM string to look for
+ * 
+ * @return TRUE if the needle is found inside the span
+ */
+bool span_contains_P(const buffer_span &span, PGM_P needle){
+  if(span.pointer == NULL)
+    return false;
+  return strnstr_P(span.pointer, needle, span.length) != NULL;
+}
+
+/*!
+ * @brief Checks whether a span begins with a PROGMEM string
+ * 
+ * @param span    the span to check
+ * @param prefix  PROGMEM string the span should start with
+ * 
+ * @return TRUE if the span starts with the prefix
+ */
+bool span_starts_with_P(const buffer_span &span, PGM_P prefix){
+  size_t prefix_length = strlen_P(prefix);
+  if(span.pointer == NULL || span.length < prefix_length)
+    return false;
+  return strncmp_P(span.pointer, prefix, prefix_length) == 0;
+}
+
+/*!
+ * @brief Checks whether a token was found inside a span of a line, 
+ *        without searching the line again
+ * 
+ * Only the first occurrence of a token in the line is remembered, so a
+ * token that shows up earlier in the line, outside the span, hides one
+ * inside it.
+ * 
+ * @param view   the line, with the tokens found in it
+ * @param span   part of view.line (e.g. view.path)
+ * @param token  one of token_id
+ * 
+ * @return TRUE if the token lies entirely inside the span
+ */
+bool span_has_token(const request_view &view, const buffer_span &span, unsigned char token){
+  unsigned int offset;
+  if(span.pointer == NULL || !find_token(view.tokens, token, &offset))
+    return false;
+  unsigned int start = span.pointer - view.line.pointer;
+  return offset >= start && offset + get_token_length(token) <= start + span.length;
+}
+
+/*!
+ * @brief Checks whether a span of a line begins with a token, without 
+ *        searching the line again
+ * 
+ * @param view   the line, with the tokens found in it
+ * @param span   part of view.line (e.g. view.method), or the line itself
+ * @param token  one of token_id
+ * 
+ * @return TRUE if the token starts where the span does, and fits in it
+ */
+bool span_starts_with_token(const request_view &view, const buffer_span &span, unsigned char token){
+  unsigned int offset;
+  if(span.pointer == NULL || !find_token(view.tokens, token, &offset))
+    return false;
+  return offset == (unsigned int)(span.pointer - view.line.pointer) &&
+         get_token_length(token) <= span.length;
+}
+
+/*!
+ * @brief Copies the first double-quoted field of a span, e.g. the SSID 
+ *        out of '+CWJAP:"my_network",...'
+ * 
+ * @param span         the span to search
+ * @param output       where to put the field, null-terminated
+ * @param output_size  size of the output buffer, including the terminator
+ * 
+ * @return TRUE if a complete quoted field was found
+ */
+bool span_copy_quoted(const buffer_span &span, char * output, unsigned int output_size){
+  if(span.pointer == NULL || output_size == 0)
+    return false;
+  char * end = span.pointer + span.length;
+  char * start = (char *)memchr(span.pointer, '"', span.length);
+  if(start == NULL)
+    return false;
+  start++;
+  char * stop = (char *)memchr(start, '"', end - start);
+  if(stop == NULL)
+    return false;
+  unsigned int field_length = stop - start;
+  if(field_length >= output_size)
+    field_length = output_size - 1;
+  memcpy(output, start, field_length);
+  output[field_length] = '\0';
+  return true;
+}
+
+
+/*!
+ * @brief Finds the value of a header line like "Range: bytes=0-99\r\n"
+ * 
+ * @param span         the header line
+ * @param header_name  PROGMEM header name including the ':', matched 
+ *                     without regard to case
+ * @param value        set to the value, without leading spaces or the 
+ *                     line ending, if the header matches
+ * 
+ * @return TRUE if the line is that header
+ */
+bool span_header_value_P(const buffer_span &span, PGM_P header_name, buffer_span * value){
+  size_t name_length = strlen_P(header_name);
+  if(span.pointer == NULL || span.length <= name_length ||
+     strncasecmp_P(span.pointer, header_name, name_length) != 0)
+    return false;
+  char * cursor = span.pointer + name_length;
+  char * end = span.pointer + span.length;
+  while(cursor < end && *cursor == ' ')
+    cursor++;
+  while(end > cursor && (end[-1] == '\r' || end[-1] == '\n'))
+    end--;
+  value->pointer = cursor;
+  value->length = end - cursor;
+  return true;
+}
+
+
+/*!
+ * @brief Reads the number out of a header line like "Content-Length: 42\r\n"
+ * 
+ * @param span         the header line
+ * @param header_name  PROGMEM header name including the ':', matched 
+ *                     without regard to case
+ * @param value        set to the number, if the header matches
+ * 
+ * @return TRUE if the line is that header and carries a number
+ */
+bool span_header_uint_P(const buffer_span &span, PGM_P header_name, unsigned int * value){
+  buffer_span header_value;
+  if(!span_header_value_P(span, header_name, &header_value))
+    return false;
+  char * cursor = header_value.pointer;
+  char * end = header_value.pointer + header_value.length;
+  if(cursor >= end || *cursor < '0' || *cursor > '9')
+    return false;
+  unsigned int number = 0;
+  while(cursor < end && *cursor >= '0' && *cursor <= '9'){
+    number = number*10 + (*cursor - '0');
+    cursor++;
+  }
+  *value = number;
+  return true;
+}
+
+
+/*!
+ * @brief Reads a signed number out of the query string of a path, like 
+ *        the -20 of "/drive?pan=-20&tilt=5"
+ * 
+ * @param span            the path
+ * @param parameter_name  PROGMEM parameter name including the '=', matched
+ *                        only right after the '?' or a '&'
+ * @param value           set to the number, capped at +/-9999, if found
+ * 
+ * @return TRUE if the parameter is there and carries a number
+ */
+bool span_query_int_P(const buffer_span &span, PGM_P parameter_name, int * value){
+  if(span.pointer == NULL)
+    return false;
+  char * end = span.pointer + span.length;
+  char * cursor = span.pointer;
+  size_t name_length = strlen_P(parameter_name);
+  while((cursor = strnstr_P(cursor, parameter_name, end - cursor)) != NULL){
+    if(cursor > span.pointer && (cursor[-1] == '?' || cursor[-1] == '&'))
+      break;
+    cursor++;
+  }
+  if(cursor == NULL)
+    return false;
+  cursor += name_length;
+  bool negative = cursor < end && *cursor == '-';
+  if(negative)
+    cursor++;
+  if(cursor >= end || *cursor < '0' || *cursor > '9')
+    return false;
+  int number = 0;
+  while(cursor < end && *cursor >= '0' && *cursor <= '9'){
+    number = (number > 999) ? 9999 : number*10 + (*cursor - '0');
+    cursor++;
+  }
+  *value = negative ? -number : number;
+  return true;
+}
+
+
+/*!
+ * @brief Reads a decimal number, capped at BYTE_RANGE_OPEN
+ * 
+ * @return TRUE if there was at least one digit
+ */
+static bool read_range_number(char ** cursor, char * end, unsigned int * value){
+  unsigned long number = 0;
+  char * start = *cursor;
+  while(*cursor < end && **cursor >= '0' && **cursor <= '9'){
+    number = number*10 + (**cursor - '0');
+    if(number > BYTE_RANGE_OPEN)
+      number = BYTE_RANGE_OPEN;
+    (*cursor)++;
+  }
+  *value = number;
+  return *cursor > start;
+}
+
+
+/*!
+ * @brief Parses the value of a Range header: "bytes=FIRST-LAST", 
+ *        "bytes=FIRST-" or "bytes=-SUFFIX_LENGTH"
+ * 
+ * Lists of ranges are not supported; the whole resource should be sent
+ * instead, which HTTP allows.
+ * 
+ * @param value  the header value, see span_header_value_P()
+ * @param range  filled in if the value is a single byte range
+ * 
+ * @return TRUE if the value is a single byte range
+ */
+bool span_parse_byte_range(const buffer_span &value, byte_range * range){
+  if(value.pointer == NULL || value.length <= 6 ||
+     strncasecmp_P(value.pointer, PSTR("bytes="), 6) != 0)
+    return false;
+  char * cursor = value.pointer + 6;
+  char * end = value.pointer + value.length;
+  byte_range parsed;
+  parsed.requested = true;
+  parsed.suffix = !read_range_number(&cursor, end, &parsed.first);
+  if(cursor >= end || *cursor != '-')
+    return false;
+  cursor++;
+  if(!read_range_number(&cursor, end, &parsed.last)){
+    if(parsed.suffix)
+      return false;
+    parsed.last = BYTE_RANGE_OPEN;
+  }
+  if(cursor != end || (!parsed.suffix && parsed.last < parsed.first))
+    return false;
+  *range = parsed;
+  return true;
+}
+
+
+/*!
+ * @brief Works out which bytes of a resource a range covers
+ * 
+ * @param range   the range asked for
+ * @param length  length of the resource
+ * @param first   set to the first byte to send
+ * @param count   set to the number of bytes to send
+ * 
+ * @return FALSE if the range covers none of the resource (HTTP 416)
+ */
+bool resolve_byte_range(const byte_range &range, unsigned int length,
+                        unsigned int * first, unsigned int * count){
+  if(range.suffix){
+    unsigned int wanted = range.last < length ? range.last : length;
+    if(wanted == 0)
+      return false;
+    *first = length - wanted;
+    *count = wanted;
+    return true;
+  }
+  if(range.first >= length)
+    return false;
+  unsigned int last = range.last < length ? range.last : length - 1;
+  *first = range.first;
+  *count = last - range.first + 1;
+  return true;
+}
+
+
+/*!
+ * @brief Checks for the empty line that ends the HTTP headers
+ * 
+ * @return TRUE if the span is just "\r\n" (or "\n")
+ */
+bool span_is_blank_line(const buffer_span &span){
+  if(span.pointer == NULL)
+    return false;
+  return (span.length == 2 && span.pointer[0] == '\r' && span.pointer[1] == '\n') ||
+         (span.length == 1 && span.pointer[0] == '\n');
+}
@@ -0,0 +1,91 @@
+/*!
+ * @file RequestView.h
+ * 
+ * @brief Zero-copy views of lines read from the ESP8266
+ * 
+ */
+#ifndef REQUEST_VIEW_H
+#define REQUEST_VIEW_H
+
+#include <Arduino.h>
+#include "TokenMatcher.h"
+
+/*! 
+ * @struct buffer_span
+ * 
+ * @brief A slice of characters living in someone else's buffer (usually the
+ *        ESP8266 input ring).  Not necessarily null-terminated.
+ * 
+ */
+struct buffer_span{
+  char * pointer;       ///< first character of the span, NULL if empty
+  unsigned int length;  ///< number of characters in the span
+};
+
+/*! 
+ * @struct request_view
+ * 
+ * @brief Zero-copy view of one line read from the ESP8266.
+ * 
+ * All spans point into the ESP8266 input ring, and are only valid until
+ * the next call to ESP8266::read_request().  The line itself is 
+ * null-terminated, so it can still be handed to the C string functions.
+ * 
+ * For a line like "+IPD,0,345:GET /config HTTP/1.1\r\n":
+ *  * channel = 0
+ *  * method  = "GET"
+ *  * path    = "/config"
+ *  * body    = "GET /config HTTP/1.1\r\n" (everything after the ':')
+ * 
+ * For lines that are not the start of an IPD (headers, POST bodies, AT
+ * command responses) the method and path are empty and the body is the
+ * whole line.  Lines that belong to the payload of an earlier IPD are
+ * flagged is_payload, and carry that IPD's channel.  A payload line longer
+ * than the input ring comes in more than one piece.
+ * 
+ * The tokens of tokens.h found in the line come along, so the line need
+ * not be searched again: see span_has_token() and span_starts_with_token().
+ */
+struct request_view{
+  buffer_span line;    ///< The whole line, including the trailing '\n'
+  buffer_span method;  ///< HTTP method, on request lines only
+  buffer_span path;    ///< HTTP path, on request lines only
+  buffer_span body;    ///< Payload carried on this line
+  bool is_ipd;         ///< True if this line started with an +IPD header
+  bool is_payload;     ///< True if this line is (part of) data received on a connection
+  char channel;        ///< Channel from the +IPD header, zero if none is found
+  token_hits tokens;   ///< Tokens found in the line, with offsets from the start of line
+};
+
+/*! @def BYTE_RANGE_OPEN
+ *  byte_range::last of a range with no end, e.g. "bytes=100-".*/
+#define BYTE_RANGE_OPEN 0xFFFF
+
+/*! 
+ * @struct byte_range
+ * 
+ * @brief The range asked for by a "Range: bytes=..." header.  Only a 
+ *        single range is supported.
+ */
+struct byte_range{
+  bool requested;      ///< True if a usable Range header was seen
+  bool suffix;         ///< True for "bytes=-N": the last N bytes, N is in last
+  unsigned int first;  ///< First byte wanted
+  unsigned int last;   ///< Last byte wanted (inclusive), or BYTE_RANGE_OPEN
+};
+
+char *strnstr_P(char *haystack, PGM_P needle, size_t haystack_length);
+bool span_contains_P(const buffer_span &span, PGM_P needle);
+bool span_starts_with_P(const buffer_span &span, PGM_P prefix);
+bool span_has_token(const request_view &view, const buffer_span &span, unsigned char token);
+bool span_starts_with_token(const request_view &view, const buffer_span &span, unsigned char token);
+bool span_copy_quoted(const buffer_span &span, char * output, unsigned int output_size);
+bool span_header_value_P(const buffer_span &span, PGM_P header_name, buffer_span * value);
+bool span_header_uint_P(const buffer_span &span, PGM_P header_name, unsigned int * value);
+bool span_query_int_P(const buffer_span &span, PGM_P parameter_name, int * value);
+bool span_parse_byte_range(const buffer_span &value, byte_range * range);
+bool resolve_byte_range(const byte_range &range, unsigned int length,
+                        unsigned int * first, unsigned int * count);
+bool span_is_blank_line(const buffer_span &span);
+
+#endif
@@ -7,87 +7,267 @@
 #include "Rubber_Band_Shooter.h"
 
 /*!
- * Fire the rubber band
+ * Fire the rubber band.  Blocks for HAMMER_TRAVEL_MS - use release_hammer()
+ * and arm_hammer() to fire without blocking.
  */
 void Rubber_Band_Shooter::fire() {
-  hammer.write(map(FIRE_HAMMER_POSITION,0,180,MIN_PULSE_WIDTH,MAX_PULSE_WIDTH));  //fiiiirrrre!
-  delay(1000);  //wait a second for the servo to get there
-  hammer.write(map(ARMED_HAMMER_POSITION,0,180,MIN_PULSE_WIDTH,MAX_PULSE_WIDTH));  //ready to load again
+  release_hammer();
+  delay(HAMMER_TRAVEL_MS);  //wait a second for the servo to get there
+  arm_hammer();
 }
 
 /*!
- * increase the elevation by one increment
+ * Start moving the hammer to the fire position.  It takes 
+ * HAMMER_TRAVEL_MS to get there.
  */
-void Rubber_Band_Shooter::turn_up() {
+void Rubber_Band_Shooter::release_hammer() {
+  engine->set_servo_degrees(hammer, calibration.fire_hammer_position);  //fiiiirrrre!
+}
+
+/*!
+ * Move the hammer back to the armed position, ready to load again.
+ */
+void Rubber_Band_Shooter::arm_hammer() {
+  engine->set_servo_degrees(hammer, calibration.armed_hammer_position);  //ready to load again
+}
+
+/*!
+ * increase the elevation by a number of increments, in one move
+ * 
+ * @param increments
+ *        how many ELEVATION_POSITION_INCREMENTs to move
+ */
+void Rubber_Band_Shooter::turn_up(unsigned char increments) {
+  stop_velocity();
   //move in positive direction
-  elevation_command_position = elevation_command_position + ELEVATION_POSITION_INCREMENT;
-  if(elevation_command_position > (ELEVATION_CENTER_POSITION + ELEVATION_MOVEMENT_RANGE) ){
-    elevation_command_position = (ELEVATION_CENTER_POSITION + ELEVATION_MOVEMENT_RANGE);
+  elevation_command_position = elevation_command_position + ELEVATION_POSITION_INCREMENT * increments;
+  if(elevation_command_position > (calibration.elevation_center_position + calibration.elevation_movement_range) ){
+    elevation_command_position = (calibration.elevation_center_position + calibration.elevation_movement_range);
     Serial.print(F("|Fixing elevation out-of-range elevation input!"));Serial.println(elevation_command_position);
   }
 
-  elevation.write(map(elevation_command_position,0,180,MIN_PULSE_WIDTH,MAX_PULSE_WIDTH));
+  engine->set_servo_degrees(elevation, elevation_command_position);
 }
 
 /*!
- * decrease the elevation by one increment
+ * decrease the elevation by a number of increments, in one move
+ * 
+ * @param increments
+ *        how many ELEVATION_POSITION_INCREMENTs to move
  */
-void Rubber_Band_Shooter::turn_down() {
+void Rubber_Band_Shooter::turn_down(unsigned char increments) {
+  stop_velocity();
   //move in positive direction
-  elevation_command_position = elevation_command_position - ELEVATION_POSITION_INCREMENT;
-  if(elevation_command_position < (ELEVATION_CENTER_POSITION - ELEVATION_MOVEMENT_RANGE) )
-    elevation_command_position = (ELEVATION_CENTER_POSITION - ELEVATION_MOVEMENT_RANGE);
+  elevation_command_position = elevation_command_position - ELEVATION_POSITION_INCREMENT * increments;
+  if(elevation_command_position < (calibration.elevation_center_position - calibration.elevation_movement_range) )
+    elevation_command_position = (calibration.elevation_center_position - calibration.elevation_movement_range);
+
+  engine->set_servo_degrees(elevation, elevation_command_position);
+}
+
+/*!
+ * start turning clockwise by a number of increments, in one move.  Returns
+ * at once, the engine makes the steps.
+ * 
+ * @param increments
+ *        how many BASE_STEP_INCREMENTs to turn
+ */
+void Rubber_Band_Shooter::turn_right(unsigned char increments){
+  stop_velocity();
+  int step_distance = BASE_STEP_INCREMENT * BASE_STEPS_PER_DEGREE * increments;
+  engine->move_stepper(step_distance, BASE_STEP_TICKS);// Rotate CW
+}
+
+/*!
+ * start turning counterclockwise by a number of increments, in one move.
+ * Returns at once, the engine makes the steps.
+ * 
+ * @param increments
+ *        how many BASE_STEP_INCREMENTs to turn
+ */
+void Rubber_Band_Shooter::turn_left(unsigned char increments){
+  stop_velocity();
+  int step_distance = -1 * BASE_STEP_INCREMENT * BASE_STEPS_PER_DEGREE * increments;
+  engine->move_stepper(step_distance, BASE_STEP_TICKS);// Rotate CCW
+}
+
+/*!
+ * @return TRUE while an increment move is under way: the base is turning
+ *         or the elevation is slewing, other than in velocity mode
+ */
+bool Rubber_Band_Shooter::is_moving(){
+  return (pan_rate == 0 && engine->is_stepper_moving()) ||
+         (tilt_rate == 0 && engine->is_servo_moving(elevation));
+}
+
+
+/*!
+ * Set the velocity mode rates to ramp to.  Zero for both ramps the 
+ * turret to a stop.
+ * 
+ * @param pan_deg_per_s
+ *        clockwise positive, capped at BASE_MAX_RATE_DEG_PER_S
+ * @param tilt_deg_per_s
+ *        up positive, capped at ELEVATION_MAX_RATE_DEG_PER_S
+ */
+void Rubber_Band_Shooter::set_velocity(int pan_deg_per_s, int tilt_deg_per_s){
+  pan_target = constrain(pan_deg_per_s, -(int)BASE_MAX_RATE_DEG_PER_S, (int)BASE_MAX_RATE_DEG_PER_S);
+  tilt_target = constrain(tilt_deg_per_s, -ELEVATION_MAX_RATE_DEG_PER_S, ELEVATION_MAX_RATE_DEG_PER_S);
+}
+
+
+/*!
+ * Moves a rate toward its target by at most step.
+ */
+static int ramp_rate(int rate, int target, int step){
+  if(rate < target)
+    return (target - rate > step) ? rate + step : target;
+  return (rate - target > step) ? rate - step : target;
+}
+
+
+/*!
+ * Ramp the velocity mode rates toward their targets, then move the turret
+ * on at them: the base stepper's rate is changed, and the elevation 
+ * moved by the whole degrees the tilt rate makes in elapsed_ms.
+ * 
+ * @param elapsed_ms
+ *        time since the last update, capped at VELOCITY_MAX_UPDATE_MS
+ */
+void Rubber_Band_Shooter::update_velocity(unsigned int elapsed_ms){
+  if(elapsed_ms > VELOCITY_MAX_UPDATE_MS)
+    elapsed_ms = VELOCITY_MAX_UPDATE_MS;
+  int step = (long)VELOCITY_ACCEL_DEG_PER_S2 * elapsed_ms / 1000;
+  if(step == 0)
+    step = 1;
+
+  int new_pan_rate = ramp_rate(pan_rate, pan_target, step);
+  if(new_pan_rate == 0){
+    if(pan_rate != 0)
+      engine->stop_stepper();
+  } else {
+    // renew the lease on every update, even if the rate hasn't changed
+    unsigned long ticks = 1000000UL / ((unsigned long)PULSE_TICK_US * BASE_STEPS_PER_DEGREE * abs(new_pan_rate));
+    ticks = constrain(ticks, BASE_STEP_TICKS, PULSE_MAX_STEP_TICKS);
+    unsigned int lease = VELOCITY_LEASE_MS * 1000UL / (ticks * PULSE_TICK_US) + 1;
+    engine->run_stepper(new_pan_rate > 0, ticks, lease);
+  }
+  pan_rate = new_pan_rate;
+
+  tilt_rate = ramp_rate(tilt_rate, tilt_target, step);
+  if(tilt_rate == 0){
+    tilt_remainder = 0;
+    return;
+  }
+  tilt_remainder += tilt_rate * (int)elapsed_ms;
+  int degrees = tilt_remainder / 1000;
+  if(degrees == 0)
+    return;
+  tilt_remainder -= degrees * 1000;
+  int low = calibration.elevation_center_position - calibration.elevation_movement_range;
+  int high = calibration.elevation_center_position + calibration.elevation_movement_range;
+  int position = constrain(elevation_command_position + degrees, low, high);
+  if(position != elevation_command_position){
+    elevation_command_position = position;
+    engine->set_servo_degrees(elevation, elevation_command_position);
+  }
+}
+
 
-  elevation.write(map(elevation_command_position,0,180,MIN_PULSE_WIDTH,MAX_PULSE_WIDTH));
+/*!
+ * @return TRUE while velocity mode moves the turret, ramping down included
+ */
+bool Rubber_Band_Shooter::is_driving(){
+  return pan_rate != 0 || tilt_rate != 0;
 }
 
+
 /*!
- * turn clockwise by one increment
+ * Leave velocity mode at once, without ramping down, e.g. for an
+ * increment move.
  */
-void Rubber_Band_Shooter::turn_right(){
-  int step_distance = BASE_STEP_INCREMENT * BASE_STEPS_PER_DEGREE;
-  small_stepper->setSpeed(BASE_MAX_SPEED);
-  small_stepper->step(step_distance);// Rotate CW
-  delay(MAX_BLOCKING_DELAY);
+void Rubber_Band_Shooter::stop_velocity(){
+  if(pan_rate != 0)
+    engine->stop_stepper();
+  pan_target = 0;
+  tilt_target = 0;
+  pan_rate = 0;
+  tilt_rate = 0;
+  tilt_remainder = 0;
 }
 
+
 /*!
- * turn counterclockwise by one increment
+ * Fills in the calibration built from the compile-time definitions.
+ * 
+ * @param defaults
+ *        the calibration to fill in
  */
-void Rubber_Band_Shooter::turn_left(){
-  int step_distance = -1 * BASE_STEP_INCREMENT * BASE_STEPS_PER_DEGREE;
-  small_stepper->setSpeed(BASE_MAX_SPEED); //Max is 500
-  small_stepper->step(step_distance);// Rotate CCW
-  delay(MAX_BLOCKING_DELAY);
+void Rubber_Band_Shooter::get_default_calibration(motion_calibration * defaults){
+  defaults->armed_hammer_position = ARMED_HAMMER_POSITION;
+  defaults->fire_hammer_position = FIRE_HAMMER_POSITION;
+  defaults->elevation_center_position = ELEVATION_CENTER_POSITION;
+  defaults->elevation_movement_range = ELEVATION_MOVEMENT_RANGE;
 }
 
 
 /*!
- * Constructor
+ * Replaces the servo calibration, and moves the servos to the new 
+ * armed and centered positions.
+ * 
+ * @param new_calibration
+ *        the calibration to use from now on
  */
-Rubber_Band_Shooter::Rubber_Band_Shooter(){
-  Rubber_Band_Shooter(HAMMER_PIN, ELEVATION_PIN);
+void Rubber_Band_Shooter::set_calibration(const motion_calibration & new_calibration){
+  calibration = new_calibration;
+  elevation_command_position = calibration.elevation_center_position;
+  engine->set_servo_degrees(elevation, elevation_command_position);
+  engine->set_servo_degrees(hammer, calibration.armed_hammer_position);
 }
 
 
 /*!
- * Constructor with pin specifier
+ * Constructor with pin specifier.  Nothing is attached until begin().
  * 
+ * @param engine
+ *        Times the servos and the base stepper; begun before begin()
+ * @param base_stepper
+ *        Driver of the base (azimuth) stepper; it is started by begin()
  * @param hammer_pin
  *        The pin on which the hammer servo is driven
  * @param elevation_pin
  *        The pin on which the elevation servo is driven
  */
-Rubber_Band_Shooter::Rubber_Band_Shooter(unsigned char hammer_pin, unsigned char elevation_pin){
+Rubber_Band_Shooter::Rubber_Band_Shooter(PulseEngine * engine, StepperDriver * base_stepper,
+                                         unsigned char hammer_pin, unsigned char elevation_pin){
+  this->engine = engine;
+  this->small_stepper = base_stepper;
+  this->hammer = PULSE_NO_SERVO;
+  this->elevation = PULSE_NO_SERVO;
+  this->hammer_pin = hammer_pin;
+  this->elevation_pin = elevation_pin;
+  get_default_calibration(&calibration);
+  elevation_command_position = calibration.elevation_center_position;
+  this->pan_target = 0;
+  this->tilt_target = 0;
+  this->pan_rate = 0;
+  this->tilt_rate = 0;
+  this->tilt_remainder = 0;
+}
 
-  elevation_command_position = ELEVATION_CENTER_POSITION;
-  elevation.attach(elevation_pin);  // attaches the servo on pin 9 to the servo object
-  hammer.write(map(elevation_command_position,0,180,MIN_PULSE_WIDTH,MAX_PULSE_WIDTH));
-  
-  hammer.attach(hammer_pin);
-  hammer.write(map(ARMED_HAMMER_POSITION,0,180,MIN_PULSE_WIDTH,MAX_PULSE_WIDTH));
 
-  small_stepper = new Stepper(STEPS_PER_REV, 2, 6, 10, 7);
+/*!
+ * Attaches the servos and the base stepper to the engine, and moves the
+ * servos to the armed and centered positions.
+ */
+void Rubber_Band_Shooter::begin(){
+  small_stepper->begin();
+  engine->attach_stepper(small_stepper);
+  elevation = engine->attach_servo(elevation_pin, ELEVATION_SLEW_DEG_PER_S);
+  engine->set_servo_degrees(elevation, elevation_command_position);
+  
+  hammer = engine->attach_servo(hammer_pin, 0);  // the hammer snaps, that's how it fires
+  engine->set_servo_degrees(hammer, calibration.armed_hammer_position);
 
   Serial.println(F("| Rubber_Band_Shooter Setup complete."));
 }
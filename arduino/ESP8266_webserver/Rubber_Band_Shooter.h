@@ -8,13 +8,8 @@
 #define RUBBER_BAND_SHOOTER_H
 
 #include <Arduino.h>
-#include <ServoTimer2.h>
-#include "Stepper.h"
-
-////////////// Serial and Debug Definitions //////////////
-/*! @def MAX_BLOCKING_DELAY
- * Max delay in ms for the rubber band shooter internal logic*/
-#define MAX_BLOCKING_DELAY 5
+#include "StepperDriver.h"
+#include "PulseEngine.h"
 
 
 ////////////// Servo Control Definitions //////////////
@@ -26,6 +21,9 @@
 /*! @def FIRE_HAMMER_POSITION
  * Fire hammer position, in degrees*/
 #define FIRE_HAMMER_POSITION 5
+/*! @def HAMMER_TRAVEL_MS
+ * Time for the hammer servo to get from armed to fire position*/
+#define HAMMER_TRAVEL_MS 1000
 /*! @def HAMMER_PIN
  * must be a PWM pin*/
 #define HAMMER_PIN 3
@@ -45,6 +43,9 @@
 /*! @def ELEVATION_POSITION_INCREMENT
  * degrees per up or down command step*/
 #define ELEVATION_POSITION_INCREMENT 5
+/*! @def ELEVATION_SLEW_DEG_PER_S
+ * elevation servo speed limit, so the barrel doesn't jerk the mount*/
+#define ELEVATION_SLEW_DEG_PER_S 120
 
 /*! @def STEPS_PER_REV
  * Base (azimuth) stepper motor (z-down, so CW is positive)
@@ -59,30 +60,129 @@
  * roughly - 2048/360 = 5.6889*/
 #define BASE_STEPS_PER_DEGREE 6
 /*! @def BASE_MAX_SPEED
- * max increments per second*/
+ * max speed, in revolutions per minute of STEPS_PER_REV steps*/
 #define BASE_MAX_SPEED 500
+/*! @def BASE_STEP_TICKS
+ * time between base steps at BASE_MAX_SPEED, in PulseEngine ticks*/
+#define BASE_STEP_TICKS PULSE_TICKS_FOR_US(60UL * 1000UL * 1000UL / STEPS_PER_REV / BASE_MAX_SPEED)
+/*! @def BASE_MAX_RATE_DEG_PER_S
+ * fastest pan in velocity mode: a step every BASE_STEP_TICKS*/
+#define BASE_MAX_RATE_DEG_PER_S \
+  (1000000UL / ((unsigned long)PULSE_TICK_US * BASE_STEP_TICKS * BASE_STEPS_PER_DEGREE))
+/*! @def ELEVATION_MAX_RATE_DEG_PER_S
+ * fastest tilt in velocity mode, under ELEVATION_SLEW_DEG_PER_S*/
+#define ELEVATION_MAX_RATE_DEG_PER_S 60
+/*! @def VELOCITY_ACCEL_DEG_PER_S2
+ * how fast velocity mode rates ramp up, and down to a stop*/
+#define VELOCITY_ACCEL_DEG_PER_S2 80
+/*! @def VELOCITY_LEASE_MS
+ * the base runs on for this long past each update_velocity(), so it stops
+ * by itself if the updates stop coming (see PulseEngine::run_stepper())*/
+#define VELOCITY_LEASE_MS 250
+/*! @def VELOCITY_MAX_UPDATE_MS
+ * longest time update_velocity() moves for at once, should its caller
+ * have been held up*/
+#define VELOCITY_MAX_UPDATE_MS 200
+/*! @def BASE_STEPPER_PINS
+ * the four stepper driver inputs, in Stepper's order*/
+#define BASE_STEPPER_PINS 2, 6, 10, 7
+
+/*! 
+ * @struct motion_calibration
+ * 
+ * @brief Servo positions that depend on how the shooter was assembled.
+ * 
+ * Defaults come from the definitions above; a saved copy can be loaded 
+ * from the config store and handed to set_calibration().
+ */
+struct motion_calibration{
+  unsigned char armed_hammer_position;     ///<degrees, see ARMED_HAMMER_POSITION
+  unsigned char fire_hammer_position;      ///<degrees, see FIRE_HAMMER_POSITION
+  unsigned char elevation_center_position; ///<degrees, see ELEVATION_CENTER_POSITION
+  unsigned char elevation_movement_range;  ///<degrees, see ELEVATION_MOVEMENT_RANGE
+};
 
 /*!
  * @class Rubber_Band_Shooter
  * 
  * @brief Handles all arduino functions to control movement of rubber band shooter.
  * 
+ * Meant to be a global: the constructor only remembers the pins, and 
+ * begin() attaches the servos and the base stepper to the PulseEngine 
+ * once the Arduino core is up.  Moves return at once, and are carried 
+ * out by the engine; is_moving() says when they are done.
+ * 
+ * Velocity mode moves the turret at a rate instead of by increments:
+ * set_velocity() sets the rates to reach, and update_velocity(), called
+ * every few tens of milliseconds, ramps toward them and moves the turret.
+ * The base stepper runs at the pan rate for VELOCITY_LEASE_MS past each
+ * update, and the elevation target is advanced by the tilt rate.  An 
+ * increment move ends velocity mode at once.  is_moving() only covers 
+ * increment moves, so waiting for one doesn't wait for velocity mode.
+ * 
+ * The base stepper is handed in; PinnedShooter brings its own, with 
+ * every pin fixed at compile time.  For pins chosen at run time:<pre>
+ *    RuntimeStepper base(STEPS_PER_REV, 2, 6, 10, 7);
+ *    Rubber_Band_Shooter shooter(&engine, &base, hammer_pin, elevation_pin);</pre>
  */
 class Rubber_Band_Shooter{
 private:
-  ServoTimer2 hammer;
-  ServoTimer2 elevation;  // create servo object to control a servo
+  PulseEngine * engine;         ///<times the servos and the base, initialized outside of this class
+  unsigned char hammer;         ///<engine servo channel of the hammer
+  unsigned char elevation;      ///<engine servo channel of the elevation
+  unsigned char hammer_pin;     ///<see HAMMER_PIN
+  unsigned char elevation_pin;  ///<see ELEVATION_PIN
   int elevation_command_position;
-  Stepper * small_stepper;
+  StepperDriver * small_stepper;  ///<base (azimuth) stepper, initialized outside of this class
+  motion_calibration calibration;
+  int pan_target;       ///<velocity mode pan rate to reach, degrees per second, clockwise positive
+  int tilt_target;      ///<velocity mode tilt rate to reach, degrees per second, up positive
+  int pan_rate;         ///<velocity mode pan rate now
+  int tilt_rate;        ///<velocity mode tilt rate now
+  int tilt_remainder;   ///<tilt not yet made for being under a degree, in degree-milliseconds per second
+
+  void stop_velocity();
 
 public:
-  Rubber_Band_Shooter();
-  Rubber_Band_Shooter(unsigned char hammer_pin, unsigned char elevation_pin);
+  Rubber_Band_Shooter(PulseEngine * engine, StepperDriver * base_stepper,
+                      unsigned char hammer_pin = HAMMER_PIN, unsigned char elevation_pin = ELEVATION_PIN);
+  void begin();
+  static void get_default_calibration(motion_calibration * defaults);
+  void set_calibration(const motion_calibration & new_calibration);
   void fire();
-  void turn_up();
-  void turn_down();
-  void turn_right();
-  void turn_left();
+  void release_hammer();
+  void arm_hammer();
+  void turn_up(unsigned char increments = 1);
+  void turn_down(unsigned char increments = 1);
+  void turn_right(unsigned char increments = 1);
+  void turn_left(unsigned char increments = 1);
+  bool is_moving();
+  void set_velocity(int pan_deg_per_s, int tilt_deg_per_s);
+  void update_velocity(unsigned int elapsed_ms);
+  bool is_driving();
+};
+
+/*!
+ * @class PinnedShooter
+ * 
+ * @brief Rubber_Band_Shooter with its pins fixed at compile time, and its
+ *        base stepper driven through the port registers (see FastStepper).
+ * 
+ * @tparam HAMMER     hammer servo pin, see HAMMER_PIN
+ * @tparam ELEVATION  elevation servo pin, see ELEVATION_PIN
+ * @tparam COIL1...COIL4  base stepper coil pins, see BASE_STEPPER_PINS
+ */
+template <unsigned char HAMMER, unsigned char ELEVATION,
+          unsigned char COIL1, unsigned char COIL2, unsigned char COIL3, unsigned char COIL4>
+class PinnedShooter : public Rubber_Band_Shooter{
+private:
+  static_assert(pins_distinct(HAMMER, ELEVATION, COIL1, COIL2, COIL3, COIL4),
+                "every servo and coil needs its own pin");
+  FastStepper<COIL1, COIL2, COIL3, COIL4> base_stepper;  ///<handed to the shooter, which only uses it from begin()
+
+public:
+  PinnedShooter(PulseEngine * engine)
+    : Rubber_Band_Shooter(engine, &base_stepper, HAMMER, ELEVATION), base_stepper(STEPS_PER_REV){}
 };
 
 #endif
@@ -0,0 +1,178 @@
+/*!
+ * @file Scheduler.cpp
+ * 
+ * @brief Cooperative round-robin scheduler with fixed task slots
+ * 
+ */
+#include "Scheduler.h"
+
+/*!
+ * @brief true if time a is at or after time b, allowing for millis() wrapping
+ */
+static bool time_reached(unsigned long a, unsigned long b){
+  return (long)(a - b) >= 0;
+}
+
+
+/*!
+ * @brief Start a timeout for a task, to be checked with task_deadline_passed()
+ * 
+ * @param self        the task
+ * @param timeout_ms  how long from now the deadline is
+ */
+void task_set_deadline(task * self, unsigned long timeout_ms){
+  self->deadline_ms = millis() + timeout_ms;
+}
+
+
+/*!
+ * @param self  the task
+ * 
+ * @return TRUE if the deadline set by task_set_deadline() has passed. Use
+ *         it to give up on a TASK_WAIT_UNTIL.
+ */
+bool task_deadline_passed(task * self){
+  return time_reached(millis(), self->deadline_ms);
+}
+
+
+/*!
+ * @brief Constructor - all slots start out free
+ */
+Scheduler::Scheduler(){
+  this->task_count = 0;
+  this->running_task = SCHEDULER_NO_TASK;
+}
+
+
+/*!
+ * @brief Put a task in the next free slot
+ * 
+ * @param name       PROGMEM name for the stats, up to 8 characters are shown
+ * @param function   body of the task
+ * @param period_ms  minimum time between runs, zero to run on every pass.
+ *                   A TASK_SLEEP inside the task overrides it for one run.
+ * 
+ * @return the slot number, or SCHEDULER_NO_TASK if they are all taken
+ */
+unsigned char Scheduler::add_task(PGM_P name, task_function function, unsigned int period_ms){
+  if(task_count >= SCHEDULER_MAX_TASKS)
+    return SCHEDULER_NO_TASK;
+  task * t = &tasks[task_count];
+  memset(t, 0, sizeof(task));
+  t->function = function;
+  t->name = name;
+  t->period_ms = period_ms;
+  t->wake_ms = millis();
+  t->last_run_ms = t->wake_ms;
+  return task_count++;
+}
+
+
+/*!
+ * @brief Run every task that is due, once, in slot order.
+ */
+void Scheduler::run_once(){
+  for(unsigned char i = 0; i < task_count; i++){
+    task * t = &tasks[i];
+    unsigned long now = millis();
+    if(!time_reached(now, t->wake_ms))
+      continue;
+    t->wake_ms = now + t->period_ms;
+
+    unsigned long start_us = micros();
+    running_task = i;
+    t->function(t);
+    running_task = SCHEDULER_NO_TASK;
+    unsigned long elapsed_us = micros() - start_us;
+    t->last_run_ms = millis();
+
+    t->runs++;
+    t->busy_us += elapsed_us;
+    if(elapsed_us > t->max_us)
+      t->max_us = (elapsed_us > 0xFFFF) ? 0xFFFF : elapsed_us;
+  }
+}
+
+
+/*!
+ * @return the number of slots in use
+ */
+unsigned char Scheduler::get_task_count(){
+  return task_count;
+}
+
+
+/*!
+ * @param slot  a slot number returned by add_task()
+ * 
+ * @return the task in that slot, for reading
+ */
+const task * Scheduler::get_task(unsigned char slot){
+  return &tasks[slot];
+}
+
+
+/*!
+ * @return the slot of the task running right now, or SCHEDULER_NO_TASK if
+ *         the scheduler is between tasks.  Safe to call from an interrupt.
+ */
+unsigned char Scheduler::get_running_task(){
+  return running_task;
+}
+
+
+/*!
+ * @return length of the stats report: a header line and one line per task
+ */
+unsigned int Scheduler::get_stats_length(){
+  return (task_count + 1) * SCHEDULER_STATS_LINE_LEN;
+}
+
+
+/*!
+ * @brief Format one line of the stats report
+ * 
+ * @param line    zero for the header, then one per task slot
+ * @param output  at least SCHEDULER_STATS_LINE_LEN+1 bytes
+ * 
+ * @return SCHEDULER_STATS_LINE_LEN
+ */
+unsigned int Scheduler::format_stats_line(unsigned char line, char * output){
+  TextWriter stats(output, SCHEDULER_STATS_LINE_LEN + 1);
+  if(line == 0){
+    stats.print(F("task           runs      busy_us max_us"));
+  } else {
+    task * t = &tasks[line - 1];
+    stats.print(column_P(t->name, 8), ' ', column(t->runs, 10), ' ',
+                column(t->busy_us, 12), ' ', column(t->max_us, 5));
+  }
+  // pad (or cut) to the fixed width, so the Content-Length is known up front
+  stats.end_line(SCHEDULER_STATS_LINE_LEN);
+  return SCHEDULER_STATS_LINE_LEN;
+}
+
+
+/*!
+ * @brief OutputQueue segment_generator for the stats report.
+ * 
+ * Queue it with get_stats_length() as the length, and the scheduler as 
+ * the context.
+ */
+unsigned int Scheduler::stats_generator(void * context, unsigned int offset,
+                                        char * output, unsigned int output_size){
+  Scheduler * scheduler = (Scheduler *)context;
+  char line[SCHEDULER_STATS_LINE_LEN + 1];
+  unsigned int produced = 0;
+  while(produced < output_size && offset < scheduler->get_stats_length()){
+    unsigned int column = offset % SCHEDULER_STATS_LINE_LEN;
+    scheduler->format_stats_line(offset / SCHEDULER_STATS_LINE_LEN, line);
+    unsigned int wanted = SCHEDULER_STATS_LINE_LEN - column;
+    if(wanted > output_size - produced)
+      wanted = output_size - produced;
+    memcpy(output + produced, line + column, wanted);
+    produced += wanted;
+    offset += wanted;
+  }
+  return produced;
+}
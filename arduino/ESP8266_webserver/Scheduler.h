@@ -0,0 +1,113 @@
+/*!
+ * @file Scheduler.h
+ * 
+ * @brief Cooperative round-robin scheduler with fixed task slots
+ * 
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+#include "TextWriter.h"
+
+/*! @def SCHEDULER_MAX_TASKS
+ *  Number of task slots.  Slots are allocated once, at startup.*/
+#define SCHEDULER_MAX_TASKS 7
+
+/*! @def SCHEDULER_NO_TASK
+ *  Returned by add_task() when every slot is taken.*/
+#define SCHEDULER_NO_TASK 0xFF
+
+/*! @def SCHEDULER_STATS_LINE_LEN
+ *  Every line of the stats report is exactly this long, including the '\n',
+ *  so the report length is known before it is generated.*/
+#define SCHEDULER_STATS_LINE_LEN 40
+
+struct task;
+
+/*! @typedef task_function
+ *  Body of a task.  Must return quickly - use the TASK_* macros below to
+ *  wait for things without blocking the other tasks.*/
+typedef void (*task_function)(task * self);
+
+/*! 
+ * @struct task
+ * 
+ * @brief One task slot: what to run, when, and how long it has taken.
+ */
+struct task{
+  task_function function;      ///<body of the task, NULL if the slot is free
+  PGM_P name;                  ///<PROGMEM name, shown in the stats
+  unsigned int resume_point;   ///<where a TASK_BEGIN/TASK_END task picks up, zero = the top
+  unsigned int period_ms;      ///<run at most this often, zero = on every pass
+  unsigned long wake_ms;       ///<don't run before this time
+  unsigned long deadline_ms;   ///<see task_set_deadline()
+  unsigned long last_run_ms;   ///<when the task last returned to the scheduler
+  unsigned long runs;          ///<number of times the task has run
+  unsigned long busy_us;       ///<total time spent in the task. Wraps, so look at the difference between readings.
+  unsigned int max_us;         ///<longest single run
+};
+
+/*!
+ * @name Stackless coroutines
+ * 
+ * Protothread-style macros for writing a task as straight-line code that
+ * waits.  Local variables do NOT survive a wait - keep state in the 
+ * context.  Don't use a switch statement between TASK_BEGIN and TASK_END.
+ *<pre>
+ *   void blink(task * self){
+ *     TASK_BEGIN(self);
+ *     while(true){
+ *       digitalWrite(13, HIGH);
+ *       TASK_SLEEP(self, 500);
+ *       digitalWrite(13, LOW);
+ *       TASK_SLEEP(self, 500);
+ *     }
+ *     TASK_END(self);
+ *   }</pre>
+ * @{
+ */
+#define TASK_BEGIN(t)  switch((t)->resume_point){ case 0:                                    ///<starts a coroutine body
+#define TASK_YIELD(t)  do{ (t)->resume_point = __LINE__; return; case __LINE__:; }while(0)   ///<lets the other tasks run
+#define TASK_WAIT_UNTIL(t, condition) do{ (t)->resume_point = __LINE__; case __LINE__: if(!(condition)) return; }while(0) ///<yields until condition is true
+#define TASK_SLEEP(t, ms) do{ (t)->wake_ms = millis() + (ms); TASK_YIELD(t); }while(0)         ///<yields for at least ms
+#define TASK_END(t)    } (t)->resume_point = 0;                                               ///<ends a coroutine body; the next run starts over
+/*! @} */
+
+void task_set_deadline(task * self, unsigned long timeout_ms);
+bool task_deadline_passed(task * self);
+
+/*!
+ * @class Scheduler
+ * 
+ * @brief Runs each due task in turn, and keeps track of how long each takes.
+ * 
+ * Usage:<pre>
+ *    Scheduler scheduler;
+ *    void setup(){
+ *      scheduler.add_task(PSTR("blink"), blink, 0);
+ *    }
+ *    void loop(){
+ *      scheduler.run_once();
+ *    }</pre>
+ */
+class Scheduler{
+private:
+  task tasks[SCHEDULER_MAX_TASKS];  ///<fixed slots, in the order they were added
+  unsigned char task_count;         ///<number of slots in use
+  volatile unsigned char running_task; ///<slot being run now, SCHEDULER_NO_TASK between tasks
+
+public:
+  Scheduler();
+  unsigned char add_task(PGM_P name, task_function function, unsigned int period_ms);
+  void run_once();
+  unsigned char get_task_count();
+  const task * get_task(unsigned char slot);
+  unsigned char get_running_task();
+  unsigned int get_stats_length();
+  unsigned int format_stats_line(unsigned char line, char * output);
+  static unsigned int stats_generator(void * context, unsigned int offset,
+                                      char * output, unsigned int output_size);
+};
+
+#endif
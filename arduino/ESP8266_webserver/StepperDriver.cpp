@@ -0,0 +1,107 @@
+/*!
+ * @file StepperDriver.cpp
+ *
+ * @brief Four-wire stepper motor driver, with the coils written straight
+ *        to the port registers
+ *
+ */
+#include "StepperDriver.h"
+
+/*!
+ * @var stepper_patterns
+ *
+ * @brief Coils energized at each phase of the full-step sequence, bit 0 =
+ *        coil 1: 1010, 0110, 0101, 1001.
+ */
+const unsigned char stepper_patterns[STEPPER_PHASES] PROGMEM = {0x05, 0x06, 0x0A, 0x09};
+
+
+/*!
+ * @brief Constructor.  The coils are left alone until the first step.
+ *
+ * @param steps_per_rev  full steps per revolution of the shaft
+ */
+StepperDriver::StepperDriver(unsigned int steps_per_rev){
+  this->steps_per_rev = steps_per_rev;
+  this->step_delay_us = 0;
+  this->last_step_us = 0;
+  this->phase = 0;
+}
+
+
+/*!
+ * @brief Set how fast step() turns the shaft
+ *
+ * @param rpm  revolutions per minute
+ */
+void StepperDriver::set_speed(unsigned int rpm){
+  step_delay_us = 60UL * 1000UL * 1000UL / steps_per_rev / rpm;
+}
+
+
+/*!
+ * @brief Move one step right now, without waiting.  Cheap enough for an
+ *        interrupt handler.
+ *
+ * @param forward  TRUE for positive steps
+ */
+void StepperDriver::single_step(bool forward){
+  phase = (phase + (forward ? 1 : STEPPER_PHASES - 1)) % STEPPER_PHASES;
+  write_coils(pgm_read_byte(&stepper_patterns[phase]));
+}
+
+
+/*!
+ * @brief Move a number of steps at the speed from set_speed().  Blocks 
+ *        until done.
+ *
+ * @param steps  how far to move; negative steps go backward
+ */
+void StepperDriver::step(int steps){
+  bool forward = steps > 0;
+  unsigned int steps_left = forward ? steps : -steps;
+  while(steps_left > 0){
+    unsigned long now = micros();
+    if(now - last_step_us >= step_delay_us){
+      last_step_us = now;
+      single_step(forward);
+      steps_left--;
+    }
+  }
+}
+
+
+/*!
+ * @brief Constructor
+ *
+ * @param steps_per_rev  full steps per revolution of the shaft
+ * @param pin1...pin4    coil inputs, in the Stepper library's order
+ */
+RuntimeStepper::RuntimeStepper(unsigned int steps_per_rev, unsigned char pin1, unsigned char pin2,
+                               unsigned char pin3, unsigned char pin4)
+  : StepperDriver(steps_per_rev), coil1(pin1), coil2(pin2), coil3(pin3), coil4(pin4){
+}
+
+
+/*!
+ * @brief Make the coil pins outputs
+ */
+void RuntimeStepper::begin(){
+  coil1.set_output();
+  coil2.set_output();
+  coil3.set_output();
+  coil4.set_output();
+}
+
+
+/*!
+ * @brief Write the coils one at a time
+ *
+ * @param pattern  see StepperDriver
+ */
+void RuntimeStepper::write_coils(unsigned char pattern){
+  coil1.write(pattern & 0x01);
+  coil2.write(pattern & 0x02);
+  coil3.write(pattern & 0x04);
+  coil4.write(pattern & 0x08);
+}
@@ -0,0 +1,136 @@
+/*!
+ * @file StepperDriver.h
+ *
+ * @brief Four-wire stepper motor driver, with the coils written straight
+ *        to the port registers
+ *
+ */
+#ifndef STEPPER_DRIVER_H
+#define STEPPER_DRIVER_H
+
+#include <Arduino.h>
+#include "FastPin.h"
+
+/*! @def STEPPER_PHASES
+ *  Full steps in one cycle of coil patterns.*/
+#define STEPPER_PHASES 4
+
+/*!
+ * @class StepperDriver
+ *
+ * @brief Steps a four-wire stepper through the same full-step sequence as
+ *        the Arduino Stepper library, which it replaces.
+ *
+ * The timing and the sequence live here, and the coils are written by a
+ * subclass: FastStepper for pins known at compile time, RuntimeStepper
+ * for pins that aren't.  A pattern has one bit per coil (bit 0 = coil 1).
+ */
+class StepperDriver{
+private:
+  unsigned int steps_per_rev;   ///<full steps per revolution of the shaft
+  unsigned long step_delay_us;  ///<time between steps, see set_speed()
+  unsigned long last_step_us;   ///<micros() of the last step
+  unsigned char phase;          ///<where in the sequence the motor is, 0 to STEPPER_PHASES-1
+
+protected:
+  virtual void write_coils(unsigned char pattern) = 0;
+
+public:
+  StepperDriver(unsigned int steps_per_rev);
+  virtual void begin() = 0;
+  void set_speed(unsigned int rpm);
+  void single_step(bool forward);
+  void step(int steps);
+};
+
+/*!
+ * @class FastStepper
+ *
+ * @brief StepperDriver with its coil pins fixed at compile time
+ *
+ * All the coils on one port are written with a single store, so a step 
+ * is at most three port writes (one on the Uno's default wiring, plus 
+ * one for the coil on pin 10) instead of four digitalWrite()s.
+ *
+ * @tparam COIL1...COIL4  Arduino pin numbers of the coil inputs, in the 
+ *                        Stepper library's order
+ */
+template <unsigned char COIL1, unsigned char COIL2, unsigned char COIL3, unsigned char COIL4>
+class FastStepper : public StepperDriver{
+private:
+  static_assert(pins_distinct(COIL1, COIL2, COIL3, COIL4), "each coil needs its own pin");
+  typedef FastPin<COIL1> Coil1;
+  typedef FastPin<COIL2> Coil2;
+  typedef FastPin<COIL3> Coil3;
+  typedef FastPin<COIL4> Coil4;
+
+#if FAST_PIN_DIRECT
+  /*!
+   * @brief Write the coils of pattern that are on PORT, in one store.
+   *        Compiles to nothing if no coil is on PORT.
+   */
+  template <unsigned char PORT>
+  static void write_port(unsigned char pattern){
+    const unsigned char mask = Coil1::get_mask_on(PORT) | Coil2::get_mask_on(PORT) |
+                               Coil3::get_mask_on(PORT) | Coil4::get_mask_on(PORT);
+    if(mask == 0)
+      return;
+    unsigned char value = ((pattern & 0x01) ? Coil1::get_mask_on(PORT) : 0) |
+                          ((pattern & 0x02) ? Coil2::get_mask_on(PORT) : 0) |
+                          ((pattern & 0x04) ? Coil3::get_mask_on(PORT) : 0) |
+                          ((pattern & 0x08) ? Coil4::get_mask_on(PORT) : 0);
+    // the servo ISR writes pins on the same ports
+    unsigned char sreg = SREG;
+    cli();
+    volatile uint8_t & output = fast_port_output(PORT);
+    output = (output & (unsigned char)~mask) | value;
+    SREG = sreg;
+  }
+#endif
+
+protected:
+  void write_coils(unsigned char pattern){
+#if FAST_PIN_DIRECT
+    write_port<FAST_PORT_B>(pattern);
+    write_port<FAST_PORT_C>(pattern);
+    write_port<FAST_PORT_D>(pattern);
+#else
+    Coil1::write(pattern & 0x01);
+    Coil2::write(pattern & 0x02);
+    Coil3::write(pattern & 0x04);
+    Coil4::write(pattern & 0x08);
+#endif
+  }
+
+public:
+  FastStepper(unsigned int steps_per_rev) : StepperDriver(steps_per_rev){}
+  void begin(){
+    Coil1::set_output();
+    Coil2::set_output();
+    Coil3::set_output();
+    Coil4::set_output();
+  }
+};
+
+/*!
+ * @class RuntimeStepper
+ *
+ * @brief StepperDriver with its coil pins given at run time
+ */
+class RuntimeStepper : public StepperDriver{
+private:
+  RuntimePin coil1;  ///<coil inputs, in the Stepper library's order
+  RuntimePin coil2;
+  RuntimePin coil3;
+  RuntimePin coil4;
+
+protected:
+  void write_coils(unsigned char pattern);
+
+public:
+  RuntimeStepper(unsigned int steps_per_rev, unsigned char pin1, unsigned char pin2,
+                 unsigned char pin3, unsigned char pin4);
+  void begin();
+};
+
+#endif
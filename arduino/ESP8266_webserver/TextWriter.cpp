@@ -0,0 +1,224 @@
+/*!
+ * @file TextWriter.cpp
+ *
+ * @brief Small, type-checked text formatting into a buffer, in place of
+ *        snprintf_P()
+ *
+ */
+#include "TextWriter.h"
+
+/*! @def TEXT_WRITER_MAX_DIGITS
+ *  Digits in the largest unsigned long, in decimal.*/
+#define TEXT_WRITER_MAX_DIGITS 10
+
+
+/*!
+ * @brief Constructor
+ *
+ * @param output  the buffer to write to
+ * @param size    bytes in the buffer, including room for the null
+ * @param length  characters already in the buffer, to write after
+ */
+TextWriter::TextWriter(char * output, unsigned int size, unsigned int length){
+  this->output = output;
+  this->size = size;
+  this->length = (size > 0 && length >= size) ? size - 1 : length;
+  this->truncated = false;
+  if(size > 0)
+    output[this->length] = '\0';
+}
+
+
+/*!
+ * @return characters written so far, not counting the null
+ */
+unsigned int TextWriter::get_length(){
+  return length;
+}
+
+
+/*!
+ * @return TRUE if some of the text didn't fit in the buffer
+ */
+bool TextWriter::is_truncated(){
+  return truncated;
+}
+
+
+/*!
+ * @brief Pads (or cuts) the text to width-1 characters and ends it with
+ *        a '\n', for reports made of fixed-width lines - their length is
+ *        known before they are written.
+ *
+ * @param width  length of the line, including the '\n'.  The buffer must
+ *               have room for width+1 bytes.
+ *
+ * @return width
+ */
+unsigned int TextWriter::end_line(unsigned int width){
+  if(length > width - 1)
+    length = width - 1;
+  put_repeated(' ', (width - 1) - length);
+  put('\n');
+  return length;
+}
+
+
+/*!
+ * @param c  character to append
+ */
+void TextWriter::put(char c){
+  if(length + 1 >= size){
+    truncated = true;
+    return;
+  }
+  output[length++] = c;
+  output[length] = '\0';
+}
+
+
+/*!
+ * @param c      character to append
+ * @param count  times to append it
+ */
+void TextWriter::put_repeated(char c, unsigned int count){
+  while(count-- > 0)
+    put(c);
+}
+
+
+/*!
+ * @param text  null-terminated string in RAM to append
+ */
+void TextWriter::put(const char * text){
+  while(*text != '\0')
+    put(*text++);
+}
+
+
+/*!
+ * @param text  null-terminated PROGMEM string to append, from F() or flash()
+ */
+void TextWriter::put(const __FlashStringHelper * text){
+  PGM_P p = (PGM_P)text;
+  char c;
+  while((c = pgm_read_byte(p++)) != '\0')
+    put(c);
+}
+
+
+/*!
+ * @brief Appends a number in decimal
+ *
+ * @param value  the number
+ * @param width  least number of characters to write
+ * @param fill   written in front of the digits to make up the width
+ */
+void TextWriter::put_unsigned(unsigned long value, unsigned char width, char fill){
+  char digits[TEXT_WRITER_MAX_DIGITS];
+  unsigned char count = 0;
+  if(value <= 0xFFFF){
+    // 16-bit division is several times faster on AVR
+    unsigned int small = value;
+    do{
+      digits[count++] = '0' + (small % 10);
+      small /= 10;
+    }while(small != 0);
+  } else {
+    do{
+      digits[count++] = '0' + (value % 10);
+      value /= 10;
+    }while(value != 0);
+  }
+  if(width > count)
+    put_repeated(fill, width - count);
+  while(count > 0)
+    put(digits[--count]);
+}
+
+
+/*!
+ * @param value  number to append in decimal
+ */
+void TextWriter::put(unsigned char value){
+  put_unsigned(value, 0, ' ');
+}
+
+
+/*!
+ * @param value  number to append in decimal
+ */
+void TextWriter::put(unsigned int value){
+  put_unsigned(value, 0, ' ');
+}
+
+
+/*!
+ * @param value  number to append in decimal
+ */
+void TextWriter::put(unsigned long value){
+  put_unsigned(value, 0, ' ');
+}
+
+
+/*!
+ * @param value  number to append in decimal
+ */
+void TextWriter::put(int value){
+  put((long)value);
+}
+
+
+/*!
+ * @param value  number to append in decimal
+ */
+void TextWriter::put(long value){
+  if(value < 0){
+    put('-');
+    put_unsigned(-(unsigned long)value, 0, ' ');
+  } else {
+    put_unsigned(value, 0, ' ');
+  }
+}
+
+
+/*!
+ * @param piece  PROGMEM string to append in a column, see text_column
+ */
+void TextWriter::put(const text_column & piece){
+  PGM_P p = piece.text;
+  unsigned char written = 0;
+  char c;
+  while(written < piece.width && (c = pgm_read_byte(p++)) != '\0'){
+    put(c);
+    written++;
+  }
+  put_repeated(' ', piece.width - written);
+}
+
+
+/*!
+ * @param piece  number to append in a column, see number_column
+ */
+void TextWriter::put(const number_column & piece){
+  put_unsigned(piece.value, piece.width, ' ');
+}
+
+
+/*!
+ * @param piece  number to append in hex, see hex_number
+ */
+void TextWriter::put(const hex_number & piece){
+  char digits[2*sizeof(unsigned long)];
+  unsigned long value = piece.value;
+  unsigned char count = 0;
+  do{
+    unsigned char nibble = value & 0x0F;
+    digits[count++] = (nibble < 10) ? ('0' + nibble) : ('A' + nibble - 10);
+    value >>= 4;
+  }while(value != 0);
+  if(piece.digits > count)
+    put_repeated('0', piece.digits - count);
+  while(count > 0)
+    put(digits[--count]);
+}
@@ -0,0 +1,154 @@
+/*!
+ * @file TextWriter.h
+ *
+ * @brief Small, type-checked text formatting into a buffer, in place of
+ *        snprintf_P()
+ *
+ * snprintf_P() drags in avr-libc's whole vfprintf (several KB of flash),
+ * parses its format string on every call, and has no idea whether its
+ * arguments match it.  A TextWriter is handed the pieces of the text
+ * instead, and the type of each piece picks how it is written - so a
+ * mismatch is a compile error, and nothing is parsed at run time.
+ */
+#ifndef TEXT_WRITER_H
+#define TEXT_WRITER_H
+
+#include <Arduino.h>
+
+/*!
+ * @struct text_column
+ *
+ * @brief A PROGMEM string, left-justified in a column of a fixed width
+ *        and cut if it is longer (like "%-8.8S").  See column_P().
+ */
+struct text_column{
+  PGM_P text;           ///<PROGMEM string
+  unsigned char width;  ///<characters the column takes
+};
+
+/*!
+ * @struct number_column
+ *
+ * @brief A number, right-justified in a column of at least a fixed width
+ *        (like "%10lu").  See column().
+ */
+struct number_column{
+  unsigned long value;  ///<the number
+  unsigned char width;  ///<characters the column takes, at least
+};
+
+/*!
+ * @struct hex_number
+ *
+ * @brief A number in upper case hex, zero-padded to a number of digits
+ *        (like "%02X").  See hex_digits().
+ */
+struct hex_number{
+  unsigned long value;  ///<the number
+  unsigned char digits; ///<digits to write, at least
+};
+
+/*!
+ * @return text, marked as a PROGMEM string for TextWriter::print() (the
+ *         same as F(), for strings that are already in PROGMEM)
+ */
+inline const __FlashStringHelper * flash(PGM_P text){
+  return (const __FlashStringHelper *)text;
+}
+
+/*!
+ * @return text in a column of width characters, see text_column
+ */
+inline text_column column_P(PGM_P text, unsigned char width){
+  text_column result = {text, width};
+  return result;
+}
+
+/*!
+ * @return value in a column of width characters, see number_column
+ */
+inline number_column column(unsigned long value, unsigned char width){
+  number_column result = {value, width};
+  return result;
+}
+
+/*!
+ * @return value as digits hex digits, see hex_number
+ */
+inline hex_number hex_digits(unsigned long value, unsigned char digits){
+  hex_number result = {value, digits};
+  return result;
+}
+
+/*!
+ * @class TextWriter
+ *
+ * @brief Appends text to a buffer, and keeps it null-terminated.
+ *
+ * Like snprintf(), it never writes past the end of the buffer, and the
+ * text is cut short if it doesn't fit (see is_truncated()).  Unlike
+ * snprintf(), the length is tracked as it goes, so there is no strlen()
+ * afterwards, and a writer can pick up where an earlier one stopped.
+ *
+ * What is written depends on the type of each piece:
+ *  * F("...") or flash(pointer): a PROGMEM string
+ *  * const char *: a string in RAM
+ *  * char: one character
+ *  * unsigned char/int/long and int/long: a number, in decimal.  Numbers
+ *    that fit in 16 bits skip the (slow, on AVR) 32-bit division.
+ *  * column_P(), column(), hex_digits(): see text_column, number_column
+ *    and hex_number
+ *
+ * Usage:<pre>
+ *    char command[20];
+ *    unsigned int length = TextWriter(command, sizeof(command))
+ *                            .print(F("AT+CIPSEND="), channel, ',', count, F("\r\n"));</pre>
+ */
+class TextWriter{
+private:
+  char * output;        ///<the buffer, always null-terminated
+  unsigned int size;    ///<bytes in the buffer, including the null
+  unsigned int length;  ///<characters written so far
+  bool truncated;       ///<something didn't fit
+
+  void put_unsigned(unsigned long value, unsigned char width, char fill);
+  void put_repeated(char c, unsigned int count);
+
+public:
+  TextWriter(char * output, unsigned int size, unsigned int length = 0);
+  unsigned int get_length();
+  bool is_truncated();
+  unsigned int end_line(unsigned int width);
+
+  void put(char c);
+  void put(const char * text);
+  void put(const __FlashStringHelper * text);
+  void put(unsigned char value);
+  void put(unsigned int value);
+  void put(unsigned long value);
+  void put(int value);
+  void put(long value);
+  void put(const text_column & piece);
+  void put(const number_column & piece);
+  void put(const hex_number & piece);
+
+  /*!
+   * @brief Write each piece in turn.  See the class description for what
+   *        the types of pieces do.
+   *
+   * @return the length of the text so far
+   */
+  template <typename Piece, typename... Pieces>
+  unsigned int print(const Piece & piece, const Pieces &... pieces){
+    put(piece);
+    return print(pieces...);
+  }
+  /*!
+   * @return the length of the text so far
+   */
+  unsigned int print(){
+    return length;
+  }
+};
+
+#endif
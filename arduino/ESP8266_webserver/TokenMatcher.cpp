@@ -0,0 +1,162 @@
+/*!
+ * @file TokenMatcher.cpp
+ *
+ * @brief Finds every token of tokens.h in a line, one byte at a time
+ *
+ */
+#include "TokenMatcher.h"
+
+/*! @def TOKEN_TEXT_ENTRY
+ *  Turns a TOKEN_LIST entry into a step of token_text().*/
+#define TOKEN_TEXT_ENTRY(id, text) (token == id) ? text :
+
+/*!
+ * @return the text of a token, at compile time, to check the generated
+ *         automaton against tokens.h
+ */
+constexpr const char * token_text(int token){
+  return TOKEN_LIST(TOKEN_TEXT_ENTRY) "";
+}
+
+/*!
+ * @return TRUE if two strings are the same, at compile time
+ */
+constexpr bool token_text_is(const char * a, const char * b){
+  return *a == *b && (*a == '\0' || token_text_is(a + 1, b + 1));
+}
+
+// Only this file includes the automaton, and it checks itself against tokens.h
+#include "token_automaton.hh"
+
+
+/*!
+ * @brief Looks a token up among the hits of a line
+ *
+ * @param hits    from TokenMatcher::get_hits(), or a request_view
+ * @param token   one of token_id
+ * @param offset  set to where in the line the token starts, if found
+ *
+ * @return TRUE if the token was found
+ */
+bool find_token(const token_hits &hits, unsigned char token, unsigned int * offset){
+  for(unsigned char i = 0; i < hits.count; i++){
+    if(hits.hit[i].token == token){
+      *offset = hits.hit[i].offset;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*!
+ * @param token  one of token_id
+ *
+ * @return characters in the token
+ */
+unsigned char get_token_length(unsigned char token){
+  if(token >= TOKEN_COUNT)
+    return 0;
+  return pgm_read_byte(&token_length[token]);
+}
+
+
+/*!
+ * @brief Constructor
+ */
+TokenMatcher::TokenMatcher(){
+  reset();
+}
+
+
+/*!
+ * @brief Start a new line: forget the hits, and go back to the root
+ */
+void TokenMatcher::reset(){
+  state = 0;
+  position = 0;
+  hits.count = 0;
+}
+
+
+/*!
+ * @brief Take one step of the automaton, and note any tokens that end at
+ *        this byte
+ *
+ * @param c  the next byte of the line
+ */
+void TokenMatcher::feed(char c){
+  unsigned char ch = c;
+  position++;
+  if(ch & 0x80){
+    state = 0;  // no token has such a character
+    return;
+  }
+  // A state only stores its transitions that don't lead where the root's do
+  unsigned char next = pgm_read_byte(&token_root[ch]);
+  unsigned int edge = pgm_read_word(&token_edge_start[state]);
+  unsigned int edge_end = pgm_read_word(&token_edge_start[state + 1]);
+  for(; edge < edge_end; edge++){
+    char edge_char = pgm_read_byte(&token_edge_char[edge]);
+    if(edge_char >= (char)ch){
+      if(edge_char == (char)ch)
+        next = pgm_read_byte(&token_edge_next[edge]);
+      break;
+    }
+  }
+  state = next;
+
+  // Nearly every state ends no token, and the rest end one or two
+  unsigned char output_state = state;
+  while(output_state != 0){
+    unsigned char token = pgm_read_byte(&token_output[output_state]);
+    if(token != TOKEN_NONE)
+      add_hit(token);
+    output_state = pgm_read_byte(&token_output_link[output_state]);
+  }
+}
+
+
+/*!
+ * @brief Note a token that ends at the byte just fed, unless it was
+ *        found earlier in the line or there is no room left
+ *
+ * @param token  one of token_id
+ */
+void TokenMatcher::add_hit(unsigned char token){
+  unsigned int offset;
+  if(hits.count >= TOKEN_MAX_HITS || find_token(hits, token, &offset))
+    return;
+  hits.hit[hits.count].token = token;
+  hits.hit[hits.count].offset = position - pgm_read_byte(&token_length[token]);
+  hits.count++;
+}
+
+
+/*!
+ * @brief The first byte of the line was lost (e.g. the input buffer
+ *        overflowed): move the hits so they stay relative to the start
+ *        of what is left, and forget any that started in the lost byte.
+ */
+void TokenMatcher::drop_first(){
+  if(position == 0)
+    return;
+  position--;
+  unsigned char kept = 0;
+  for(unsigned char i = 0; i < hits.count; i++){
+    if(hits.hit[i].offset == 0)
+      continue;
+    hits.hit[kept].token = hits.hit[i].token;
+    hits.hit[kept].offset = hits.hit[i].offset - 1;
+    kept++;
+  }
+  hits.count = kept;
+}
+
+
+/*!
+ * @return the tokens found since reset()
+ */
+const token_hits & TokenMatcher::get_hits(){
+  return hits;
+}
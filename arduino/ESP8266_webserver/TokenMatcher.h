@@ -0,0 +1,80 @@
+/*!
+ * @file TokenMatcher.h
+ *
+ * @brief Finds every token of tokens.h in a line, one byte at a time
+ *
+ */
+#ifndef TOKEN_MATCHER_H
+#define TOKEN_MATCHER_H
+
+#include <Arduino.h>
+#include "tokens.h"
+
+/*! @def TOKEN_MAX_HITS
+ *  Most tokens remembered per line.  A request line has four at most
+ *  (e.g. "+IPD,", "GET", "settings", "/info/settings").*/
+#define TOKEN_MAX_HITS 6
+
+/*!
+ * @struct token_hit
+ *
+ * @brief A token found in a line
+ */
+struct token_hit{
+  unsigned char token;  ///<one of token_id
+  unsigned int offset;  ///<where in the line it starts
+};
+
+/*!
+ * @struct token_hits
+ *
+ * @brief The tokens found in a line, first occurrence of each, in the
+ *        order they ended
+ */
+struct token_hits{
+  token_hit hit[TOKEN_MAX_HITS];  ///<the tokens found
+  unsigned char count;            ///<number of entries in hit
+};
+
+bool find_token(const token_hits &hits, unsigned char token, unsigned int * offset);
+unsigned char get_token_length(unsigned char token);
+
+/*!
+ * @class TokenMatcher
+ *
+ * @brief Aho-Corasick automaton over every token, fed as bytes arrive
+ *
+ * The automaton is built on the host by tools/token_compiler, and lives
+ * in PROGMEM (see token_automaton.hh).  Each byte is one transition, no
+ * matter how many tokens there are, and no byte is looked at twice -
+ * unlike searching the finished line once per string.  Tokens ending
+ * inside longer ones are found too (e.g. "settings" in
+ * "/info/settings").
+ *
+ * Usage:<pre>
+ *    TokenMatcher matcher;
+ *    // for each byte of the line:
+ *    matcher.feed(c);
+ *    // at the end of the line:
+ *    unsigned int offset;
+ *    if(find_token(matcher.get_hits(), TOKEN_IPD, &offset) && offset == 0)
+ *      ...
+ *    matcher.reset();</pre>
+ */
+class TokenMatcher{
+private:
+  unsigned char state;    ///<where the automaton is
+  unsigned int position;  ///<bytes fed since reset()
+  token_hits hits;        ///<what was found since reset()
+
+  void add_hit(unsigned char token);
+
+public:
+  TokenMatcher();
+  void reset();
+  void feed(char c);
+  void drop_first();
+  const token_hits & get_hits();
+};
+
+#endif
@@ -0,0 +1,177 @@
+/*!
+ * @file Trace.cpp
+ *
+ * @brief Timeline of what happened to each request, kept in a small RAM
+ *        ring
+ *
+ */
+#include "Trace.h"
+#include "TextWriter.h"
+
+static trace_event trace_ring[TRACE_EVENTS];  ///<the last TRACE_EVENTS events
+static unsigned int trace_count = 0;          ///<events recorded since boot, wraps
+static bool trace_full = false;               ///<TRUE once the ring has gone round
+static unsigned char next_request = 0;        ///<id the next request gets
+/*! @var channel_request
+ *  Request on each connection.*/
+static unsigned char channel_request[TRACE_CHANNELS] = {
+  TRACE_NO_REQUEST, TRACE_NO_REQUEST, TRACE_NO_REQUEST, TRACE_NO_REQUEST, TRACE_NO_REQUEST};
+static unsigned char channel_open = 0;        ///<bit per connection whose request is still going
+
+const char trace_name_ipd[] PROGMEM = "ipd";
+const char trace_name_routed[] PROGMEM = "route";
+const char trace_name_cipsend[] PROGMEM = "cipsend";
+const char trace_name_prompt[] PROGMEM = "prompt";
+const char trace_name_payload_done[] PROGMEM = "payload";
+const char trace_name_send_ok[] PROGMEM = "send_ok";
+const char trace_name_send_fail[] PROGMEM = "send_err";
+const char trace_name_close_ok[] PROGMEM = "close_ok";
+const char trace_name_close_fail[] PROGMEM = "close_err";
+const char trace_name_closed[] PROGMEM = "closed";
+const char trace_name_motion_start[] PROGMEM = "mot_beg";
+const char trace_name_motion_end[] PROGMEM = "mot_end";
+/*! @var trace_names
+ *  Name of each trace_phase in the dump, in order.*/
+const char * const trace_names[TRACE_PHASES] PROGMEM = {
+  trace_name_ipd, trace_name_routed, trace_name_cipsend, trace_name_prompt,
+  trace_name_payload_done, trace_name_send_ok, trace_name_send_fail,
+  trace_name_close_ok, trace_name_close_fail, trace_name_closed,
+  trace_name_motion_start, trace_name_motion_end};
+
+
+/*!
+ * @brief Add an event to the ring, over the oldest one
+ *
+ * @param request  request id, or TRACE_NO_REQUEST
+ * @param phase    one of trace_phase
+ */
+void trace_request(unsigned char request, unsigned char phase){
+  trace_event * event = &trace_ring[trace_count % TRACE_EVENTS];
+  event->time_us = micros();
+  event->request = request;
+  event->phase = phase;
+  trace_count++;
+  if(trace_count % TRACE_EVENTS == 0)
+    trace_full = true;
+}
+
+
+/*!
+ * @brief "+IPD" data arrived.  Unless the connection's request is still
+ *        going, this is a new request, and it gets the next id.
+ *
+ * @param channel  the connection
+ */
+void trace_ipd(unsigned char channel){
+  if(channel >= TRACE_CHANNELS)
+    return;
+  if(!(channel_open & _BV(channel))){
+    channel_open |= _BV(channel);
+    channel_request[channel] = next_request;
+    next_request = (next_request + 1) % TRACE_NO_REQUEST;
+  }
+  trace_request(channel_request[channel], TRACE_IPD);
+}
+
+
+/*!
+ * @brief Record a step of the request on a connection
+ *
+ * @param channel  the connection
+ * @param phase    one of trace_phase
+ */
+void trace_channel(unsigned char channel, unsigned char phase){
+  trace_request(get_trace_request(channel), phase);
+}
+
+
+/*!
+ * @brief Record the end of a connection; its next "+IPD" is a new
+ *        request.
+ *
+ * @param channel  the connection
+ * @param phase    TRACE_CLOSE_OK, TRACE_CLOSE_FAIL or TRACE_CLOSED
+ */
+void trace_channel_closed(unsigned char channel, unsigned char phase){
+  trace_channel(channel, phase);
+  if(channel < TRACE_CHANNELS)
+    channel_open &= ~_BV(channel);
+}
+
+
+/*!
+ * @param channel  a connection
+ *
+ * @return id of the request on channel, e.g. to hand to the move it
+ *         asks for; TRACE_NO_REQUEST if there is none
+ */
+unsigned char get_trace_request(unsigned char channel){
+  return channel < TRACE_CHANNELS ? channel_request[channel] : TRACE_NO_REQUEST;
+}
+
+
+/*!
+ * @return events recorded so far (wrapping at 65536): where a dump ends.
+ *         Pass a copy to trace_generator() as its context.
+ */
+unsigned int get_trace_count(){
+  return trace_count;
+}
+
+
+/*!
+ * @return length of a dump, TRACE_EVENTS lines
+ */
+unsigned int get_trace_length(){
+  return TRACE_EVENTS * TRACE_LINE_LEN;
+}
+
+
+/*!
+ * @brief Format one line of a dump
+ *
+ * @param sequence  which event, counted like get_trace_count()
+ * @param output    at least TRACE_LINE_LEN+1 bytes
+ */
+static void format_trace_line(unsigned int sequence, char * output){
+  TextWriter line(output, TRACE_LINE_LEN + 1);
+  unsigned int age = trace_count - sequence;
+  if(age == 0 || age > TRACE_EVENTS || (!trace_full && sequence >= trace_count)){
+    // not recorded yet, or written over since the dump was queued
+    line.print('-');
+  } else {
+    const trace_event & event = trace_ring[sequence % TRACE_EVENTS];
+    PGM_P name = (PGM_P)pgm_read_word(&trace_names[event.phase]);
+    line.print(column(event.time_us, 10), ' ', column(event.request, 3), ' ', flash(name));
+  }
+  // pad to the fixed width, so the Content-Length is known up front
+  line.end_line(TRACE_LINE_LEN);
+}
+
+
+/*!
+ * @brief OutputQueue segment_generator for a dump of the ring, oldest
+ *        event first.
+ *
+ * Queue it with get_trace_length() as the length, and a pointer to the
+ * get_trace_count() of when the dump was asked for as the context: it
+ * dumps the TRACE_EVENTS events before that.  Events recorded while the
+ * dump is being sent are left out, and lines whose event has been written
+ * over by then are "-".
+ */
+unsigned int trace_generator(void * context, unsigned int offset, char * output, unsigned int output_size){
+  unsigned int end = *(unsigned int *)context;
+  char line[TRACE_LINE_LEN + 1];
+  unsigned int produced = 0;
+  while(produced < output_size && offset < get_trace_length()){
+    unsigned int column = offset % TRACE_LINE_LEN;
+    format_trace_line(end - TRACE_EVENTS + offset / TRACE_LINE_LEN, line);
+    unsigned int wanted = TRACE_LINE_LEN - column;
+    if(wanted > output_size - produced)
+      wanted = output_size - produced;
+    memcpy(output + produced, line + column, wanted);
+    produced += wanted;
+    offset += wanted;
+  }
+  return produced;
+}
@@ -0,0 +1,86 @@
+/*!
+ * @file Trace.h
+ *
+ * @brief Timeline of what happened to each request, kept in a small RAM
+ *        ring
+ *
+ * The /metrics counters say how long things take on average; the trace
+ * says why one request took long.  Each step of a request - its +IPD,
+ * the route, every AT+CIPSEND and its '>' prompt and "SEND OK", the
+ * close, and the move it asked for - is recorded with its micros() time
+ * and the request's id.  The last TRACE_EVENTS events are kept.
+ *
+ * A request gets its id with its first +IPD, and keeps it until its
+ * connection is closed.  Events are recorded by connection (channel),
+ * except for moves, which outlive the connection and carry their id.
+ *
+ * GET /debug/trace dumps the ring, oldest first, one event per line:<pre>
+ *   <micros()> <request id> <phase></pre>
+ * and tools/trace_converter turns a dump into Chrome trace-event JSON,
+ * for chrome://tracing or ui.perfetto.dev.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <Arduino.h>
+
+/*! @def TRACE_EVENTS
+ *  Events kept, 6 bytes of RAM each.  A fire request takes about ten, so
+ *  this holds the last one whole.  Must be a power of two, so the ring 
+ *  index survives the event counter wrapping.*/
+#define TRACE_EVENTS 16
+static_assert(TRACE_EVENTS >= 2 && (TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0,
+              "TRACE_EVENTS must be a power of two");
+/*! @def TRACE_CHANNELS
+ *  Connections the ESP8266 can have, 0 to 4.*/
+#define TRACE_CHANNELS 5
+/*! @def TRACE_NO_REQUEST
+ *  Request id of events that belong to no request.*/
+#define TRACE_NO_REQUEST 0xFF
+/*! @def TRACE_LINE_LEN
+ *  Every line of the dump is exactly this long, including the '\n', so
+ *  the dump length is known before it is generated.*/
+#define TRACE_LINE_LEN 24
+
+/*!
+ * @enum trace_phase
+ *
+ * @brief Steps of a request.  The names in the dump are in Trace.cpp.
+ */
+enum trace_phase{
+  TRACE_IPD,           ///<"+IPD" data arrived for the request
+  TRACE_ROUTED,        ///<the request line was matched to what it asks for
+  TRACE_CIPSEND,       ///<AT+CIPSEND of a response segment was sent
+  TRACE_PROMPT,        ///<the ESP8266's '>' prompt for the segment
+  TRACE_PAYLOAD_DONE,  ///<the segment data was written to the serial port
+  TRACE_SEND_OK,       ///<"SEND OK" for the segment
+  TRACE_SEND_FAIL,     ///<the segment failed, it is sent again
+  TRACE_CLOSE_OK,      ///<AT+CIPCLOSE of the connection finished
+  TRACE_CLOSE_FAIL,    ///<AT+CIPCLOSE of the connection failed or timed out
+  TRACE_CLOSED,        ///<the ESP8266 reported the connection closed
+  TRACE_MOTION_START,  ///<the motion task started the requested move
+  TRACE_MOTION_END,    ///<the move is done
+  TRACE_PHASES         ///<number of phases
+};
+
+/*!
+ * @struct trace_event
+ *
+ * @brief One entry of the ring
+ */
+struct trace_event{
+  unsigned long time_us;  ///<micros() when it happened
+  unsigned char request;  ///<request id, or TRACE_NO_REQUEST
+  unsigned char phase;    ///<one of trace_phase
+};
+
+void trace_ipd(unsigned char channel);
+void trace_channel(unsigned char channel, unsigned char phase);
+void trace_channel_closed(unsigned char channel, unsigned char phase);
+void trace_request(unsigned char request, unsigned char phase);
+unsigned char get_trace_request(unsigned char channel);
+unsigned int get_trace_count();
+unsigned int get_trace_length();
+unsigned int trace_generator(void * context, unsigned int offset, char * output, unsigned int output_size);
+
+#endif
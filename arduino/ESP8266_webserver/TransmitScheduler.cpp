@@ -0,0 +1,395 @@
+/*!
+ * @file TransmitScheduler.cpp
+ *
+ * @brief Sends responses to the ESP8266 in acknowledged segments, taking
+ *        turns between connections.
+ *
+ */
+#include "TransmitScheduler.h"
+
+/*!
+ * @brief Constructor
+ *
+ * @param port          already-initialized transport to the ESP8266
+ * @param at            the AT engine that talks to the same ESP8266
+ * @param streams       storage for the responses on their way, one per
+ *                      connection that can be answered at once
+ * @param stream_count  number of streams, 2 to TX_MAX_STREAMS
+ */
+TransmitScheduler::TransmitScheduler(EspTransport * port, AtEngine * at,
+                                     tx_stream * streams, unsigned char stream_count){
+  this->port = port;
+  this->at = at;
+  this->streams = streams;
+  this->stream_count = stream_count;
+  for(unsigned char lane = 0; lane < TX_LANES; lane++)
+    this->turn[lane] = 0;
+  this->active = TX_NO_STREAM;
+  this->retry_after_ms = 0;
+  this->backing_off = false;
+  for(unsigned char i = 0; i < stream_count; i++)
+    this->streams[i].state = TX_FREE;
+}
+
+
+/*!
+ * @param channel  a connection
+ *
+ * @return index of the stream going to channel, or TX_NO_STREAM
+ */
+unsigned char TransmitScheduler::find_stream(unsigned char channel){
+  for(unsigned char i = 0; i < stream_count; i++){
+    if(streams[i].state != TX_FREE && streams[i].channel == channel)
+      return i;
+  }
+  return TX_NO_STREAM;
+}
+
+
+/*!
+ * @brief Start a response to a connection.  Queue it into the returned
+ *        queue, then hand it over with send().
+ *
+ * @param channel  the connection to respond to
+ * @param lane     one of tx_lane
+ *
+ * @return an empty queue for the response, or NULL if the lane has no
+ *         room or the connection already has a response on its way
+ */
+OutputQueue * TransmitScheduler::open(unsigned char channel, unsigned char lane){
+  if(find_stream(channel) != TX_NO_STREAM || !has_room(lane))
+    return NULL;
+  for(unsigned char i = 0; i < stream_count; i++){
+    tx_stream * stream = &streams[i];
+    if(stream->state != TX_FREE)
+      continue;
+    stream->queue.clear_elements();
+    stream->in_flight = 0;
+    stream->acked = 0;
+    stream->deficit = 0;
+    stream->channel = channel;
+    stream->lane = lane;
+    stream->retries = 0;
+    stream->state = TX_FILLING;
+    return &stream->queue;
+  }
+  return NULL;
+}
+
+
+/*!
+ * @brief Hand over a response queued since open().  It goes out from poll().
+ *
+ * @param channel  the connection passed to open()
+ */
+void TransmitScheduler::send(unsigned char channel){
+  unsigned char index = find_stream(channel);
+  if(index == TX_NO_STREAM || streams[index].state != TX_FILLING)
+    return;
+  streams[index].state = streams[index].queue.is_empty() ? TX_CLOSING : TX_SENDING;
+}
+
+
+/*!
+ * @brief Get back at a response that was opened but not sent yet, e.g.
+ *        one that waits for an AT command to finish.
+ *
+ * @param channel  the connection passed to open()
+ *
+ * @return its queue, or NULL if the connection has gone away since (or
+ *         the response was sent already)
+ */
+OutputQueue * TransmitScheduler::get_filling(unsigned char channel){
+  unsigned char index = find_stream(channel);
+  if(index == TX_NO_STREAM || streams[index].state != TX_FILLING)
+    return NULL;
+  return &streams[index].queue;
+}
+
+
+/*!
+ * @brief The connection went away: forget its response.
+ *
+ * The ESP8266 reports the close of our own AT+CIPCLOSE too, before its
+ * OK.  That stream is left to close_done(), which knows how the close
+ * ended.
+ *
+ * @param channel  the connection that closed
+ *
+ * @return FALSE if it was our AT+CIPCLOSE in flight that closed it
+ */
+bool TransmitScheduler::drop(unsigned char channel){
+  unsigned char index = find_stream(channel);
+  if(index == TX_NO_STREAM)
+    return true;
+  if(index == active && streams[index].state == TX_CLOSING)
+    return false;
+  // A command in flight still needs its stream, to write its data at the prompt
+  streams[index].state = (index == active) ? TX_DROPPED : TX_FREE;
+  return true;
+}
+
+
+/*!
+ * @brief Forget every response, e.g. after the ESP8266 restarted.
+ */
+void TransmitScheduler::drop_all(){
+  for(unsigned char i = 0; i < stream_count; i++){
+    if(streams[i].state != TX_FREE)
+      streams[i].state = (i == active) ? TX_DROPPED : TX_FREE;
+  }
+}
+
+
+/*!
+ * @param channel  a connection
+ *
+ * @return TRUE while the response to channel still reads from its queue,
+ *         i.e. until its last segment has been written
+ */
+bool TransmitScheduler::is_sending(unsigned char channel){
+  unsigned char index = find_stream(channel);
+  if(index == TX_NO_STREAM)
+    return false;
+  unsigned char state = streams[index].state;
+  return state == TX_FILLING || state == TX_SENDING || (state == TX_DROPPED && index == active);
+}
+
+
+/*!
+ * @param lane  one of tx_lane
+ *
+ * @return TRUE if open() would find a stream in lane for a new connection
+ */
+bool TransmitScheduler::has_room(unsigned char lane){
+  unsigned char free_streams = 0;
+  unsigned char bulk_streams = 0;
+  for(unsigned char i = 0; i < stream_count; i++){
+    if(streams[i].state == TX_FREE)
+      free_streams++;
+    else if(streams[i].lane == TX_LANE_BULK)
+      bulk_streams++;
+  }
+  if(lane == TX_LANE_BULK && bulk_streams + 1 >= stream_count)
+    return false;
+  return free_streams > 0;
+}
+
+
+/*!
+ * @brief Send the next segment or close the next finished connection,
+ *        unless a command of mine is still in flight.  Control segments
+ *        come first, then closes, then bulk segments.
+ */
+void TransmitScheduler::poll(){
+  if(active != TX_NO_STREAM)
+    return;
+  if(backing_off){
+    if((millis() - retry_after_ms) < TX_RETRY_BACKOFF_MS)
+      return;
+    backing_off = false;
+  }
+  unsigned int length;
+  unsigned char index = pick_stream(TX_LANE_CONTROL, &length);
+  if(index != TX_NO_STREAM){
+    start_segment(index, length);
+    return;
+  }
+  // Closing is quick, and frees a stream for the next request
+  for(unsigned char i = 0; i < stream_count; i++){
+    if(streams[i].state == TX_CLOSING){
+      start_close(i);
+      return;
+    }
+  }
+  index = pick_stream(TX_LANE_BULK, &length);
+  if(index != TX_NO_STREAM)
+    start_segment(index, length);
+}
+
+
+/*!
+ * @brief Deficit round robin: the stream whose turn it is keeps it as
+ *        long as its next segment fits its allowance.  Then the turn
+ *        passes on, and the next stream's allowance grows by TX_QUANTUM.
+ *
+ * @param lane    only streams in this lane take turns, one of tx_lane
+ * @param length  set to the length of the picked stream's next segment
+ *
+ * @return index of the stream to send from, or TX_NO_STREAM if none in
+ *         the lane is sending
+ */
+unsigned char TransmitScheduler::pick_stream(unsigned char lane, unsigned int * length){
+  // enough turns for any sending stream to save up a full segment
+  const unsigned char max_visits = stream_count * (TX_SEGMENT_LEN / TX_QUANTUM + 1);
+  unsigned char index = turn[lane];
+  for(unsigned char visit = 0; visit <= max_visits; visit++){
+    tx_stream * stream = &streams[index];
+    if(stream->state == TX_SENDING && stream->lane == lane){
+      unsigned int next = stream->queue.get_total_size();
+      if(next > TX_SEGMENT_LEN)
+        next = TX_SEGMENT_LEN;
+      if(next <= stream->deficit){
+        *length = next;
+        turn[lane] = index;
+        return index;
+      }
+    }
+    index = (index + 1) % stream_count;
+    if(streams[index].state == TX_SENDING && streams[index].lane == lane)
+      streams[index].deficit += TX_QUANTUM;
+  }
+  turn[lane] = index;
+  return TX_NO_STREAM;
+}
+
+
+/*!
+ * @brief Announce a segment with AT+CIPSEND.  The data goes out at the
+ *        prompt, see on_prompt().
+ *
+ * @param index   the stream to send from
+ * @param length  bytes in the segment
+ */
+void TransmitScheduler::start_segment(unsigned char index, unsigned int length){
+  tx_stream * stream = &streams[index];
+  TextWriter(command, TX_COMMAND_BUFFER_SIZE).print(F("AT+CIPSEND="), stream->channel, ',', length, F("\r\n"));
+  at_command request = {command, NULL, NULL, on_segment_done, this,
+                        TX_SEGMENT_TIMEOUT_MS, AT_EXPECT_PROMPT, on_prompt};
+  active = index;
+  if(!at->submit(request)){
+    // the AT engine is full - try again on the next poll
+    active = TX_NO_STREAM;
+    return;
+  }
+  stream->queue.mark(&stream->segment_start);
+  stream->in_flight = length;
+  stream->deficit -= length;
+  trace_channel(stream->channel, TRACE_CIPSEND);
+}
+
+
+/*!
+ * @brief Close a stream's connection with AT+CIPCLOSE
+ *
+ * @param index  the stream whose connection to close
+ */
+void TransmitScheduler::start_close(unsigned char index){
+  TextWriter(command, TX_COMMAND_BUFFER_SIZE).print(F("AT+CIPCLOSE="), streams[index].channel, F("\r\n"));
+  at_command request = {command, NULL, NULL, on_close_done, this,
+                        TX_CLOSE_TIMEOUT_MS, 0, NULL};
+  active = index;
+  if(!at->submit(request))
+    active = TX_NO_STREAM;
+}
+
+
+/*!
+ * AT engine callback: writes the segment in flight at the '>' prompt.
+ * The ESP8266 waits for exactly the announced number of bytes, so if the
+ * queue comes up short the rest is padded.
+ */
+void TransmitScheduler::on_prompt(void * context){
+  TransmitScheduler * transmit = (TransmitScheduler *)context;
+  if(transmit->active == TX_NO_STREAM)
+    return;
+  tx_stream * stream = &transmit->streams[transmit->active];
+  trace_channel(stream->channel, TRACE_PROMPT);
+  char chunk[TX_CHUNK_SIZE];
+  unsigned int written = 0;
+  while(written < stream->in_flight){
+    unsigned int wanted = stream->in_flight - written;
+    if(wanted > TX_CHUNK_SIZE)
+      wanted = TX_CHUNK_SIZE;
+    unsigned int chunk_len = stream->queue.read(chunk, wanted);
+    if(chunk_len == 0){
+      Serial.println(F("| TransmitScheduler: response ended early!"));
+      memset(chunk, ' ', wanted);
+      chunk_len = wanted;
+    }
+    transmit->port->write(chunk, chunk_len);
+    written += chunk_len;
+  }
+  trace_channel(stream->channel, TRACE_PAYLOAD_DONE);
+}
+
+
+/*!
+ * AT engine callback: a segment was acknowledged, or it failed.
+ */
+void TransmitScheduler::on_segment_done(void * context, unsigned char result){
+  ((TransmitScheduler *)context)->segment_done(result);
+}
+
+
+/*!
+ * @brief Account for the segment in flight.  A failed segment is read
+ *        again from where it started, and is sent again after a pause.
+ *
+ * @param result  one of at_result
+ */
+void TransmitScheduler::segment_done(unsigned char result){
+  tx_stream * stream = &streams[active];
+  active = TX_NO_STREAM;
+  if(stream->state == TX_DROPPED){
+    stream->state = TX_FREE;
+    return;
+  }
+  if(result == AT_OK){
+    trace_channel(stream->channel, TRACE_SEND_OK);
+    stream->acked += stream->in_flight;
+    stream->in_flight = 0;
+    stream->retries = 0;
+    if(stream->queue.is_empty()){
+      stream->deficit = 0;
+      stream->state = TX_CLOSING;
+    }
+    return;
+  }
+
+  trace_channel(stream->channel, TRACE_SEND_FAIL);
+  stream->queue.rewind(stream->segment_start);
+  stream->deficit += stream->in_flight;
+  stream->in_flight = 0;
+  backing_off = true;
+  retry_after_ms = millis();
+  if(++stream->retries > TX_MAX_RETRIES){
+    Serial.print(F("| WARNING: giving up on the response to channel "));
+    Serial.print(stream->channel, DEC);
+    Serial.print(F(" after "));
+    Serial.print(stream->acked);
+    Serial.println(F(" bytes"));
+    stream->state = TX_CLOSING;
+  }
+}
+
+
+/*!
+ * AT engine callback: a connection was closed.
+ */
+void TransmitScheduler::on_close_done(void * context, unsigned char result){
+  ((TransmitScheduler *)context)->close_done(result);
+}
+
+
+/*!
+ * @brief Free the stream whose connection was just closed.
+ *
+ * @param result  one of at_result
+ */
+void TransmitScheduler::close_done(unsigned char result){
+  tx_stream * stream = &streams[active];
+  active = TX_NO_STREAM;
+  // only drop_all() leaves a closing stream dropped: the ESP8266 restarted,
+  // and the connection's end was traced then
+  if(stream->state != TX_DROPPED){
+    if(result == AT_OK){
+      trace_channel_closed(stream->channel, TRACE_CLOSE_OK);
+    } else {
+      Serial.print(F("| WARNING Failed to close connection to the ESP8266 on channel "));
+      Serial.println(stream->channel, DEC);
+      trace_channel_closed(stream->channel, TRACE_CLOSE_FAIL);
+    }
+  }
+  stream->state = TX_FREE;
+}
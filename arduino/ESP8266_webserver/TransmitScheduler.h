@@ -0,0 +1,173 @@
+/*!
+ * @file TransmitScheduler.h
+ *
+ * @brief Sends responses to the ESP8266 in acknowledged segments, taking
+ *        turns between connections.
+ *
+ */
+#ifndef TRANSMIT_SCHEDULER_H
+#define TRANSMIT_SCHEDULER_H
+
+#include <Arduino.h>
+#include "EspTransport.h"
+#include "AtEngine.h"
+#include "OutputQueue.h"
+#include "TextWriter.h"
+#include "Trace.h"
+
+/*! @def TX_MAX_STREAMS
+ *  Most streams a TransmitScheduler can be given: the ESP8266 has five
+ *  link ids, 0 to 4.*/
+#define TX_MAX_STREAMS 5
+/*! @def TX_SEGMENT_LEN
+ *  Most bytes per AT+CIPSEND.  The ESP8266 takes up to 2048, but the data
+ *  is written out in one go at the prompt, and nothing else is read from
+ *  the port meanwhile - smaller segments keep that short, and let other
+ *  connections take their turn sooner.*/
+#define TX_SEGMENT_LEN 512
+/*! @def TX_QUANTUM
+ *  Bytes a connection may send per turn, on average (deficit round robin).*/
+#define TX_QUANTUM TX_SEGMENT_LEN
+/*! @def TX_MAX_RETRIES
+ *  A segment that fails (SEND FAIL, ERROR, timeout) or finds the ESP8266
+ *  busy is sent again this many times before the connection is given up.*/
+#define TX_MAX_RETRIES 5
+/*! @def TX_RETRY_BACKOFF_MS
+ *  How long to wait before sending a segment again.*/
+#define TX_RETRY_BACKOFF_MS 50
+/*! @def TX_SEGMENT_TIMEOUT_MS
+ *  How long a segment may take, from AT+CIPSEND to "SEND OK".*/
+#define TX_SEGMENT_TIMEOUT_MS 5000
+/*! @def TX_CLOSE_TIMEOUT_MS
+ *  How long AT+CIPCLOSE may take.*/
+#define TX_CLOSE_TIMEOUT_MS 1000
+/*! @def TX_COMMAND_BUFFER_SIZE
+ *  Fits "AT+CIPSEND=<channel>,<length>\r\n" and "AT+CIPCLOSE=<channel>\r\n".*/
+#define TX_COMMAND_BUFFER_SIZE 20
+static_assert(TX_SEGMENT_LEN <= 9999 && sizeof("AT+CIPSEND=0,9999\r\n") <= TX_COMMAND_BUFFER_SIZE,
+              "TX_COMMAND_BUFFER_SIZE must fit the longest AT+CIPSEND");
+/*! @def TX_CHUNK_SIZE
+ *  Segment data is read out of the output queue through a stack buffer of
+ *  this size on its way to the serial port.*/
+#define TX_CHUNK_SIZE 16
+/*! @def TX_NO_STREAM
+ *  Index of no stream.*/
+#define TX_NO_STREAM 0xFF
+
+/*!
+ * @enum tx_lane
+ *
+ * @brief Priority of a response
+ */
+enum tx_lane{
+  TX_LANE_CONTROL,  ///<small replies that someone is waiting on, e.g. to fire; always sent first
+  TX_LANE_BULK,     ///<pages and other large responses
+  TX_LANES          ///<number of lanes
+};
+
+/*!
+ * @enum tx_state
+ *
+ * @brief Where a stream is in its life
+ */
+enum tx_state{
+  TX_FREE,      ///<slot unused
+  TX_FILLING,   ///<handed out by open(), the response is being queued
+  TX_SENDING,   ///<taking turns at sending segments
+  TX_CLOSING,   ///<everything sent (or given up), the connection is to be closed
+  TX_DROPPED    ///<the connection went away while a command for it was in flight
+};
+
+/*!
+ * @struct tx_stream
+ *
+ * @brief One response on its way to a connection
+ */
+struct tx_stream{
+  OutputQueue queue;        ///<what is left to send
+  queue_mark segment_start; ///<where the segment in flight starts, to send it again
+  unsigned int in_flight;   ///<bytes of the segment in flight, not acknowledged yet
+  unsigned int acked;       ///<bytes the ESP8266 has acknowledged with "SEND OK"
+  unsigned int deficit;     ///<bytes this stream may still send in its turn
+  unsigned char channel;    ///<connection the response goes to
+  unsigned char lane;       ///<one of tx_lane
+  unsigned char state;      ///<one of tx_state
+  unsigned char retries;    ///<times the segment in flight has been sent again
+};
+
+/*!
+ * @class TransmitScheduler
+ *
+ * @brief Sends responses without blocking, one acknowledged segment at a time
+ *
+ * A response is queued into a stream from open(), and handed over with
+ * send().  From then on poll() sends it in segments of up to
+ * TX_SEGMENT_LEN bytes: AT+CIPSEND, the data at the '>' prompt, and then
+ * the ESP8266's "SEND OK" before the next segment goes out.  Since the
+ * ESP8266 takes one send at a time, at most one segment is in flight, so
+ * its buffers can't be overrun.
+ *
+ * Every response goes in a lane.  Segments of the control lane always go
+ * first, so a reply to a fire command only waits for the segment in 
+ * flight, not for the page being sent.  Within a lane, streams take turns
+ * by deficit round robin: each turn tops a stream's allowance up by 
+ * TX_QUANTUM bytes, and it may send a segment if the segment fits its 
+ * allowance - so two pages share the link by bytes, not by segments.
+ *
+ * The streams are handed in by the owner, one per connection that can be
+ * answered at once.  The bulk lane may take all but one of them, so 
+ * there is always room for a control reply (or a 503) while pages are 
+ * going out.
+ *
+ * A segment that fails, or that the ESP8266 is too busy to take, is sent
+ * again after TX_RETRY_BACKOFF_MS.  When a response is done, or has been
+ * given up on, its connection is closed with AT+CIPCLOSE.
+ *
+ * Usage:<pre>
+ *    tx_stream streams[3];
+ *    TransmitScheduler transmit(&transport, &at, streams, 3);
+ *    OutputQueue * queue = transmit.open(channel, TX_LANE_BULK);
+ *    if(queue != NULL){
+ *      queue->add_progmem(my_response, sizeof(my_response)-1);
+ *      transmit.send(channel);
+ *    }
+ *    while(true){
+ *      transmit.poll();
+ *      //...feed the AT engine, call at.handle_prompt() at each '>'
+ *    }</pre>
+ */
+class TransmitScheduler{
+private:
+  EspTransport * port;                      ///<where the segment data is written
+  AtEngine * at;                            ///<sends AT+CIPSEND and AT+CIPCLOSE
+  tx_stream * streams;                      ///<one per response, owned by the caller
+  unsigned char stream_count;               ///<number of streams
+  unsigned char turn[TX_LANES];             ///<stream whose turn it is, per lane
+  unsigned char active;                     ///<stream with a command in flight, or TX_NO_STREAM
+  unsigned long retry_after_ms;             ///<when the last failure was, see TX_RETRY_BACKOFF_MS
+  bool backing_off;                         ///<TRUE while waiting to send a segment again
+  char command[TX_COMMAND_BUFFER_SIZE];     ///<the command in flight; the AT engine doesn't copy it
+
+  unsigned char find_stream(unsigned char channel);
+  unsigned char pick_stream(unsigned char lane, unsigned int * length);
+  void start_segment(unsigned char index, unsigned int length);
+  void start_close(unsigned char index);
+  void segment_done(unsigned char result);
+  void close_done(unsigned char result);
+  static void on_prompt(void * context);
+  static void on_segment_done(void * context, unsigned char result);
+  static void on_close_done(void * context, unsigned char result);
+
+public:
+  TransmitScheduler(EspTransport * port, AtEngine * at, tx_stream * streams, unsigned char stream_count);
+  OutputQueue * open(unsigned char channel, unsigned char lane);
+  void send(unsigned char channel);
+  OutputQueue * get_filling(unsigned char channel);
+  void poll();
+  bool drop(unsigned char channel);
+  void drop_all();
+  bool is_sending(unsigned char channel);
+  bool has_room(unsigned char lane);
+};
+
+#endif
@@ -0,0 +1,271 @@
+/*!
+ * @file Watchdog.cpp
+ * 
+ * @brief Hardware watchdog, fed only while every watched task keeps running
+ * 
+ */
+#include "Watchdog.h"
+
+/*! @def RESET_FLAGS
+ *  The reset cause bits of MCUSR.*/
+#define RESET_FLAGS (_BV(WDRF) | _BV(BORF) | _BV(EXTRF) | _BV(PORF))
+
+/*! @var boot_mcusr
+ *  MCUSR as it was at reset, captured before anything else runs.*/
+unsigned char boot_mcusr __attribute__((section(".noinit")));
+/*! @var bootloader_mcusr
+ *  r2 at startup: Optiboot 6 and later clear MCUSR, and leave its old 
+ *  value there.*/
+unsigned char bootloader_mcusr __attribute__((section(".noinit")));
+
+/*!
+ * @brief Saves and clears the reset cause, and stops a watchdog left 
+ *        running by the reset, before the C runtime starts.  The stock
+ *        Uno bootloader clears MCUSR before the sketch starts; newer 
+ *        Optiboots hand the flags over in r2 instead, which nothing 
+ *        before .init3 touches.
+ */
+void capture_reset_cause() __attribute__((naked, used, section(".init3")));
+void capture_reset_cause(){
+  __asm__ __volatile__ ("sts %0, r2\n" : "=m" (bootloader_mcusr) :);
+  boot_mcusr = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
+  // without a bootloader that passes them on, r2 is just what was left in it
+  if(boot_mcusr == 0 && (bootloader_mcusr & ~RESET_FLAGS) == 0)
+    boot_mcusr = bootloader_mcusr;
+}
+
+/*! @var active_watchdog
+ *  The instance the watchdog interrupt reports to.*/
+static Watchdog * active_watchdog = NULL;
+
+/*!
+ * @brief First watchdog expiry: save the post-mortem before the reset.
+ */
+ISR(WDT_vect){
+  if(active_watchdog != NULL)
+    active_watchdog->on_interrupt();
+}
+
+
+/*!
+ * @brief Constructor - nothing is watched until watch_task() is called
+ * 
+ * @param scheduler  the scheduler whose tasks to watch
+ */
+Watchdog::Watchdog(Scheduler * scheduler){
+  this->scheduler = scheduler;
+  this->record_address = 0;
+  this->overdue_task = SCHEDULER_NO_TASK;
+  this->reset_cause = 0;
+  memset(budget_ms, 0, sizeof(budget_ms));
+  memset(&last_record, 0, sizeof(last_record));
+}
+
+
+/*!
+ * @brief Write the record, touching only the bytes that changed
+ */
+void Watchdog::write_record(const watchdog_record & record){
+  const unsigned char * bytes = (const unsigned char *)&record;
+  bool writer_running = eeprom_pause_writer();
+  for(unsigned char i = 0; i < sizeof(watchdog_record); i++)
+    EEPROM.update(record_address + i, bytes[i]);
+  eeprom_resume_writer(writer_running);
+}
+
+
+/*!
+ * @brief Read back what happened before this boot, and count the boot.
+ * 
+ * @param eeprom_address  where the record lives - WATCHDOG_RECORD_SIZE 
+ *                        bytes that nothing else uses, e.g. 
+ *                        ConfigStore::end_address()
+ */
+void Watchdog::begin(int eeprom_address){
+  record_address = eeprom_address;
+  reset_cause = boot_mcusr;
+
+  bool writer_running = eeprom_pause_writer();
+  EEPROM.get(record_address, last_record);
+  eeprom_resume_writer(writer_running);
+  if(last_record.magic != WATCHDOG_RECORD_MAGIC){
+    memset(&last_record, 0, sizeof(last_record));
+    last_record.magic = WATCHDOG_RECORD_MAGIC;
+    last_record.stalled_task = SCHEDULER_NO_TASK;
+  }
+  // The interrupt only fires right before the watchdog resets the board,
+  // so a pending record is the evidence - MCUSR may have been cleared by
+  // the bootloader.  Only a power cycle in between says otherwise.
+  if(last_record.pending && (reset_cause & (_BV(PORF) | _BV(BORF)))){
+    last_record.reason = WATCHDOG_NONE;
+  } else if(last_record.pending){
+    reset_cause |= _BV(WDRF);
+    last_record.watchdog_resets++;
+  }
+  last_record.pending = 0;
+  last_record.boot_count++;
+  write_record(last_record);
+
+  if(reset_cause & _BV(WDRF)){
+    Serial.print(F("| WARNING: reset by the watchdog, while in task "));
+    Serial.println(last_record.stalled_task,DEC);
+  }
+}
+
+
+/*!
+ * @brief Give a task a budget.  Budgets must be longer than the task's 
+ *        period, and shorter than anything that should be called a hang.
+ * 
+ * @param slot       scheduler slot, as returned by Scheduler::add_task()
+ * @param budget_ms  longest time the task may go without running
+ */
+void Watchdog::watch_task(unsigned char slot, unsigned int budget_ms){
+  if(slot < SCHEDULER_MAX_TASKS)
+    this->budget_ms[slot] = budget_ms;
+}
+
+
+/*!
+ * @brief Start the hardware watchdog, in interrupt-then-reset mode.
+ */
+void Watchdog::enable(){
+  active_watchdog = this;
+  wdt_enable(WATCHDOG_TIMEOUT);
+  WDTCSR |= _BV(WDIE);
+}
+
+
+/*!
+ * @brief Reset the hardware watchdog, but only if every watched task has 
+ *        run within its budget.  Call it once per scheduler pass.
+ */
+void Watchdog::feed(){
+  unsigned long now = millis();
+  for(unsigned char slot = 0; slot < scheduler->get_task_count(); slot++){
+    if(budget_ms[slot] == 0)
+      continue;
+    if(now - scheduler->get_task(slot)->last_run_ms > budget_ms[slot]){
+      overdue_task = slot;
+      return;
+    }
+  }
+  overdue_task = SCHEDULER_NO_TASK;
+  keep_alive();
+}
+
+
+/*!
+ * @brief Reset the hardware watchdog unconditionally.  Only for waits 
+ *        that are bounded by their own timeout (e.g. a blocking AT command)
+ *        and keep the scheduler from running meanwhile.
+ */
+void Watchdog::keep_alive(){
+  wdt_reset();
+  if(!(WDTCSR & _BV(WDIE))){
+    // the interrupt went off, but we recovered before the reset
+    WDTCSR |= _BV(WDIE);
+    bool writer_running = eeprom_pause_writer();
+    EEPROM.update(record_address + offsetof(watchdog_record, pending), 0);
+    eeprom_resume_writer(writer_running);
+  }
+}
+
+
+/*!
+ * @brief Called from the watchdog interrupt: work out who is stuck, and 
+ *        save it.  The board resets at the next expiry unless fed.
+ */
+void Watchdog::on_interrupt(){
+  watchdog_record record = last_record;
+  unsigned char running = scheduler->get_running_task();
+  if(running != SCHEDULER_NO_TASK){
+    record.reason = WATCHDOG_HUNG;
+    record.stalled_task = running;
+  } else if(overdue_task != SCHEDULER_NO_TASK){
+    record.reason = WATCHDOG_OVERDUE;
+    record.stalled_task = overdue_task;
+  } else {
+    record.reason = WATCHDOG_UNKNOWN;
+    record.stalled_task = SCHEDULER_NO_TASK;
+  }
+  record.uptime_ms = millis();
+  record.pending = 1;
+  write_record(record);
+}
+
+
+/*!
+ * @return length of the report, see format_report_line()
+ */
+unsigned int Watchdog::get_report_length(){
+  return WATCHDOG_REPORT_LINES * WATCHDOG_REPORT_LINE_LEN;
+}
+
+
+/*!
+ * @brief Format one line of the report on the reset cause, the last stall
+ *        and the stack margin
+ * 
+ * @param line    zero to WATCHDOG_REPORT_LINES-1
+ * @param output  at least WATCHDOG_REPORT_LINE_LEN+1 bytes
+ * 
+ * @return WATCHDOG_REPORT_LINE_LEN
+ */
+unsigned int Watchdog::format_report_line(unsigned char line, char * output){
+  TextWriter report(output, WATCHDOG_REPORT_LINE_LEN + 1);
+  PGM_P text;
+  if(line == 0){
+    if(reset_cause & _BV(WDRF))       text = PSTR("watchdog");
+    else if(reset_cause & _BV(BORF))  text = PSTR("brown-out");
+    else if(reset_cause & _BV(EXTRF)) text = PSTR("external");
+    else if(reset_cause & _BV(PORF))  text = PSTR("power-on");
+    else                              text = PSTR("unknown");
+    report.print(F("reset_cause    0x"), hex_digits(reset_cause, 2), ' ', flash(text));
+  } else if(line == 1){
+    report.print(F("boots          "), last_record.boot_count, F(" wdt_resets "), last_record.watchdog_resets);
+  } else if(line == 2){
+    if(last_record.reason == WATCHDOG_HUNG)          text = PSTR("hung");
+    else if(last_record.reason == WATCHDOG_OVERDUE)  text = PSTR("overdue");
+    else if(last_record.reason == WATCHDOG_UNKNOWN)  text = PSTR("unknown");
+    else                                             text = PSTR("none");
+    PGM_P name = PSTR("-");
+    if(last_record.stalled_task < scheduler->get_task_count())
+      name = scheduler->get_task(last_record.stalled_task)->name;
+    report.print(F("last_stall     "), column_P(name, 8), ' ', flash(text));
+  } else if(line == 3){
+    report.print(F("stall_uptime   "), last_record.uptime_ms, F(" ms"));
+  } else {
+    report.print(F("stack_margin   "), get_stack_margin(), F(" free "), get_free_ram());
+  }
+  // pad (or cut) to the fixed width, so the Content-Length is known up front
+  report.end_line(WATCHDOG_REPORT_LINE_LEN);
+  return WATCHDOG_REPORT_LINE_LEN;
+}
+
+
+/*!
+ * @brief OutputQueue segment_generator for the report.
+ * 
+ * Queue it with get_report_length() as the length, and the watchdog as 
+ * the context.
+ */
+unsigned int Watchdog::report_generator(void * context, unsigned int offset,
+                                        char * output, unsigned int output_size){
+  Watchdog * watchdog = (Watchdog *)context;
+  char line[WATCHDOG_REPORT_LINE_LEN + 1];
+  unsigned int produced = 0;
+  while(produced < output_size && offset < watchdog->get_report_length()){
+    unsigned int column = offset % WATCHDOG_REPORT_LINE_LEN;
+    watchdog->format_report_line(offset / WATCHDOG_REPORT_LINE_LEN, line);
+    unsigned int wanted = WATCHDOG_REPORT_LINE_LEN - column;
+    if(wanted > output_size - produced)
+      wanted = output_size - produced;
+    memcpy(output + produced, line + column, wanted);
+    produced += wanted;
+    offset += wanted;
+  }
+  return produced;
+}
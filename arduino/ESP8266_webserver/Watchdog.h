@@ -0,0 +1,118 @@
+/*!
+ * @file Watchdog.h
+ * 
+ * @brief Hardware watchdog, fed only while every watched task keeps running
+ * 
+ */
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <Arduino.h>
+#include <avr/wdt.h>
+#include <EEPROM.h>
+#include "EepromWriter.h"
+#include "Scheduler.h"
+#include "MemoryGuard.h"
+
+/*! @def WATCHDOG_TIMEOUT
+ *  Hardware watchdog period.  The first expiry records the stall in 
+ *  EEPROM, the second resets the board.*/
+#define WATCHDOG_TIMEOUT WDTO_8S
+
+/*! @def WATCHDOG_RECORD_MAGIC
+ *  First byte of a valid post-mortem record in EEPROM.*/
+#define WATCHDOG_RECORD_MAGIC 0xD0
+
+/*! @def WATCHDOG_RECORD_SIZE
+ *  EEPROM bytes used by the post-mortem record.*/
+#define WATCHDOG_RECORD_SIZE (sizeof(watchdog_record))
+
+/*! @def WATCHDOG_REPORT_LINE_LEN
+ *  Every line of the report is exactly this long, including the '\n', so
+ *  the report length is known before it is generated.*/
+#define WATCHDOG_REPORT_LINE_LEN 40
+
+/*! @def WATCHDOG_REPORT_LINES
+ *  Number of lines in the report.*/
+#define WATCHDOG_REPORT_LINES 5
+
+/*! 
+ * @enum watchdog_reason
+ * 
+ * @brief Why the watchdog went off
+ */
+enum watchdog_reason{
+  WATCHDOG_NONE = 0,    ///<it didn't
+  WATCHDOG_HUNG,        ///<a task never returned to the scheduler
+  WATCHDOG_OVERDUE,     ///<a task was not run within its budget
+  WATCHDOG_UNKNOWN      ///<outside of any task
+};
+
+/*! 
+ * @struct watchdog_record
+ * 
+ * @brief Post-mortem record, kept in EEPROM after the config store.
+ */
+struct watchdog_record{
+  unsigned char magic;           ///<WATCHDOG_RECORD_MAGIC
+  unsigned char pending;         ///<set when the watchdog interrupt fires, cleared if the sketch recovers
+  unsigned char reason;          ///<one of watchdog_reason
+  unsigned char stalled_task;    ///<scheduler slot of the culprit, or SCHEDULER_NO_TASK
+  unsigned int boot_count;       ///<number of boots since the record was created
+  unsigned int watchdog_resets;  ///<number of resets caused by the watchdog
+  unsigned long uptime_ms;       ///<millis() when the watchdog went off
+};
+
+/*!
+ * @class Watchdog
+ * 
+ * @brief Supervises the scheduler's tasks with the AVR hardware watchdog
+ * 
+ * Each watched task gets a budget: the longest time it may go without 
+ * being run by the scheduler.  feed() only resets the hardware watchdog 
+ * while every watched task is within its budget, so a task that hangs 
+ * (never returns) or one that stops being run both end in a reset.
+ * 
+ * The watchdog runs in interrupt-then-reset mode.  The interrupt saves 
+ * which task stalled, and why, to EEPROM.  After the reboot, begin() reads 
+ * it back together with the reset cause, for the /metrics report.
+ * 
+ * Usage:<pre>
+ *    Watchdog watchdog(&scheduler);
+ *    void setup(){
+ *      watchdog.begin(config.end_address());
+ *      unsigned char slot = scheduler.add_task(PSTR("http"), http_task, 0);
+ *      watchdog.watch_task(slot, 2000);
+ *      watchdog.enable();
+ *    }
+ *    void loop(){
+ *      scheduler.run_once();
+ *      watchdog.feed();
+ *    }</pre>
+ */
+class Watchdog{
+private:
+  Scheduler * scheduler;                        ///<whose tasks are watched
+  int record_address;                           ///<EEPROM address of the watchdog_record
+  unsigned int budget_ms[SCHEDULER_MAX_TASKS];  ///<per slot, zero = not watched
+  volatile unsigned char overdue_task;          ///<slot found over budget by the last feed(), or SCHEDULER_NO_TASK
+  unsigned char reset_cause;                    ///<MCUSR flags from this boot, with WDRF added if a pending record shows the watchdog fired
+  watchdog_record last_record;                  ///<the record as it was at boot
+
+  void write_record(const watchdog_record & record);
+
+public:
+  Watchdog(Scheduler * scheduler);
+  void begin(int eeprom_address);
+  void watch_task(unsigned char slot, unsigned int budget_ms);
+  void enable();
+  void feed();
+  void keep_alive();
+  void on_interrupt();
+  unsigned int get_report_length();
+  unsigned int format_report_line(unsigned char line, char * output);
+  static unsigned int report_generator(void * context, unsigned int offset,
+                                       char * output, unsigned int output_size);
+};
+
+#endif
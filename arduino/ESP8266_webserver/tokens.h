@@ -0,0 +1,78 @@
+/*!
+ * @file tokens.h
+ *
+ * @brief Every string the firmware looks for in what the ESP8266 sends
+ *
+ * The list is read by both the sketch (for the token ids) and the token
+ * compiler in tools/ (for the text), which builds the matching automaton
+ * in token_automaton.hh.  If you change the list, you need to run these
+ * commands to refresh it:<pre>
+ *    g++ -std=c++11 -O2 -o tools/token_compiler tools/token_compiler.cpp
+ *    tools/token_compiler</pre>
+ * A stale automaton fails to build (TOKEN_COUNT is checked).
+ *
+ * Matching is exact (case matters), and a token is found anywhere in a
+ * line; see TokenMatcher.  Keep this file free of Arduino dependencies,
+ * since the host-side compiler includes it too.
+ */
+#ifndef TOKENS_H
+#define TOKENS_H
+
+/*! @def TOKEN_LIST
+ *  X-macro of every token: X(id, "text").*/
+#define TOKEN_LIST(X) \
+  /* final result codes of AT commands */ \
+  X(TOKEN_OK,              "OK") \
+  X(TOKEN_ERROR,           "ERROR") \
+  X(TOKEN_FAIL,            "FAIL") \
+  X(TOKEN_BUSY,            "busy ") \
+  X(TOKEN_NO_CHANGE,       "no change") \
+  X(TOKEN_SEND_OK,         "SEND OK") \
+  X(TOKEN_SEND_FAIL,       "SEND FAIL") \
+  /* unsolicited messages */ \
+  X(TOKEN_CONNECT,         "CONNECT") \
+  X(TOKEN_CLOSED,          "CLOSED") \
+  X(TOKEN_WIFI_CONNECTED,  "WIFI CONNECTED") \
+  X(TOKEN_WIFI_GOT_IP,     "WIFI GOT IP") \
+  X(TOKEN_WIFI_DISCONNECT, "WIFI DISCONNECT") \
+  X(TOKEN_READY,           "ready") \
+  /* responses to queries, and connection data */ \
+  X(TOKEN_IPD,             "+IPD,") \
+  X(TOKEN_CWJAP,           "+CWJAP") \
+  X(TOKEN_CWLAP,           "+CWLAP") \
+  /* HTTP requests */ \
+  X(TOKEN_GET,             "GET") \
+  X(TOKEN_POST,            "POST") \
+  X(TOKEN_TILT_UP,         "tilt_up") \
+  X(TOKEN_TILT_DOWN,       "tilt_down") \
+  X(TOKEN_PAN_RIGHT,       "pan_right") \
+  X(TOKEN_PAN_LEFT,        "pan_left") \
+  X(TOKEN_FIRE,            "fire") \
+  X(TOKEN_DRIVE,           "/drive?") \
+  X(TOKEN_SETTINGS,        "settings") \
+  X(TOKEN_SETTINGS_SSID,   "settings/ssid__") \
+  X(TOKEN_SETTINGS_AP,     "settings/ap_ssd") \
+  X(TOKEN_INFO_NETWORKS,   "/info/networks") \
+  X(TOKEN_INFO_SETTINGS,   "/info/settings") \
+  X(TOKEN_METRICS,         "/metrics") \
+  X(TOKEN_DEBUG_TRACE,     "/debug/trace")
+
+/*! @def TOKEN_ENUM_ENTRY
+ *  Turns a TOKEN_LIST entry into an enum constant.*/
+#define TOKEN_ENUM_ENTRY(id, text) id,
+
+/*!
+ * @enum token_id
+ *
+ * @brief One per entry of TOKEN_LIST, in order
+ */
+enum token_id{
+  TOKEN_LIST(TOKEN_ENUM_ENTRY)
+  TOKEN_COUNT  ///<number of tokens
+};
+
+/*! @def TOKEN_NONE
+ *  No token.*/
+#define TOKEN_NONE 0xFF
+
+#endif
@@ -0,0 +1,836 @@
+/*!
+ * @file asset_compiler.cpp
+ *
+ * @brief Host-side tool that packs the files in html/ into one PROGMEM
+ *        bundle
+ *
+ * Writes asset_bundle.hh, holding:
+ *  * asset_data - every asset, minified and packed back to back
+ *  * asset_directory - one asset_entry (see AssetBundle.h) per asset,
+ *    sorted by path so the firmware can binary search it
+ *  * the paths, entity tags and fetched field names the entries point to
+ *
+ * The data length is exact, and a static_assert checks it against the
+ * generated string literal, so a miscounted escape breaks the build
+ * instead of a Content-Length.  Before anything is written, the tool
+ * also checks its output against its input: the literal is parsed back
+ * and must give the data again, assets packed as they are must match 
+ * their files byte for byte, and minified ones may only have lost 
+ * characters (and whitespace) from theirs.
+ *
+ * Assets:
+ *  * .html, .css, .js and .svg files are minified; .ico, .png and 
+ *    anything ending in .gz (sent with Content-Encoding: gzip) are packed
+ *    as they are
+ *  * An asset is served at "/" + its file name (without .gz), except that
+ *    "<!--route:/path-->" anywhere in an html page sets its path
+ *  * In an html page, the lines between "//FETCHDATA_START" and 
+ *    "//FETCHDATA_END" are "field:example_value," pairs.  The firmware 
+ *    writes live values in their place, so only the field names are kept,
+ *    and the page is never cached.
+ *  * In an html page, lines whose first non-blank characters are "//" are
+ *    comments
+ *
+ * Minifying is conservative: HTML comments and the indentation between
+ * two tags are dropped, other runs of whitespace in HTML text become one
+ * space, CSS and JavaScript lose comments and the whitespace
+ * around punctuation.  A line break in script is kept where it could end
+ * a statement.  JavaScript regular expression literals are not
+ * recognized - don't put "//" or quotes in one.
+ *
+ * Build and run from the sketch directory (the Arduino IDE does not
+ * compile the tools/ directory):<pre>
+ *    g++ -std=c++11 -O2 -o tools/asset_compiler tools/asset_compiler.cpp
+ *    tools/asset_compiler html/favicon.svg html/config_website.html ...</pre>
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <vector>
+
+/*! @def LITERAL_LINE_LEN
+ *  Generated string literals are split into lines of about this many
+ *  characters.*/
+#define LITERAL_LINE_LEN 100
+/*! @def FETCHDATA_START
+ *  Marks the start of the block of fetched fields.*/
+#define FETCHDATA_START "//FETCHDATA_START"
+/*! @def FETCHDATA_END
+ *  Marks the end of the block of fetched fields.*/
+#define FETCHDATA_END "//FETCHDATA_END"
+/*! @def DEFAULT_OUTPUT
+ *  Where the bundle is written, unless -o says otherwise.*/
+#define DEFAULT_OUTPUT "asset_bundle.hh"
+/*! @def ROUTE_DIRECTIVE
+ *  HTML comment that sets the path a page is served at.*/
+#define ROUTE_DIRECTIVE "<!--route:"
+
+
+/*!
+ * @enum minify_mode
+ *
+ * @brief What part of the page the minifier is in
+ */
+enum minify_mode{
+  MODE_TEXT,       ///<between tags
+  MODE_TAG,        ///<inside <...>
+  MODE_COMMENT,    ///<inside <!-- ... -->
+  MODE_STYLE,      ///<CSS inside <style>
+  MODE_SCRIPT,     ///<JavaScript inside <script>
+  MODE_RAW         ///<inside <pre> or <textarea>, copied as is
+};
+
+
+/*!
+ * @class Minifier
+ *
+ * @brief Streaming HTML/CSS/JS minifier
+ *
+ * State carries over between calls to minify(), so a page can be cut
+ * into segments anywhere - e.g. in the middle of a script.
+ */
+class Minifier{
+private:
+  minify_mode mode;
+  char quote;              ///<quote character of the open string, or 0
+  bool escaped;            ///<last character in the string was a backslash
+  bool line_comment;       ///<inside a // comment
+  bool block_comment;      ///<inside a /* */ comment
+  bool pending_space;      ///<whitespace was skipped since the last output
+  bool pending_newline;    ///<...and it contained a line break
+  std::string raw_end;     ///<closing tag that ends MODE_RAW
+  std::string tag_name;    ///<name of the tag being read in MODE_TAG
+  bool reading_tag_name;   ///<still reading tag_name
+  std::string route;       ///<from the route directive, if any
+  std::string comment;     ///<text of the HTML comment being read
+
+  void text_char(const std::string & in, size_t & i, std::string & out);
+  void tag_char(char c, std::string & out);
+  void style_char(const std::string & in, size_t & i, std::string & out);
+  void script_char(const std::string & in, size_t & i, std::string & out);
+  bool at_closing_tag(const std::string & in, size_t i, const char * name);
+
+public:
+  Minifier(minify_mode start_mode);
+  std::string minify(const std::string & in);
+  const std::string & get_route(){ return route; }
+};
+
+
+/*!
+ * @return TRUE if c may be part of a JavaScript identifier, number or
+ *         string, i.e. two of them can't touch.
+ */
+static bool is_word_char(char c){
+  return isalnum((unsigned char)c) || c == '_' || c == '$' || (c & 0x80) ||
+         c == '"' || c == '\'' || c == '`';
+}
+
+
+/*!
+ * @return the last character of out, or 0 if it's empty
+ */
+static char last_char(const std::string & out){
+  return out.empty() ? 0 : out[out.size() - 1];
+}
+
+
+/*!
+ * @param start_mode
+ *        MODE_TEXT for a page, MODE_STYLE for a style sheet, MODE_SCRIPT 
+ *        for a script
+ */
+Minifier::Minifier(minify_mode start_mode){
+  mode = start_mode;
+  quote = 0;
+  escaped = false;
+  line_comment = false;
+  block_comment = false;
+  pending_space = false;
+  pending_newline = false;
+  reading_tag_name = false;
+}
+
+
+/*!
+ * @return TRUE if in[i] starts "</name", in any case
+ */
+bool Minifier::at_closing_tag(const std::string & in, size_t i, const char * name){
+  size_t len = strlen(name);
+  if(in.compare(i, 2, "</") != 0 || i + 2 + len > in.size())
+    return false;
+  for(size_t j = 0; j < len; j++){
+    if(tolower((unsigned char)in[i + 2 + j]) != name[j])
+      return false;
+  }
+  return true;
+}
+
+
+/*!
+ * Minifies the next part of a page.
+ *
+ * @param in
+ *        page source
+ *
+ * @return the minified source
+ */
+std::string Minifier::minify(const std::string & in){
+  std::string out;
+  for(size_t i = 0; i < in.size(); i++){
+    switch(mode){
+    case MODE_TEXT:
+      text_char(in, i, out);
+      break;
+    case MODE_TAG:
+      tag_char(in[i], out);
+      break;
+    case MODE_COMMENT:
+      comment += in[i];
+      if(comment.size() >= 3 && comment.compare(comment.size() - 3, 3, "-->") == 0){
+        if(comment.compare(0, strlen(ROUTE_DIRECTIVE), ROUTE_DIRECTIVE) == 0){
+          route = comment.substr(strlen(ROUTE_DIRECTIVE),
+                                 comment.size() - 3 - strlen(ROUTE_DIRECTIVE));
+        }
+        mode = MODE_TEXT;
+      }
+      break;
+    case MODE_STYLE:
+      style_char(in, i, out);
+      break;
+    case MODE_SCRIPT:
+      script_char(in, i, out);
+      break;
+    case MODE_RAW:
+      if(at_closing_tag(in, i, raw_end.c_str())){
+        mode = MODE_TEXT;
+        text_char(in, i, out);
+      } else {
+        out += in[i];
+      }
+      break;
+    }
+  }
+  return out;
+}
+
+
+/*!
+ * HTML text: runs of whitespace become one space, and indentation (any
+ * run with a line break in it) between two tags is dropped.  Next to 
+ * text it stays a space, since it renders as one ("foo\n<b>bar" is not 
+ * "foo<b>bar").
+ */
+void Minifier::text_char(const std::string & in, size_t & i, std::string & out){
+  char c = in[i];
+  if(isspace((unsigned char)c)){
+    pending_space = true;
+    pending_newline |= (c == '\n');
+    return;
+  }
+  if(c == '<' && in.compare(i, 4, "<!--") == 0){
+    comment = "<!--";
+    i += 3;
+    mode = MODE_COMMENT;
+    return;
+  }
+  if(pending_space && !out.empty() && !(pending_newline && c == '<' && last_char(out) == '>'))
+    out += ' ';
+  pending_space = false;
+  pending_newline = false;
+  out += c;
+  if(c == '<'){
+    mode = MODE_TAG;
+    quote = 0;
+    tag_name.clear();
+    reading_tag_name = true;
+  }
+}
+
+
+/*!
+ * Inside a tag: runs of whitespace become one space, except around '='
+ * and before the closing '>'.  Quoted attribute values are left alone.
+ */
+void Minifier::tag_char(char c, std::string & out){
+  if(quote){
+    out += c;
+    if(c == quote)
+      quote = 0;
+    return;
+  }
+  if(reading_tag_name){
+    if(isalnum((unsigned char)c) || c == '/' || c == '!'){
+      tag_name += (char)tolower((unsigned char)c);
+      out += c;
+      return;
+    }
+    reading_tag_name = false;
+  }
+  if(isspace((unsigned char)c)){
+    pending_space = true;
+    return;
+  }
+  if(pending_space && c != '>' && c != '=' && last_char(out) != '=')
+    out += ' ';
+  pending_space = false;
+  pending_newline = false;
+  out += c;
+  if(c == '"' || c == '\''){
+    quote = c;
+  } else if(c == '>'){
+    if(last_char(tag_name) == '/' || tag_name.empty() || tag_name[0] == '/' || tag_name[0] == '!'){
+      mode = MODE_TEXT;
+    } else if(tag_name == "style"){
+      mode = MODE_STYLE;
+    } else if(tag_name == "script"){
+      mode = MODE_SCRIPT;
+    } else if(tag_name == "pre" || tag_name == "textarea"){
+      mode = MODE_RAW;
+      raw_end = tag_name;
+    } else {
+      mode = MODE_TEXT;
+    }
+    quote = 0;
+    line_comment = false;
+    block_comment = false;
+  }
+}
+
+
+/*!
+ * CSS: comments go, and whitespace only stays between two words.  The
+ * last ';' before a '}' goes too.
+ */
+void Minifier::style_char(const std::string & in, size_t & i, std::string & out){
+  char c = in[i];
+  if(block_comment){
+    if(c == '*' && i + 1 < in.size() && in[i + 1] == '/'){
+      block_comment = false;
+      i++;
+    }
+    return;
+  }
+  if(quote){
+    out += c;
+    if(escaped)
+      escaped = false;
+    else if(c == '\\')
+      escaped = true;
+    else if(c == quote)
+      quote = 0;
+    return;
+  }
+  if(at_closing_tag(in, i, "style")){
+    pending_space = false;
+    pending_newline = false;
+    mode = MODE_TEXT;
+    text_char(in, i, out);
+    return;
+  }
+  if(c == '/' && i + 1 < in.size() && in[i + 1] == '*'){
+    block_comment = true;
+    i++;
+    return;
+  }
+  if(isspace((unsigned char)c)){
+    pending_space = true;
+    return;
+  }
+  if(pending_space && !out.empty() && !strchr("{};:,>", last_char(out)) && !strchr("{};,>", c))
+    out += ' ';
+  pending_space = false;
+  if(c == '}' && last_char(out) == ';')
+    out.erase(out.size() - 1);
+  out += c;
+  if(c == '"' || c == '\'')
+    quote = c;
+}
+
+
+/*!
+ * JavaScript: comments go, and whitespace is dropped unless it separates
+ * two words (or two '+'/'-', which would merge into an operator).  Line
+ * breaks are kept where automatic semicolon insertion might need them.
+ */
+void Minifier::script_char(const std::string & in, size_t & i, std::string & out){
+  char c = in[i];
+  if(line_comment){
+    if(c == '\n'){
+      line_comment = false;
+      pending_space = true;
+      pending_newline = true;
+    }
+    return;
+  }
+  if(block_comment){
+    if(c == '*' && i + 1 < in.size() && in[i + 1] == '/'){
+      block_comment = false;
+      pending_space = true;
+      i++;
+    }
+    return;
+  }
+  if(quote){
+    out += c;
+    if(escaped)
+      escaped = false;
+    else if(c == '\\')
+      escaped = true;
+    else if(c == quote)
+      quote = 0;
+    return;
+  }
+  if(at_closing_tag(in, i, "script")){
+    pending_space = false;
+    pending_newline = false;
+    mode = MODE_TEXT;
+    text_char(in, i, out);
+    return;
+  }
+  if(c == '/' && i + 1 < in.size() && in[i + 1] == '/'){
+    line_comment = true;
+    return;
+  }
+  if(c == '/' && i + 1 < in.size() && in[i + 1] == '*'){
+    block_comment = true;
+    i++;
+    return;
+  }
+  if(isspace((unsigned char)c)){
+    pending_space = true;
+    pending_newline |= (c == '\n');
+    return;
+  }
+  if(pending_space && !out.empty()){
+    char prev = last_char(out);
+    if(is_word_char(prev) && is_word_char(c))
+      out += pending_newline ? '\n' : ' ';
+    else if(pending_newline && strchr(")]}", prev) && (is_word_char(c) || strchr("([{+-", c)))
+      out += '\n';
+    else if(prev == c && (c == '+' || c == '-'))
+      out += ' ';
+  }
+  pending_space = false;
+  pending_newline = false;
+  out += c;
+  if(c == '"' || c == '\'' || c == '`')
+    quote = c;
+}
+
+
+/*!
+ * @return s without leading and trailing whitespace
+ */
+static std::string trim(const std::string & s){
+  size_t first = s.find_first_not_of(" \t\r\n");
+  if(first == std::string::npos)
+    return "";
+  size_t last = s.find_last_not_of(" \t\r\n");
+  return s.substr(first, last - first + 1);
+}
+
+
+/*!
+ * @return 32-bit FNV-1a hash of data, continuing from hash
+ */
+static unsigned long fnv1a(const std::string & data, unsigned long hash){
+  for(size_t i = 0; i < data.size(); i++){
+    hash ^= (unsigned char)data[i];
+    hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+  }
+  return hash;
+}
+
+
+/*!
+ * Writes data as a C string literal, split over several lines.  Every
+ * character outside printable ASCII is written as a three-digit octal
+ * escape, so a following digit can't extend it.
+ */
+static void write_literal(std::ostream & out, const std::string & data){
+  std::string line;
+  out << "\"";
+  for(size_t i = 0; i < data.size(); i++){
+    unsigned char c = (unsigned char)data[i];
+    if(c == '"' || c == '\\'){
+      line += '\\';
+      line += (char)c;
+    } else if(c == '\n'){
+      line += "\\n";
+    } else if(c < 0x20 || c >= 0x7F){
+      char escape[5];
+      snprintf(escape, sizeof(escape), "\\%03o", c);
+      line += escape;
+    } else {
+      line += (char)c;
+    }
+    if(line.size() >= LITERAL_LINE_LEN && i + 1 < data.size()){
+      out << line << "\"\n\"";
+      line.clear();
+    }
+  }
+  out << line << "\"";
+}
+
+
+/*!
+ * @struct asset
+ *
+ * @brief One file, on its way into the bundle
+ */
+struct asset{
+  std::string source;               ///<file it came from
+  std::string path;                 ///<request path
+  std::string data;                 ///<what gets sent
+  std::vector<std::string> fields;  ///<fetched field names
+  size_t split;                     ///<bytes of data before the fetched fields
+  size_t offset;                    ///<where data starts in asset_data
+  const char * mime;                ///<asset_mime enumerator name
+  bool gzip;                        ///<data is gzip-compressed
+  unsigned long hash;               ///<FNV-1a hash of data and field names
+};
+
+
+/*!
+ * @return TRUE if name ends with suffix
+ */
+static bool ends_with(const std::string & name, const char * suffix){
+  size_t len = strlen(suffix);
+  return name.size() >= len && name.compare(name.size() - len, len, suffix) == 0;
+}
+
+
+/*!
+ * Splits an html page around the fetch data block, dropping comment
+ * lines, and minifies it.
+ */
+static void load_page(std::istream & source, asset & page, std::string & route){
+  std::string parts[2];
+  int part = 0;
+  bool in_fetch_data = false;
+  std::string line;
+  while(std::getline(source, line)){
+    std::string trimmed = trim(line);
+    if(trimmed == FETCHDATA_START){
+      in_fetch_data = true;
+      continue;
+    }
+    if(trimmed == FETCHDATA_END){
+      in_fetch_data = false;
+      part = 1;
+      continue;
+    }
+    if(trimmed.compare(0, 2, "//") == 0)
+      continue;
+    if(in_fetch_data){
+      if(!trimmed.empty())
+        page.fields.push_back(trim(trimmed.substr(0, trimmed.find(':'))));
+      continue;
+    }
+    parts[part] += line;
+    parts[part] += '\n';
+  }
+
+  Minifier minifier(MODE_TEXT);
+  page.data = minifier.minify(parts[0]);
+  page.split = page.data.size();
+  page.data += minifier.minify(parts[1]);
+  route = minifier.get_route();
+}
+
+
+/*!
+ * Reads and minifies one asset.
+ *
+ * @return FALSE if the file couldn't be read
+ */
+static bool load_asset(const std::string & file_path, asset & a){
+  std::ifstream source(file_path.c_str(), std::ios::binary);
+  if(!source){
+    std::cerr << "asset_compiler: can't read " << file_path << "\n";
+    return false;
+  }
+  size_t slash = file_path.find_last_of('/');
+  std::string name = (slash == std::string::npos) ? file_path : file_path.substr(slash + 1);
+
+  a.source = file_path;
+  a.gzip = ends_with(name, ".gz");
+  if(a.gzip)
+    name = name.substr(0, name.size() - 3);
+  a.path = "/" + name;
+
+  std::string route;
+  if(ends_with(name, ".html") || ends_with(name, ".htm")){
+    a.mime = "MIME_HTML";
+  } else if(ends_with(name, ".css")){
+    a.mime = "MIME_CSS";
+  } else if(ends_with(name, ".js")){
+    a.mime = "MIME_JS";
+  } else if(ends_with(name, ".svg")){
+    a.mime = "MIME_SVG";
+  } else if(ends_with(name, ".ico")){
+    a.mime = "MIME_ICO";
+  } else if(ends_with(name, ".png")){
+    a.mime = "MIME_PNG";
+  } else {
+    a.mime = "MIME_TEXT";
+  }
+
+  if(a.gzip || strcmp(a.mime, "MIME_ICO") == 0 || strcmp(a.mime, "MIME_PNG") == 0){
+    std::ostringstream raw;
+    raw << source.rdbuf();
+    a.data = raw.str();
+    a.split = a.data.size();
+  } else if(strcmp(a.mime, "MIME_HTML") == 0){
+    load_page(source, a, route);
+    if(route.empty())
+      a.path = "/" + name.substr(0, name.find('.'));
+    else
+      a.path = route;
+  } else {
+    std::ostringstream text;
+    text << source.rdbuf();
+    minify_mode mode = MODE_TEXT;
+    if(strcmp(a.mime, "MIME_CSS") == 0)
+      mode = MODE_STYLE;
+    else if(strcmp(a.mime, "MIME_JS") == 0)
+      mode = MODE_SCRIPT;
+    Minifier minifier(mode);
+    a.data = minifier.minify(text.str());
+    a.split = a.data.size();
+  }
+
+  a.hash = fnv1a(a.data, 2166136261UL);
+  for(size_t i = 0; i < a.fields.size(); i++)
+    a.hash = fnv1a(a.fields[i], a.hash);
+  return true;
+}
+
+
+/*!
+ * Parses a literal from write_literal() back.
+ *
+ * @return the bytes it stands for
+ */
+static std::string read_literal(const std::string & literal){
+  std::string data;
+  bool inside = false;
+  for(size_t i = 0; i < literal.size(); i++){
+    char c = literal[i];
+    if(!inside){
+      inside = (c == '"');
+      continue;
+    }
+    if(c == '"'){
+      inside = false;
+    } else if(c != '\\'){
+      data += c;
+    } else if(literal[++i] == 'n'){
+      data += '\n';
+    } else if(literal[i] >= '0' && literal[i] <= '7'){
+      data += (char)strtol(literal.substr(i, 3).c_str(), NULL, 8);
+      i += 2;
+    } else {
+      data += literal[i];
+    }
+  }
+  return data;
+}
+
+
+/*!
+ * @return TRUE if the literal written for data reads back as data
+ */
+static bool check_literal(const std::string & data){
+  std::ostringstream literal;
+  write_literal(literal, data);
+  return read_literal(literal.str()) == data;
+}
+
+
+/*!
+ * Checks an asset against its file: packed as is, it must be the same;
+ * minified, it may be no longer, and what isn't whitespace must appear 
+ * in the file in the same order.  (Fetched field values and comments 
+ * are left out, and whitespace collapses, but nothing is ever added.)
+ *
+ * @return FALSE if the asset doesn't come from its file
+ */
+static bool check_against_source(const asset & a){
+  std::ifstream source(a.source.c_str(), std::ios::binary);
+  std::ostringstream raw;
+  raw << source.rdbuf();
+  const std::string original = raw.str();
+  if(a.gzip || strcmp(a.mime, "MIME_ICO") == 0 || strcmp(a.mime, "MIME_PNG") == 0)
+    return a.data == original;
+  if(a.data.size() > original.size())
+    return false;
+  size_t from = 0;
+  for(size_t i = 0; i < a.data.size(); i++){
+    if(isspace((unsigned char)a.data[i]))
+      continue;
+    from = original.find(a.data[i], from);
+    if(from == std::string::npos)
+      return false;
+    from++;
+  }
+  return true;
+}
+
+
+/*!
+ * @return TRUE if a sorts before b in the directory
+ */
+static bool path_less(const asset & a, const asset & b){
+  return strcmp(a.path.c_str(), b.path.c_str()) < 0;
+}
+
+
+/*!
+ * Writes the bundle header.
+ */
+static void write_bundle(std::ostream & out, const std::string & header_name,
+                         std::vector<asset> & assets){
+  std::string data;
+  for(size_t i = 0; i < assets.size(); i++){
+    assets[i].offset = data.size();
+    data += assets[i].data;
+  }
+
+  out << "#ifndef ASSET_BUNDLE_HH\n"
+      << "#define ASSET_BUNDLE_HH\n"
+      << "/************************************************\n"
+      << " @file " << header_name << "\n"
+      << " * GENERATED FILE -- DO NOT HAND-MODIFY!!!!!!!!!!\n"
+      << " * Generated by tools/asset_compiler from:\n";
+  for(size_t i = 0; i < assets.size(); i++)
+    out << " *   " << assets[i].source << "\n";
+  out << " ***********************************************/\n\n"
+      << "/*! @var asset_data\n"
+      << " *  @brief every asset, back to back\n"
+      << " */\n"
+      << "const char asset_data[] PROGMEM = \n";
+  write_literal(out, data);
+  out << ";\n"
+      << "/*! @def ASSET_DATA_LEN\n"
+      << " *  exact length of asset_data, not counting the null terminator*/\n"
+      << "#define ASSET_DATA_LEN " << data.size() << "\n"
+      << "static_assert(sizeof(asset_data) - 1 == ASSET_DATA_LEN, "
+      << "\"ASSET_DATA_LEN does not match the generated data\");\n\n";
+
+  for(size_t i = 0; i < assets.size(); i++){
+    const asset & a = assets[i];
+    char etag[16];
+    snprintf(etag, sizeof(etag), "\"%08lx\"", a.hash);
+    out << "const char asset_path_" << i << "[] PROGMEM = ";
+    write_literal(out, a.path);
+    out << ";\n"
+        << "const char asset_etag_" << i << "[] PROGMEM = ";
+    write_literal(out, etag);
+    out << ";\n";
+    for(size_t f = 0; f < a.fields.size(); f++){
+      out << "const char asset_field_" << i << "_" << f << "[] PROGMEM = ";
+      write_literal(out, a.fields[f]);
+      out << ";\n";
+    }
+    if(!a.fields.empty()){
+      out << "const char * const asset_fields_" << i << "[] PROGMEM = {\n";
+      for(size_t f = 0; f < a.fields.size(); f++)
+        out << "  asset_field_" << i << "_" << f << ",\n";
+      out << "};\n";
+    }
+    out << "\n";
+  }
+
+  out << "/*! @var asset_directory\n"
+      << " *  @brief one entry per asset, sorted by path\n"
+      << " */\n"
+      << "const asset_entry asset_directory[] PROGMEM = {\n";
+  for(size_t i = 0; i < assets.size(); i++){
+    const asset & a = assets[i];
+    std::string flags = a.gzip ? "ASSET_GZIP" : "";
+    if(a.fields.empty())
+      flags += flags.empty() ? "ASSET_CACHEABLE" : " | ASSET_CACHEABLE";
+    if(flags.empty())
+      flags = "0";
+    out << "  {asset_path_" << i << ", asset_etag_" << i << ", "
+        << (a.fields.empty() ? std::string("NULL") : "asset_fields_" + std::to_string(i)) << ", "
+        << "asset_data + " << a.offset << ", " << a.data.size() << ", " << a.split << ", "
+        << a.fields.size() << ", " << a.mime << ", " << flags << "},  // " << a.source << "\n";
+  }
+  out << "};\n"
+      << "/*! @def ASSET_COUNT\n"
+      << " *  number of entries in asset_directory*/\n"
+      << "#define ASSET_COUNT " << assets.size() << "\n\n"
+      << "#endif\n";
+}
+
+
+/*!
+ * Usage: asset_compiler [-o asset_bundle.hh] file...
+ */
+int main(int argc, char ** argv){
+  std::string output = DEFAULT_OUTPUT;
+  int first = 1;
+  if(argc > 2 && strcmp(argv[1], "-o") == 0){
+    output = argv[2];
+    first = 3;
+  }
+  if(first >= argc){
+    std::cerr << "usage: asset_compiler [-o " DEFAULT_OUTPUT "] file...\n";
+    return 2;
+  }
+
+  std::vector<asset> assets;
+  for(int i = first; i < argc; i++){
+    asset a;
+    if(!load_asset(argv[i], a))
+      return 1;
+    assets.push_back(a);
+  }
+  std::sort(assets.begin(), assets.end(), path_less);
+  for(size_t i = 1; i < assets.size(); i++){
+    if(assets[i].path == assets[i - 1].path){
+      std::cerr << "asset_compiler: " << assets[i - 1].source << " and " << assets[i].source
+                << " are both served at " << assets[i].path << "\n";
+      return 1;
+    }
+  }
+  if(assets.size() > 255){
+    std::cerr << "asset_compiler: too many assets\n";
+    return 1;
+  }
+  std::string data;
+  for(size_t i = 0; i < assets.size(); i++){
+    if(!check_against_source(assets[i])){
+      std::cerr << "asset_compiler: " << assets[i].path << " doesn't match " << assets[i].source << "\n";
+      return 1;
+    }
+    data += assets[i].data;
+  }
+  if(!check_literal(data)){
+    std::cerr << "asset_compiler: the generated literal doesn't read back as the data\n";
+    return 1;
+  }
+
+  std::ofstream out(output.c_str(), std::ios::binary);
+  if(!out){
+    std::cerr << "asset_compiler: can't write " << output << "\n";
+    return 1;
+  }
+  size_t slash = output.find_last_of('/');
+  write_bundle(out, (slash == std::string::npos) ? output : output.substr(slash + 1), assets);
+
+  for(size_t i = 0; i < assets.size(); i++){
+    std::cout << assets[i].path << " <- " << assets[i].source << ": "
+              << assets[i].data.size() << " bytes, " << assets[i].fields.size() << " fields\n";
+  }
+  return 0;
+}
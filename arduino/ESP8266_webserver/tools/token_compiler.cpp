@@ -0,0 +1,312 @@
+/*!
+ * @file token_compiler.cpp
+ *
+ * @brief Host-side tool that builds the token matching automaton
+ *
+ * Reads the token list in tokens.h and writes token_automaton.hh: an
+ * Aho-Corasick automaton over every token, flattened into a DFA so the
+ * firmware takes exactly one transition per byte, whatever the number of
+ * tokens.  See TokenMatcher.h for how it is walked.
+ *
+ * A full DFA table (one next state per state and character) would not fit
+ * in flash, so each state only stores the transitions that differ from
+ * the root's, and the root has a full row:
+ *  * token_root - the next state from the root, per 7-bit character
+ *  * token_edge_start - where each state's transitions start in
+ *    token_edge_char and token_edge_next (sorted by character)
+ *  * token_output - the longest token ending at each state
+ *  * token_output_link - the next shorter state (by suffix) with a token,
+ *    for tokens that end inside others (e.g. "OK" in "SEND OK")
+ *  * token_length - the length of each token
+ * States are numbered in the order the trie was built, and must fit in an
+ * unsigned char.
+ *
+ * Build and run from the sketch directory (the Arduino IDE does not
+ * compile the tools/ directory):<pre>
+ *    g++ -std=c++11 -O2 -o tools/token_compiler tools/token_compiler.cpp
+ *    tools/token_compiler</pre>
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include "../tokens.h"
+
+/*! @def DEFAULT_OUTPUT
+ *  Where the automaton is written, unless -o says otherwise.*/
+#define DEFAULT_OUTPUT "token_automaton.hh"
+/*! @def ALPHABET
+ *  Characters the automaton knows about; anything above is never part of
+ *  a token, and leads back to the root.*/
+#define ALPHABET 128
+/*! @def MAX_STATES
+ *  States must fit in an unsigned char.*/
+#define MAX_STATES 255
+/*! @def VALUES_PER_LINE
+ *  Generated arrays are split into lines of this many values.*/
+#define VALUES_PER_LINE 16
+
+/*! @def TOKEN_TEXT_ENTRY
+ *  Turns a TOKEN_LIST entry into its text.*/
+#define TOKEN_TEXT_ENTRY(id, text) text,
+/*! @def TOKEN_NAME_ENTRY
+ *  Turns a TOKEN_LIST entry into the name of its id.*/
+#define TOKEN_NAME_ENTRY(id, text) #id,
+
+static const char * const token_texts[] = {TOKEN_LIST(TOKEN_TEXT_ENTRY)};
+static const char * const token_names[] = {TOKEN_LIST(TOKEN_NAME_ENTRY)};
+
+
+/*!
+ * @struct state
+ *
+ * @brief One node of the trie, and then of the automaton
+ */
+struct state{
+  int next[ALPHABET];  ///<trie edges (-1 for none), then every DFA transition
+  int fail;            ///<longest proper suffix that is also a trie node
+  int output;          ///<token ending here (the longest), or TOKEN_NONE
+  int output_link;     ///<nearest state down the fail chain with an output, or 0
+  int depth;           ///<characters from the root
+};
+
+
+/*!
+ * @brief Builds the trie of every token, then the failure links and the
+ *        full transition table, breadth-first.
+ *
+ * @return the states, root first; empty if a token can't be used
+ */
+static std::vector<state> build_automaton(){
+  std::vector<state> states(1);
+  memset(states[0].next, -1, sizeof(states[0].next));
+  states[0].fail = 0;
+  states[0].output = TOKEN_NONE;
+  states[0].output_link = 0;
+  states[0].depth = 0;
+
+  for(int token = 0; token < TOKEN_COUNT; token++){
+    const char * text = token_texts[token];
+    if(text[0] == '\0'){
+      std::cerr << "token_compiler: " << token_names[token] << " is empty\n";
+      return std::vector<state>();
+    }
+    int current = 0;
+    for(const char * c = text; *c != '\0'; c++){
+      unsigned char ch = *c;
+      if(ch >= ALPHABET){
+        std::cerr << "token_compiler: " << token_names[token] << " is not 7-bit ASCII\n";
+        return std::vector<state>();
+      }
+      if(states[current].next[ch] < 0){
+        state node;
+        memset(node.next, -1, sizeof(node.next));
+        node.fail = 0;
+        node.output = TOKEN_NONE;
+        node.output_link = 0;
+        node.depth = states[current].depth + 1;
+        states.push_back(node);
+        states[current].next[ch] = states.size() - 1;
+      }
+      current = states[current].next[ch];
+    }
+    if(states[current].output != TOKEN_NONE){
+      std::cerr << "token_compiler: " << token_names[token] << " and "
+                << token_names[states[current].output] << " are the same\n";
+      return std::vector<state>();
+    }
+    states[current].output = token;
+  }
+
+  // Breadth first, so every fail link points at a finished state
+  std::deque<int> pending;
+  for(int ch = 0; ch < ALPHABET; ch++){
+    if(states[0].next[ch] < 0){
+      states[0].next[ch] = 0;
+    } else {
+      states[states[0].next[ch]].fail = 0;
+      pending.push_back(states[0].next[ch]);
+    }
+  }
+  while(!pending.empty()){
+    int current = pending.front();
+    pending.pop_front();
+    int fail = states[current].fail;
+    states[current].output_link = (states[fail].output != TOKEN_NONE) ? fail : states[fail].output_link;
+    for(int ch = 0; ch < ALPHABET; ch++){
+      int child = states[current].next[ch];
+      if(child < 0){
+        states[current].next[ch] = states[fail].next[ch];
+      } else {
+        states[child].fail = states[fail].next[ch];
+        pending.push_back(child);
+      }
+    }
+  }
+  return states;
+}
+
+
+/*!
+ * @brief Writes the values of an array and closes it
+ */
+static void write_values(std::ostream & out, const std::vector<int> & values){
+  for(size_t i = 0; i < values.size(); i++){
+    if(i % VALUES_PER_LINE == 0)
+      out << "\n  ";
+    out << values[i] << (i + 1 < values.size() ? "," : "");
+  }
+  out << "\n};\n\n";
+}
+
+
+/*!
+ * @brief Writes a character as a C character literal
+ */
+static std::string char_literal(int ch){
+  char literal[8];
+  if(ch == '\'' || ch == '\\')
+    snprintf(literal, sizeof(literal), "'\\%c'", ch);
+  else if(ch >= 0x20 && ch < 0x7F)
+    snprintf(literal, sizeof(literal), "'%c'", ch);
+  else
+    snprintf(literal, sizeof(literal), "%d", ch);
+  return literal;
+}
+
+
+/*!
+ * @brief Writes the automaton as PROGMEM tables
+ */
+static void write_automaton(std::ostream & out, const std::string & header_name,
+                            const std::vector<state> & states, size_t * edge_count){
+  out << "#ifndef TOKEN_AUTOMATON_HH\n"
+      << "#define TOKEN_AUTOMATON_HH\n"
+      << "/************************************************\n"
+      << " @file " << header_name << "\n"
+      << " * GENERATED FILE -- DO NOT HAND-MODIFY!!!!!!!!!!\n"
+      << " * Generated by tools/token_compiler from tokens.h\n"
+      << " ***********************************************/\n\n";
+
+  out << "/*! @def TOKEN_STATES\n"
+      << " *  number of states of the automaton*/\n"
+      << "#define TOKEN_STATES " << states.size() << "\n"
+      << "static_assert(TOKEN_COUNT == " << TOKEN_COUNT << ", "
+      << "\"token_automaton.hh is out of date, run tools/token_compiler\");\n";
+  for(int token = 0; token < TOKEN_COUNT; token++){
+    out << "static_assert(token_text_is(token_text(" << token_names[token] << "), \"";
+    for(const char * c = token_texts[token]; *c != '\0'; c++){
+      if(*c == '"' || *c == '\\')
+        out << '\\';
+      out << *c;
+    }
+    out << "\"), \"token_automaton.hh is out of date, run tools/token_compiler\");\n";
+  }
+  out << "\n";
+
+  std::vector<int> root(states[0].next, states[0].next + ALPHABET);
+  out << "/*! @var token_root\n"
+      << " *  @brief next state from the root, per character*/\n"
+      << "const unsigned char token_root[" << ALPHABET << "] PROGMEM = {";
+  write_values(out, root);
+
+  std::vector<int> edge_start;
+  std::vector<std::string> edge_chars;
+  std::vector<int> edge_next;
+  for(size_t s = 0; s < states.size(); s++){
+    edge_start.push_back(edge_next.size());
+    if(s == 0)
+      continue;
+    for(int ch = 0; ch < ALPHABET; ch++){
+      if(states[s].next[ch] != states[0].next[ch]){
+        edge_chars.push_back(char_literal(ch));
+        edge_next.push_back(states[s].next[ch]);
+      }
+    }
+  }
+  edge_start.push_back(edge_next.size());
+  *edge_count = edge_next.size();
+
+  out << "/*! @var token_edge_start\n"
+      << " *  @brief where the transitions of each state start, the last entry is the end*/\n"
+      << "const unsigned int token_edge_start[TOKEN_STATES + 1] PROGMEM = {";
+  write_values(out, edge_start);
+
+  out << "/*! @var token_edge_char\n"
+      << " *  @brief character of each transition that doesn't lead where the root's does*/\n"
+      << "const char token_edge_char[" << edge_chars.size() << "] PROGMEM = {";
+  for(size_t i = 0; i < edge_chars.size(); i++){
+    if(i % VALUES_PER_LINE == 0)
+      out << "\n  ";
+    out << edge_chars[i] << (i + 1 < edge_chars.size() ? "," : "");
+  }
+  out << "\n};\n\n";
+
+  out << "/*! @var token_edge_next\n"
+      << " *  @brief next state of each transition*/\n"
+      << "const unsigned char token_edge_next[" << edge_next.size() << "] PROGMEM = {";
+  write_values(out, edge_next);
+
+  std::vector<int> output, output_link;
+  for(size_t s = 0; s < states.size(); s++){
+    output.push_back(states[s].output);
+    output_link.push_back(states[s].output_link);
+  }
+  out << "/*! @var token_output\n"
+      << " *  @brief longest token ending at each state, or TOKEN_NONE*/\n"
+      << "const unsigned char token_output[TOKEN_STATES] PROGMEM = {";
+  write_values(out, output);
+
+  out << "/*! @var token_output_link\n"
+      << " *  @brief next state with a token that ends at the same character, or 0*/\n"
+      << "const unsigned char token_output_link[TOKEN_STATES] PROGMEM = {";
+  write_values(out, output_link);
+
+  std::vector<int> length;
+  for(int token = 0; token < TOKEN_COUNT; token++)
+    length.push_back(strlen(token_texts[token]));
+  out << "/*! @var token_length\n"
+      << " *  @brief characters in each token*/\n"
+      << "const unsigned char token_length[TOKEN_COUNT] PROGMEM = {";
+  write_values(out, length);
+
+  out << "#endif\n";
+}
+
+
+int main(int argc, char ** argv){
+  std::string output = DEFAULT_OUTPUT;
+  if(argc > 2 && strcmp(argv[1], "-o") == 0){
+    output = argv[2];
+  } else if(argc > 1){
+    std::cerr << "usage: token_compiler [-o " DEFAULT_OUTPUT "]\n";
+    return 2;
+  }
+
+  std::vector<state> states = build_automaton();
+  if(states.empty())
+    return 1;
+  if(states.size() > MAX_STATES){
+    std::cerr << "token_compiler: " << states.size() << " states, at most "
+              << MAX_STATES << " fit in an unsigned char\n";
+    return 1;
+  }
+
+  std::ofstream out(output.c_str(), std::ios::binary);
+  if(!out){
+    std::cerr << "token_compiler: can't write " << output << "\n";
+    return 1;
+  }
+  size_t slash = output.find_last_of('/');
+  size_t edge_count = 0;
+  write_automaton(out, (slash == std::string::npos) ? output : output.substr(slash + 1),
+                  states, &edge_count);
+
+  std::cout << TOKEN_COUNT << " tokens, " << states.size() << " states, "
+            << edge_count << " transitions besides the root's\n";
+  return 0;
+}
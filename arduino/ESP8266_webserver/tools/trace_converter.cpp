@@ -0,0 +1,187 @@
+/*!
+ * @file trace_converter.cpp
+ *
+ * @brief Host-side tool that turns a /debug/trace dump into Chrome
+ *        trace-event JSON
+ *
+ * Reads the dump (see Trace.h), one "<micros> <request> <phase>" line per
+ * event, and writes a JSON trace that chrome://tracing and
+ * ui.perfetto.dev can open:
+ *  * every request is a thread of the "network" process, with one span
+ *    per step, from each of its events to the next (e.g.
+ *    "cipsend -> prompt" is how long the ESP8266 took to ask for the data)
+ *  * the moves are spans of the "motion" process, on the thread of the
+ *    request that asked for them
+ *
+ * Lines that aren't events (the "-" of events lost before the dump was
+ * sent, or HTTP headers) are skipped, and micros() wrapping around is
+ * undone.
+ *
+ * Build and run from the sketch directory (the Arduino IDE does not
+ * compile the tools/ directory):<pre>
+ *    g++ -std=c++11 -O2 -o tools/trace_converter tools/trace_converter.cpp
+ *    curl -s http://<shooter>/debug/trace | tools/trace_converter > trace.json</pre>
+ */
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*! @def NETWORK_PID
+ *  Process of the request steps in the trace.*/
+#define NETWORK_PID 1
+/*! @def MOTION_PID
+ *  Process of the moves in the trace.*/
+#define MOTION_PID 2
+/*! @def NO_REQUEST
+ *  Request id of events that belong to no request (TRACE_NO_REQUEST).*/
+#define NO_REQUEST 255
+
+/*!
+ * @struct event
+ *
+ * @brief One line of the dump
+ */
+struct event{
+  unsigned long long time_us;  ///<micros(), with the wrap-arounds undone
+  unsigned int request;        ///<request id
+  std::string phase;           ///<phase name, as in Trace.cpp
+};
+
+/*!
+ * @brief Parse the dump
+ *
+ * @return the events, oldest first
+ */
+static std::vector<event> read_dump(std::istream & in){
+  std::vector<event> events;
+  unsigned long long wraps = 0;
+  unsigned long last = 0;
+  std::string line;
+  while(std::getline(in, line)){
+    std::istringstream fields(line);
+    unsigned long time_us;
+    unsigned int request;
+    std::string phase;
+    if(!(fields >> time_us >> request >> phase) || request > NO_REQUEST)
+      continue;
+    if(!events.empty() && time_us < last)
+      wraps += 1ULL << 32;
+    last = time_us;
+    event e = {wraps + time_us, request, phase};
+    events.push_back(e);
+  }
+  return events;
+}
+
+/*!
+ * @brief Write a complete ("X") event
+ */
+static void write_span(std::ostream & out, bool & first, int pid, unsigned int tid,
+                       const std::string & name, unsigned long long start_us, unsigned long long end_us){
+  out << (first ? "\n" : ",\n");
+  first = false;
+  out << "  {\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << tid
+      << ",\"ts\":" << start_us << ",\"dur\":" << (end_us - start_us) << "}";
+}
+
+/*!
+ * @brief Write an instant ("i") event, for a request's last step
+ */
+static void write_instant(std::ostream & out, bool & first, int pid, unsigned int tid,
+                          const std::string & name, unsigned long long time_us){
+  out << (first ? "\n" : ",\n");
+  first = false;
+  out << "  {\"name\":\"" << name << "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":" << pid << ",\"tid\":" << tid
+      << ",\"ts\":" << time_us << "}";
+}
+
+/*!
+ * @brief Write a metadata ("M") event naming a process or a thread
+ */
+static void write_name(std::ostream & out, bool & first, const char * kind, int pid, long tid,
+                       const std::string & name){
+  out << (first ? "\n" : ",\n");
+  first = false;
+  out << "  {\"name\":\"" << kind << "\",\"ph\":\"M\",\"pid\":" << pid;
+  if(tid >= 0)
+    out << ",\"tid\":" << tid;
+  out << ",\"args\":{\"name\":\"" << name << "\"}}";
+}
+
+/*!
+ * @brief Write the trace: the steps of each request, then the moves
+ */
+static void write_trace(std::ostream & out, const std::vector<event> & events){
+  bool first = true;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  write_name(out, first, "process_name", NETWORK_PID, -1, "network");
+  write_name(out, first, "process_name", MOTION_PID, -1, "motion");
+
+  std::map<unsigned int, const event *> previous;     // last step of each request
+  std::map<unsigned int, const event *> move_started;  // move in progress, per request
+  for(size_t i = 0; i < events.size(); i++){
+    const event & e = events[i];
+    if(e.phase == "mot_beg"){
+      move_started[e.request] = &e;
+      continue;
+    }
+    if(e.phase == "mot_end"){
+      if(move_started.count(e.request)){
+        write_span(out, first, MOTION_PID, e.request, "move", move_started[e.request]->time_us, e.time_us);
+        move_started.erase(e.request);
+      }
+      continue;
+    }
+    if(previous.count(e.request)){
+      const event & p = *previous[e.request];
+      write_span(out, first, NETWORK_PID, e.request, p.phase + " -> " + e.phase, p.time_us, e.time_us);
+    } else {
+      std::ostringstream name;
+      if(e.request == NO_REQUEST)
+        name << "no request";
+      else
+        name << "request " << e.request;
+      write_name(out, first, "thread_name", NETWORK_PID, e.request, name.str());
+      write_name(out, first, "thread_name", MOTION_PID, e.request, name.str());
+    }
+    previous[e.request] = &e;
+  }
+  for(std::map<unsigned int, const event *>::iterator it = previous.begin(); it != previous.end(); ++it)
+    write_instant(out, first, NETWORK_PID, it->first, it->second->phase, it->second->time_us);
+  for(std::map<unsigned int, const event *>::iterator it = move_started.begin(); it != move_started.end(); ++it)
+    write_instant(out, first, MOTION_PID, it->first, "move (not finished)", it->second->time_us);
+  out << "\n]}\n";
+}
+
+
+/*!
+ * Usage: trace_converter [dump] - reads standard input without a dump
+ * file, and writes the JSON to standard output.
+ */
+int main(int argc, char ** argv){
+  std::vector<event> events;
+  if(argc > 2){
+    std::cerr << "usage: trace_converter [dump]\n";
+    return 2;
+  }
+  if(argc == 2){
+    std::ifstream in(argv[1]);
+    if(!in){
+      std::cerr << "trace_converter: can't read " << argv[1] << "\n";
+      return 1;
+    }
+    events = read_dump(in);
+  } else {
+    events = read_dump(std::cin);
+  }
+  if(events.empty()){
+    std::cerr << "trace_converter: no events found\n";
+    return 1;
+  }
+  write_trace(std::cout, events);
+  return 0;
+}
@@ -12,12 +12,99 @@
 /*!
  * @var http_200_start_line
  * 
- * @brief HTTP 200 response start line and trailing newlines.
+ * @brief HTTP 200 response start line, up to the Content-Length value.
  * 
  */
-//! @todo: add content length header
-const char http_200_start_line[] PROGMEM = "HTTP/1.1 200 OK\r\n\r\n";
-#define HTTP_200_START_LINE_LEN 19 //! @def length of HTTP 200 start line
+const char http_200_start_line[] PROGMEM = "HTTP/1.1 200 OK\r\nContent-Length: ";
+#define HTTP_200_START_LINE_LEN (sizeof(http_200_start_line)-1) //! @def length of HTTP 200 start line
+
+/*!
+ * @var http_200_content_type
+ * 
+ * @brief HTTP 200 response start line for assets, up to the Content-Type value.
+ * 
+ */
+const char http_200_content_type[] PROGMEM = "HTTP/1.1 200 OK\r\nContent-Type: ";
+#define HTTP_200_CONTENT_TYPE_LEN (sizeof(http_200_content_type)-1) //! @def length of http_200_content_type
+
+/*!
+ * @var http_206_content_type
+ * 
+ * @brief HTTP 206 response start line for part of an asset, up to the 
+ *        Content-Type value.
+ * 
+ */
+const char http_206_content_type[] PROGMEM = "HTTP/1.1 206 Partial Content\r\nContent-Type: ";
+#define HTTP_206_CONTENT_TYPE_LEN (sizeof(http_206_content_type)-1) //! @def length of http_206_content_type
+
+/*!
+ * @var http_304_start_line
+ * 
+ * @brief HTTP 304 response start line, for a cached asset that hasn't changed.
+ *        Followed by http_cache_control.
+ * 
+ */
+const char http_304_start_line[] PROGMEM = "HTTP/1.1 304 Not Modified";
+#define HTTP_304_START_LINE_LEN (sizeof(http_304_start_line)-1) //! @def length of http_304_start_line
+
+/*!
+ * @var http_416_start_line
+ * 
+ * @brief HTTP 416 response start line, up to the length of the asset.
+ * 
+ */
+const char http_416_start_line[] PROGMEM = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */";
+#define HTTP_416_START_LINE_LEN (sizeof(http_416_start_line)-1) //! @def length of http_416_start_line
+
+/*!
+ * @var http_503_response
+ * 
+ * @brief Complete HTTP 503 response, for a request there is no room for
+ *        right now.
+ * 
+ */
+const char http_503_response[] PROGMEM = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+#define HTTP_503_RESPONSE_LEN (sizeof(http_503_response)-1) //! @def length of http_503_response
+
+/*!
+ * @var http_gzip_encoding
+ * 
+ * @brief Ends the previous header and marks the body as gzip-compressed.
+ * 
+ */
+const char http_gzip_encoding[] PROGMEM = "\r\nContent-Encoding: gzip";
+#define HTTP_GZIP_ENCODING_LEN (sizeof(http_gzip_encoding)-1) //! @def length of http_gzip_encoding
+
+/*!
+ * @var http_cache_control
+ * 
+ * @brief Ends the previous header, and starts the caching headers for 
+ *        assets that only change when the sketch is reflashed, up to the
+ *        ETag value.  Browsers keep these for a day, so the asset comes 
+ *        straight from their cache.  The same assets can be sent in 
+ *        parts, so a dropped transfer can be resumed.
+ * 
+ */
+const char http_cache_control[] PROGMEM = "\r\nAccept-Ranges: bytes\r\nCache-Control: public, max-age=86400\r\nETag: ";
+#define HTTP_CACHE_CONTROL_LEN (sizeof(http_cache_control)-1) //! @def length of http_cache_control
+
+/*!
+ * @var http_content_length
+ * 
+ * @brief Ends the previous header and starts the Content-Length header.
+ * 
+ */
+const char http_content_length[] PROGMEM = "\r\nContent-Length: ";
+#define HTTP_CONTENT_LENGTH_LEN (sizeof(http_content_length)-1) //! @def length of http_content_length
+
+/*!
+ * @var http_header_end
+ * 
+ * @brief Terminates the Content-Length header and the header block.
+ * 
+ */
+const char http_header_end[] PROGMEM = "\r\n\r\n";
+#define HTTP_HEADER_END_LEN (sizeof(http_header_end)-1) //! @def length of the header terminator
 
 const char success_msg[] PROGMEM = "SUCCESS"; //! @var const char success_msg @brief returned on command success
 const char failure_msg[] PROGMEM = "FAIL";    //! @var @brief returned on command failure
@@ -28,11 +115,4 @@ const char blank_website_text[] PROGMEM = "<!DOCTYPE html>\
 </html>";
 
 
-// This file is generated from static_website.html by invoking the bash script:
-//    'source generate_headers_from_html.bash'
-// If you update the html file, you need to run the above command to refresh the 
-//    generated header file.
-#include "static_website.html.hh"
-#include "config_website.html.hh"
-
 #endif /* webserver_constants_h */
@@ -1,3 +1,13 @@
+/*
+ * Serial_Setup.ino
+ * 
+ * Standalone bring-up sketch: scans for an ESP8266 at every baud rate and
+ * sets it up for the webserver.
+ * 
+ * The webserver sketch now finds and renegotiates the baud rate itself
+ * (ESP8266::negotiate_baud), so this is only needed to poke at a device
+ * by hand.
+ */
 #include <AltSoftSerial.h>
 #include <MemoryUsage.h>
 